@@ -0,0 +1,436 @@
+/*
+** bench.c - Microbenchmarks of the pivot_vtab methods
+**
+** Build and run from the repository root:
+**
+**   gcc -O2 -I. -DSQLITE_ENABLE_COLUMN_METADATA bench/bench.c -lsqlite3 -lpthread -o pivot_bench
+**   ./pivot_bench bench/cells.sql bench/source.sql
+**
+** or "make bench" to run every script in bench/.
+** Each script creates a fixed dataset and a pivot table named p on a new
+** in-memory database. The program then drives the xBestIndex, xFilter,
+** xNext and xColumn methods of p directly through its sqlite3_module
+** pointers, without SQL statements in between, and reports per call:
+**
+**   ns/op      Wall-clock time
+**   allocs/op  Calls of xMalloc and xRealloc, counted by wrappers
+**              installed with SQLITE_CONFIG_MALLOC. Lookaside is disabled
+**              so that every allocation is counted.
+**   instr/op, cycles/op, misses/op
+**              User-space instructions, cycles and cache misses, read
+**              with perf_event_open() on Linux, or "-" where it is not
+**              available (e.g. kernel.perf_event_paranoid > 2)
+**
+** The methods are measured for a full scan and for point lookups on the
+** first row key column, cycling through every row key. xNext is measured
+** over whole scans, and xColumn as the time of scans that read every
+** column less that of the same scans without, divided by the cells read.
+** Each measurement follows an untimed run of the same calls, so that the
+** figures are those of warm caches and plans.
+**
+** Options:
+**
+**   -n N   Multiply the number of calls by N (default 1)
+**
+** This file includes pivot_vtab.c, to reach the table behind p, so it is
+** built with SQLITE_CORE. Define SQLITE_ENABLE_COLUMN_METADATA if the
+** SQLite library has it, as most distribution builds do, so that the
+** extension reads the column metadata as it does when loaded.
+*/
+#define SQLITE_CORE 1
+#include "pivot_vtab.c"
+#include <time.h>
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+#define BENCH_NPERF 3
+
+static sqlite3_mem_methods benchDefaultMem;
+static sqlite3_int64 nBenchAlloc = 0;
+static int aPerfFd[BENCH_NPERF] = { -1, -1, -1 };
+static int nMult = 1;
+
+static void *benchMalloc(int n){
+  nBenchAlloc++;
+  return benchDefaultMem.xMalloc(n);
+}
+
+static void *benchRealloc(void *p, int n){
+  nBenchAlloc++;
+  return benchDefaultMem.xRealloc(p, n);
+}
+
+/*
+** Wrap the memory allocator of SQLite with counting functions. Must be
+** called before SQLite is initialized.
+*/
+static void benchMallocInit(void){
+  static sqlite3_mem_methods mem;
+  sqlite3_config(SQLITE_CONFIG_GETMALLOC, &benchDefaultMem);
+  mem = benchDefaultMem;
+  mem.xMalloc = benchMalloc;
+  mem.xRealloc = benchRealloc;
+  sqlite3_config(SQLITE_CONFIG_MALLOC, &mem);
+}
+
+/*
+** Open the hardware counters as one group: instructions, cycles and cache
+** misses. Counters that cannot be opened are left at -1.
+*/
+static void benchPerfInit(void){
+#ifdef __linux__
+  static const unsigned long long aConfig[BENCH_NPERF] = {
+    PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES
+  };
+  int i;
+  for( i=0; i<BENCH_NPERF; i++ ){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = aConfig[i];
+    attr.disabled = aPerfFd[0]<0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    aPerfFd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, aPerfFd[0], 0);
+    if( i==0 && aPerfFd[0]<0 ) return;
+  }
+  ioctl(aPerfFd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+/*
+** The counters at one point in time, or the difference between two
+*/
+typedef struct BenchCount BenchCount;
+struct BenchCount {
+  sqlite3_int64 iNs;             // Nanoseconds
+  sqlite3_int64 nAlloc;          // Allocations
+  sqlite3_int64 aPerf[BENCH_NPERF];  // Hardware counters, where open
+};
+
+static void benchRead(BenchCount *p){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  p->iNs = (sqlite3_int64)ts.tv_sec*1000000000 + ts.tv_nsec;
+  p->nAlloc = nBenchAlloc;
+  memset(p->aPerf, 0, sizeof(p->aPerf));
+#ifdef __linux__
+  if( aPerfFd[0]>=0 ){
+    unsigned long long aBuf[1+BENCH_NPERF];
+    int n = 0;
+    int i;
+    if( read(aPerfFd[0], aBuf, sizeof(aBuf))>0 ){
+      for( i=0; i<BENCH_NPERF; i++ ){
+        if( aPerfFd[i]>=0 && n<(int)aBuf[0] ) p->aPerf[i] = (sqlite3_int64)aBuf[1+n++];
+      }
+    }
+  }
+#endif
+}
+
+/*
+** Add the counts since *pStart to *pTotal.
+*/
+static void benchAdd(BenchCount *pTotal, const BenchCount *pStart){
+  BenchCount now;
+  int i;
+  benchRead(&now);
+  pTotal->iNs += now.iNs-pStart->iNs;
+  pTotal->nAlloc += now.nAlloc-pStart->nAlloc;
+  for( i=0; i<BENCH_NPERF; i++ ) pTotal->aPerf[i] += now.aPerf[i]-pStart->aPerf[i];
+}
+
+/*
+** Print one line of the report: the counts of p divided by nOp.
+*/
+static void benchReport(const char *zScript, const char *zMethod, const BenchCount *p, sqlite3_int64 nOp){
+  int i;
+  if( nOp<=0 ) return;
+  printf("%-20s %-18s %9lld %10.1f %9.2f", zScript, zMethod, nOp,
+    (double)p->iNs/nOp, (double)p->nAlloc/nOp);
+  for( i=0; i<BENCH_NPERF; i++ ){
+    if( aPerfFd[i]>=0 ){
+      printf(" %10.1f", (double)p->aPerf[i]/nOp);
+    }else{
+      printf(" %10s", "-");
+    }
+  }
+  printf("\n");
+}
+
+/*
+** Return the difference of the counts a and b.
+*/
+static BenchCount benchSub(const BenchCount *a, const BenchCount *b){
+  BenchCount d;
+  int i;
+  d.iNs = a->iNs-b->iNs;
+  d.nAlloc = a->nAlloc-b->nAlloc;
+  for( i=0; i<BENCH_NPERF; i++ ) d.aPerf[i] = a->aPerf[i]-b->aPerf[i];
+  return d;
+}
+
+/*
+** The pivot table under test
+*/
+typedef struct Bench Bench;
+struct Bench {
+  const char *zScript;           // Script that created the table
+  sqlite3_vtab *pVtab;           // The pivot table
+  const sqlite3_module *pMod;    // Its methods
+  int nCol;                      // Number of row key and pivot columns
+  int nKey;                      // Number of values in apKey
+  sqlite3_value **apKey;         // First row key column of every row
+  int rc;                        // First error, or SQLITE_OK
+};
+
+/*
+** Plan a scan of b with nCons constraints on the first row key column
+** (0 for a full scan, 1 for a point lookup) with xBestIndex, nOp times.
+** Return the plan of the last call in *pIdxNum and *pzIdxStr, and add the
+** counts of the calls to *pCount.
+*/
+static void benchBestIndex(Bench *b, int nCons, int nOp, int *pIdxNum, char **pzIdxStr, BenchCount *pCount){
+  struct sqlite3_index_constraint aCons[1];
+  struct sqlite3_index_constraint_usage aUsage[1];
+  sqlite3_index_info info;
+  BenchCount start;
+  char *zIdxStr = 0;
+  int i;
+
+  memset(aCons, 0, sizeof(aCons));
+  aCons[0].iColumn = 0;
+  aCons[0].op = SQLITE_INDEX_CONSTRAINT_EQ;
+  aCons[0].usable = 1;
+  benchRead(&start);
+  for( i=0; i<nOp && b->rc==SQLITE_OK; i++ ){
+    sqlite3_free(zIdxStr);
+    memset(&info, 0, sizeof(info));
+    memset(aUsage, 0, sizeof(aUsage));
+    info.nConstraint = nCons;
+    info.aConstraint = aCons;
+    info.aConstraintUsage = aUsage;
+    info.colUsed = ~(sqlite3_uint64)0;
+    b->rc = b->pMod->xBestIndex(b->pVtab, &info);
+    zIdxStr = info.needToFreeIdxStr ? info.idxStr : 0;
+  }
+  if( pCount ) benchAdd(pCount, &start);
+  if( nCons>0 && aUsage[0].argvIndex!=1 && b->rc==SQLITE_OK ){
+    printf("%s: xBestIndex does not use the row key constraint\n", b->zScript);
+    b->rc = SQLITE_ERROR;
+  }
+  *pIdxNum = info.idxNum;
+  *pzIdxStr = zIdxStr ? zIdxStr : sqlite3_mprintf("%s", info.idxStr ? info.idxStr : "");
+}
+
+/*
+** Run nScan scans of cursor pCur with plan (idxNum, zIdxStr). For a point
+** lookup, the argument of scan i is row key i%nKey. If ctx is
+** not 0, read every column of every row. Add the counts of the xFilter
+** calls to *pFilter, and those of the xNext and xColumn calls to *pRest.
+** Return the number of rows read.
+*/
+static sqlite3_int64 benchScan(
+  Bench *b,
+  sqlite3_vtab_cursor *pCur,
+  int idxNum,
+  const char *zIdxStr,
+  int bLookup,
+  int nScan,
+  sqlite3_context *ctx,
+  BenchCount *pFilter,
+  BenchCount *pRest
+){
+  sqlite3_int64 nRow = 0;
+  BenchCount start;
+  int i, j;
+
+  for( i=0; i<nScan && b->rc==SQLITE_OK; i++ ){
+    sqlite3_value *pArg = bLookup ? b->apKey[i%b->nKey] : 0;
+    benchRead(&start);
+    b->rc = b->pMod->xFilter(pCur, idxNum, zIdxStr, bLookup, &pArg);
+    benchAdd(pFilter, &start);
+    benchRead(&start);
+    while( b->rc==SQLITE_OK && !b->pMod->xEof(pCur) ){
+      for( j=0; ctx && j<b->nCol && b->rc==SQLITE_OK; j++ ){
+        b->rc = b->pMod->xColumn(pCur, ctx, j);
+      }
+      if( b->rc==SQLITE_OK ) b->rc = b->pMod->xNext(pCur);
+      nRow++;
+    }
+    benchAdd(pRest, &start);
+  }
+  return nRow;
+}
+
+/*
+** SQL function bench_run(). Run the benchmarks of the Bench object in the
+** user data. It runs inside a statement so that xColumn has a context to
+** return its values to.
+*/
+static void benchRunFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  static const BenchCount zero = { 0, 0, { 0, 0, 0 } };
+  Bench *b = (Bench*)sqlite3_user_data(ctx);
+  sqlite3_vtab_cursor *pCur = 0;
+  int idxScan = 0, idxEq = 0;
+  char *zScan = 0, *zEq = 0;
+  int nBest = 20000*nMult;
+  int nFull = 20*nMult;
+  int nLookup = b->nKey*2*nMult;
+  (void)argc;
+  (void)argv;
+
+  // Plans
+  {
+    BenchCount scan = zero, eq = zero;
+    benchBestIndex(b, 0, nBest, &idxScan, &zScan, 0);
+    sqlite3_free(zScan);
+    benchBestIndex(b, 0, nBest, &idxScan, &zScan, &scan);
+    benchReport(b->zScript, "xBestIndex scan", &scan, nBest);
+    benchBestIndex(b, 1, nBest, &idxEq, &zEq, 0);
+    sqlite3_free(zEq);
+    benchBestIndex(b, 1, nBest, &idxEq, &zEq, &eq);
+    benchReport(b->zScript, "xBestIndex lookup", &eq, nBest);
+  }
+
+  if( b->rc==SQLITE_OK ) b->rc = b->pMod->xOpen(b->pVtab, &pCur);
+  if( b->rc==SQLITE_OK ) pCur->pVtab = b->pVtab;
+
+  // Full scans, without and with columns
+  if( b->rc==SQLITE_OK ){
+    BenchCount filter = zero, next = zero, filterCol = zero, nextCol = zero, col;
+    sqlite3_int64 nRow, nCell;
+    benchScan(b, pCur, idxScan, zScan, 0, 1, ctx, &filter, &next);
+    filter = next = zero;
+    nRow = benchScan(b, pCur, idxScan, zScan, 0, nFull, 0, &filter, &next);
+    benchReport(b->zScript, "xFilter scan", &filter, nFull);
+    benchReport(b->zScript, "xNext scan", &next, nRow);
+    nCell = benchScan(b, pCur, idxScan, zScan, 0, nFull, ctx, &filterCol, &nextCol)*b->nCol;
+    col = benchSub(&nextCol, &next);
+    benchReport(b->zScript, "xColumn scan", &col, nCell);
+  }
+
+  // Point lookups, without and with columns
+  if( b->rc==SQLITE_OK ){
+    BenchCount filter = zero, next = zero, filterCol = zero, nextCol = zero, col;
+    sqlite3_int64 nCell;
+    benchScan(b, pCur, idxEq, zEq, 1, b->nKey, ctx, &filter, &next);
+    filter = next = zero;
+    benchScan(b, pCur, idxEq, zEq, 1, nLookup, 0, &filter, &next);
+    benchReport(b->zScript, "xFilter lookup", &filter, nLookup);
+    nCell = benchScan(b, pCur, idxEq, zEq, 1, nLookup, ctx, &filterCol, &nextCol)*b->nCol;
+    col = benchSub(&nextCol, &next);
+    benchReport(b->zScript, "xColumn lookup", &col, nCell);
+  }
+
+  if( pCur ) b->pMod->xClose(pCur);
+  sqlite3_free(zScan);
+  sqlite3_free(zEq);
+  if( b->rc!=SQLITE_OK ){
+    sqlite3_result_error(ctx, b->pVtab->zErrMsg ? b->pVtab->zErrMsg : sqlite3_errstr(b->rc), -1);
+  }
+}
+
+/*
+** Read the file zFile into a buffer obtained from sqlite3_malloc(), or
+** return 0.
+*/
+static char *benchReadFile(const char *zFile){
+  FILE *in = fopen(zFile, "rb");
+  char *z = 0;
+  long n;
+  if( in==0 ) return 0;
+  fseek(in, 0, SEEK_END);
+  n = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  z = sqlite3_malloc64(n+1);
+  if( z && fread(z, 1, n, in)!=(size_t)n ){
+    sqlite3_free(z);
+    z = 0;
+  }
+  if( z ) z[n] = 0;
+  fclose(in);
+  return z;
+}
+
+/*
+** Run the benchmarks of script zScript. Return non-zero on error.
+*/
+static int benchScript(const char *zScript){
+  sqlite3 *db = 0;
+  sqlite3_stmt *stmt = 0;
+  pivot_vtab_reader *pReader = 0;
+  char *zSql = benchReadFile(zScript);
+  char *zErr = 0;
+  Bench b;
+  int rc;
+
+  memset(&b, 0, sizeof(b));
+  b.zScript = strrchr(zScript, '/') ? strrchr(zScript, '/')+1 : zScript;
+  if( zSql==0 ){
+    printf("%s: cannot read\n", zScript);
+    return 1;
+  }
+  sqlite3_open(":memory:", &db);
+  sqlite3_db_config(db, SQLITE_DBCONFIG_LOOKASIDE, 0, 0, 0);
+  rc = sqlite3_exec(db, zSql, 0, 0, &zErr);
+  if( rc==SQLITE_OK ) rc = pivot_vtab_reader_open(db, "main", "p", &pReader);
+  if( rc==SQLITE_OK ){
+    b.pVtab = &pReader->tab->base;
+    b.pMod = b.pVtab->pModule;
+    b.nCol = pivot_vtab_reader_column_count(pReader);
+    rc = sqlite3_prepare_v2(db, "SELECT * FROM p", -1, &stmt, 0);
+  }
+  while( rc==SQLITE_OK && sqlite3_step(stmt)==SQLITE_ROW ){
+    sqlite3_value **ap = sqlite3_realloc64(b.apKey, (b.nKey+1)*sizeof(sqlite3_value*));
+    if( ap==0 ) break;
+    b.apKey = ap;
+    ap[b.nKey] = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
+    if( ap[b.nKey] ) b.nKey++;
+  }
+  if( rc==SQLITE_OK ) rc = sqlite3_finalize(stmt);
+  if( rc==SQLITE_OK && b.nKey==0 ){
+    zErr = sqlite3_mprintf("p has no rows");
+    rc = SQLITE_ERROR;
+  }
+  if( rc==SQLITE_OK ){
+    sqlite3_create_function(db, "bench_run", 0, SQLITE_UTF8, &b, benchRunFunc, 0, 0);
+    rc = sqlite3_exec(db, "SELECT bench_run()", 0, 0, &zErr);
+  }
+  if( rc!=SQLITE_OK ){
+    printf("%s: %s\n", zScript, zErr ? zErr : sqlite3_errmsg(db));
+  }
+  while( b.nKey>0 ) sqlite3_value_free(b.apKey[--b.nKey]);
+  sqlite3_free(b.apKey);
+  sqlite3_free(zErr);
+  sqlite3_free(zSql);
+  pivot_vtab_reader_close(pReader);
+  sqlite3_close(db);
+  return rc!=SQLITE_OK;
+}
+
+int main(int argc, char **argv){
+  int nErr = 0;
+  int i;
+
+  benchMallocInit();
+  sqlite3_auto_extension((void(*)(void))sqlite3_pivotvtab_init);
+  benchPerfInit();
+  printf("%-20s %-18s %9s %10s %9s %10s %10s %10s\n", "script", "method", "ops",
+    "ns/op", "allocs/op", "instr/op", "cycles/op", "misses/op");
+  for( i=1; i<argc; i++ ){
+    if( strcmp(argv[i], "-n")==0 && i+1<argc ){
+      nMult = atoi(argv[++i]);
+      if( nMult<1 ) nMult = 1;
+    }else{
+      nErr += benchScript(argv[i]);
+    }
+  }
+  return nErr!=0;
+}
@@ -0,0 +1,15 @@
+-- One pivot query per cell: 2000 rows of 8 columns, a quarter of the
+-- cells empty, over an index on the compared columns.
+CREATE TABLE r(id INTEGER PRIMARY KEY);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<2000) INSERT INTO r SELECT i FROM n;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<8) INSERT INTO c SELECT i, 'c' || i FROM n;
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, CASE c.id%3 WHEN 0 THEN r.id*c.id WHEN 1 THEN 'v' || r.id ELSE r.id/4.0 END
+  FROM r, c WHERE (r.id+c.id)%4;
+CREATE INDEX x_r_c ON x(r_id, c_id);
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2)
+);
@@ -0,0 +1,272 @@
+/*
+** throughput.c - Query throughput of a pivot_vtab build
+**
+** Build and run from the repository root:
+**
+**   gcc -O2 bench/throughput.c -lsqlite3 -o pivot_throughput
+**   ./pivot_throughput -ext ./pivot_vtab.so bench/cells.sql > plain.txt
+**   ./pivot_throughput -ext ./pgo/pivot_vtab.so -baseline plain.txt bench/cells.sql
+**
+** Each script creates a dataset and a pivot table named p on a new
+** in-memory database, as for bench.c. The program then runs SQL queries
+** on p and reports the rows read per second:
+**
+**   scan    SELECT * FROM p, reading every column
+**   lookup  SELECT * FROM p WHERE <first column> = ?1, for every row key
+**
+** Each query runs for at least 0.2 seconds, three times, and the best of
+** the three is reported, to limit the noise of other processes.
+**
+** Options:
+**
+**   -ext FILE        Load the extension from FILE. Programs built with
+**                    SQLITE_CORE and pivot_vtab.c (the static builds of
+**                    the Makefile) use the built-in extension without it.
+**   -baseline FILE   Compare with the output of an earlier run, and add
+**                    the speedup of this run over it to each line
+**   -n N             Multiply the minimum run time by N (default 1)
+**
+** The output has one line per script and query, so that runs of two
+** builds can be compared with -baseline.
+*/
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef SQLITE_CORE
+int sqlite3_pivotvtab_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+#endif
+
+static const char *zExt = 0;
+static int nMult = 1;
+
+/*
+** A line of a baseline run
+*/
+typedef struct Baseline Baseline;
+struct Baseline {
+  char zScript[64];              // Script name
+  char zQuery[16];               // Query name
+  double rRate;                  // Rows per second
+};
+static Baseline *aBase = 0;
+static int nBase = 0;
+
+/*
+** Return the current time in seconds.
+*/
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/*
+** Read the lines of baseline file zFile into aBase. Return non-zero if
+** the file cannot be read.
+*/
+static int readBaseline(const char *zFile){
+  FILE *in = fopen(zFile, "r");
+  char zLine[256];
+  if( in==0 ){
+    printf("%s: cannot open\n", zFile);
+    return 1;
+  }
+  while( fgets(zLine, sizeof(zLine), in) ){
+    Baseline b;
+    Baseline *a;
+    if( sscanf(zLine, "%63s %15s %lf", b.zScript, b.zQuery, &b.rRate)!=3 ) continue;
+    a = realloc(aBase, (nBase+1)*sizeof(Baseline));
+    if( a==0 ) break;
+    aBase = a;
+    aBase[nBase++] = b;
+  }
+  fclose(in);
+  return 0;
+}
+
+/*
+** Print the rate of query zQuery of script zScript, and its speedup over
+** the baseline if there is one.
+*/
+static void report(const char *zScript, const char *zQuery, double rRate){
+  int i;
+  printf("%-20s %-8s %14.0f", zScript, zQuery, rRate);
+  for( i=0; i<nBase; i++ ){
+    if( strcmp(aBase[i].zScript, zScript)==0 && strcmp(aBase[i].zQuery, zQuery)==0 ){
+      printf(" %14.0f %7.3fx", aBase[i].rRate, rRate/aBase[i].rRate);
+      break;
+    }
+  }
+  printf("\n");
+}
+
+/*
+** Step stmt to its end, reading every column of every row, and reset it.
+** Return the number of rows, or -1 on error.
+*/
+static int readRows(sqlite3_stmt *stmt){
+  int nCol = sqlite3_column_count(stmt);
+  int nRow = 0;
+  int i;
+  while( sqlite3_step(stmt)==SQLITE_ROW ){
+    for( i=0; i<nCol; i++ ) sqlite3_column_value(stmt, i);
+    nRow++;
+  }
+  return sqlite3_reset(stmt)==SQLITE_OK ? nRow : -1;
+}
+
+/*
+** Run query zSql of script zScript as described in the header comment.
+** If the query has a parameter, bind each of the nKey values of apKey to
+** it in turn. Return non-zero on error.
+*/
+static int runQuery(
+  sqlite3 *db,
+  const char *zScript,
+  const char *zQuery,
+  const char *zSql,
+  int nKey,
+  sqlite3_value **apKey
+){
+  sqlite3_stmt *stmt = 0;
+  double rBest = 0.0;
+  int bParam;
+  int iRound;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+  if( rc!=SQLITE_OK ){
+    printf("%s: %s\n", zSql, sqlite3_errmsg(db));
+    return 1;
+  }
+  bParam = sqlite3_bind_parameter_count(stmt)>0;
+
+  // An untimed run warms the caches and plans
+  for( iRound=-1; iRound<3 && rc==SQLITE_OK; iRound++ ){
+    double rStart = now();
+    double rElapsed;
+    sqlite3_int64 nRow = 0;
+    do{
+      int i, n;
+      for( i=0; i<(bParam ? nKey : 1) && rc==SQLITE_OK; i++ ){
+        if( bParam ) sqlite3_bind_value(stmt, 1, apKey[i]);
+        n = readRows(stmt);
+        if( n<0 ) rc = SQLITE_ERROR;
+        nRow += n;
+      }
+      rElapsed = now()-rStart;
+    }while( rc==SQLITE_OK && iRound>=0 && rElapsed<0.2*nMult );
+    if( iRound>=0 && rElapsed>0 && nRow/rElapsed>rBest ) rBest = nRow/rElapsed;
+  }
+  if( rc!=SQLITE_OK ){
+    printf("%s: %s\n", zSql, sqlite3_errmsg(db));
+  }else{
+    report(zScript, zQuery, rBest);
+  }
+  sqlite3_finalize(stmt);
+  return rc!=SQLITE_OK;
+}
+
+/*
+** Read the file zFile into a buffer obtained from sqlite3_malloc(), or
+** return 0.
+*/
+static char *readFile(const char *zFile){
+  FILE *in = fopen(zFile, "rb");
+  char *z = 0;
+  long n;
+  if( in==0 ) return 0;
+  fseek(in, 0, SEEK_END);
+  n = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  z = sqlite3_malloc64(n+1);
+  if( z && fread(z, 1, n, in)!=(size_t)n ){
+    sqlite3_free(z);
+    z = 0;
+  }
+  if( z ) z[n] = 0;
+  fclose(in);
+  return z;
+}
+
+/*
+** Run the queries of script zFile. Return non-zero on error.
+*/
+static int runScript(const char *zFile){
+  const char *zScript = strrchr(zFile, '/') ? strrchr(zFile, '/')+1 : zFile;
+  sqlite3 *db = 0;
+  sqlite3_stmt *stmt = 0;
+  sqlite3_value **apKey = 0;
+  char *zSql = readFile(zFile);
+  char *zErr = 0;
+  char *zLookup = 0;
+  int nKey = 0;
+  int nErr = 0;
+  int rc;
+
+  if( zSql==0 ){
+    printf("%s: cannot read\n", zFile);
+    return 1;
+  }
+  sqlite3_open(":memory:", &db);
+  rc = SQLITE_OK;
+  if( zExt ){
+    sqlite3_enable_load_extension(db, 1);
+    rc = sqlite3_load_extension(db, zExt, "sqlite3_pivotvtab_init", &zErr);
+  }
+  if( rc==SQLITE_OK ) rc = sqlite3_exec(db, zSql, 0, 0, &zErr);
+  if( rc==SQLITE_OK ) rc = sqlite3_prepare_v2(db, "SELECT * FROM p", -1, &stmt, 0);
+  while( rc==SQLITE_OK && sqlite3_step(stmt)==SQLITE_ROW ){
+    sqlite3_value **ap = sqlite3_realloc64(apKey, (nKey+1)*sizeof(sqlite3_value*));
+    if( ap==0 ) break;
+    apKey = ap;
+    if( zLookup==0 ){
+      zLookup = sqlite3_mprintf("SELECT * FROM p WHERE \"%w\" = ?1", sqlite3_column_name(stmt, 0));
+    }
+    ap[nKey] = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
+    if( ap[nKey] ) nKey++;
+  }
+  if( rc==SQLITE_OK ) rc = sqlite3_finalize(stmt);
+  if( rc!=SQLITE_OK ){
+    printf("%s: %s\n", zFile, zErr ? zErr : sqlite3_errmsg(db));
+    nErr++;
+  }else{
+    nErr += runQuery(db, zScript, "scan", "SELECT * FROM p", 0, 0);
+    if( zLookup ) nErr += runQuery(db, zScript, "lookup", zLookup, nKey, apKey);
+  }
+  while( nKey>0 ) sqlite3_value_free(apKey[--nKey]);
+  sqlite3_free(apKey);
+  sqlite3_free(zLookup);
+  sqlite3_free(zErr);
+  sqlite3_free(zSql);
+  sqlite3_close(db);
+  return nErr;
+}
+
+int main(int argc, char **argv){
+  int nErr = 0;
+  int i;
+
+#ifdef SQLITE_CORE
+  sqlite3_auto_extension((void(*)(void))sqlite3_pivotvtab_init);
+#endif
+  for( i=1; i<argc-1; i++ ){
+    if( strcmp(argv[i], "-baseline")==0 && readBaseline(argv[++i]) ) return 1;
+  }
+  printf("%-20s %-8s %14s%s\n", "script", "query", "rows/s", nBase ? "       baseline speedup" : "");
+  for( i=1; i<argc; i++ ){
+    if( strcmp(argv[i], "-ext")==0 && i+1<argc ){
+      zExt = argv[++i];
+    }else if( strcmp(argv[i], "-baseline")==0 && i+1<argc ){
+      i++;
+    }else if( strcmp(argv[i], "-n")==0 && i+1<argc ){
+      nMult = atoi(argv[++i]);
+      if( nMult<1 ) nMult = 1;
+    }else{
+      nErr += runScript(argv[i]);
+    }
+  }
+  free(aBase);
+  return nErr!=0;
+}
@@ -185,14 +185,413 @@
 
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT1
+#include "pivot_vtab.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+
+/*
+** The refresh_ms option rebuilds source scans in a background thread. It
+** is unavailable on Windows and in builds with -DPIVOT_VTAB_OMIT_THREADS.
+*/
+#if !defined(_WIN32) && !defined(PIVOT_VTAB_OMIT_THREADS)
+# include <pthread.h>
+# define PIVOT_VTAB_THREADS 1
+#endif
+
+/*
+** Latency histogram buckets are updated and read with relaxed atomics, so
+** that they need no lock and a reader never sees a torn count.
+*/
+#if defined(__GNUC__) || defined(__clang__)
+# define PIVOT_ATOMIC_INC(p)  __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+# define PIVOT_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#elif defined(_MSC_VER)
+# include <intrin.h>
+# define PIVOT_ATOMIC_INC(p)  _InterlockedIncrement64((volatile __int64*)(p))
+# define PIVOT_ATOMIC_LOAD(p) (*(volatile sqlite3_int64*)(p))
+#else
+# define PIVOT_ATOMIC_INC(p)  (++*(p))
+# define PIVOT_ATOMIC_LOAD(p) (*(p))
+#endif
+
+/*
+** Maximum number of key query plans memoized per pivot_vtab. Once the
+** limit is reached pivotBestIndex() falls back to passing the filtered
+** key query to pivotFilter() as idxStr.
+*/
+#ifndef PIVOT_VTAB_MAX_PLANS
+# define PIVOT_VTAB_MAX_PLANS 64
+#endif
+
+/*
+** Maximum number of parameter columns per pivot_vtab. The parameters
+** constrained by a plan are passed to pivotFilter() as a bitmask, so this
+** may not exceed 30.
+*/
+#ifndef PIVOT_VTAB_MAX_PARAMS
+# define PIVOT_VTAB_MAX_PARAMS 16
+#endif
+
+/*
+** Default capacities of the row and miss caches (see the row_cache and
+** miss_cache options).
+*/
+#ifndef PIVOT_VTAB_ROW_CACHE
+# define PIVOT_VTAB_ROW_CACHE 256
+#endif
+#ifndef PIVOT_VTAB_MISS_CACHE
+# define PIVOT_VTAB_MISS_CACHE 256
+#endif
+
+/*
+** Maximum number of changed source rows recorded for a delta query
+** between two cache validations. Beyond this the caches are flushed.
+*/
+#ifndef PIVOT_VTAB_MAX_DELTA
+# define PIVOT_VTAB_MAX_DELTA 1024
+#endif
+
+/*
+** Number of buckets of a latency histogram. Bucket i counts durations of
+** 2^i to 2^(i+1)-1 nanoseconds, and the last bucket everything longer.
+*/
+#define PIVOT_VTAB_HIST_BUCKETS 40
+
+/*
+** Maximum number of rows of a tile of a tiled scan (see the tile_rows
+** option). Tiles start at tile_rows rows and grow up to this limit, or
+** until the tile queries of a tile return PIVOT_VTAB_TILE_CELLS cells.
+*/
+#ifndef PIVOT_VTAB_MAX_TILE_ROWS
+# define PIVOT_VTAB_MAX_TILE_ROWS 4096
+#endif
+#ifndef PIVOT_VTAB_TILE_CELLS
+# define PIVOT_VTAB_TILE_CELLS 65536
+#endif
+
+/*
+** pivot_version is the version of the data that cached cells were read
+** at: the data version of the attached databases, and a count of the
+** changes made by this connection. Both only ever increase, and they are
+** compared separately, so that no change to one can be hidden by the
+** other.
+*/
+typedef struct pivot_version pivot_version;
+struct pivot_version {
+  sqlite3_uint64 iData;          // Sum of the data versions of the databases
+  sqlite3_int64 iChange;         // Changes made by this connection
+};
+#define PIVOT_VERSION_SAME(a, b) ((a).iData==(b).iData && (a).iChange==(b).iChange)
+
+/*
+** pivot_plan is a memoized pivotBestIndex() result. Plans are identified
+** by the usable constraints and ORDER BY terms that were consumed, and
+** are referenced from pivotFilter() by their index (idxNum).
+*/
+typedef struct pivot_plan pivot_plan;
+struct pivot_plan {
+  int nSig;                      // Number of entries in aSig
+  int *aSig;                     // (iColumn, op) per constraint, then (iColumn, desc) per ORDER BY term
+  int nCons;                     // Number of constraints in aSig
+  char *zSql;                    // Filtered key query
+  sqlite3_stmt *stmt;            // Idle prepared key query, or 0 if none/in use
+  int *aPoint;                   // argv index of each row key column for point lookups, or 0
+  unsigned int mParam;           // Mask of the parameters passed first in argv
+  int iValueCol;                 // Pivot column of the value index constraints, or -1
+  int nValueCons;                // Number of value index constraints, last in aSig and argv
+  char *zValueSql;               // Key query filtered on the row key values of a source row
+};
+
+/*
+** pivot_entry is a row cache entry. It holds every row returned by the
+** key query for one point lookup on the pivot table key, along with the
+** cells of those rows that have been evaluated so far.
+*/
+typedef struct pivot_entry pivot_entry;
+struct pivot_entry {
+  char *zKey;                    // Serialized row key values
+  int nKey;                      // Size of zKey in bytes
+  unsigned int iHash;            // Hash of zKey
+  int nRef;                      // Number of cursors reading this entry
+  int bOrphan;                   // True if removed from the cache while in use
+  int nRow;                      // Number of key query rows
+  sqlite3_value **aVal;          // nRow*(nRow_cols+nCol_key) key and cell values
+  unsigned char *aEval;          // aEval[i] is true if aVal[i] has been evaluated
+  int iRow;                      // Row of a source scan entry
+  pivot_entry *pHashNext;        // Next entry in the same hash bucket
+  pivot_entry *pLruPrev;         // Next most recently used entry
+  pivot_entry *pLruNext;         // Next least recently used entry
+};
+
+/*
+** pivot_lru is a hash table of pivot_entry objects with least recently
+** used eviction. It backs the row cache and the miss cache.
+*/
+typedef struct pivot_lru pivot_lru;
+struct pivot_lru {
+  int nMax;                      // Capacity in entries, 0 if disabled
+  int nEntry;                    // Number of entries
+  int nHash;                     // Number of hash buckets
+  pivot_entry **aHash;           // Hash table
+  pivot_entry *pFirst;           // Most recently used entry
+  pivot_entry *pLast;            // Least recently used entry
+};
+
+/*
+** pivot_vector holds the cells of one pivot column of a source scan, by
+** column. Element i is the cell of row i. The type of the column is that
+** of its first non-null value, and its values are stored unboxed in the
+** array for that type: aInt, aReal, or an offset and length into zArena
+** for text and blobs. The rare values of another type are kept as
+** sqlite3_value copies in aOther.
+**
+** With the compress option, a loaded vector without values in aOther is
+** compressed (see pivotVectorCompress()). Text and blobs with few distinct
+** values are stored once each, in a dictionary indexed by aCode. Mostly
+** NULL vectors store only their non-null values, the value of row i in
+** slot aRank[i/64] plus the bits of aValid set before bit i.
+*/
+typedef struct pivot_vector pivot_vector;
+struct pivot_vector {
+  int eType;                     // SQLITE_INTEGER, _FLOAT, _TEXT or _BLOB, or 0 if all NULL
+  unsigned char *aValid;         // Bit i is set if row i is not NULL
+  unsigned char *aSeen;          // Bit i is set once row i is loaded, while scanning
+  sqlite3_int64 *aInt;           // SQLITE_INTEGER values
+  double *aReal;                 // SQLITE_FLOAT values
+  int *aOff;                     // SQLITE_TEXT and SQLITE_BLOB offsets in zArena
+  int *aLen;                     // SQLITE_TEXT and SQLITE_BLOB sizes in bytes
+  char *zArena;                  // Text and blob values, each nul-terminated
+  int nArena;                    // Bytes of zArena used
+  int nArenaAlloc;               // Bytes of zArena allocated
+  sqlite3_value **aOther;        // Values not of type eType, or 0
+  int *aRank;                    // Values before each 64 rows, or 0 if dense
+  unsigned short *aCode;         // Dictionary codes of text and blobs, or 0
+  int nDict;                     // Dictionary size, if aCode is not 0
+  int *aSorted;                  // Non-null rows sorted by value, or 0
+  int nSorted;                   // Number of entries in aSorted
+};
+
+/*
+** pivot_scan holds every cell of a pivot table, loaded by one scan of its
+** source query. Each row is a pivot_entry keyed by the row key values
+** bound to the pivot query, and its cells are row iRow of the column
+** vectors.
+**
+** The scan of an as-of pivot table holds the latest cells at or before
+** the cutoff pAsOf. Only cursors with that cutoff may read it, which they
+** tell by iLoad (see pivotSourceCurrent()).
+**
+** With a column query instead of a source query, bValid is never set, and
+** the vector of each column is loaded by one run of the column query the
+** first time a scan reads the column (see pivotColumnLoad()).
+*/
+typedef struct pivot_scan pivot_scan;
+struct pivot_scan {
+  int bValid;                    // True if the cells are current
+  int nEntry;                    // Number of entries
+  int nHash;                     // Number of hash buckets
+  pivot_entry **aHash;           // Hash table
+  int nRowAlloc;                 // Rows allocated in each vector
+  int nVec;                      // Number of vectors
+  pivot_vector *aVec;            // Cells of each pivot column
+  unsigned char *aMember;        // Bit i is set if row i is returned by the key query, or 0
+  int bMemberDup;                // True if the key query returns a row more than once
+  pivot_entry **aEntry;          // Entry of each row, or 0
+  unsigned char *aLoaded;        // Bit i is set once column i is loaded by the column query
+  sqlite3_value *pAsOf;          // Cutoff of an as-of scan, or 0 if NULL
+  int iLoad;                     // Incremented each time the scan is loaded
+};
+
+/*
+** pivot_column is a pivot column. Its evaluation profile is reported by
+** the pivot_vtab_column_stats table.
+*/
+typedef struct pivot_column pivot_column;
+struct pivot_column {
+  char *zName;                   // Column name
+  sqlite3_value *pKey;           // Column key
+  sqlite3_int64 nEval;           // Number of pivot query evaluations
+  sqlite3_int64 nHit;            // Number of evaluations that returned a row
+  sqlite3_int64 nTime;           // Wall time spent evaluating, in nanoseconds
+  int bValueIndex;               // True if the column has a value index
+};
+
+/*
+** pivot_keytype is how the values of a key column of the source or column
+** query compare with the value bound to the pivot query in their place:
+** with the affinity and collation of the column. Keys are serialized in
+** that form by pivotKeyBuild(), so that the keys that compare equal match.
+*/
+#define PIVOT_AFF_NONE     0     // No affinity - values compare as they are
+#define PIVOT_AFF_TEXT     1     // TEXT affinity
+#define PIVOT_AFF_NUMERIC  2     // INTEGER, REAL or NUMERIC affinity
+#define PIVOT_COLL_BINARY  0
+#define PIVOT_COLL_NOCASE  1
+#define PIVOT_COLL_RTRIM   2
+typedef struct pivot_keytype pivot_keytype;
+struct pivot_keytype {
+  int eAff;                      // PIVOT_AFF_NONE, _TEXT or _NUMERIC
+  int eColl;                     // PIVOT_COLL_BINARY, _NOCASE or _RTRIM
+};
+
+/*
+** Statistics reported for each pivot_vtab by the pivot_vtab_stats table.
+*/
+enum {
+  PIVOT_STAT_ROW_CACHE_CAPACITY,
+  PIVOT_STAT_ROW_CACHE_SIZE,
+  PIVOT_STAT_ROW_CACHE_HITS,
+  PIVOT_STAT_ROW_CACHE_MISSES,
+  PIVOT_STAT_ROW_CACHE_HIT_RATE,
+  PIVOT_STAT_ROW_CACHE_EVICTIONS,
+  PIVOT_STAT_MISS_CACHE_CAPACITY,
+  PIVOT_STAT_MISS_CACHE_SIZE,
+  PIVOT_STAT_MISS_CACHE_HITS,
+  PIVOT_STAT_MISS_CACHE_EVICTIONS,
+  PIVOT_STAT_CACHE_FLUSHES,
+  PIVOT_STAT_DEPENDENCIES,
+  PIVOT_STAT_DEPENDENCY_CHANGES,
+  PIVOT_STAT_DELTA_ROWS,
+  PIVOT_STAT_DELTA_INVALIDATIONS,
+  PIVOT_STAT_SOURCE_SCANS,
+  PIVOT_STAT_SOURCE_SHARED_SCANS,
+  PIVOT_STAT_COLUMN_SCANS,
+  PIVOT_STAT_TILE_QUERIES,
+  PIVOT_STAT_SOURCE_BYTES,
+  PIVOT_STAT_VALUE_INDEX_SCANS,
+  PIVOT_STAT_SNAPSHOT_REFRESHES,
+  PIVOT_STAT_SNAPSHOT_WAITS,
+  PIVOT_STAT_SNAPSHOT_FAILURES,
+  PIVOT_STAT_BEST_INDEX_CALLS,
+  PIVOT_STAT_FILTER_CALLS,
+  PIVOT_STAT_NEXT_CALLS,
+  PIVOT_STAT_COLUMN_CALLS,
+  PIVOT_STAT_INDEX_ADVICE,
+  PIVOT_STAT_COUNT
+};
+static const char *const azPivotStat[PIVOT_STAT_COUNT] = {
+  "row_cache_capacity",
+  "row_cache_size",
+  "row_cache_hits",
+  "row_cache_misses",
+  "row_cache_hit_rate",
+  "row_cache_evictions",
+  "miss_cache_capacity",
+  "miss_cache_size",
+  "miss_cache_hits",
+  "miss_cache_evictions",
+  "cache_flushes",
+  "dependencies",
+  "dependency_changes",
+  "delta_rows",
+  "delta_invalidations",
+  "source_scans",
+  "source_shared_scans",
+  "column_scans",
+  "tile_queries",
+  "source_bytes",
+  "value_index_scans",
+  "snapshot_refreshes",
+  "snapshot_waits",
+  "snapshot_failures",
+  "best_index_calls",
+  "filter_calls",
+  "next_calls",
+  "column_calls",
+  "index_advice",
+};
+
+/*
+** Latency histograms recorded for each pivot_vtab and reported by the
+** pivot_vtab_latency table.
+*/
+enum {
+  PIVOT_HIST_SCAN,               // pivotFilter() to the end of the scan
+  PIVOT_HIST_FIRST_ROW,          // pivotFilter() to the first row
+  PIVOT_HIST_CELL,               // One pivot query evaluation
+  PIVOT_HIST_COUNT
+};
+static const char *const azPivotHist[PIVOT_HIST_COUNT] = {
+  "scan",
+  "first_row",
+  "cell",
+};
+
+/*
+** pivot_global holds the per-connection state shared by every pivot_vtab
+** on a database connection. It is the pAux of the registered modules.
+*/
+typedef struct pivot_vtab pivot_vtab;
+typedef struct pivot_global pivot_global;
+struct pivot_global {
+  sqlite3 *db;                   // Database connection
+  pivot_vtab *pVtab;             // List of connected pivot tables
+  sqlite3_int64 nHookChange;     // Row changes reported by the update hook
+  sqlite3_int64 nHookChangeSeen; // nHookChange at the last pivotGlobalSync()
+  sqlite3_int64 nTotalChangeSeen;// sqlite3_total_changes64() at the last pivotGlobalSync()
+  int nVersion;                  // Number of entries in azVersionDb and aVersionStmt
+  char **azVersionDb;            // Schema name of each aVersionStmt
+  sqlite3_stmt **aVersionStmt;   // PRAGMA data_version stmt for each attached database
+};
+
+/*
+** pivot_dep is a table read by the key query or the pivot query.
+*/
+typedef struct pivot_dep pivot_dep;
+struct pivot_dep {
+  char *zDb;                     // Schema name
+  char *zTab;                    // Table name
+};
+
+/*
+** pivot_snapshot is a source scan loaded by a background refresh (see the
+** refresh_ms option). A refresh replaces the current snapshot of a table
+** rather than modifying it: each scan pins the snapshot it started on, and
+** a snapshot is freed once the table and every scan have released it.
+*/
+typedef struct pivot_snapshot pivot_snapshot;
+struct pivot_snapshot {
+  pivot_scan scan;               // Cells of the source query
+  int nRef;                      // Number of references
+  pivot_version version;         // Data version when the refresh started
+  sqlite3_int64 iStart;          // Time the refresh started
+};
+
+/*
+** pivot_refresh is the background refresh state of a pivot table with the
+** refresh_ms option. The worker thread loads pNew on its own read
+** connection, reading only the parts of the pivot_vtab that are fixed once
+** connected, and sets bDone under the mutex. Everything else belongs to
+** the thread using the database connection, which joins the worker before
+** making pNew current.
+*/
+typedef struct pivot_refresh pivot_refresh;
+struct pivot_refresh {
+  pivot_vtab *tab;               // Table refreshed
+  sqlite3_int64 nWindow;         // Staleness allowed, in nanoseconds
+  char *zFile;                   // Database file read by the worker
+  sqlite3 *db;                   // Read connection of the worker, or 0
+  sqlite3_mutex *mutex;          // Guards bDone, rc and zErr
+  int bRunning;                  // True from starting the worker until joining it
+  int bDone;                     // True once the worker has finished
+  int rc;                        // Result of the worker
+  char *zErr;                    // Error message of a failed worker, or 0
+  int nFail;                     // Number of consecutive failed refreshes
+  sqlite3_int64 iFail;           // Time the last refresh failed
+  pivot_snapshot *pNew;          // Snapshot being loaded by the worker, or 0
+  pivot_snapshot *pSnapshot;     // Current snapshot, or 0
+#ifdef PIVOT_VTAB_THREADS
+  pthread_t thread;              // Worker thread
+#endif
+};
 
 /*
 ** pivot_vtab is a subclass of sqlite3_vtab which is
 ** underlying representation of the virtual table
 */
-typedef struct pivot_vtab pivot_vtab;
 struct pivot_vtab {
   sqlite3_vtab base;             // Base class. Must be first
   sqlite3 *db;                   // Database connection
@@ -200,548 +599,6525 @@ struct pivot_vtab {
   int nRow_cols;                 // Number of row columns
   int nCol_key;                  // Number of column key values
   sqlite3_stmt **col_stmt;       // List of column pivot query stmts
+  pivot_column *aCol;            // Name, key and profile of each pivot column
   char *key_sql_full_table_scan; // Full table scan key query
   char **key_sql_col_names;      // Array of key query column names
+  int nParam;                    // Number of parameter columns
+  char **azParam;                // Parameter column names
+  int nValueIndex;               // Number of value_index options
+  int bValueRebind;              // True if source row keys can be bound to the key query
+  char **azValueIndex;           // Columns named by value_index options
+  int nKeyParam;                 // Number of bound params in the key query
+  int nPlan;                     // Number of memoized key query plans
+  pivot_plan *aPlan;             // Memoized key query plans, indexed by idxNum
+  char *zName;                   // Name of the virtual table
+  char *zDb;                     // Schema of the virtual table
+  pivot_global *pGlobal;         // Per-connection state
+  pivot_vtab_reader *pReader;    // Readers open on this table
+  pivot_vtab *pNext;             // Next pivot table on this connection
+  sqlite3_int64 aStat[PIVOT_STAT_COUNT]; // Statistics counters
+  pivot_lru rowCache;            // Rows of recent point lookups
+  pivot_lru missCache;           // Keys of recent point lookups that found no rows
+  pivot_version cacheVersion;    // Data version the caches were filled at
+  int bCacheWriteTxn;            // True if the caches were validated in a write transaction
+  int bTrackDeps;                // True to invalidate only on changes to aDep tables
+  int nDep;                      // Number of tables in aDep
+  pivot_dep *aDep;               // Tables read by the key and pivot queries
+  sqlite3_int64 iDepChange;      // Incremented on every change to an aDep table
+  char *zDeltaSql;               // Delta query, or 0
+  sqlite3_stmt *delta_stmt;      // Delta query stmt - maps a source rowid to row keys
+  char *zDeltaDb;                // Schema of the delta query source table
+  char *zDeltaTab;               // Delta query source table
+  int nDelta;                    // Number of rowids in aDelta
+  sqlite3_int64 *aDelta;         // Changed source rowids not yet applied to the caches
+  char *zSourceSql;              // Source query, or 0
+  sqlite3_stmt *source_stmt;     // Source query stmt
+  char *zColumnSql;              // Column query, or 0
+  sqlite3_stmt *column_stmt;     // Column query stmt
+  int nTileRows;                 // Rows in the first tile of a tiled scan, 0 if disabled
+  sqlite3_stmt *tile_stmt;       // Source query filtered on lists of row and column keys
+  sqlite3_stmt *value_stmt;      // "SELECT ?1" - boxes source scan vector values
+  pivot_keytype *aKeyType;       // Type of each key column of the source or column query, or 0
+  char **azColKey;               // Serialized column key values, or 0 if NULL
+  int *anColKey;                 // Size of each azColKey entry in bytes, or -1 if NULL
+  int *aColNext;                 // Next pivot column with the same serialized column key, or -1
+  int nColHash;                  // Number of slots in aColHash
+  int *aColHash;                 // Hash of azColKey - column index plus 1, or 0
+  pivot_scan source;             // Cells of the last scan of the source query
+  int bScanning;                 // True while receiving a shared source scan
+  int bInner;                    // True to skip rows without non-null cells
+  int bCompress;                 // True to compress source scan vectors
+  int bReference;                // True to evaluate every cell by its pivot query
+  int bAsOf;                     // True if the parameter is the cutoff of an as-of source
+  int nRefreshMs;                // Staleness window of background refreshes, 0 if disabled
+  pivot_refresh *pRefresh;       // Background refresh state, or 0
+  int bKeyRowid;                 // True if the rowid is the row key, known to hold unique integers
+  char *zAdvice;                 // Index advice of the last pivotAdvise() call, or 0
+  int bCreateIndex;              // True to create the advised indexes
+  sqlite3_int64 aHist[PIVOT_HIST_COUNT][PIVOT_VTAB_HIST_BUCKETS]; // Latency histograms
+  sqlite3_int64 nSlowScan;       // Scans slower than this many ns are logged, 0 for none
+  int bTiming;                   // True to time each pivot query evaluation
+};
+
+/*
+** pivot_cursor is a subclass of sqlite3_vtab_cursor which will
+** serve as the underlying representation of a cursor that scans
+** over rows of the result
+*/
+typedef struct pivot_cursor pivot_cursor;
+struct pivot_cursor {
+  sqlite3_vtab_cursor base;  // Base class - must be first
+  sqlite3_int64 iRowid;      // The rowid
+  sqlite3_stmt *stmt;        // Row key prepared stmt - used for full table scan
+  int iPlan;                 // Plan that stmt belongs to, or -1
+  int rc;                    // Return value for stmt
+  sqlite3_value **pivot_key; // Array of row keys
+  pivot_entry *pEntry;       // Row cache entry being read, or 0
+  int iEntryRow;             // Current row of pEntry
+  sqlite3_value **aParam;    // Parameter values of the current filter, or 0
+  sqlite3_int64 iScanStart;  // Time the current scan started, or 0
+  sqlite3_int64 nScanRow;    // Rows returned by the current scan
+  sqlite3_int64 nScanCell;   // Cells evaluated by the current scan
+  char *zScanSql;            // Expanded key query of the current scan, if logging
+  char *zScanArgs;           // Constraint values of the current scan, if logging
+  int bColumnScan;           // True if cells are loaded by the column query
+  char *zMatch;              // Row keys of the source rows of a value index scan
+  int *aMatch;               // Offset of each row key in zMatch, and the end
+  int nMatch;                // Number of row keys in zMatch
+  int iMatch;                // Row key being read
+  int nTileRows;             // Rows in the next tile of a tiled scan, or 0
+  pivot_scan tile;           // Row keys of the current tile
+  int *aTileHead;            // First row of pEntry with each row key of tile
+  int *aTileNext;            // Next row with the same row key, -1, or -2 if not tiled
+  unsigned char *aTileDone;  // Bit i is set once column i of the tile is fetched
+  unsigned char *aTileUsed;  // Bit i is set if column i is fetched with the first column read in a tile
+  int *aTileReads;           // Reads of each column in the current tile
+  sqlite3_int64 nTileCells;  // Cells returned by the tile queries of the current tile
+  int iSourceLoad;           // iLoad of the source scan with the cutoff of an as-of scan, or -1
+  pivot_snapshot *pSnapshot; // Snapshot pinned by the current scan, or 0
 };
 
-/* 
-** pivot_cursor is a subclass of sqlite3_vtab_cursor which will
-** serve as the underlying representation of a cursor that scans
-** over rows of the result
-*/
-typedef struct pivot_cursor pivot_cursor;
-struct pivot_cursor {
-  sqlite3_vtab_cursor base;  // Base class - must be first
-  sqlite3_int64 iRowid;      // The rowid
-  sqlite3_stmt *stmt;        // Row key prepared stmt - used for full table scan
-  int rc;                    // Return value for stmt
-  sqlite3_value **pivot_key; // Array of row keys
+/*
+** Append the serialized form of a value to a row cache key. Values of
+** different types never serialize to the same bytes.
+*/
+static void pivotKeyAppend(sqlite3_str *pKey, sqlite3_value *pVal){
+  int eType = sqlite3_value_type(pVal);
+  char t = (char)eType;
+  sqlite3_str_append(pKey, &t, 1);
+  switch( eType ){
+    case SQLITE_INTEGER: {
+      sqlite3_int64 v = sqlite3_value_int64(pVal);
+      sqlite3_str_append(pKey, (const char*)&v, sizeof(v));
+      break;
+    }
+    case SQLITE_FLOAT: {
+      double v = sqlite3_value_double(pVal);
+      sqlite3_str_append(pKey, (const char*)&v, sizeof(v));
+      break;
+    }
+    case SQLITE_TEXT:
+    case SQLITE_BLOB: {
+      const void *z = eType==SQLITE_TEXT ? (const void*)sqlite3_value_text(pVal) : sqlite3_value_blob(pVal);
+      int n = sqlite3_value_bytes(pVal);
+      sqlite3_str_append(pKey, (const char*)&n, sizeof(n));
+      if( n>0 ) sqlite3_str_append(pKey, (const char*)z, n);
+      break;
+    }
+  }
+}
+
+/*
+** FNV-1a hash of a serialized row cache key.
+*/
+static unsigned int pivotKeyHash(const char *zKey, int nKey){
+  unsigned int h = 2166136261u;
+  int i;
+  for( i=0; i<nKey; i++ ){
+    h ^= (unsigned char)zKey[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+** Return the pivot_keytype affinity of a column with declared type zType,
+** or of an expression if zType is 0.
+*/
+static int pivotKeyAffinity(const char *zType){
+  if( zType==0 ) return PIVOT_AFF_NONE;
+  if( sqlite3_strlike("%INT%", zType, 0)==0 ) return PIVOT_AFF_NUMERIC;
+  if( sqlite3_strlike("%CHAR%", zType, 0)==0
+   || sqlite3_strlike("%CLOB%", zType, 0)==0
+   || sqlite3_strlike("%TEXT%", zType, 0)==0 ) return PIVOT_AFF_TEXT;
+  if( zType[0]==0 || sqlite3_strlike("%BLOB%", zType, 0)==0 ) return PIVOT_AFF_NONE;
+  return PIVOT_AFF_NUMERIC;
+}
+
+/*
+** Set *pType to the type of result column i of stmt. The collation is
+** that of the table column it reads, which is only known if SQLite was
+** built with SQLITE_ENABLE_COLUMN_METADATA - it is BINARY otherwise.
+** Return SQLITE_ERROR, with an error message in *pzErr, if the collation
+** is not one of the built-in ones.
+*/
+static int pivotKeyTypeOf(sqlite3 *db, sqlite3_stmt *stmt, int i, pivot_keytype *pType, char **pzErr){
+  pType->eAff = pivotKeyAffinity(sqlite3_column_decltype(stmt, i));
+  pType->eColl = PIVOT_COLL_BINARY;
+#if !defined(SQLITE_CORE) || defined(SQLITE_ENABLE_COLUMN_METADATA)
+  if( sqlite3_compileoption_used("ENABLE_COLUMN_METADATA") ){
+    const char *zDb = sqlite3_column_database_name(stmt, i);
+    const char *zTab = sqlite3_column_table_name(stmt, i);
+    const char *zCol = sqlite3_column_origin_name(stmt, i);
+    const char *zColl = 0;
+    if( zDb && zTab && zCol
+     && sqlite3_table_column_metadata(db, zDb, zTab, zCol, 0, &zColl, 0, 0, 0)==SQLITE_OK
+     && zColl ){
+      if( sqlite3_stricmp(zColl, "NOCASE")==0 ){
+        pType->eColl = PIVOT_COLL_NOCASE;
+      }else if( sqlite3_stricmp(zColl, "RTRIM")==0 ){
+        pType->eColl = PIVOT_COLL_RTRIM;
+      }else if( sqlite3_stricmp(zColl, "BINARY")!=0 ){
+        *pzErr = sqlite3_mprintf("key column \"%s\" has collation %s - only BINARY, NOCASE and RTRIM keys can be matched.", zCol, zColl);
+        return SQLITE_ERROR;
+      }
+    }
+  }
+#endif
+  return SQLITE_OK;
+}
+
+/*
+** Append the serialized form of key value pVal to pKey as it compares
+** with a key column of type pType: with the affinity of the column applied,
+** integral reals as integers, and text folded by the collation of the
+** column. Values that compare equal serialize to the same bytes. Return
+** SQLITE_NOMEM if the value could not be converted.
+*/
+static int pivotKeyAppendAs(sqlite3_str *pKey, sqlite3_value *pVal, const pivot_keytype *pType){
+  sqlite3_value *pConv = 0;
+  int eType = sqlite3_value_type(pVal);
+  char t;
+
+  if( (pType->eAff==PIVOT_AFF_NUMERIC && eType==SQLITE_TEXT)
+   || (pType->eAff==PIVOT_AFF_TEXT && (eType==SQLITE_INTEGER || eType==SQLITE_FLOAT)) ){
+    pConv = sqlite3_value_dup(pVal);
+    if( pConv==0 ) return SQLITE_NOMEM;
+    pVal = pConv;
+    if( pType->eAff==PIVOT_AFF_NUMERIC ){
+      eType = sqlite3_value_numeric_type(pVal);
+    }else{
+      if( sqlite3_value_text(pVal)==0 ){
+        sqlite3_value_free(pConv);
+        return SQLITE_NOMEM;
+      }
+      eType = SQLITE_TEXT;
+    }
+  }
+
+  if( eType==SQLITE_FLOAT ){
+    double r = sqlite3_value_double(pVal);
+    if( r>=-9223372036854775808.0 && r<9223372036854775808.0
+     && r==(double)(sqlite3_int64)r ){
+      sqlite3_int64 v = (sqlite3_int64)r;
+      t = (char)SQLITE_INTEGER;
+      sqlite3_str_append(pKey, &t, 1);
+      sqlite3_str_append(pKey, (const char*)&v, sizeof(v));
+      sqlite3_value_free(pConv);
+      return SQLITE_OK;
+    }
+  }
+  // Text is serialized here rather than by pivotKeyAppend(), as a number
+  // converted to TEXT affinity still reports its numeric type
+  if( eType==SQLITE_TEXT ){
+    const char *z = (const char*)sqlite3_value_text(pVal);
+    int n = sqlite3_value_bytes(pVal);
+    int iStart;
+    char *zOut;
+    int i;
+    if( z==0 ){
+      sqlite3_value_free(pConv);
+      return SQLITE_NOMEM;
+    }
+    if( pType->eColl==PIVOT_COLL_RTRIM ){
+      while( n>0 && z[n-1]==' ' ) n--;
+    }
+    t = (char)SQLITE_TEXT;
+    sqlite3_str_append(pKey, &t, 1);
+    sqlite3_str_append(pKey, (const char*)&n, sizeof(n));
+    iStart = sqlite3_str_length(pKey);
+    if( n>0 ) sqlite3_str_append(pKey, z, n);
+    zOut = sqlite3_str_value(pKey);
+    if( pType->eColl==PIVOT_COLL_NOCASE && zOut ){
+      for( i=iStart; i<iStart+n; i++ ){
+        if( zOut[i]>='A' && zOut[i]<='Z' ) zOut[i] += 'a'-'A';
+      }
+    }
+    sqlite3_value_free(pConv);
+    return SQLITE_OK;
+  }
+  pivotKeyAppend(pKey, pVal);
+  sqlite3_value_free(pConv);
+  return SQLITE_OK;
+}
+
+/*
+** Serialize nVal key values, compared with key columns of types aType, to
+** *pzKey (nul-terminated, freed with sqlite3_free()) and its size to
+** *pnKey. The values are aVal, or columns 0 to nVal-1 of stmt if aVal is
+** 0. A NULL key value compares equal to nothing, so *pzKey is set to 0 if
+** there is one.
+*/
+static int pivotKeyBuild(
+  sqlite3 *db,
+  const pivot_keytype *aType,
+  int nVal,
+  sqlite3_value **aVal,
+  sqlite3_stmt *stmt,
+  char **pzKey,
+  int *pnKey
+){
+  sqlite3_str *pKey = sqlite3_str_new(db);
+  sqlite3_value *pVal;
+  int rc = SQLITE_OK;
+  int i;
+
+  *pzKey = 0;
+  *pnKey = 0;
+  for( i=0; i<nVal && rc==SQLITE_OK; i++ ){
+    pVal = aVal ? aVal[i] : sqlite3_column_value(stmt, i);
+    if( sqlite3_value_type(pVal)==SQLITE_NULL ) break;
+    rc = pivotKeyAppendAs(pKey, pVal, &aType[i]);
+  }
+  if( rc==SQLITE_OK && sqlite3_str_errcode(pKey) ) rc = SQLITE_NOMEM;
+  *pnKey = sqlite3_str_length(pKey);
+  *pzKey = sqlite3_str_finish(pKey);
+  if( rc!=SQLITE_OK || i<nVal ){
+    sqlite3_free(*pzKey);
+    *pzKey = 0;
+    return rc;
+  }
+  if( *pzKey==0 ) *pzKey = sqlite3_mprintf("");
+  return *pzKey ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+/*
+** Return the current wall clock time in nanoseconds.
+*/
+static sqlite3_int64 pivotTimeNs(void){
+  struct timespec ts;
+  if( timespec_get(&ts, TIME_UTC)==0 ) return 0;
+  return (sqlite3_int64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/*
+** Count a duration of nNs nanoseconds in a latency histogram.
+*/
+static void pivotHistAdd(sqlite3_int64 *aBucket, sqlite3_int64 nNs){
+  int i = 0;
+  while( nNs>1 && i<PIVOT_VTAB_HIST_BUCKETS-1 ){
+    nNs >>= 1;
+    i++;
+  }
+  PIVOT_ATOMIC_INC(&aBucket[i]);
+}
+
+/*
+** Return a value that increases whenever a change to any database attached
+** to db is committed, by this or another connection. The data version of
+** each database only ever increases, so their sum changes whenever any of
+** them does.
+*/
+static sqlite3_uint64 pivotDataVersion(sqlite3 *db){
+  sqlite3_uint64 iVersion = 0;
+  const char *zDb;
+  unsigned int v;
+  int i;
+  for( i=0; (zDb = sqlite3_db_name(db, i))!=0; i++ ){
+    v = 0;
+    sqlite3_file_control(db, zDb, SQLITE_FCNTL_DATA_VERSION, &v);
+    iVersion += v;
+  }
+  return iVersion;
+}
+
+/*
+** Return true if db has a write transaction open on any database. Its
+** changes may yet be rolled back, in full or to a savepoint, which
+** neither the data version nor the change counts reveal.
+*/
+static int pivotWriteTxn(sqlite3 *db){
+  return sqlite3_txn_state(db, 0)==SQLITE_TXN_WRITE;
+}
+
+/*
+** Return a value that increases whenever another connection commits a
+** change to any database attached to db. Unlike pivotDataVersion(), this
+** ignores changes made by db itself.
+*/
+static sqlite3_uint64 pivotForeignDataVersion(pivot_global *g){
+  sqlite3_uint64 iVersion = 0;
+  const char *zDb;
+  int i;
+  for( i=0; (zDb = sqlite3_db_name(g->db, i))!=0; i++ ){
+    if( i>=g->nVersion ){
+      char **azDb = sqlite3_realloc(g->azVersionDb, (i+1)*sizeof(char*));
+      sqlite3_stmt **aStmt;
+      if( azDb ) g->azVersionDb = azDb;
+      aStmt = sqlite3_realloc(g->aVersionStmt, (i+1)*sizeof(sqlite3_stmt*));
+      if( aStmt ) g->aVersionStmt = aStmt;
+      if( azDb==0 || aStmt==0 ) return iVersion;
+      azDb[i] = 0;
+      aStmt[i] = 0;
+      g->nVersion = i+1;
+    }
+    if( g->azVersionDb[i]==0 || strcmp(g->azVersionDb[i], zDb) ){
+      char *zSql = sqlite3_mprintf("PRAGMA \"%w\".data_version", zDb);
+      sqlite3_finalize(g->aVersionStmt[i]);
+      g->aVersionStmt[i] = 0;
+      sqlite3_free(g->azVersionDb[i]);
+      g->azVersionDb[i] = sqlite3_mprintf("%s", zDb);
+      if( zSql ) sqlite3_prepare_v2(g->db, zSql, -1, &g->aVersionStmt[i], 0);
+      sqlite3_free(zSql);
+    }
+    if( g->aVersionStmt[i] && sqlite3_step(g->aVersionStmt[i])==SQLITE_ROW ){
+      iVersion += (sqlite3_uint64)sqlite3_column_int64(g->aVersionStmt[i], 0);
+    }
+    sqlite3_reset(g->aVersionStmt[i]);
+  }
+  return iVersion;
+}
+
+/*
+** Finalize the stmts held by the per-connection state. This is done when
+** the last pivot table disconnects, as sqlite3_close() fails while any
+** stmt is unfinalized.
+*/
+static void pivotGlobalFinalize(pivot_global *g){
+  int i;
+  for( i=0; i<g->nVersion; i++ ){
+    sqlite3_finalize(g->aVersionStmt[i]);
+    sqlite3_free(g->azVersionDb[i]);
+  }
+  sqlite3_free(g->aVersionStmt);
+  sqlite3_free(g->azVersionDb);
+  g->aVersionStmt = 0;
+  g->azVersionDb = 0;
+  g->nVersion = 0;
+}
+
+/*
+** Return true if the table zTab of schema zDb is in the list aDep.
+*/
+static int pivotDepFind(int nDep, pivot_dep *aDep, const char *zDb, const char *zTab){
+  int i;
+  for( i=0; i<nDep; i++ ){
+    if( sqlite3_stricmp(aDep[i].zTab, zTab)==0
+     && sqlite3_stricmp(aDep[i].zDb, zDb)==0 ){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Free a list of tables.
+*/
+static void pivotDepFree(int nDep, pivot_dep *aDep){
+  int i;
+  for( i=0; i<nDep; i++ ){
+    sqlite3_free(aDep[i].zDb);
+    sqlite3_free(aDep[i].zTab);
+  }
+  sqlite3_free(aDep);
+}
+
+/*
+** Return true if the table zTab of schema zDb is read by the key query or
+** the pivot query of tab.
+*/
+static int pivotDependsOn(pivot_vtab *tab, const char *zDb, const char *zTab){
+  return pivotDepFind(tab->nDep, tab->aDep, zDb, zTab);
+}
+
+/*
+** Return true if zDb.zTab is the source table of the delta query of tab.
+*/
+static int pivotIsDeltaTable(pivot_vtab *tab, const char *zDb, const char *zTab){
+  return tab->delta_stmt
+      && sqlite3_stricmp(tab->zDeltaTab, zTab)==0
+      && sqlite3_stricmp(tab->zDeltaDb, zDb)==0;
+}
+
+/*
+** Update hook, installed by the application (see pivot_vtab.h). Marks the
+** pivot tables that read the changed table.
+*/
+void pivot_vtab_update_hook(
+  void *pArg,
+  int op,
+  const char *zDb,
+  const char *zTab,
+  sqlite3_int64 iRowid
+){
+  pivot_global *g = (pivot_global*)pArg;
+  pivot_vtab *tab;
+  if( g==0 ) return;
+  g->nHookChange++;
+  for( tab=g->pVtab; tab; tab=tab->pNext ){
+    if( !tab->bTrackDeps || !pivotDependsOn(tab, zDb, zTab) ) continue;
+
+    // Inserts into the delta query's source table are recorded so that
+    // only the affected rows are invalidated. The rowid of a deleted row
+    // can no longer be mapped to a row key, and that of an updated row
+    // only to its new row key, not to the one it may have moved from.
+    if( op==SQLITE_INSERT && tab->nDelta<PIVOT_VTAB_MAX_DELTA
+     && pivotIsDeltaTable(tab, zDb, zTab) ){
+      if( tab->aDelta==0 ){
+        tab->aDelta = sqlite3_malloc(PIVOT_VTAB_MAX_DELTA*sizeof(sqlite3_int64));
+      }
+      if( tab->aDelta ){
+        tab->aDelta[tab->nDelta++] = iRowid;
+        continue;
+      }
+    }
+    tab->iDepChange++;
+  }
+}
+
+/*
+** Rollback hook, installed by the application (see pivot_vtab.h). Rows
+** cached during a transaction that is rolled back may hold changes that
+** no longer exist, so every tracking pivot table is marked as changed.
+*/
+void pivot_vtab_rollback_hook(void *pArg){
+  pivot_global *g = (pivot_global*)pArg;
+  pivot_vtab *tab;
+  if( g==0 ) return;
+  for( tab=g->pVtab; tab; tab=tab->pNext ){
+    if( tab->bTrackDeps ) tab->iDepChange++;
+  }
+}
+
+/*
+** The update hook is not invoked for every change - e.g. not for WITHOUT
+** ROWID tables, virtual tables or the truncate optimization - nor at all
+** if the application has not installed it. If this connection changed
+** more rows than the hook reported, mark every tracking pivot table as
+** changed.
+*/
+static void pivotGlobalSync(pivot_global *g){
+  sqlite3_int64 nTotal = sqlite3_total_changes64(g->db);
+  pivot_vtab *tab;
+  if( nTotal-g->nTotalChangeSeen > g->nHookChange-g->nHookChangeSeen ){
+    for( tab=g->pVtab; tab; tab=tab->pNext ){
+      if( tab->bTrackDeps ) tab->iDepChange++;
+    }
+  }
+  g->nTotalChangeSeen = nTotal;
+  g->nHookChangeSeen = g->nHookChange;
+}
+
+/*
+** Add the tables read by the SQL statement zSql to the list *paDep. The
+** tables are found from the OpenRead opcodes of the statement's bytecode.
+** If a table cannot be identified, or the statement reads a virtual table
+** whose changes are not reported by the update hook, *pbOk is cleared.
+*/
+static int pivotFindTables(
+  sqlite3 *db,
+  const char *zSql,
+  int *pnDep,
+  pivot_dep **paDep,
+  int *pbOk
+){
+  sqlite3_stmt *stmt_explain = 0;
+  sqlite3_stmt *stmt_schema = 0;
+  char *zExplain;
+  const char *zOp;
+  const char *zDb;
+  const char *zTab;
+  char *zSchemaSql;
+  pivot_dep *aDep;
+  int rc;
+
+  zExplain = sqlite3_mprintf("EXPLAIN %s", zSql);
+  if( zExplain==0 ) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(db, zExplain, -1, &stmt_explain, 0);
+  sqlite3_free(zExplain);
+
+  while( rc==SQLITE_OK && *pbOk && sqlite3_step(stmt_explain)==SQLITE_ROW ){
+    zOp = (const char*)sqlite3_column_text(stmt_explain, 1);
+    if( zOp==0 ) continue;
+    if( strcmp(zOp, "VOpen")==0 ){
+      *pbOk = 0;
+      break;
+    }
+    if( strcmp(zOp, "OpenRead") && strcmp(zOp, "ReopenIdx") ) continue;
+
+    // P2 is the root page, P3 the database
+    zDb = sqlite3_db_name(db, sqlite3_column_int(stmt_explain, 4));
+    if( zDb==0 || (sqlite3_column_int(stmt_explain, 6) & 0x10) ){
+      *pbOk = 0;
+      break;
+    }
+    zSchemaSql = sqlite3_mprintf("SELECT tbl_name FROM \"%w\".sqlite_schema WHERE rootpage = ?", zDb);
+    if( zSchemaSql==0 ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    rc = sqlite3_prepare_v2(db, zSchemaSql, -1, &stmt_schema, 0);
+    sqlite3_free(zSchemaSql);
+    if( rc!=SQLITE_OK ) break;
+    sqlite3_bind_int(stmt_schema, 1, sqlite3_column_int(stmt_explain, 3));
+    if( sqlite3_step(stmt_schema)==SQLITE_ROW ){
+      zTab = (const char*)sqlite3_column_text(stmt_schema, 0);
+      if( zTab && !pivotDepFind(*pnDep, *paDep, zDb, zTab) ){
+        aDep = sqlite3_realloc(*paDep, (*pnDep+1)*sizeof(pivot_dep));
+        if( aDep==0 ){
+          rc = SQLITE_NOMEM;
+        }else{
+          *paDep = aDep;
+          aDep[*pnDep].zDb = sqlite3_mprintf("%s", zDb);
+          aDep[*pnDep].zTab = sqlite3_mprintf("%s", zTab);
+          (*pnDep)++;
+          if( aDep[*pnDep-1].zDb==0 || aDep[*pnDep-1].zTab==0 ) rc = SQLITE_NOMEM;
+        }
+      }
+    }else if( sqlite3_column_int(stmt_explain, 3)!=1 ){
+      // Not a schema table (e.g. sqlite_schema itself has root page 1)
+      *pbOk = 0;
+    }
+    sqlite3_finalize(stmt_schema);
+    stmt_schema = 0;
+  }
+  sqlite3_finalize(stmt_explain);
+  return rc;
+}
+
+/*
+** Set *pbRowid if the single column of key query zSql is known to hold
+** unique integers: it is the INTEGER PRIMARY KEY rowid alias of a table,
+** and the query reads each row of that table at most once - it reads no
+** other table, in a single loop, without coroutines or ephemeral tables.
+** This relies on the column metadata, and is never set without it.
+*/
+static int pivotKeyIsRowid(sqlite3 *db, const char *zSql, int *pbRowid){
+#if !defined(SQLITE_CORE) || defined(SQLITE_ENABLE_COLUMN_METADATA)
+  sqlite3_stmt *stmt = 0;
+  char *zDb = 0;
+  char *zTab = 0;
+  char *zCol = 0;
+  char *zExplain;
+  const char *zOp;
+  pivot_dep *aDep = 0;
+  int nDep = 0;
+  int bOk = 1;
+  int nLoop = 0;
+  int rc;
+
+  *pbRowid = 0;
+  if( !sqlite3_compileoption_used("ENABLE_COLUMN_METADATA") ) return SQLITE_OK;
+
+  // The key column must be read straight from a table column
+  rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+  if( rc!=SQLITE_OK ) return rc;
+  if( sqlite3_column_count(stmt)==1
+   && sqlite3_column_database_name(stmt, 0)
+   && sqlite3_column_table_name(stmt, 0)
+   && sqlite3_column_origin_name(stmt, 0) ){
+    zDb = sqlite3_mprintf("%s", sqlite3_column_database_name(stmt, 0));
+    zTab = sqlite3_mprintf("%s", sqlite3_column_table_name(stmt, 0));
+    zCol = sqlite3_mprintf("%s", sqlite3_column_origin_name(stmt, 0));
+    if( zDb==0 || zTab==0 || zCol==0 ) rc = SQLITE_NOMEM;
+  }
+  sqlite3_finalize(stmt);
+  stmt = 0;
+  if( rc!=SQLITE_OK || zCol==0 ) goto key_rowid_done;
+
+  // That column is the rowid alias if the rowid of the table reads it.
+  // Tables without a rowid fail to prepare.
+  zExplain = sqlite3_mprintf("SELECT rowid FROM \"%w\".\"%w\"", zDb, zTab);
+  if( zExplain==0 ){
+    rc = SQLITE_NOMEM;
+    goto key_rowid_done;
+  }
+  if( sqlite3_prepare_v2(db, zExplain, -1, &stmt, 0)==SQLITE_OK ){
+    const char *zOrigin = sqlite3_column_origin_name(stmt, 0);
+    if( zOrigin==0 || sqlite3_stricmp(zOrigin, zCol) ) bOk = 0;
+  }else{
+    bOk = 0;
+  }
+  sqlite3_free(zExplain);
+  sqlite3_finalize(stmt);
+  stmt = 0;
+  if( !bOk ) goto key_rowid_done;
+
+  // The table, and its indexes, are the only b-trees read
+  rc = pivotFindTables(db, zSql, &nDep, &aDep, &bOk);
+  if( rc!=SQLITE_OK || !bOk || nDep!=1 || !pivotDepFind(nDep, aDep, zDb, zTab) ){
+    goto key_rowid_done;
+  }
+
+  // Each row of the table is visited at most once
+  zExplain = sqlite3_mprintf("EXPLAIN %s", zSql);
+  if( zExplain==0 ){
+    rc = SQLITE_NOMEM;
+    goto key_rowid_done;
+  }
+  rc = sqlite3_prepare_v2(db, zExplain, -1, &stmt, 0);
+  sqlite3_free(zExplain);
+  while( rc==SQLITE_OK && bOk && sqlite3_step(stmt)==SQLITE_ROW ){
+    zOp = (const char*)sqlite3_column_text(stmt, 1);
+    if( zOp==0 ) continue;
+    if( strcmp(zOp, "Next")==0 || strcmp(zOp, "Prev")==0 ){
+      if( ++nLoop>1 ) bOk = 0;
+    }else if( strcmp(zOp, "OpenEphemeral")==0 || strcmp(zOp, "OpenAutoindex")==0
+           || strcmp(zOp, "InitCoroutine")==0 || strcmp(zOp, "Yield")==0
+           || strcmp(zOp, "RowSetAdd")==0 || strcmp(zOp, "VFilter")==0 ){
+      bOk = 0;
+    }
+  }
+  sqlite3_finalize(stmt);
+  if( rc==SQLITE_OK ) *pbRowid = bOk;
+
+key_rowid_done:
+  pivotDepFree(nDep, aDep);
+  sqlite3_free(zDb);
+  sqlite3_free(zTab);
+  sqlite3_free(zCol);
+  return rc;
+#else
+  (void)db;
+  (void)zSql;
+  *pbRowid = 0;
+  return SQLITE_OK;
+#endif
+}
+
+/*
+** Return a copy of zName with every character other than an ASCII letter,
+** digit or underscore replaced by an underscore, for use in the names of
+** advised indexes and in comments. Returns 0 if out of memory.
+*/
+static char *pivotSanitizeName(const char *zName){
+  char *zOut = sqlite3_mprintf("%s", zName);
+  int i;
+  if( zOut==0 ) return 0;
+  for( i=0; zOut[i]; i++ ){
+    if( !isalnum((unsigned char)zOut[i]) || (zOut[i]&0x80) ) zOut[i] = '_';
+  }
+  return zOut;
+}
+
+/*
+** Opcodes of the pivot query read by pivotAdvise().
+*/
+#define PIVOT_OP_OPEN      1    // OpenRead or ReopenIdx
+#define PIVOT_OP_REWIND    2    // Rewind or Last
+#define PIVOT_OP_VARIABLE  3    // Variable - a bound parameter
+#define PIVOT_OP_COLUMN    4    // Column
+#define PIVOT_OP_EQ        5    // Eq or Ne
+
+/*
+** Return the index in aOp of the last PIVOT_OP_OPEN before iOp of cursor
+** iCursor, or -1 if there is none.
+*/
+static int pivotAdviseOpen(const int *aOp, int iOp, int iCursor){
+  int i;
+  for( i=iOp-1; i>=0; i-- ){
+    if( aOp[i*4]==PIVOT_OP_OPEN && aOp[i*4+1]==iCursor ) return i;
+  }
+  return -1;
+}
+
+/*
+** Find the tables that the pivot query of tab scans in full on every
+** evaluation, and set tab->zAdvice to a script of the CREATE INDEX
+** statements that would turn each scan into a b-tree search. Tables for
+** which no index can be suggested get a comment instead.
+**
+** Full scans are found from the bytecode of the pivot query - a Rewind
+** on a cursor opened by OpenRead. This is what EXPLAIN QUERY PLAN reports
+** as SCAN, but it is not confused by table aliases, and it also catches
+** automatic indexes, which are rebuilt on every evaluation. The suggested
+** index columns are those the bytecode reads from the scanned cursor and
+** compares for equality with a bound parameter.
+**
+** The advice needs the pivot query to be prepared again and the schema to
+** be queried, so it is only computed when asked for - by pivot_advise(),
+** the index_advice statistic and the create_index option.
+*/
+static int pivotAdvise(pivot_vtab *tab){
+  sqlite3_stmt *stmt = 0;
+  sqlite3_str *pAdvice;
+  pivot_dep *aScan = 0;
+  char **azCol = 0;
+  int *aColScan = 0;
+  int *aOpScan = 0;
+  int *aOp = 0;
+  int nOp = 0;
+  int nScan = 0;
+  int nCol = 0;
+  const char *zOp;
+  const char *zDb = 0;
+  char *zSql;
+  int rc;
+  int i, j, k;
+
+  sqlite3_free(tab->zAdvice);
+  tab->zAdvice = 0;
+  if( tab->nCol_key==0 ) return SQLITE_OK;
+
+  zSql = sqlite3_mprintf("EXPLAIN %s", sqlite3_sql(tab->col_stmt[0]));
+  if( zSql==0 ) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(tab->db, zSql, -1, &stmt, 0);
+  sqlite3_free(zSql);
+
+  // Keep the (opcode, p1, p2, p3) of the opcodes read below
+  while( rc==SQLITE_OK && sqlite3_step(stmt)==SQLITE_ROW ){
+    int eOp = 0;
+    zOp = (const char*)sqlite3_column_text(stmt, 1);
+    if( zOp==0 ) continue;
+    if( strcmp(zOp, "OpenRead")==0 || strcmp(zOp, "ReopenIdx")==0 ){
+      eOp = PIVOT_OP_OPEN;
+    }else if( strcmp(zOp, "Rewind")==0 || strcmp(zOp, "Last")==0 ){
+      eOp = PIVOT_OP_REWIND;
+    }else if( strcmp(zOp, "Variable")==0 ){
+      eOp = PIVOT_OP_VARIABLE;
+    }else if( strcmp(zOp, "Column")==0 ){
+      eOp = PIVOT_OP_COLUMN;
+    }else if( strcmp(zOp, "Eq")==0 || strcmp(zOp, "Ne")==0 ){
+      eOp = PIVOT_OP_EQ;
+    }
+    if( eOp==0 ) continue;
+    if( nOp%64==0 ){
+      int *aNew = sqlite3_realloc(aOp, (nOp+64)*4*sizeof(int));
+      if( aNew==0 ){
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      aOp = aNew;
+    }
+    aOp[nOp*4] = eOp;
+    aOp[nOp*4+1] = sqlite3_column_int(stmt, 2);
+    aOp[nOp*4+2] = sqlite3_column_int(stmt, 3);
+    aOp[nOp*4+3] = sqlite3_column_int(stmt, 4);
+    nOp++;
+  }
+  sqlite3_finalize(stmt);
+  stmt = 0;
+  if( rc==SQLITE_OK ){
+    aOpScan = sqlite3_malloc(nOp*sizeof(int)+1);
+    if( aOpScan==0 ) rc = SQLITE_NOMEM;
+  }
+  for( i=0; i<nOp && aOpScan; i++ ) aOpScan[i] = -1;
+
+  // Find the scanned tables, and the index in aScan of the table opened by
+  // each OPEN. The root page may be that of a table or of one of its indexes.
+  for( i=0; rc==SQLITE_OK && i<nOp; i++ ){
+    if( aOp[i*4]!=PIVOT_OP_REWIND ) continue;
+    j = pivotAdviseOpen(aOp, i, aOp[i*4+1]);
+    if( j<0 || (zDb = sqlite3_db_name(tab->db, aOp[j*4+3]))==0 ) continue;
+    zSql = sqlite3_mprintf("SELECT tbl_name FROM \"%w\".sqlite_schema WHERE rootpage = ?", zDb);
+    if( zSql==0 ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    rc = sqlite3_prepare_v2(tab->db, zSql, -1, &stmt, 0);
+    sqlite3_free(zSql);
+    if( rc!=SQLITE_OK ) break;
+    sqlite3_bind_int(stmt, 1, aOp[j*4+2]);
+    if( sqlite3_step(stmt)==SQLITE_ROW && sqlite3_column_text(stmt, 0) ){
+      const char *zTab = (const char*)sqlite3_column_text(stmt, 0);
+      for( k=0; k<nScan && !pivotDepFind(1, &aScan[k], zDb, zTab); k++ );
+      if( k==nScan ){
+        pivot_dep *aNew = sqlite3_realloc(aScan, (nScan+1)*sizeof(pivot_dep));
+        if( aNew==0 ){
+          rc = SQLITE_NOMEM;
+        }else{
+          aScan = aNew;
+          aScan[nScan].zDb = sqlite3_mprintf("%s", zDb);
+          aScan[nScan].zTab = sqlite3_mprintf("%s", zTab);
+          nScan++;
+          if( aScan[nScan-1].zDb==0 || aScan[nScan-1].zTab==0 ) rc = SQLITE_NOMEM;
+        }
+      }
+      aOpScan[j] = k;
+    }
+    sqlite3_finalize(stmt);
+    stmt = 0;
+  }
+
+  // Find the columns of scanned tables compared for equality with a bound
+  // parameter - an Eq or Ne with one operand set by Variable and the other
+  // by a Column on a scanned cursor. Column numbers are those of the b-tree
+  // scanned, which are given by index_xinfo for an index or a WITHOUT
+  // ROWID table and by table_xinfo for a rowid table.
+  for( i=0; rc==SQLITE_OK && i<nOp; i++ ){
+    int iCol = -1;
+    int iScan = -1;
+    if( aOp[i*4]!=PIVOT_OP_EQ ) continue;
+    for( k=0; k<2 && iScan<0; k++ ){
+      int iParam = aOp[i*4+(k ? 3 : 1)];
+      int iReg = aOp[i*4+(k ? 1 : 3)];
+      for( j=0; j<nOp && !(aOp[j*4]==PIVOT_OP_VARIABLE && aOp[j*4+2]==iParam); j++ );
+      if( j==nOp ) continue;
+      for( j=i-1; j>=0 && !(aOp[j*4]==PIVOT_OP_COLUMN && aOp[j*4+3]==iReg); j-- );
+      if( j<0 ) continue;
+      iCol = aOp[j*4+2];
+      j = pivotAdviseOpen(aOp, j, aOp[j*4+1]);
+      if( j>=0 ) iScan = aOpScan[j];
+      if( iScan>=0 ) zDb = sqlite3_db_name(tab->db, aOp[j*4+3]);
+    }
+    if( iScan<0 || zDb==0 ) continue;
+    zSql = sqlite3_mprintf(
+      "SELECT coalesce(i.name, t.name) FROM \"%w\".sqlite_schema s"
+      " LEFT JOIN pragma_index_xinfo(s.name, ?1) i ON i.seqno = ?3"
+      " LEFT JOIN pragma_table_xinfo(s.name, ?1) t ON t.cid = ?3"
+      " WHERE s.rootpage = ?2", zDb
+    );
+    if( zSql==0 ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    rc = sqlite3_prepare_v2(tab->db, zSql, -1, &stmt, 0);
+    sqlite3_free(zSql);
+    if( rc!=SQLITE_OK ) break;
+    sqlite3_bind_text(stmt, 1, zDb, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, aOp[j*4+2]);
+    sqlite3_bind_int(stmt, 3, iCol);
+    if( sqlite3_step(stmt)==SQLITE_ROW && sqlite3_column_text(stmt, 0) ){
+      const char *zCol = (const char*)sqlite3_column_text(stmt, 0);
+      for( k=0; k<nCol && (aColScan[k]!=iScan || sqlite3_stricmp(azCol[k], zCol)); k++ );
+      if( k==nCol ){
+        char **azNew = sqlite3_realloc(azCol, (nCol+1)*sizeof(char*));
+        int *aNew = sqlite3_realloc(aColScan, (nCol+1)*sizeof(int));
+        if( azNew ) azCol = azNew;
+        if( aNew ) aColScan = aNew;
+        if( azNew==0 || aNew==0 ){
+          rc = SQLITE_NOMEM;
+        }else{
+          aColScan[nCol] = iScan;
+          azCol[nCol] = sqlite3_mprintf("%s", zCol);
+          nCol++;
+          if( azCol[nCol-1]==0 ) rc = SQLITE_NOMEM;
+        }
+      }
+    }
+    sqlite3_finalize(stmt);
+    stmt = 0;
+  }
+
+  // Suggest an index on those columns of each scanned table. Identifiers
+  // are quoted, and the index name and comments only use sanitized names,
+  // so the advice is a safe script whatever the tables are called.
+  pAdvice = sqlite3_str_new(tab->db);
+  for( i=0; rc==SQLITE_OK && i<nScan; i++ ){
+    sqlite3_str *pName = sqlite3_str_new(tab->db);
+    sqlite3_str *pCols = sqlite3_str_new(tab->db);
+    char *zName;
+    char *zCols;
+    char *zClean = pivotSanitizeName(aScan[i].zTab);
+    sqlite3_str_appendf(pName, "%s_pivot", zClean);
+    sqlite3_free(zClean);
+    for( j=0; j<nCol; j++ ){
+      if( aColScan[j]!=i ) continue;
+      zClean = pivotSanitizeName(azCol[j]);
+      sqlite3_str_appendf(pName, "_%s", zClean);
+      sqlite3_str_appendf(pCols, "%s\"%w\"", sqlite3_str_length(pCols) ? ", " : "", azCol[j]);
+      sqlite3_free(zClean);
+    }
+    zName = sqlite3_str_finish(pName);
+    zCols = sqlite3_str_finish(pCols);
+    if( zName==0 ){
+      rc = SQLITE_NOMEM;
+    }else if( zCols ){
+      sqlite3_str_appendf(pAdvice, "CREATE INDEX IF NOT EXISTS \"%w\".\"%w\" ON \"%w\"(%s);\n", aScan[i].zDb, zName, aScan[i].zTab, zCols);
+    }else{
+      char *zCleanDb = pivotSanitizeName(aScan[i].zDb);
+      zClean = pivotSanitizeName(aScan[i].zTab);
+      sqlite3_str_appendf(pAdvice, "-- %s.%s is scanned in full by the pivot query\n", zCleanDb, zClean);
+      sqlite3_free(zCleanDb);
+      sqlite3_free(zClean);
+    }
+    sqlite3_free(zName);
+    sqlite3_free(zCols);
+  }
+  tab->zAdvice = sqlite3_str_finish(pAdvice);
+  if( rc!=SQLITE_OK ){
+    sqlite3_free(tab->zAdvice);
+    tab->zAdvice = 0;
+  }
+  for( i=0; i<nCol; i++ ) sqlite3_free(azCol[i]);
+  sqlite3_free(azCol);
+  sqlite3_free(aColScan);
+  sqlite3_free(aOpScan);
+  sqlite3_free(aOp);
+  pivotDepFree(nScan, aScan);
+  return rc;
+}
+
+/*
+** Set *pVersion to the version the caches of tab are validated against.
+** The data version only changes once a change is committed, so the
+** changes made by this connection are also counted, committed or not.
+*/
+static void pivotCacheVersion(pivot_vtab *tab, pivot_version *pVersion){
+  if( tab->bTrackDeps ){
+    pivotGlobalSync(tab->pGlobal);
+    pVersion->iData = pivotForeignDataVersion(tab->pGlobal);
+    pVersion->iChange = tab->iDepChange;
+  }else{
+    pVersion->iData = pivotDataVersion(tab->db);
+    pVersion->iChange = sqlite3_total_changes64(tab->db);
+  }
+}
+
+/*
+** Free a row cache entry.
+*/
+static void pivotEntryFree(pivot_vtab *tab, pivot_entry *e){
+  int i;
+  for( i=0; i<e->nRow*(tab->nRow_cols+tab->nCol_key); i++ )
+    sqlite3_value_free(e->aVal[i]);
+  sqlite3_free(e->aVal);
+  sqlite3_free(e->aEval);
+  sqlite3_free(e->zKey);
+  sqlite3_free(e);
+}
+
+/*
+** Allocate a row cache entry for a serialized key. The entry takes
+** ownership of zKey, which is freed if the allocation fails.
+*/
+static pivot_entry *pivotEntryNew(char *zKey, int nKey, unsigned int iHash){
+  pivot_entry *e = sqlite3_malloc(sizeof(*e));
+  if( e==0 ){
+    sqlite3_free(zKey);
+    return 0;
+  }
+  memset(e, 0, sizeof(*e));
+  e->zKey = zKey;
+  e->nKey = nKey;
+  e->iHash = iHash;
+  return e;
+}
+
+/*
+** Release a cursor's reference to a row cache entry.
+*/
+static void pivotEntryRelease(pivot_vtab *tab, pivot_entry *e){
+  e->nRef--;
+  if( e->nRef==0 && e->bOrphan ) pivotEntryFree(tab, e);
+}
+
+/*
+** Remove an entry from an LRU cache. Entries still being read by a
+** cursor are freed once the last cursor releases them.
+*/
+static void pivotLruRemove(pivot_vtab *tab, pivot_lru *pLru, pivot_entry *e){
+  pivot_entry **pp;
+  for( pp=&pLru->aHash[e->iHash % pLru->nHash]; *pp!=e; pp=&(*pp)->pHashNext );
+  *pp = e->pHashNext;
+  if( e->pLruPrev ) e->pLruPrev->pLruNext = e->pLruNext;
+  else pLru->pFirst = e->pLruNext;
+  if( e->pLruNext ) e->pLruNext->pLruPrev = e->pLruPrev;
+  else pLru->pLast = e->pLruPrev;
+  pLru->nEntry--;
+  if( e->nRef>0 ){
+    e->bOrphan = 1;
+  }else{
+    pivotEntryFree(tab, e);
+  }
+}
+
+/*
+** Remove every entry from an LRU cache.
+*/
+static void pivotLruFlush(pivot_vtab *tab, pivot_lru *pLru){
+  while( pLru->pFirst ) pivotLruRemove(tab, pLru, pLru->pFirst);
+}
+
+/*
+** Look up an LRU cache entry, marking it as the most recently used.
+*/
+static pivot_entry *pivotLruFind(pivot_lru *pLru, const char *zKey, int nKey, unsigned int iHash){
+  pivot_entry *e;
+  if( pLru->nHash==0 ) return 0;
+  for( e=pLru->aHash[iHash % pLru->nHash]; e; e=e->pHashNext ){
+    if( e->iHash==iHash && e->nKey==nKey && memcmp(e->zKey, zKey, nKey)==0 ) break;
+  }
+  if( e && e!=pLru->pFirst ){
+    e->pLruPrev->pLruNext = e->pLruNext;
+    if( e->pLruNext ) e->pLruNext->pLruPrev = e->pLruPrev;
+    else pLru->pLast = e->pLruPrev;
+    e->pLruPrev = 0;
+    e->pLruNext = pLru->pFirst;
+    pLru->pFirst->pLruPrev = e;
+    pLru->pFirst = e;
+  }
+  return e;
+}
+
+/*
+** Return true if bit i of bitmap a is set.
+*/
+#define PIVOT_BIT(a, i) (((a)[(i)/8]>>((i)%8))&1)
+
+/*
+** Number of bits set in byte m.
+*/
+static int pivotPopcount(unsigned int m){
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcount(m);
+#else
+  int n = 0;
+  for( ; m; m &= m-1 ) n++;
+  return n;
+#endif
+}
+
+/*
+** Grow a bitmap from nOld to nNew bits, clearing the new bits.
+*/
+static int pivotBitmapGrow(unsigned char **pa, int nOld, int nNew){
+  unsigned char *a = sqlite3_realloc(*pa, (nNew+7)/8);
+  if( a==0 ) return SQLITE_NOMEM;
+  memset(&a[(nOld+7)/8], 0, (nNew+7)/8-(nOld+7)/8);
+  *pa = a;
+  return SQLITE_OK;
+}
+
+/*
+** Grow the arrays of a vector from nOld to nNew rows.
+*/
+static int pivotVectorGrow(pivot_vector *pVec, int nOld, int nNew){
+  if( pivotBitmapGrow(&pVec->aValid, nOld, nNew) ) return SQLITE_NOMEM;
+  if( pivotBitmapGrow(&pVec->aSeen, nOld, nNew) ) return SQLITE_NOMEM;
+  if( pVec->aInt ){
+    sqlite3_int64 *aInt = sqlite3_realloc(pVec->aInt, nNew*sizeof(sqlite3_int64));
+    if( aInt==0 ) return SQLITE_NOMEM;
+    pVec->aInt = aInt;
+  }
+  if( pVec->aReal ){
+    double *aReal = sqlite3_realloc(pVec->aReal, nNew*sizeof(double));
+    if( aReal==0 ) return SQLITE_NOMEM;
+    pVec->aReal = aReal;
+  }
+  if( pVec->aOff ){
+    int *aOff = sqlite3_realloc(pVec->aOff, nNew*sizeof(int));
+    if( aOff==0 ) return SQLITE_NOMEM;
+    pVec->aOff = aOff;
+    aOff = sqlite3_realloc(pVec->aLen, nNew*sizeof(int));
+    if( aOff==0 ) return SQLITE_NOMEM;
+    pVec->aLen = aOff;
+  }
+  if( pVec->aOther ){
+    sqlite3_value **aOther = sqlite3_realloc(pVec->aOther, nNew*sizeof(sqlite3_value*));
+    if( aOther==0 ) return SQLITE_NOMEM;
+    memset(&aOther[nOld], 0, (nNew-nOld)*sizeof(sqlite3_value*));
+    pVec->aOther = aOther;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Set row iRow of a vector of nRow rows to pVal, unless the row is
+** already loaded - where the source query returns several rows for a
+** cell, the first wins.
+*/
+static int pivotVectorSet(pivot_vector *pVec, int nRow, int iRow, sqlite3_value *pVal){
+  int eType = sqlite3_value_type(pVal);
+
+  if( PIVOT_BIT(pVec->aSeen, iRow) ) return SQLITE_OK;
+  pVec->aSeen[iRow/8] |= (unsigned char)(1<<(iRow%8));
+  if( eType==SQLITE_NULL ) return SQLITE_OK;
+
+  if( pVec->eType==0 ){
+    pVec->eType = eType;
+    switch( eType ){
+      case SQLITE_INTEGER:
+        pVec->aInt = sqlite3_malloc(nRow*sizeof(sqlite3_int64));
+        if( pVec->aInt==0 ) return SQLITE_NOMEM;
+        break;
+      case SQLITE_FLOAT:
+        pVec->aReal = sqlite3_malloc(nRow*sizeof(double));
+        if( pVec->aReal==0 ) return SQLITE_NOMEM;
+        break;
+      default:
+        pVec->aOff = sqlite3_malloc(nRow*sizeof(int));
+        pVec->aLen = sqlite3_malloc(nRow*sizeof(int));
+        if( pVec->aOff==0 || pVec->aLen==0 ) return SQLITE_NOMEM;
+        break;
+    }
+  }
+
+  if( eType!=pVec->eType ){
+    if( pVec->aOther==0 ){
+      pVec->aOther = sqlite3_malloc(nRow*sizeof(sqlite3_value*));
+      if( pVec->aOther==0 ) return SQLITE_NOMEM;
+      memset(pVec->aOther, 0, nRow*sizeof(sqlite3_value*));
+    }
+    pVec->aOther[iRow] = sqlite3_value_dup(pVal);
+    if( pVec->aOther[iRow]==0 ) return SQLITE_NOMEM;
+  }else if( eType==SQLITE_INTEGER ){
+    pVec->aInt[iRow] = sqlite3_value_int64(pVal);
+  }else if( eType==SQLITE_FLOAT ){
+    pVec->aReal[iRow] = sqlite3_value_double(pVal);
+  }else{
+    const void *z = eType==SQLITE_TEXT ? (const void*)sqlite3_value_text(pVal) : sqlite3_value_blob(pVal);
+    int n = sqlite3_value_bytes(pVal);
+    if( pVec->nArena+n+1>pVec->nArenaAlloc ){
+      int nAlloc = pVec->nArenaAlloc ? pVec->nArenaAlloc*2 : 256;
+      char *zArena;
+      while( nAlloc<pVec->nArena+n+1 ) nAlloc *= 2;
+      zArena = sqlite3_realloc(pVec->zArena, nAlloc);
+      if( zArena==0 ) return SQLITE_NOMEM;
+      pVec->zArena = zArena;
+      pVec->nArenaAlloc = nAlloc;
+    }
+    if( n>0 ) memcpy(&pVec->zArena[pVec->nArena], z, n);
+    pVec->zArena[pVec->nArena+n] = 0;
+    pVec->aOff[iRow] = pVec->nArena;
+    pVec->aLen[iRow] = n;
+    pVec->nArena += n+1;
+  }
+  pVec->aValid[iRow/8] |= (unsigned char)(1<<(iRow%8));
+  return SQLITE_OK;
+}
+
+/*
+** Return the index of the value of non-null row iRow of a vector in its
+** value arrays.
+*/
+static int pivotVectorSlot(pivot_vector *pVec, int iRow){
+  int iSlot;
+  int i;
+  if( pVec->aRank==0 ) return iRow;
+  iSlot = pVec->aRank[iRow/64];
+  for( i=(iRow/64)*8; i<iRow/8; i++ ) iSlot += pivotPopcount(pVec->aValid[i]);
+  return iSlot + pivotPopcount(pVec->aValid[iRow/8] & ((1u<<(iRow%8))-1));
+}
+
+/*
+** Set *pz to the text or blob in slot iSlot of a vector and return its
+** size in bytes.
+*/
+static int pivotVectorText(pivot_vector *pVec, int iSlot, const char **pz){
+  if( pVec->aCode ) iSlot = pVec->aCode[iSlot];
+  *pz = &pVec->zArena[pVec->aOff[iSlot]];
+  return pVec->aLen[iSlot];
+}
+
+/*
+** Dictionary-encode the nValid text or blob values of a loaded vector of
+** nRow rows, if they have few enough distinct values.
+*/
+static int pivotVectorDictionary(pivot_vector *pVec, int nRow, int nValid){
+  int nMax = nValid/4 < 65535 ? nValid/4 : 65535;
+  int nHash = 64;
+  int *aHash = 0;
+  int *aFirst = 0;
+  unsigned short *aCode = 0;
+  char *zArena = 0;
+  int *aOff = 0;
+  int *aLen = 0;
+  int nDict = 0;
+  int nArena = 0;
+  int i, j, h;
+
+  if( nMax<2 ) return SQLITE_OK;
+  while( nHash<nMax*2 ) nHash *= 2;
+  aHash = sqlite3_malloc(nHash*sizeof(int));
+  aFirst = sqlite3_malloc(nMax*sizeof(int));
+  aCode = sqlite3_malloc(nRow*sizeof(unsigned short)+1);
+  if( aHash==0 || aFirst==0 || aCode==0 ) goto dictionary_nomem;
+  memset(aHash, 0xff, nHash*sizeof(int));
+
+  // Find the distinct values, giving up once there are too many
+  for( i=0; i<nRow; i++ ){
+    const char *z;
+    int n;
+    if( !PIVOT_BIT(pVec->aValid, i) ) continue;
+    z = &pVec->zArena[pVec->aOff[i]];
+    n = pVec->aLen[i];
+    for( h=pivotKeyHash(z, n)&(nHash-1); (j = aHash[h])>=0; h=(h+1)&(nHash-1) ){
+      int k = aFirst[j];
+      if( pVec->aLen[k]==n && memcmp(&pVec->zArena[pVec->aOff[k]], z, n)==0 ) break;
+    }
+    if( j<0 ){
+      if( nDict==nMax ){
+        sqlite3_free(aHash);
+        sqlite3_free(aFirst);
+        sqlite3_free(aCode);
+        return SQLITE_OK;
+      }
+      j = aHash[h] = nDict++;
+      aFirst[j] = i;
+      nArena += n+1;
+    }
+    aCode[i] = (unsigned short)j;
+  }
+
+  zArena = sqlite3_malloc(nArena+1);
+  aOff = sqlite3_malloc(nDict*sizeof(int));
+  aLen = sqlite3_malloc(nDict*sizeof(int));
+  if( zArena==0 || aOff==0 || aLen==0 ) goto dictionary_nomem;
+  nArena = 0;
+  for( j=0; j<nDict; j++ ){
+    int k = aFirst[j];
+    memcpy(&zArena[nArena], &pVec->zArena[pVec->aOff[k]], pVec->aLen[k]+1);
+    aOff[j] = nArena;
+    aLen[j] = pVec->aLen[k];
+    nArena += aLen[j]+1;
+  }
+  sqlite3_free(pVec->zArena);
+  sqlite3_free(pVec->aOff);
+  sqlite3_free(pVec->aLen);
+  pVec->zArena = zArena;
+  pVec->nArena = pVec->nArenaAlloc = nArena;
+  pVec->aOff = aOff;
+  pVec->aLen = aLen;
+  pVec->aCode = aCode;
+  pVec->nDict = nDict;
+  sqlite3_free(aHash);
+  sqlite3_free(aFirst);
+  return SQLITE_OK;
+
+dictionary_nomem:
+  sqlite3_free(aHash);
+  sqlite3_free(aFirst);
+  sqlite3_free(aCode);
+  sqlite3_free(zArena);
+  sqlite3_free(aOff);
+  sqlite3_free(aLen);
+  return SQLITE_NOMEM;
+}
+
+/*
+** Move the values of the non-null rows of a vector to the start of array
+** a of elements of sz bytes, and shrink it to nValid elements.
+*/
+static void *pivotVectorPack(pivot_vector *pVec, int nRow, int nValid, void *a, int sz){
+  char *z = (char*)a;
+  void *aNew;
+  int iSlot = 0;
+  int i;
+  if( z==0 ) return 0;
+  for( i=0; i<nRow; i++ ){
+    if( !PIVOT_BIT(pVec->aValid, i) ) continue;
+    if( iSlot<i ) memcpy(&z[iSlot*sz], &z[i*sz], sz);
+    iSlot++;
+  }
+  aNew = sqlite3_realloc(a, nValid*sz+1);
+  return aNew ? aNew : a;
+}
+
+/*
+** Compress a loaded vector of nRow rows, choosing the encodings from the
+** values loaded. The text or blob values are dictionary-encoded if there
+** are at most a quarter as many distinct values as values, and the null
+** rows are dropped from the value arrays if they are at least half of
+** the rows.
+*/
+static int pivotVectorCompress(pivot_vector *pVec, int nRow){
+  int nValid = 0;
+  int i;
+
+  if( pVec->eType==0 || pVec->aOther || pVec->aRank || pVec->aCode ) return SQLITE_OK;
+  for( i=0; i<(nRow+7)/8; i++ ) nValid += pivotPopcount(pVec->aValid[i]);
+
+  if( pVec->eType==SQLITE_TEXT || pVec->eType==SQLITE_BLOB ){
+    if( pivotVectorDictionary(pVec, nRow, nValid) ) return SQLITE_NOMEM;
+  }
+
+  if( nValid<=nRow/2 ){
+    int nValue = 0;
+    pVec->aRank = sqlite3_malloc(((nRow+63)/64)*sizeof(int)+1);
+    if( pVec->aRank==0 ) return SQLITE_NOMEM;
+    for( i=0; i<(nRow+7)/8; i++ ){
+      if( i%8==0 ) pVec->aRank[i/8] = nValue;
+      nValue += pivotPopcount(pVec->aValid[i]);
+    }
+    if( pVec->aCode ){
+      pVec->aCode = pivotVectorPack(pVec, nRow, nValid, pVec->aCode, sizeof(unsigned short));
+    }else if( pVec->aOff ){
+      pVec->aOff = pivotVectorPack(pVec, nRow, nValid, pVec->aOff, sizeof(int));
+      pVec->aLen = pivotVectorPack(pVec, nRow, nValid, pVec->aLen, sizeof(int));
+    }
+    pVec->aInt = pivotVectorPack(pVec, nRow, nValid, pVec->aInt, sizeof(sqlite3_int64));
+    pVec->aReal = pivotVectorPack(pVec, nRow, nValid, pVec->aReal, sizeof(double));
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Return the number of bytes of memory used by a vector of nRow rows.
+*/
+static sqlite3_int64 pivotVectorBytes(pivot_vector *pVec, int nRow){
+  sqlite3_int64 nValue = nRow;
+  sqlite3_int64 n = (nRow+7)/8 + pVec->nArenaAlloc;
+  int i;
+  if( pVec->aRank ){
+    nValue = pVec->aRank[(nRow-1)/64];
+    for( i=((nRow-1)/64)*8; i<(nRow+7)/8; i++ ) nValue += pivotPopcount(pVec->aValid[i]);
+    n += ((nRow+63)/64)*sizeof(int);
+  }
+  if( pVec->aInt ) n += nValue*sizeof(sqlite3_int64);
+  if( pVec->aReal ) n += nValue*sizeof(double);
+  if( pVec->aCode ){
+    n += nValue*sizeof(unsigned short) + pVec->nDict*2*sizeof(int);
+  }else if( pVec->aOff ){
+    n += nValue*2*sizeof(int);
+  }
+  if( pVec->aOther ){
+    n += nRow*sizeof(sqlite3_value*);
+    for( i=0; i<nRow; i++ ){
+      if( pVec->aOther[i] ) n += sqlite3_value_bytes(pVec->aOther[i]);
+    }
+  }
+  return n;
+}
+
+/*
+** Return row iRow of a vector as the result of an SQL function or
+** column.
+*/
+static void pivotVectorResult(pivot_vector *pVec, int iRow, sqlite3_context *ctx){
+  const char *z;
+  int n;
+  if( !PIVOT_BIT(pVec->aValid, iRow) ){
+    sqlite3_result_null(ctx);
+  }else if( pVec->aOther && pVec->aOther[iRow] ){
+    sqlite3_result_value(ctx, pVec->aOther[iRow]);
+  }else if( pVec->eType==SQLITE_INTEGER ){
+    sqlite3_result_int64(ctx, pVec->aInt[pivotVectorSlot(pVec, iRow)]);
+  }else if( pVec->eType==SQLITE_FLOAT ){
+    sqlite3_result_double(ctx, pVec->aReal[pivotVectorSlot(pVec, iRow)]);
+  }else if( pVec->eType==SQLITE_TEXT ){
+    n = pivotVectorText(pVec, pivotVectorSlot(pVec, iRow), &z);
+    sqlite3_result_text(ctx, z, n, SQLITE_TRANSIENT);
+  }else{
+    n = pivotVectorText(pVec, pivotVectorSlot(pVec, iRow), &z);
+    sqlite3_result_blob(ctx, z, n, SQLITE_TRANSIENT);
+  }
+}
+
+/*
+** Set *ppVal to a copy of row iRow of a vector, or to 0 if it is NULL.
+** Unboxed values are boxed by binding them to the value stmt of tab.
+*/
+static int pivotVectorValue(pivot_vtab *tab, pivot_vector *pVec, int iRow, sqlite3_value **ppVal){
+  sqlite3_stmt *stmt = tab->value_stmt;
+  const char *z;
+  int n;
+  *ppVal = 0;
+  if( !PIVOT_BIT(pVec->aValid, iRow) ) return SQLITE_OK;
+  if( pVec->aOther && pVec->aOther[iRow] ){
+    *ppVal = sqlite3_value_dup(pVec->aOther[iRow]);
+    return *ppVal ? SQLITE_OK : SQLITE_NOMEM;
+  }
+  iRow = pivotVectorSlot(pVec, iRow);
+  switch( pVec->eType ){
+    case SQLITE_INTEGER:
+      sqlite3_bind_int64(stmt, 1, pVec->aInt[iRow]);
+      break;
+    case SQLITE_FLOAT:
+      sqlite3_bind_double(stmt, 1, pVec->aReal[iRow]);
+      break;
+    case SQLITE_TEXT:
+      n = pivotVectorText(pVec, iRow, &z);
+      sqlite3_bind_text(stmt, 1, z, n, SQLITE_STATIC);
+      break;
+    default:
+      n = pivotVectorText(pVec, iRow, &z);
+      sqlite3_bind_blob(stmt, 1, z, n, SQLITE_STATIC);
+      break;
+  }
+  if( sqlite3_step(stmt)==SQLITE_ROW ){
+    *ppVal = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return *ppVal ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+/*
+** Free the arrays of a vector.
+*/
+static void pivotVectorFree(pivot_vector *pVec, int nRow){
+  int i;
+  if( pVec->aOther ){
+    for( i=0; i<nRow; i++ ) sqlite3_value_free(pVec->aOther[i]);
+    sqlite3_free(pVec->aOther);
+  }
+  sqlite3_free(pVec->aValid);
+  sqlite3_free(pVec->aSeen);
+  sqlite3_free(pVec->aInt);
+  sqlite3_free(pVec->aReal);
+  sqlite3_free(pVec->aOff);
+  sqlite3_free(pVec->aLen);
+  sqlite3_free(pVec->zArena);
+  sqlite3_free(pVec->aRank);
+  sqlite3_free(pVec->aCode);
+  sqlite3_free(pVec->aSorted);
+  memset(pVec, 0, sizeof(*pVec));
+}
+
+/*
+** Look up the row of a source scan with serialized row key zKey.
+*/
+static pivot_entry *pivotScanFind(pivot_scan *pScan, const char *zKey, int nKey, unsigned int iHash){
+  pivot_entry *e;
+  if( pScan->nHash==0 ) return 0;
+  for( e=pScan->aHash[iHash % pScan->nHash]; e; e=e->pHashNext ){
+    if( e->iHash==iHash && e->nKey==nKey && memcmp(e->zKey, zKey, nKey)==0 ) break;
+  }
+  return e;
+}
+
+/*
+** Add a row to a source scan, growing its hash table and vectors as
+** needed. The row is given the next row number.
+*/
+static int pivotScanInsert(pivot_scan *pScan, pivot_entry *e){
+  int h;
+  if( pScan->nEntry>=pScan->nRowAlloc ){
+    int nRowAlloc = pScan->nRowAlloc ? pScan->nRowAlloc*2 : 64;
+    for( h=0; h<pScan->nVec; h++ ){
+      if( pivotVectorGrow(&pScan->aVec[h], pScan->nRowAlloc, nRowAlloc) ) return SQLITE_NOMEM;
+    }
+    pScan->nRowAlloc = nRowAlloc;
+  }
+  if( pScan->nEntry>=pScan->nHash ){
+    int nHash = pScan->nHash ? pScan->nHash*2 : 64;
+    pivot_entry **aHash = sqlite3_malloc(nHash*sizeof(pivot_entry*));
+    pivot_entry *pNext;
+    pivot_entry *p;
+    if( aHash==0 ) return SQLITE_NOMEM;
+    memset(aHash, 0, nHash*sizeof(pivot_entry*));
+    for( h=0; h<pScan->nHash; h++ ){
+      for( p=pScan->aHash[h]; p; p=pNext ){
+        pNext = p->pHashNext;
+        p->pHashNext = aHash[p->iHash % nHash];
+        aHash[p->iHash % nHash] = p;
+      }
+    }
+    sqlite3_free(pScan->aHash);
+    pScan->aHash = aHash;
+    pScan->nHash = nHash;
+  }
+  h = e->iHash % pScan->nHash;
+  e->pHashNext = pScan->aHash[h];
+  pScan->aHash[h] = e;
+  e->iRow = pScan->nEntry++;
+  return SQLITE_OK;
+}
+
+/*
+** Free the rows of a source scan.
+*/
+static void pivotScanFlush(pivot_vtab *tab, pivot_scan *pScan){
+  pivot_entry *pNext;
+  pivot_entry *e;
+  int h;
+  for( h=0; h<pScan->nHash; h++ ){
+    for( e=pScan->aHash[h]; e; e=pNext ){
+      pNext = e->pHashNext;
+      pivotEntryFree(tab, e);
+    }
+  }
+  sqlite3_free(pScan->aHash);
+  for( h=0; h<pScan->nVec; h++ ) pivotVectorFree(&pScan->aVec[h], pScan->nEntry);
+  sqlite3_free(pScan->aMember);
+  sqlite3_free(pScan->aEntry);
+  sqlite3_free(pScan->aLoaded);
+  sqlite3_value_free(pScan->pAsOf);
+  pScan->pAsOf = 0;
+  pScan->aMember = 0;
+  pScan->bMemberDup = 0;
+  pScan->aEntry = 0;
+  pScan->aLoaded = 0;
+  pScan->aHash = 0;
+  pScan->nHash = 0;
+  pScan->nEntry = 0;
+  pScan->nRowAlloc = 0;
+  pScan->bValid = 0;
+}
+
+/*
+** Flush the caches.
+*/
+static void pivotCacheFlush(pivot_vtab *tab){
+  if( tab->rowCache.nEntry>0 || tab->missCache.nEntry>0 || tab->source.nEntry>0 ){
+    tab->aStat[PIVOT_STAT_CACHE_FLUSHES]++;
+  }
+  pivotLruFlush(tab, &tab->rowCache);
+  pivotLruFlush(tab, &tab->missCache);
+  pivotScanFlush(tab, &tab->source);
+  tab->nDelta = 0;
+}
+
+/*
+** Serialize the forms in which a row key value may have been looked up.
+** Depending on the affinity of the key query column, a source value of 1
+** matches lookups on 1, 1.0 and '1'. Returns the number of forms written
+** to azForm and their sizes to anForm. All four azForm entries must be
+** freed by the caller.
+*/
+static int pivotKeyForms(sqlite3_value *pVal, char **azForm, int *anForm){
+  sqlite3_value *pNum = 0;
+  sqlite3_str *aStr[4];
+  sqlite3_int64 iVal;
+  double rVal;
+  char *zText = 0;
+  char t;
+  int nForm = 0;
+  int eType = sqlite3_value_type(pVal);
+  int i;
+
+  for( i=0; i<4; i++ ) aStr[i] = sqlite3_str_new(0);
+  pivotKeyAppend(aStr[nForm++], pVal);
+
+  // The numeric value of a text value that looks like a number
+  if( eType==SQLITE_TEXT ){
+    pNum = sqlite3_value_dup(pVal);
+    if( pNum && sqlite3_value_numeric_type(pNum)!=SQLITE_TEXT ){
+      pVal = pNum;
+      eType = sqlite3_value_type(pNum);
+      pivotKeyAppend(aStr[nForm++], pNum);
+    }
+  }else if( eType==SQLITE_INTEGER || eType==SQLITE_FLOAT ){
+    zText = sqlite3_mprintf("%s", sqlite3_value_text(pVal));
+    if( zText ){
+      int n = (int)strlen(zText);
+      t = SQLITE_TEXT;
+      sqlite3_str_append(aStr[nForm], &t, 1);
+      sqlite3_str_append(aStr[nForm], (const char*)&n, sizeof(n));
+      sqlite3_str_append(aStr[nForm++], zText, n);
+    }
+  }
+
+  // An integer may have been looked up as a real, and an integral real
+  // as an integer
+  if( eType==SQLITE_INTEGER ){
+    rVal = (double)sqlite3_value_int64(pVal);
+    t = SQLITE_FLOAT;
+    sqlite3_str_append(aStr[nForm], &t, 1);
+    sqlite3_str_append(aStr[nForm++], (const char*)&rVal, sizeof(rVal));
+  }else if( eType==SQLITE_FLOAT ){
+    rVal = sqlite3_value_double(pVal);
+    if( rVal>=-9.2e18 && rVal<=9.2e18 && (double)(sqlite3_int64)rVal==rVal ){
+      iVal = (sqlite3_int64)rVal;
+      t = SQLITE_INTEGER;
+      sqlite3_str_append(aStr[nForm], &t, 1);
+      sqlite3_str_append(aStr[nForm++], (const char*)&iVal, sizeof(iVal));
+    }
+  }
+
+  for( i=0; i<4; i++ ){
+    anForm[i] = sqlite3_str_length(aStr[i]);
+    azForm[i] = sqlite3_str_finish(aStr[i]);
+  }
+  sqlite3_free(zText);
+  sqlite3_value_free(pNum);
+  return nForm;
+}
+
+/*
+** Remove the row key values in the current row of stmt from the row and
+** miss caches, in every form they may have been looked up in.
+*/
+static int pivotCacheInvalidate(pivot_vtab *tab, sqlite3_stmt *stmt){
+  char **azForm;
+  int *anForm;
+  int *aiForm;
+  int *anCol;
+  sqlite3_str *pKey;
+  pivot_entry *e;
+  char *zKey;
+  int nKey;
+  unsigned int iHash;
+  int rc = SQLITE_OK;
+  int i;
+
+  azForm = sqlite3_malloc(tab->nRow_cols*4*sizeof(char*));
+  anForm = sqlite3_malloc(tab->nRow_cols*4*sizeof(int));
+  aiForm = sqlite3_malloc(tab->nRow_cols*sizeof(int));
+  anCol = sqlite3_malloc(tab->nRow_cols*sizeof(int));
+  if( azForm==0 || anForm==0 || aiForm==0 || anCol==0 ){
+    sqlite3_free(azForm);
+    sqlite3_free(anForm);
+    sqlite3_free(aiForm);
+    sqlite3_free(anCol);
+    return SQLITE_NOMEM;
+  }
+  for( i=0; i<tab->nRow_cols; i++ ){
+    anCol[i] = pivotKeyForms(sqlite3_column_value(stmt, i), &azForm[i*4], &anForm[i*4]);
+    aiForm[i] = 0;
+  }
+
+  // Visit every combination of the forms of each column
+  while( rc==SQLITE_OK ){
+    pKey = sqlite3_str_new(tab->db);
+    for( i=0; i<tab->nRow_cols; i++ ){
+      if( anForm[i*4+aiForm[i]]>0 ){
+        sqlite3_str_append(pKey, azForm[i*4+aiForm[i]], anForm[i*4+aiForm[i]]);
+      }
+    }
+    nKey = sqlite3_str_length(pKey);
+    zKey = sqlite3_str_finish(pKey);
+    if( zKey==0 ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    iHash = pivotKeyHash(zKey, nKey);
+    if( (e = pivotLruFind(&tab->rowCache, zKey, nKey, iHash))!=0 ){
+      pivotLruRemove(tab, &tab->rowCache, e);
+      tab->aStat[PIVOT_STAT_DELTA_INVALIDATIONS]++;
+    }
+    if( (e = pivotLruFind(&tab->missCache, zKey, nKey, iHash))!=0 ){
+      pivotLruRemove(tab, &tab->missCache, e);
+      tab->aStat[PIVOT_STAT_DELTA_INVALIDATIONS]++;
+    }
+    sqlite3_free(zKey);
+
+    for( i=0; i<tab->nRow_cols; i++ ){
+      if( ++aiForm[i]<anCol[i] ) break;
+      aiForm[i] = 0;
+    }
+    if( i==tab->nRow_cols ) break;
+  }
+
+  for( i=0; i<tab->nRow_cols*4; i++ ) sqlite3_free(azForm[i]);
+  sqlite3_free(azForm);
+  sqlite3_free(anForm);
+  sqlite3_free(aiForm);
+  sqlite3_free(anCol);
+  return rc;
+}
+
+/*
+** Invalidate the rows affected by the source rows recorded by the update
+** hook. The delta query maps the rowid of each changed source row to the
+** row key values it contributes to. The affected rows are evaluated again
+** the next time they are looked up. If anything goes wrong the caches
+** are flushed. The caches of a pivot table with parameter columns are
+** always flushed, as the delta query cannot tell which parameter values
+** a source row contributes to.
+*/
+static void pivotApplyDeltas(pivot_vtab *tab){
+  int rc = tab->nParam>0 ? SQLITE_ERROR : SQLITE_OK;
+  int i;
+
+  for( i=0; i<tab->nDelta && rc==SQLITE_OK; i++ ){
+    sqlite3_bind_int64(tab->delta_stmt, 1, tab->aDelta[i]);
+    while( (rc = sqlite3_step(tab->delta_stmt))==SQLITE_ROW ){
+      rc = pivotCacheInvalidate(tab, tab->delta_stmt);
+      if( rc!=SQLITE_OK ) break;
+    }
+    if( rc==SQLITE_DONE ) rc = SQLITE_OK;
+    sqlite3_reset(tab->delta_stmt);
+  }
+  tab->aStat[PIVOT_STAT_DELTA_ROWS] += tab->nDelta;
+  tab->nDelta = 0;
+  if( rc!=SQLITE_OK ) pivotCacheFlush(tab);
+}
+
+/*
+** Flush the caches if the database has changed since they were filled,
+** or invalidate only the affected rows if the changes are known.
+**
+** The caches are also flushed at the first validation inside a write
+** transaction, and at the first one after it, as cells read inside it may
+** be rolled back. Within the transaction they are only flushed again when
+** this connection changes the database. The row and miss caches are not
+** used at all inside a write transaction (see pivotFilterScan()), and a
+** source scan loaded inside one is only read by the scan that loaded it,
+** as a ROLLBACK TO a savepoint changes neither the data version nor the
+** change count.
+*/
+static void pivotCacheValidate(pivot_vtab *tab){
+  pivot_version version;
+  int bWriteTxn = pivotWriteTxn(tab->db);
+  pivotCacheVersion(tab, &version);
+  if( !PIVOT_VERSION_SAME(version, tab->cacheVersion) || bWriteTxn!=tab->bCacheWriteTxn ){
+    pivotCacheFlush(tab);
+    tab->cacheVersion = version;
+  }else if( tab->nDelta>0 ){
+    pivotScanFlush(tab, &tab->source);
+    pivotApplyDeltas(tab);
+  }else if( bWriteTxn ){
+    pivotScanFlush(tab, &tab->source);
+  }
+  tab->bCacheWriteTxn = bWriteTxn;
+}
+
+/*
+** Add an entry to an LRU cache, evicting least recently used entries to
+** stay within its capacity. Evictions are counted in tab->aStat[iStat].
+*/
+static int pivotLruInsert(pivot_vtab *tab, pivot_lru *pLru, pivot_entry *e, int iStat){
+  int h;
+  if( pLru->aHash==0 ){
+    pLru->nHash = pLru->nMax<16 ? 16 : pLru->nMax;
+    pLru->aHash = sqlite3_malloc(pLru->nHash*sizeof(pivot_entry*));
+    if( pLru->aHash==0 ){
+      pLru->nHash = 0;
+      return SQLITE_NOMEM;
+    }
+    memset(pLru->aHash, 0, pLru->nHash*sizeof(pivot_entry*));
+  }
+  while( pLru->nEntry>=pLru->nMax && pLru->pLast ){
+    pivotLruRemove(tab, pLru, pLru->pLast);
+    tab->aStat[iStat]++;
+  }
+  h = e->iHash % pLru->nHash;
+  e->pHashNext = pLru->aHash[h];
+  pLru->aHash[h] = e;
+  e->pLruPrev = 0;
+  e->pLruNext = pLru->pFirst;
+  if( pLru->pFirst ) pLru->pFirst->pLruPrev = e;
+  else pLru->pLast = e;
+  pLru->pFirst = e;
+  pLru->nEntry++;
+  return SQLITE_OK;
+}
+
+/*
+** Free an LRU cache and its entries.
+*/
+static void pivotLruFree(pivot_vtab *tab, pivot_lru *pLru){
+  pivotLruFlush(tab, pLru);
+  sqlite3_free(pLru->aHash);
+  pLru->aHash = 0;
+  pLru->nHash = 0;
+}
+
+/*
+** Build the hash of the serialized column key values of tab. Columns with
+** a NULL key are left out, as they match no source row, and columns whose
+** keys compare equal are chained through aColNext from the first one.
+*/
+static int pivotColHashBuild(pivot_vtab *tab){
+  int i, j, h;
+  tab->nColHash = 16;
+  while( tab->nColHash<tab->nCol_key*2 ) tab->nColHash *= 2;
+  tab->aColHash = sqlite3_malloc(tab->nColHash*sizeof(int));
+  tab->aColNext = sqlite3_malloc(tab->nCol_key*sizeof(int)+1);
+  if( tab->aColHash==0 || tab->aColNext==0 ) return SQLITE_NOMEM;
+  memset(tab->aColHash, 0, tab->nColHash*sizeof(int));
+  for( i=0; i<tab->nCol_key; i++ ){
+    tab->aColNext[i] = -1;
+    if( tab->azColKey[i]==0 ) continue;
+    h = pivotKeyHash(tab->azColKey[i], tab->anColKey[i]) & (tab->nColHash-1);
+    while( (j = tab->aColHash[h])!=0 ){
+      if( tab->anColKey[j-1]==tab->anColKey[i]
+       && memcmp(tab->azColKey[j-1], tab->azColKey[i], tab->anColKey[i])==0 ) break;
+      h = (h+1) & (tab->nColHash-1);
+    }
+    if( j ){
+      for( j--; tab->aColNext[j]>=0; j=tab->aColNext[j] ){}
+      tab->aColNext[j] = i;
+    }else{
+      tab->aColHash[h] = i+1;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Return the index of the first pivot column with serialized column key
+** zCol, or -1 if there is none. Further columns with the same key follow
+** in aColNext.
+*/
+static int pivotColFind(pivot_vtab *tab, const char *zCol, int nCol, unsigned int iHash){
+  int h = iHash & (tab->nColHash-1);
+  int i;
+  while( (i = tab->aColHash[h])!=0 ){
+    if( tab->anColKey[i-1]==nCol && memcmp(tab->azColKey[i-1], zCol, nCol)==0 ){
+      return i-1;
+    }
+    h = (h+1) & (tab->nColHash-1);
+  }
+  return -1;
+}
+
+/*
+** Set column iCol of the row with serialized row key zKey (nKey bytes,
+** hash iHash) of a source scan being loaded to pVal, adding the row if it
+** is new. Only the first cell loaded for a row and column is kept.
+*/
+static int pivotScanAddCell(
+  pivot_vtab *tab,
+  pivot_scan *pScan,
+  const char *zKey, int nKey, unsigned int iHash,
+  int iCol,
+  sqlite3_value *pVal
+){
+  pivot_entry *e = pivotScanFind(pScan, zKey, nKey, iHash);
+  if( e==0 ){
+    char *zCopy = sqlite3_malloc(nKey+1);
+    if( zCopy==0 ) return SQLITE_NOMEM;
+    memcpy(zCopy, zKey, nKey);
+    e = pivotEntryNew(zCopy, nKey, iHash);
+    if( e==0 || pivotScanInsert(pScan, e) ){
+      if( e ) pivotEntryFree(tab, e);
+      return SQLITE_NOMEM;
+    }
+  }
+  if( pivotVectorSet(&pScan->aVec[iCol], pScan->nRowAlloc, e->iRow, pVal) ){
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Finish loading a source scan. The first-row-wins bitmaps are only
+** needed while loading, and the vectors are compressed if asked to.
+*/
+static int pivotScanLoaded(pivot_vtab *tab, pivot_scan *pScan){
+  int rc = SQLITE_OK;
+  int i;
+  for( i=0; i<pScan->nVec; i++ ){
+    sqlite3_free(pScan->aVec[i].aSeen);
+    pScan->aVec[i].aSeen = 0;
+    if( tab->bCompress && rc==SQLITE_OK ){
+      if( pivotVectorCompress(&pScan->aVec[i], pScan->nEntry) ) rc = SQLITE_NOMEM;
+    }
+  }
+  return rc;
+}
+
+/*
+** Scan the source query of tab once and load every cell of tab from it.
+**
+** The pivot tables on the connection act as a scan coordinator: every
+** other pivot table with the same source query whose cells are not
+** current receives the rows of the same scan, so that k pivot tables over
+** one source read it once rather than k times. Where the source query
+** returns more than one row for a cell, the first row wins.
+**
+** The source query of an as-of pivot table is bound to the cutoff pAsOf,
+** or NULL if pAsOf is 0, and its scan is never shared.
+*/
+static int pivotSourceScan(pivot_vtab *tab, sqlite3_value *pAsOf){
+  sqlite3_stmt *stmt = tab->source_stmt;
+  sqlite3_value *pColKey;
+  pivot_vtab *p;
+  char *zKey = 0;
+  char *zCol = 0;
+  int nKey, nCol;
+  unsigned int iHash, iColHash;
+  int iCol;
+  int rc;
+
+  for( p=tab->pGlobal->pVtab; p; p=p->pNext ){
+    p->bScanning = 0;
+    if( p!=tab && (p->zSourceSql==0 || strcmp(p->zSourceSql, tab->zSourceSql)) ) continue;
+    if( p!=tab && (p->bAsOf || tab->bAsOf) ) continue;
+    if( p->bReference ) continue;
+    if( p!=tab ) pivotCacheValidate(p);
+    if( p!=tab && p->source.bValid ) continue;
+    pivotScanFlush(p, &p->source);
+    if( p->source.aVec==0 ){
+      p->source.aVec = sqlite3_malloc(p->nCol_key*sizeof(pivot_vector)+1);
+      if( p->source.aVec==0 ) continue;
+      memset(p->source.aVec, 0, p->nCol_key*sizeof(pivot_vector));
+      p->source.nVec = p->nCol_key;
+    }
+    p->bScanning = 1;
+  }
+  if( tab->bAsOf ){
+    if( pAsOf ){
+      sqlite3_bind_value(stmt, tab->nRow_key+2, pAsOf);
+    }else{
+      sqlite3_bind_null(stmt, tab->nRow_key+2);
+    }
+  }
+
+  while( (rc = sqlite3_step(stmt))==SQLITE_ROW ){
+    // Rows with a NULL key are the cells of no row or column
+    pColKey = sqlite3_column_value(stmt, tab->nRow_key);
+    if( pivotKeyBuild(tab->db, tab->aKeyType, tab->nRow_key, 0, stmt, &zKey, &nKey)
+     || (zKey && pivotKeyBuild(tab->db, &tab->aKeyType[tab->nRow_key], 1, &pColKey, 0, &zCol, &nCol)) ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    if( zKey==0 || zCol==0 ){
+      sqlite3_free(zKey);
+      zKey = 0;
+      continue;
+    }
+    iHash = pivotKeyHash(zKey, nKey);
+    iColHash = pivotKeyHash(zCol, nCol);
+
+    // Fan the row out to every pivot table sharing the scan, and every
+    // column of a table with that column key
+    for( p=tab->pGlobal->pVtab; p && rc==SQLITE_ROW; p=p->pNext ){
+      if( !p->bScanning ) continue;
+      for( iCol = pivotColFind(p, zCol, nCol, iColHash); iCol>=0 && rc==SQLITE_ROW; iCol = p->aColNext[iCol] ){
+        if( pivotScanAddCell(p, &p->source, zKey, nKey, iHash, iCol,
+                             sqlite3_column_value(stmt, tab->nRow_key+1)) ){
+          rc = SQLITE_NOMEM;
+        }
+      }
+    }
+    sqlite3_free(zKey);
+    sqlite3_free(zCol);
+    zKey = zCol = 0;
+    if( rc!=SQLITE_ROW ) break;
+  }
+  sqlite3_free(zKey);
+  sqlite3_free(zCol);
+  if( rc!=SQLITE_DONE && rc!=SQLITE_NOMEM ){
+    sqlite3_free(tab->base.zErrMsg);
+    tab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(tab->db));
+  }
+  sqlite3_reset(stmt);
+
+  for( p=tab->pGlobal->pVtab; p; p=p->pNext ){
+    if( !p->bScanning ) continue;
+    p->bScanning = 0;
+    if( rc!=SQLITE_DONE ){
+      pivotScanFlush(p, &p->source);
+      continue;
+    }
+    if( pivotScanLoaded(p, &p->source) ){
+      pivotScanFlush(p, &p->source);
+      rc = SQLITE_NOMEM;
+      continue;
+    }
+    if( pAsOf && p->bAsOf ){
+      p->source.pAsOf = sqlite3_value_dup(pAsOf);
+      if( p->source.pAsOf==0 ){
+        pivotScanFlush(p, &p->source);
+        rc = SQLITE_NOMEM;
+        continue;
+      }
+    }
+    p->source.bValid = 1;
+    p->source.iLoad++;
+    p->aStat[p==tab ? PIVOT_STAT_SOURCE_SCANS : PIVOT_STAT_SOURCE_SHARED_SCANS]++;
+  }
+  return rc==SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/*
+** Return true if the source scan of tab holds the cells read by cur. The
+** scan of an as-of pivot table only holds those of cursors with the
+** cutoff it was loaded for.
+*/
+static int pivotSourceCurrent(pivot_vtab *tab, pivot_cursor *cur){
+  if( !tab->source.bValid ) return 0;
+  return !tab->bAsOf || cur->iSourceLoad==tab->source.iLoad;
+}
+
+/*
+** Return true if the as-of cutoff of cur is that of the source scan of
+** tab, both being NULL or values of the same type and value.
+*/
+static int pivotAsOfSame(pivot_vtab *tab, pivot_cursor *cur){
+  sqlite3_value *aVal[2];
+  char *azKey[2];
+  int anKey[2];
+  int bSame;
+  int i;
+
+  aVal[0] = tab->source.pAsOf;
+  aVal[1] = cur->aParam[0];
+  if( aVal[0]==0 || aVal[1]==0 ) return aVal[0]==aVal[1];
+  for( i=0; i<2; i++ ){
+    sqlite3_str *pKey = sqlite3_str_new(tab->db);
+    pivotKeyAppend(pKey, aVal[i]);
+    anKey[i] = sqlite3_str_length(pKey);
+    azKey[i] = sqlite3_str_finish(pKey);
+  }
+  bSame = azKey[0] && azKey[1] && anKey[0]==anKey[1]
+       && memcmp(azKey[0], azKey[1], anKey[0])==0;
+  sqlite3_free(azKey[0]);
+  sqlite3_free(azKey[1]);
+  return bSame;
+}
+
+/*
+** Return the row of source scan pScan with row key values aKey, or 0 if
+** the source query returned no cells for the row.
+*/
+static pivot_entry *pivotSourceRow(pivot_vtab *tab, pivot_scan *pScan, sqlite3_value **aKey){
+  pivot_entry *e;
+  char *zKey;
+  int nKey;
+  pivotKeyBuild(tab->db, tab->aKeyType, tab->nRow_key, aKey, 0, &zKey, &nKey);
+  if( zKey==0 ) return 0;
+  e = pivotScanFind(pScan, zKey, nKey, pivotKeyHash(zKey, nKey));
+  sqlite3_free(zKey);
+  return e;
+}
+
+/*
+** Release a reference to a snapshot, freeing it with the last one.
+*/
+static void pivotSnapshotRelease(pivot_vtab *tab, pivot_snapshot *pSnap){
+  if( pSnap==0 || --pSnap->nRef>0 ) return;
+  pivotScanFlush(tab, &pSnap->scan);
+  sqlite3_free(pSnap->scan.aVec);
+  sqlite3_free(pSnap);
+}
+
+#ifdef PIVOT_VTAB_THREADS
+/*
+** Body of the worker thread of a background refresh. Runs the source
+** query on the worker's own read connection, loading every cell into
+** r->pNew.
+*/
+static void *pivotRefreshMain(void *pArg){
+  pivot_refresh *r = (pivot_refresh*)pArg;
+  pivot_vtab *tab = r->tab;
+  pivot_scan *pScan = &r->pNew->scan;
+  sqlite3_stmt *stmt = 0;
+  sqlite3_value *pColKey;
+  char *zKey, *zCol;
+  char *zErr = 0;
+  int nKey, nCol;
+  int iCol;
+  int rc = SQLITE_OK;
+
+  // The connection is kept for later refreshes. A busy database is waited
+  // for no longer than the staleness window.
+  if( r->db==0 ){
+    rc = sqlite3_open_v2(r->zFile, &r->db, SQLITE_OPEN_READONLY, 0);
+    if( rc==SQLITE_OK ){
+      sqlite3_busy_timeout(r->db, (int)(r->nWindow/1000000));
+    }else{
+      sqlite3_close(r->db);
+      r->db = 0;
+    }
+  }
+  if( rc==SQLITE_OK ) rc = sqlite3_prepare_v2(r->db, tab->zSourceSql, -1, &stmt, 0);
+
+  while( rc==SQLITE_OK && (rc = sqlite3_step(stmt))==SQLITE_ROW ){
+    pColKey = sqlite3_column_value(stmt, tab->nRow_key);
+    zCol = 0;
+    rc = pivotKeyBuild(r->db, tab->aKeyType, tab->nRow_key, 0, stmt, &zKey, &nKey);
+    if( rc==SQLITE_OK && zKey ){
+      rc = pivotKeyBuild(r->db, &tab->aKeyType[tab->nRow_key], 1, &pColKey, 0, &zCol, &nCol);
+    }
+    if( rc==SQLITE_OK && zKey && zCol ){
+      for( iCol = pivotColFind(tab, zCol, nCol, pivotKeyHash(zCol, nCol)); iCol>=0 && rc==SQLITE_OK; iCol = tab->aColNext[iCol] ){
+        rc = pivotScanAddCell(tab, pScan, zKey, nKey, pivotKeyHash(zKey, nKey), iCol,
+                              sqlite3_column_value(stmt, tab->nRow_key+1));
+      }
+    }
+    sqlite3_free(zKey);
+    sqlite3_free(zCol);
+  }
+  if( rc!=SQLITE_DONE && rc!=SQLITE_OK ){
+    zErr = sqlite3_mprintf("%s", r->db ? sqlite3_errmsg(r->db) : sqlite3_errstr(rc));
+  }
+  sqlite3_finalize(stmt);
+  if( rc==SQLITE_DONE ) rc = pivotScanLoaded(tab, pScan);
+  if( rc==SQLITE_OK ) pScan->bValid = 1;
+
+  sqlite3_mutex_enter(r->mutex);
+  r->rc = rc;
+  r->zErr = zErr;
+  r->bDone = 1;
+  sqlite3_mutex_leave(r->mutex);
+  return 0;
+}
+#endif
+
+/*
+** Start a background refresh of the snapshot of tab, at data version
+** *pVersion.
+*/
+static int pivotRefreshStart(pivot_vtab *tab, pivot_version *pVersion){
+  pivot_refresh *r = tab->pRefresh;
+  pivot_snapshot *pNew = sqlite3_malloc(sizeof(pivot_snapshot));
+  if( pNew==0 ) return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(pivot_snapshot));
+  pNew->nRef = 1;
+  pNew->version = *pVersion;
+  pNew->iStart = pivotTimeNs();
+  pNew->scan.aVec = sqlite3_malloc(tab->nCol_key*sizeof(pivot_vector)+1);
+  if( pNew->scan.aVec==0 ){
+    sqlite3_free(pNew);
+    return SQLITE_NOMEM;
+  }
+  memset(pNew->scan.aVec, 0, tab->nCol_key*sizeof(pivot_vector));
+  pNew->scan.nVec = tab->nCol_key;
+
+  r->pNew = pNew;
+  r->bDone = 0;
+  r->rc = SQLITE_OK;
+  sqlite3_free(r->zErr);
+  r->zErr = 0;
+#ifdef PIVOT_VTAB_THREADS
+  if( pthread_create(&r->thread, 0, pivotRefreshMain, r)==0 ){
+    r->bRunning = 1;
+    return SQLITE_OK;
+  }
+#endif
+  pivotSnapshotRelease(tab, pNew);
+  r->pNew = 0;
+  return SQLITE_ERROR;
+}
+
+/*
+** Wait for the background refresh of tab to finish, and make its snapshot
+** current if it loaded. Scans reading the previous snapshot keep reading
+** it until they end. A failed refresh is logged with sqlite3_log().
+*/
+static void pivotRefreshFinish(pivot_vtab *tab){
+  pivot_refresh *r = tab->pRefresh;
+#ifdef PIVOT_VTAB_THREADS
+  pthread_join(r->thread, 0);
+#endif
+  r->bRunning = 0;
+  if( r->rc==SQLITE_OK ){
+    pivotSnapshotRelease(tab, r->pSnapshot);
+    r->pSnapshot = r->pNew;
+    // Cached rows may hold cells of the previous snapshot
+    pivotLruFlush(tab, &tab->rowCache);
+    pivotLruFlush(tab, &tab->missCache);
+    tab->aStat[PIVOT_STAT_SNAPSHOT_REFRESHES]++;
+    r->nFail = 0;
+  }else{
+    pivotSnapshotRelease(tab, r->pNew);
+    tab->aStat[PIVOT_STAT_SNAPSHOT_FAILURES]++;
+    sqlite3_log(r->rc, "pivot_vtab %s: background refresh failed: %s",
+      tab->zName, r->zErr ? r->zErr : sqlite3_errstr(r->rc)
+    );
+    r->nFail++;
+    r->iFail = pivotTimeNs();
+  }
+  r->pNew = 0;
+}
+
+/*
+** Return true if a background refresh of tab may start at time iNow.
+** After a failed refresh the next one waits for the staleness window, and
+** the wait doubles with every further failure, up to 1024 windows, so that
+** a refresh that keeps failing does not start a thread for every scan.
+*/
+static int pivotRefreshReady(pivot_refresh *r, sqlite3_int64 iNow){
+  if( r->nFail==0 ) return 1;
+  return iNow-r->iFail >= r->nWindow<<(r->nFail>10 ? 10 : r->nFail-1);
+}
+
+/*
+** Return true if snapshot pSnap may be read at data version *pVersion and
+** time iNow: it is current, or the refresh that loaded it started less
+** than the staleness window ago.
+*/
+static int pivotSnapshotUsable(
+  pivot_refresh *r,
+  pivot_snapshot *pSnap,
+  pivot_version *pVersion,
+  sqlite3_int64 iNow
+){
+  if( pSnap==0 ) return 0;
+  return PIVOT_VERSION_SAME(pSnap->version, *pVersion) || iNow-pSnap->iStart<r->nWindow;
+}
+
+/*
+** Pin the snapshot that the scan of cur reads its cells from, for a table
+** with the refresh_ms option. Once the database changes, a background
+** refresh loads a new snapshot while scans keep reading the current one,
+** until it is older than the staleness window, after which scans wait for
+** the refresh. No snapshot is pinned if none is recent enough, and the
+** scan falls back to the source query.
+*/
+static void pivotSnapshotAcquire(pivot_vtab *tab, pivot_cursor *cur){
+  pivot_refresh *r = tab->pRefresh;
+  pivot_version version;
+  sqlite3_int64 iNow = pivotTimeNs();
+  int bDone;
+
+  pivotCacheVersion(tab, &version);
+  if( r->bRunning ){
+    sqlite3_mutex_enter(r->mutex);
+    bDone = r->bDone;
+    sqlite3_mutex_leave(r->mutex);
+    if( bDone ) pivotRefreshFinish(tab);
+  }
+  if( !r->bRunning && (r->pSnapshot==0 || !PIVOT_VERSION_SAME(r->pSnapshot->version, version))
+   && pivotRefreshReady(r, iNow)
+  ){
+    pivotRefreshStart(tab, &version);
+  }
+  if( r->bRunning && !pivotSnapshotUsable(r, r->pSnapshot, &version, iNow) ){
+    tab->aStat[PIVOT_STAT_SNAPSHOT_WAITS]++;
+    pivotRefreshFinish(tab);
+    iNow = pivotTimeNs();
+  }
+  if( pivotSnapshotUsable(r, r->pSnapshot, &version, iNow) ){
+    cur->pSnapshot = r->pSnapshot;
+    cur->pSnapshot->nRef++;
+  }
+}
+
+/*
+** Wait for any background refresh of tab and free its snapshots.
+*/
+static void pivotRefreshFree(pivot_vtab *tab){
+  pivot_refresh *r = tab->pRefresh;
+  if( r==0 ) return;
+#ifdef PIVOT_VTAB_THREADS
+  if( r->bRunning ) pthread_join(r->thread, 0);
+#endif
+  pivotSnapshotRelease(tab, r->pNew);
+  pivotSnapshotRelease(tab, r->pSnapshot);
+  sqlite3_free(r->zErr);
+  sqlite3_close(r->db);
+  sqlite3_mutex_free(r->mutex);
+  sqlite3_free(r->zFile);
+  sqlite3_free(r);
+  tab->pRefresh = 0;
+}
+
+/*
+** Find the rows of the valid source scan of tab that are rows of the
+** pivot table. The source query may return cells for row keys that the
+** key query does not, and the key query may return a row key more than
+** once.
+*/
+static int pivotScanMembers(pivot_vtab *tab){
+  pivot_scan *pScan = &tab->source;
+  sqlite3_stmt *stmt = 0;
+  sqlite3_value **aKey;
+  pivot_entry *e;
+  int rc, rc2;
+  int i;
+
+  if( pScan->aMember ) return SQLITE_OK;
+  pScan->aMember = sqlite3_malloc((pScan->nEntry+7)/8+1);
+  aKey = sqlite3_malloc(tab->nRow_key*sizeof(sqlite3_value*)+1);
+  if( pScan->aMember==0 || aKey==0 ){
+    sqlite3_free(pScan->aMember);
+    sqlite3_free(aKey);
+    pScan->aMember = 0;
+    return SQLITE_NOMEM;
+  }
+  memset(pScan->aMember, 0, (pScan->nEntry+7)/8+1);
+
+  rc = sqlite3_prepare_v2(tab->db, tab->key_sql_full_table_scan, -1, &stmt, 0);
+  while( rc==SQLITE_OK && sqlite3_step(stmt)==SQLITE_ROW ){
+    for( i=0; i<tab->nRow_key; i++ ) aKey[i] = sqlite3_column_value(stmt, i);
+    e = pivotSourceRow(tab, pScan, aKey);
+    if( e==0 ) continue;
+    if( PIVOT_BIT(pScan->aMember, e->iRow) ) pScan->bMemberDup = 1;
+    pScan->aMember[e->iRow/8] |= (unsigned char)(1<<(e->iRow%8));
+  }
+  rc2 = sqlite3_finalize(stmt);
+  if( rc==SQLITE_OK ) rc = rc2;
+  sqlite3_free(aKey);
+  if( rc!=SQLITE_OK ){
+    sqlite3_free(pScan->aMember);
+    pScan->aMember = 0;
+  }
+  return rc;
+}
+
+/*
+** Load the cells of pivot column iCol into the scan of tab by running the
+** column query for it.
+*/
+static int pivotColumnLoad(pivot_vtab *tab, int iCol){
+  pivot_scan *pScan = &tab->source;
+  sqlite3_stmt *stmt = tab->column_stmt;
+  pivot_entry *e;
+  char *zKey;
+  int nKey;
+  unsigned int iHash;
+  int rc;
+
+  if( pScan->aVec==0 ){
+    pScan->aVec = sqlite3_malloc(tab->nCol_key*sizeof(pivot_vector)+1);
+    if( pScan->aVec==0 ) return SQLITE_NOMEM;
+    memset(pScan->aVec, 0, tab->nCol_key*sizeof(pivot_vector));
+  }
+  pScan->nVec = tab->nCol_key;
+  if( pScan->aLoaded==0 ){
+    pScan->aLoaded = sqlite3_malloc((tab->nCol_key+7)/8+1);
+    if( pScan->aLoaded==0 ) return SQLITE_NOMEM;
+    memset(pScan->aLoaded, 0, (tab->nCol_key+7)/8+1);
+  }
+
+  sqlite3_bind_value(stmt, 1, tab->aCol[iCol].pKey);
+  while( (rc = sqlite3_step(stmt))==SQLITE_ROW ){
+    if( pivotKeyBuild(tab->db, tab->aKeyType, tab->nRow_key, 0, stmt, &zKey, &nKey) ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    if( zKey==0 ) continue;
+    iHash = pivotKeyHash(zKey, nKey);
+    e = pivotScanFind(pScan, zKey, nKey, iHash);
+    if( e ){
+      sqlite3_free(zKey);
+    }else{
+      e = pivotEntryNew(zKey, nKey, iHash);
+      if( e==0 || pivotScanInsert(pScan, e) ){
+        if( e ) pivotEntryFree(tab, e);
+        rc = SQLITE_NOMEM;
+        break;
+      }
+    }
+    if( pivotVectorSet(&pScan->aVec[iCol], pScan->nRowAlloc, e->iRow,
+                       sqlite3_column_value(stmt, tab->nRow_key)) ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+  }
+  if( rc!=SQLITE_DONE && rc!=SQLITE_NOMEM ){
+    sqlite3_free(tab->base.zErrMsg);
+    tab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(tab->db));
+  }
+  sqlite3_reset(stmt);
+  if( rc!=SQLITE_DONE ){
+    pivotScanFlush(tab, pScan);
+    return rc;
+  }
+  pScan->aLoaded[iCol/8] |= (unsigned char)(1<<(iCol%8));
+  tab->aStat[PIVOT_STAT_COLUMN_SCANS]++;
+  return SQLITE_OK;
+}
+
+/*
+** qsort() comparison function for ints.
+*/
+static int pivotIntCompare(const void *pA, const void *pB){
+  int a = *(const int*)pA;
+  int b = *(const int*)pB;
+  return a<b ? -1 : a>b;
+}
+
+/*
+** Compare integer a with real b.
+*/
+static int pivotCompareIntReal(sqlite3_int64 a, double b){
+  sqlite3_int64 i;
+  if( b<-9223372036854775808.0 ) return 1;
+  if( b>=9223372036854775808.0 ) return -1;
+  i = (sqlite3_int64)b;
+  if( a<i ) return -1;
+  if( a>i ) return 1;
+  return b>(double)i ? -1 : b<(double)i ? 1 : 0;
+}
+
+/*
+** Return the sort class of a value type - the types of one class compare
+** by value, and those of different classes by class.
+*/
+static int pivotSortClass(int eType){
+  return eType==SQLITE_FLOAT ? SQLITE_INTEGER : eType;
+}
+
+/*
+** Compare the values of non-null rows iRowA and iRowB of a vector without
+** values in aOther.
+*/
+static int pivotVectorCompare(pivot_vector *pVec, int iRowA, int iRowB){
+  int iA = pivotVectorSlot(pVec, iRowA);
+  int iB = pivotVectorSlot(pVec, iRowB);
+  const char *zA, *zB;
+  int nA, nB, c;
+  switch( pVec->eType ){
+    case SQLITE_INTEGER:
+      return pVec->aInt[iA]<pVec->aInt[iB] ? -1 : pVec->aInt[iA]>pVec->aInt[iB];
+    case SQLITE_FLOAT:
+      return pVec->aReal[iA]<pVec->aReal[iB] ? -1 : pVec->aReal[iA]>pVec->aReal[iB];
+  }
+  nA = pivotVectorText(pVec, iA, &zA);
+  nB = pivotVectorText(pVec, iB, &zB);
+  c = memcmp(zA, zB, nA<nB ? nA : nB);
+  return c ? c : nA-nB;
+}
+
+/*
+** Compare non-null row iRow of a vector without values in aOther to pVal,
+** a value of the same sort class, with the BINARY collation.
+*/
+static int pivotVectorCompareValue(pivot_vector *pVec, int iRow, sqlite3_value *pVal){
+  int iSlot = pivotVectorSlot(pVec, iRow);
+  const char *z;
+  const void *zVal;
+  int n, nVal, c;
+  if( pVec->eType==SQLITE_INTEGER ){
+    if( sqlite3_value_type(pVal)==SQLITE_INTEGER ){
+      sqlite3_int64 v = sqlite3_value_int64(pVal);
+      return pVec->aInt[iSlot]<v ? -1 : pVec->aInt[iSlot]>v;
+    }
+    return pivotCompareIntReal(pVec->aInt[iSlot], sqlite3_value_double(pVal));
+  }
+  if( pVec->eType==SQLITE_FLOAT ){
+    if( sqlite3_value_type(pVal)==SQLITE_INTEGER ){
+      return -pivotCompareIntReal(sqlite3_value_int64(pVal), pVec->aReal[iSlot]);
+    }
+    return pVec->aReal[iSlot]<sqlite3_value_double(pVal) ? -1 : pVec->aReal[iSlot]>sqlite3_value_double(pVal);
+  }
+  n = pivotVectorText(pVec, iSlot, &z);
+  zVal = pVec->eType==SQLITE_TEXT ? (const void*)sqlite3_value_text(pVal) : sqlite3_value_blob(pVal);
+  nVal = sqlite3_value_bytes(pVal);
+  c = nVal>0 ? memcmp(z, zVal, n<nVal ? n : nVal) : 0;
+  return c ? c : n-nVal;
+}
+
+/*
+** Sort the n rows in a by their values in vector pVec, ties by row, using
+** aTmp as scratch space.
+*/
+static void pivotValueSort(pivot_vector *pVec, int *a, int *aTmp, int n){
+  int nLeft = n/2;
+  int i = 0, j = nLeft, k = 0;
+  if( n<2 ) return;
+  pivotValueSort(pVec, a, aTmp, nLeft);
+  pivotValueSort(pVec, &a[nLeft], aTmp, n-nLeft);
+  while( i<nLeft && j<n ){
+    if( pivotVectorCompare(pVec, a[i], a[j])<=0 ){
+      aTmp[k++] = a[i++];
+    }else{
+      aTmp[k++] = a[j++];
+    }
+  }
+  while( i<nLeft ) aTmp[k++] = a[i++];
+  while( j<n ) aTmp[k++] = a[j++];
+  memcpy(a, aTmp, n*sizeof(int));
+}
+
+/*
+** Set tab->bValueRebind if the row keys of source rows can be bound back
+** to the key query, as value index scans do. They are kept in the folded
+** form of pivotKeyBuild(), which only compares with the key query values
+** as the pivot query does if each key column of the key query has the
+** affinity of the source query's, and both compare with BINARY.
+*/
+static void pivotValueRebindCheck(sqlite3 *db, pivot_vtab *tab){
+  sqlite3_stmt *stmt = 0;
+  pivot_keytype type;
+  char *zErr = 0;
+  int i;
+
+  tab->bValueRebind = 0;
+  if( sqlite3_prepare_v2(db, tab->key_sql_full_table_scan, -1, &stmt, 0)!=SQLITE_OK ){
+    return;
+  }
+  for( i=0; i<tab->nRow_key; i++ ){
+    if( pivotKeyTypeOf(db, stmt, i, &type, &zErr)!=SQLITE_OK ) break;
+    if( type.eColl!=PIVOT_COLL_BINARY || tab->aKeyType[i].eColl!=PIVOT_COLL_BINARY
+     || type.eAff!=tab->aKeyType[i].eAff ) break;
+  }
+  tab->bValueRebind = i==tab->nRow_key;
+  sqlite3_free(zErr);
+  sqlite3_finalize(stmt);
+}
+
+/*
+** Build the value index of pivot column iCol of the valid source scan of
+** tab, if it is not built yet: the non-null rows of its vector, sorted by
+** value. Also map the rows of the scan to their entries.
+*/
+static int pivotValueIndexBuild(pivot_vtab *tab, int iCol){
+  pivot_scan *pScan = &tab->source;
+  pivot_vector *pVec = &pScan->aVec[iCol];
+  pivot_entry *e;
+  int *aTmp;
+  int i, n;
+
+  if( pScan->aEntry==0 ){
+    pScan->aEntry = sqlite3_malloc(pScan->nEntry*sizeof(pivot_entry*)+1);
+    if( pScan->aEntry==0 ) return SQLITE_NOMEM;
+    for( i=0; i<pScan->nHash; i++ ){
+      for( e=pScan->aHash[i]; e; e=e->pHashNext ) pScan->aEntry[e->iRow] = e;
+    }
+  }
+  if( pVec->aSorted || pVec->eType==0 ) return SQLITE_OK;
+
+  for( i=n=0; i<(pScan->nEntry+7)/8; i++ ) n += pivotPopcount(pVec->aValid[i]);
+  pVec->aSorted = sqlite3_malloc(n*sizeof(int)+1);
+  aTmp = sqlite3_malloc(n*sizeof(int)+1);
+  if( pVec->aSorted==0 || aTmp==0 ){
+    sqlite3_free(pVec->aSorted);
+    sqlite3_free(aTmp);
+    pVec->aSorted = 0;
+    return SQLITE_NOMEM;
+  }
+  for( i=n=0; i<pScan->nEntry; i++ ){
+    if( PIVOT_BIT(pVec->aValid, i) ) pVec->aSorted[n++] = i;
+  }
+  pivotValueSort(pVec, pVec->aSorted, aTmp, n);
+  sqlite3_free(aTmp);
+  pVec->nSorted = n;
+  return SQLITE_OK;
+}
+
+/*
+** Return the first entry of the sorted rows of pVec whose value is greater
+** than pVal, or greater than or equal to it if bEq is true.
+*/
+static int pivotValueSearch(pivot_vector *pVec, sqlite3_value *pVal, int bEq){
+  int lo = 0;
+  int hi = pVec->nSorted;
+  while( lo<hi ){
+    int mid = lo+(hi-lo)/2;
+    int c = pivotVectorCompareValue(pVec, pVec->aSorted[mid], pVal);
+    if( c<0 || (c==0 && !bEq) ){
+      lo = mid+1;
+    }else{
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+** Find the entries [*piLo, *piHi) of the value index of pivot column
+** iCol whose values satisfy the nCons constraints of aSig on it, with
+** values aVal. *piLo is set to -1 if the index cannot answer them - if a
+** value is of a different sort class than the column, SQLite may convert
+** one of them before comparing.
+*/
+static void pivotValueIndexRange(
+  pivot_vector *pVec,
+  const int *aSig,
+  int nCons,
+  sqlite3_value **aVal,
+  int *piLo,
+  int *piHi
+){
+  int lo = 0;
+  int hi = pVec->nSorted;
+  int i;
+
+  for( i=0; i<nCons && lo<hi; i++ ){
+    int eType = sqlite3_value_type(aVal[i]);
+    if( eType==SQLITE_NULL ){
+      hi = lo;
+      break;
+    }
+    if( pivotSortClass(eType)!=pivotSortClass(pVec->eType) ){
+      *piLo = -1;
+      return;
+    }
+    switch( aSig[i*2+1] ){
+      case SQLITE_INDEX_CONSTRAINT_EQ: {
+        int iFirst = pivotValueSearch(pVec, aVal[i], 1);
+        int iLast = pivotValueSearch(pVec, aVal[i], 0);
+        if( iFirst>lo ) lo = iFirst;
+        if( iLast<hi ) hi = iLast;
+        break;
+      }
+      case SQLITE_INDEX_CONSTRAINT_GT:
+      case SQLITE_INDEX_CONSTRAINT_GE: {
+        int iFirst = pivotValueSearch(pVec, aVal[i], aSig[i*2+1]==SQLITE_INDEX_CONSTRAINT_GE);
+        if( iFirst>lo ) lo = iFirst;
+        break;
+      }
+      default: {
+        int iLast = pivotValueSearch(pVec, aVal[i], aSig[i*2+1]==SQLITE_INDEX_CONSTRAINT_LT);
+        if( iLast<hi ) hi = iLast;
+        break;
+      }
+    }
+  }
+  *piLo = lo;
+  *piHi = hi<lo ? lo : hi;
+}
+
+/*
+** Return true if the option name zName (nName bytes) is zOption.
+*/
+static int pivotOptionIs(const char *zName, int nName, const char *zOption){
+  return nName==(int)strlen(zOption) && sqlite3_strnicmp(zName, zOption, nName)==0;
+}
+
+/*
+** Parse a non-negative integer option value.
+*/
+static int pivotOptionInt(const char *zValue, int *piOut){
+  char *zEnd = 0;
+  long v = strtol(zValue, &zEnd, 10);
+  while( zEnd && isspace((unsigned char)*zEnd) ) zEnd++;
+  if( zEnd==zValue || zEnd==0 || *zEnd || v<0 || v>0x7fffffff ) return SQLITE_ERROR;
+  *piOut = (int)v;
+  return SQLITE_OK;
+}
+
+/*
+** Parse a "name=value" pivot table option into tab. Options follow the
+** pivot query in the virtual table arguments, and are documented in the
+** options table of README.md. Errors are returned with *pzErr set.
+*/
+static int pivotParseOption(pivot_vtab *tab, const char *zArg, char **pzErr){
+  const char *zEq;
+  const char *zValue;
+  int nName;
+
+  while( isspace((unsigned char)*zArg) ) zArg++;
+  zEq = strchr(zArg, '=');
+  if( zEq==0 ){
+    *pzErr = sqlite3_mprintf("Pivot table option error - expected name=value, got \"%s\".", zArg);
+    return SQLITE_ERROR;
+  }
+  nName = (int)(zEq-zArg);
+  while( nName>0 && isspace((unsigned char)zArg[nName-1]) ) nName--;
+  zValue = zEq+1;
+  while( isspace((unsigned char)*zValue) ) zValue++;
+
+  if( pivotOptionIs(zArg, nName, "row_cache") ){
+    if( pivotOptionInt(zValue, &tab->rowCache.nMax) ) goto bad_value;
+  }else if( pivotOptionIs(zArg, nName, "miss_cache") ){
+    if( pivotOptionInt(zValue, &tab->missCache.nMax) ) goto bad_value;
+  }else if( pivotOptionIs(zArg, nName, "param") || pivotOptionIs(zArg, nName, "as_of") ){
+    char **azParam;
+    if( tab->nParam>=PIVOT_VTAB_MAX_PARAMS || *zValue==0 ) goto bad_value;
+    if( pivotOptionIs(zArg, nName, "as_of") ){
+      if( tab->bAsOf ) goto bad_value;
+      tab->bAsOf = 1;
+    }
+    azParam = sqlite3_realloc(tab->azParam, (tab->nParam+1)*sizeof(char*));
+    if( azParam==0 ) return SQLITE_NOMEM;
+    tab->azParam = azParam;
+    azParam[tab->nParam] = sqlite3_mprintf("%s", zValue);
+    if( azParam[tab->nParam]==0 ) return SQLITE_NOMEM;
+    tab->nParam++;
+  }else if( pivotOptionIs(zArg, nName, "value_index") ){
+    char **azValueIndex;
+    if( *zValue==0 ) goto bad_value;
+    azValueIndex = sqlite3_realloc(tab->azValueIndex, (tab->nValueIndex+1)*sizeof(char*));
+    if( azValueIndex==0 ) return SQLITE_NOMEM;
+    tab->azValueIndex = azValueIndex;
+    azValueIndex[tab->nValueIndex] = sqlite3_mprintf("%s", zValue);
+    if( azValueIndex[tab->nValueIndex]==0 ) return SQLITE_NOMEM;
+    tab->nValueIndex++;
+  }else if( pivotOptionIs(zArg, nName, "delta_query") ){
+    sqlite3_free(tab->zDeltaSql);
+    tab->zDeltaSql = sqlite3_mprintf("SELECT * FROM \n%s", zValue);
+    if( tab->zDeltaSql==0 ) return SQLITE_NOMEM;
+    tab->bTrackDeps = 1;
+  }else if( pivotOptionIs(zArg, nName, "source") ){
+    sqlite3_free(tab->zSourceSql);
+    tab->zSourceSql = sqlite3_mprintf("SELECT * FROM \n%s", zValue);
+    if( tab->zSourceSql==0 ) return SQLITE_NOMEM;
+  }else if( pivotOptionIs(zArg, nName, "column_query") ){
+    sqlite3_free(tab->zColumnSql);
+    tab->zColumnSql = sqlite3_mprintf("SELECT * FROM \n%s", zValue);
+    if( tab->zColumnSql==0 ) return SQLITE_NOMEM;
+  }else if( pivotOptionIs(zArg, nName, "tile_rows") ){
+    if( pivotOptionInt(zValue, &tab->nTileRows) ) goto bad_value;
+  }else if( pivotOptionIs(zArg, nName, "create_index") ){
+    if( pivotOptionInt(zValue, &tab->bCreateIndex) || tab->bCreateIndex>1 ) goto bad_value;
+  }else if( pivotOptionIs(zArg, nName, "inner") ){
+    if( pivotOptionInt(zValue, &tab->bInner) || tab->bInner>1 ) goto bad_value;
+  }else if( pivotOptionIs(zArg, nName, "compress") ){
+    if( pivotOptionInt(zValue, &tab->bCompress) || tab->bCompress>1 ) goto bad_value;
+  }else if( pivotOptionIs(zArg, nName, "reference") ){
+    if( pivotOptionInt(zValue, &tab->bReference) || tab->bReference>1 ) goto bad_value;
+  }else if( pivotOptionIs(zArg, nName, "refresh_ms") ){
+    if( pivotOptionInt(zValue, &tab->nRefreshMs) ) goto bad_value;
+  }else if( pivotOptionIs(zArg, nName, "slow_scan_ms") ){
+    int nMs;
+    if( pivotOptionInt(zValue, &nMs) ) goto bad_value;
+    tab->nSlowScan = (sqlite3_int64)nMs*1000000;
+  }else if( pivotOptionIs(zArg, nName, "timing") ){
+    if( pivotOptionInt(zValue, &tab->bTiming) || tab->bTiming>1 ) goto bad_value;
+  }else if( pivotOptionIs(zArg, nName, "track_dependencies") ){
+    if( pivotOptionInt(zValue, &tab->bTrackDeps) || tab->bTrackDeps>1 ) goto bad_value;
+  }else{
+    *pzErr = sqlite3_mprintf("Pivot table option error - unknown option \"%.*s\".", nName, zArg);
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
+
+bad_value:
+  *pzErr = sqlite3_mprintf("Pivot table option error - invalid value for %.*s: \"%s\".", nName, zArg, zValue);
+  return SQLITE_ERROR;
+}
+
+#define PIVOT_VTAB_CONNECT_ERROR \
+  sqlite3_finalize(stmt_key_query); \
+  sqlite3_finalize(stmt_pivot_query); \
+  sqlite3_finalize(stmt_col_query); \
+  sqlite3_free(sql); \
+  sqlite3_free(pivot_query_sql); \
+  sqlite3_free(tab->key_sql_full_table_scan); \
+  sqlite3_free(zMsg); \
+  sqlite3_free_table(azData); \
+  sqlite3_free(sqlite3_str_finish(create_vtab_sql)); \
+  for( i=0; i<tab->nCol_key; i++ ) \
+    sqlite3_finalize(tab->col_stmt[i]); \
+  sqlite3_free(tab->col_stmt); \
+  for( i=0; i<tab->nCol_key; i++ ){ \
+    sqlite3_free(tab->aCol[i].zName); \
+    sqlite3_value_free(tab->aCol[i].pKey); \
+  } \
+  sqlite3_free(tab->aCol); \
+  for( i=0; i<tab->nRow_cols; i++ ) \
+    sqlite3_free(tab->key_sql_col_names[i]); \
+  sqlite3_free(tab->key_sql_col_names); \
+  pivotDepFree(tab->nDep, tab->aDep); \
+  sqlite3_finalize(tab->delta_stmt); \
+  sqlite3_free(tab->zDeltaSql); \
+  sqlite3_free(tab->zDeltaDb); \
+  sqlite3_free(tab->zDeltaTab); \
+  for( i=0; i<tab->nParam; i++ ) \
+    sqlite3_free(tab->azParam[i]); \
+  sqlite3_free(tab->azParam); \
+  for( i=0; i<tab->nValueIndex; i++ ) \
+    sqlite3_free(tab->azValueIndex[i]); \
+  sqlite3_free(tab->azValueIndex); \
+  sqlite3_finalize(tab->source_stmt); \
+  sqlite3_finalize(tab->column_stmt); \
+  sqlite3_free(tab->zColumnSql); \
+  sqlite3_finalize(tab->tile_stmt); \
+  sqlite3_finalize(tab->value_stmt); \
+  pivotRefreshFree(tab); \
+  sqlite3_free(tab->zSourceSql); \
+  for( i=0; i<tab->nCol_key && tab->azColKey; i++ ) \
+    sqlite3_free(tab->azColKey[i]); \
+  sqlite3_free(tab->azColKey); \
+  sqlite3_free(tab->anColKey); \
+  sqlite3_free(tab->aColNext); \
+  sqlite3_free(tab->aColHash); \
+  sqlite3_free(tab->aKeyType); \
+  sqlite3_free(tab->zAdvice); \
+  sqlite3_free(tab); \
+  return SQLITE_ERROR;
+
+/*
+** The pivotConnect() method is invoked to create a new
+** template virtual table.
+**
+** Think of this routine as the constructor for pivot_vtab objects.
+**
+** All this routine needs to do is:
+**
+**    (1) Allocate the pivot_vtab object and initialize all fields.
+**
+**    (2) Tell SQLite (via the sqlite3_declare_vtab() interface) what the
+**        result set of queries against the virtual table will look like.
+*/
+static int pivotConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  pivot_vtab *tab;
+  char *sql = 0;
+  char *pivot_query_sql = 0;
+  sqlite3_stmt *stmt_key_query = 0;
+  sqlite3_stmt *stmt_pivot_query = 0;
+  sqlite3_stmt *stmt_col_query = 0;
+  int rc;
+  int i, j;
+
+  sqlite3_str *create_vtab_sql = 0;
+  
+  tab = (pivot_vtab*)sqlite3_malloc(sizeof(pivot_vtab));
+  if( tab==0 ) return SQLITE_NOMEM;
+  memset(tab, 0, sizeof(*tab));
+  tab->db = db;
+  *ppVtab = (sqlite3_vtab*)tab;
+
+  // vars for sqlite3_get_table
+  int nRow = 0;
+  int nCol = 0;
+  char **azData = 0;
+  char *zMsg = 0;
+
+  if( argc<6 ){
+    *pzErr = sqlite3_mprintf("Pivot table expects a key query, a column definition query and a pivot query.");
+    sqlite3_free(tab);
+    return SQLITE_ERROR;
+  }
+
+  // Pivot table options
+  tab->rowCache.nMax = PIVOT_VTAB_ROW_CACHE;
+  tab->missCache.nMax = PIVOT_VTAB_MISS_CACHE;
+  for( i=6; i<argc; i++ ){
+    if( pivotParseOption(tab, argv[i], pzErr) ){
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+  }
+  if( tab->bReference ){
+    tab->rowCache.nMax = 0;
+    tab->missCache.nMax = 0;
+  }
+
+  // CREATE TABLE string
+  create_vtab_sql = sqlite3_str_new(db);
+  sqlite3_str_appendall(create_vtab_sql, "CREATE TABLE x(");
+
+  ///////////////////////////////////////////////////
+  // Pivot table key query
+  ///////////////////////////////////////////////////
+
+  tab->key_sql_full_table_scan =  sqlite3_mprintf("SELECT * FROM \n%s", argv[3]);
+  rc = sqlite3_prepare_v2(db, tab->key_sql_full_table_scan, -1, &stmt_key_query, 0);
+
+  // Validate pivot table key query
+  if( rc!=SQLITE_OK ){
+    *pzErr = sqlite3_mprintf("Pivot table key query prepare error - %s", sqlite3_errmsg(db));
+    PIVOT_VTAB_CONNECT_ERROR
+  }
+
+  // get row key columnn count
+  tab->nRow_cols = sqlite3_column_count(stmt_key_query);
+
+  // get row key column names
+  tab->key_sql_col_names = sqlite3_malloc(tab->nRow_cols*sizeof(char*));
+  memset(tab->key_sql_col_names, 0, tab->nRow_cols*sizeof(char*));
+
+  for( i=0; i<tab->nRow_cols; i++ ){
+    tab->key_sql_col_names[i] = sqlite3_mprintf("\"%w\"", sqlite3_column_name(stmt_key_query, i));
+    if( i>0 )
+      sqlite3_str_appendall(create_vtab_sql, ",");
+    sqlite3_str_appendf(create_vtab_sql, "%s", tab->key_sql_col_names[i]);
+  }
+
+  // Parameters are numbered after the row key columns and the column key
+  tab->nKeyParam = sqlite3_bind_parameter_count(stmt_key_query);
+  if( tab->nParam>0 && tab->nKeyParam>tab->nRow_cols+1+tab->nParam ){
+    *pzErr = sqlite3_mprintf("Pivot table key query error - Unexpected number of bound parameters.");
+    PIVOT_VTAB_CONNECT_ERROR
+  }
+
+  sqlite3_finalize(stmt_key_query);
+  stmt_key_query = 0;
+
+  ///////////////////////////////////////////////////
+  // Pivot query
+  ///////////////////////////////////////////////////
+
+  pivot_query_sql =  sqlite3_mprintf("SELECT * FROM \n%s", argv[5]);
+  rc = sqlite3_prepare_v2(db, pivot_query_sql, -1, &stmt_pivot_query, 0);
+
+  // Validate pivot query 
+  if( rc!=SQLITE_OK ){
+    *pzErr = sqlite3_mprintf("Pivot query prepare error - %s", sqlite3_errmsg(db));
+    PIVOT_VTAB_CONNECT_ERROR
+  }
+
+  tab->nRow_key = sqlite3_bind_parameter_count(stmt_pivot_query)-1;
+
+  // With parameters the column key is always ?N+1, where N is the number
+  // of row key columns
+  if( tab->nParam>0 && tab->nRow_key>tab->nRow_cols ){
+    if( tab->nRow_key>tab->nRow_cols+tab->nParam ){
+      *pzErr = sqlite3_mprintf("Pivot query error - Unexpected number of bound parameters.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    tab->nRow_key = tab->nRow_cols;
+  }
+
+  // Find the tables read by the key and pivot queries
+  if( tab->bTrackDeps ){
+    rc = pivotFindTables(db, tab->key_sql_full_table_scan, &tab->nDep, &tab->aDep, &tab->bTrackDeps);
+    if( rc==SQLITE_OK ){
+      rc = pivotFindTables(db, pivot_query_sql, &tab->nDep, &tab->aDep, &tab->bTrackDeps);
+    }
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table dependency error - %s", sqlite3_errmsg(db));
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+  }
+
+  ///////////////////////////////////////////////////
+  // Delta query
+  ///////////////////////////////////////////////////
+
+  if( tab->zDeltaSql ){
+    int nDeltaDep = 0;
+    pivot_dep *aDeltaDep = 0;
+    int bOk = 1;
+
+    rc = sqlite3_prepare_v2(db, tab->zDeltaSql, -1, &tab->delta_stmt, 0);
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table delta query prepare error - %s", sqlite3_errmsg(db));
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    if( sqlite3_column_count(tab->delta_stmt)!=tab->nRow_cols
+     || sqlite3_bind_parameter_count(tab->delta_stmt)!=1 ){
+      *pzErr = sqlite3_mprintf("Pivot table delta query error - expected %d result column(s) and 1 bound parameter.", tab->nRow_cols);
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    rc = pivotFindTables(db, tab->zDeltaSql, &nDeltaDep, &aDeltaDep, &bOk);
+    if( rc==SQLITE_OK && (nDeltaDep!=1 || !bOk) ){
+      pivotDepFree(nDeltaDep, aDeltaDep);
+      *pzErr = sqlite3_mprintf("Pivot table delta query error - the delta query must read exactly one table.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    if( rc!=SQLITE_OK ){
+      pivotDepFree(nDeltaDep, aDeltaDep);
+      *pzErr = sqlite3_mprintf("Pivot table delta query error - %s", sqlite3_errmsg(db));
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    tab->zDeltaDb = aDeltaDep[0].zDb;
+    tab->zDeltaTab = aDeltaDep[0].zTab;
+    sqlite3_free(aDeltaDep);
+  }
+
+  // Validate bound param count
+  if( tab->nRow_key > tab->nRow_cols ){
+    *pzErr = sqlite3_mprintf("Pivot table key query error - Unexpected number of bound parameters.");
+    PIVOT_VTAB_CONNECT_ERROR
+  }
+
+  ///////////////////////////////////////////////////
+  // Source query
+  ///////////////////////////////////////////////////
+
+  if( tab->zSourceSql ){
+    if( tab->nParam>tab->bAsOf ){
+      *pzErr = sqlite3_mprintf("Pivot table source query error - a source query cannot be used with parameter columns other than as_of.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    if( tab->bAsOf ){
+      sqlite3_str *as_of_sql;
+      char *zAsOfSql;
+
+      rc = sqlite3_prepare_v2(db, tab->zSourceSql, -1, &tab->source_stmt, 0);
+      if( rc!=SQLITE_OK ){
+        *pzErr = sqlite3_mprintf("Pivot table source query prepare error - %s", sqlite3_errmsg(db));
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+      if( sqlite3_column_count(tab->source_stmt)!=tab->nRow_key+3
+       || sqlite3_bind_parameter_count(tab->source_stmt)!=0 ){
+        *pzErr = sqlite3_mprintf("Pivot table source query error - expected %d result column(s) and no bound parameters.", tab->nRow_key+3);
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+      sqlite3_finalize(tab->source_stmt);
+      tab->source_stmt = 0;
+
+      // Keep the latest cell of each row and column at or before the
+      // cutoff, bound as ?N+2 - the bare value of a max() aggregate is
+      // that of the row with the maximum
+      as_of_sql = sqlite3_str_new(db);
+      sqlite3_str_appendall(as_of_sql, "WITH pivot_ticks(");
+      for( i=0; i<tab->nRow_key; i++ )
+        sqlite3_str_appendf(as_of_sql, "pivot_row_key%d,", i+1);
+      sqlite3_str_appendf(as_of_sql, "pivot_column_key,pivot_time,pivot_value) AS (%s)\nSELECT ", tab->zSourceSql);
+      for( i=0; i<tab->nRow_key; i++ )
+        sqlite3_str_appendf(as_of_sql, "pivot_row_key%d,", i+1);
+      sqlite3_str_appendall(as_of_sql, "pivot_column_key,pivot_value FROM (SELECT *, max(pivot_time) FROM pivot_ticks");
+      sqlite3_str_appendf(as_of_sql, " WHERE pivot_time <= ?%d GROUP BY ", tab->nRow_key+2);
+      for( i=0; i<tab->nRow_key; i++ )
+        sqlite3_str_appendf(as_of_sql, "pivot_row_key%d,", i+1);
+      sqlite3_str_appendall(as_of_sql, "pivot_column_key)");
+      zAsOfSql = sqlite3_str_finish(as_of_sql);
+      if( zAsOfSql==0 ){
+        *pzErr = sqlite3_mprintf("Pivot table source query error - out of memory.");
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+      sqlite3_free(tab->zSourceSql);
+      tab->zSourceSql = zAsOfSql;
+    }
+    rc = sqlite3_prepare_v2(db, tab->zSourceSql, -1, &tab->source_stmt, 0);
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table source query prepare error - %s", sqlite3_errmsg(db));
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    if( sqlite3_column_count(tab->source_stmt)!=tab->nRow_key+2
+     || sqlite3_bind_parameter_count(tab->source_stmt)!=(tab->bAsOf ? tab->nRow_key+2 : 0) ){
+      *pzErr = sqlite3_mprintf("Pivot table source query error - expected %d result column(s) and no bound parameters.", tab->nRow_key+2);
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    tab->aKeyType = sqlite3_malloc((tab->nRow_key+1)*sizeof(pivot_keytype));
+    if( tab->aKeyType==0 ){
+      *pzErr = sqlite3_mprintf("Pivot table source query error - out of memory.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    for( i=0; i<=tab->nRow_key; i++ ){
+      if( pivotKeyTypeOf(db, tab->source_stmt, i, &tab->aKeyType[i], &zMsg) ){
+        *pzErr = sqlite3_mprintf("Pivot table source query error - %s", zMsg);
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+    }
+    rc = sqlite3_prepare_v2(db, "SELECT ?1", -1, &tab->value_stmt, 0);
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table source query prepare error - %s", sqlite3_errmsg(db));
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    if( tab->bTrackDeps ){
+      rc = pivotFindTables(db, tab->zSourceSql, &tab->nDep, &tab->aDep, &tab->bTrackDeps);
+      if( rc!=SQLITE_OK ){
+        *pzErr = sqlite3_mprintf("Pivot table dependency error - %s", sqlite3_errmsg(db));
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+    }
+
+    // The tile query reads the cells of a tile - the row keys are bound
+    // as ?1..?N and the column keys as ?N+1, each as a JSON array, and an
+    // as-of cutoff stays ?N+2
+    if( tab->nTileRows>0 ){
+      sqlite3_str *tile_sql = sqlite3_str_new(db);
+      char *zTileSql;
+      sqlite3_str_appendall(tile_sql, "WITH pivot_source(");
+      for( i=0; i<tab->nRow_key; i++ )
+        sqlite3_str_appendf(tile_sql, "pivot_row_key%d,", i+1);
+      sqlite3_str_appendf(tile_sql, "pivot_column_key,pivot_value) AS (%s)\n", tab->zSourceSql);
+      sqlite3_str_appendall(tile_sql, "SELECT * FROM pivot_source WHERE ");
+      for( i=0; i<tab->nRow_key; i++ )
+        sqlite3_str_appendf(tile_sql, "pivot_row_key%d IN (SELECT value FROM json_each(?%d)) AND ", i+1, i+1);
+      sqlite3_str_appendf(tile_sql, "pivot_column_key IN (SELECT value FROM json_each(?%d))", tab->nRow_key+1);
+      zTileSql = sqlite3_str_finish(tile_sql);
+      if( zTileSql==0 ){
+        *pzErr = sqlite3_mprintf("Pivot table tile query error - out of memory.");
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+      rc = sqlite3_prepare_v2(db, zTileSql, -1, &tab->tile_stmt, 0);
+      sqlite3_free(zTileSql);
+      if( rc!=SQLITE_OK ){
+        *pzErr = sqlite3_mprintf("Pivot table tile query prepare error - %s", sqlite3_errmsg(db));
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+    }
+
+    // Background refreshes run the source query on a connection of their
+    // own to the database file
+    if( tab->nRefreshMs>0 ){
+      const char *zFile = sqlite3_db_filename(db, "main");
+      if( tab->bAsOf || tab->nValueIndex>0 || tab->zDeltaSql ){
+        *pzErr = sqlite3_mprintf("Pivot table option error - refresh_ms cannot be used with as_of, value_index or delta_query.");
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+#ifndef PIVOT_VTAB_THREADS
+      *pzErr = sqlite3_mprintf("Pivot table option error - refresh_ms is not available in this build.");
+      PIVOT_VTAB_CONNECT_ERROR
+#endif
+      if( sqlite3_threadsafe()==0 ){
+        *pzErr = sqlite3_mprintf("Pivot table option error - refresh_ms requires a threadsafe SQLite.");
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+      if( zFile==0 || zFile[0]==0 ){
+        *pzErr = sqlite3_mprintf("Pivot table option error - refresh_ms requires a database file.");
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+      tab->pRefresh = sqlite3_malloc(sizeof(pivot_refresh));
+      if( tab->pRefresh ){
+        memset(tab->pRefresh, 0, sizeof(pivot_refresh));
+        tab->pRefresh->tab = tab;
+        tab->pRefresh->nWindow = (sqlite3_int64)tab->nRefreshMs*1000000;
+        tab->pRefresh->zFile = sqlite3_mprintf("%s", zFile);
+        tab->pRefresh->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+      }
+      if( tab->pRefresh==0 || tab->pRefresh->zFile==0 || tab->pRefresh->mutex==0 ){
+        *pzErr = sqlite3_mprintf("Pivot table option error - out of memory.");
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+
+      // The worker's connection sees neither the temp and attached
+      // databases nor the functions of this one, so check that the source
+      // query prepares on it. A busy database is left to the worker.
+      rc = sqlite3_open_v2(zFile, &tab->pRefresh->db, SQLITE_OPEN_READONLY, 0);
+      if( rc==SQLITE_OK ){
+        sqlite3_stmt *stmt_check = 0;
+        sqlite3_busy_timeout(tab->pRefresh->db, tab->nRefreshMs);
+        rc = sqlite3_prepare_v2(tab->pRefresh->db, tab->zSourceSql, -1, &stmt_check, 0);
+        sqlite3_finalize(stmt_check);
+        if( rc==SQLITE_BUSY || rc==SQLITE_LOCKED ) rc = SQLITE_OK;
+      }
+      if( rc!=SQLITE_OK ){
+        *pzErr = sqlite3_mprintf("Pivot table refresh_ms error - the source query cannot run on a connection of its own: %s",
+          tab->pRefresh->db ? sqlite3_errmsg(tab->pRefresh->db) : sqlite3_errstr(rc)
+        );
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+    }
+  }else if( tab->bAsOf ){
+    *pzErr = sqlite3_mprintf("Pivot table option error - as_of requires a source query.");
+    PIVOT_VTAB_CONNECT_ERROR
+  }else if( tab->nTileRows>0 ){
+    *pzErr = sqlite3_mprintf("Pivot table option error - tile_rows requires a source query.");
+    PIVOT_VTAB_CONNECT_ERROR
+  }else if( tab->nRefreshMs>0 ){
+    *pzErr = sqlite3_mprintf("Pivot table option error - refresh_ms requires a source query.");
+    PIVOT_VTAB_CONNECT_ERROR
+  }
+
+  ///////////////////////////////////////////////////
+  // Column query
+  ///////////////////////////////////////////////////
+
+  if( tab->zColumnSql ){
+    if( tab->nParam>0 || tab->zSourceSql ){
+      *pzErr = sqlite3_mprintf("Pivot table column query error - a column query cannot be used with parameter columns or a source query.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    rc = sqlite3_prepare_v2(db, tab->zColumnSql, -1, &tab->column_stmt, 0);
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table column query prepare error - %s", sqlite3_errmsg(db));
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    if( sqlite3_column_count(tab->column_stmt)!=tab->nRow_key+1
+     || sqlite3_bind_parameter_count(tab->column_stmt)!=1 ){
+      *pzErr = sqlite3_mprintf("Pivot table column query error - expected %d result column(s) and 1 bound parameter.", tab->nRow_key+1);
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    tab->aKeyType = sqlite3_malloc(tab->nRow_key*sizeof(pivot_keytype)+1);
+    if( tab->aKeyType==0 ){
+      *pzErr = sqlite3_mprintf("Pivot table column query error - out of memory.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    for( i=0; i<tab->nRow_key; i++ ){
+      if( pivotKeyTypeOf(db, tab->column_stmt, i, &tab->aKeyType[i], &zMsg) ){
+        *pzErr = sqlite3_mprintf("Pivot table column query error - %s", zMsg);
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+    }
+    rc = sqlite3_prepare_v2(db, "SELECT ?1", -1, &tab->value_stmt, 0);
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table column query prepare error - %s", sqlite3_errmsg(db));
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    if( tab->bTrackDeps ){
+      rc = pivotFindTables(db, tab->zColumnSql, &tab->nDep, &tab->aDep, &tab->bTrackDeps);
+      if( rc!=SQLITE_OK ){
+        *pzErr = sqlite3_mprintf("Pivot table dependency error - %s", sqlite3_errmsg(db));
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+    }
+  }
+
+  sqlite3_finalize(stmt_pivot_query);
+  stmt_pivot_query = 0;
+
+  ///////////////////////////////////////////////////
+  // Pivot table column definition query
+  ///////////////////////////////////////////////////
+
+  sql =  sqlite3_mprintf("SELECT * FROM \n%s", argv[4]);
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt_col_query, 0);
+
+  // Validate pivot table column definition query
+  if( rc!=SQLITE_OK ){
+    *pzErr = sqlite3_mprintf("Pivot table column definition query prepare error - %s", sqlite3_errmsg(db));
+    PIVOT_VTAB_CONNECT_ERROR
+  }
+
+  // Validate pivot table column definition query count == 2
+  if( sqlite3_column_count(stmt_col_query) != 2 ){
+    *pzErr = sqlite3_mprintf("Pivot table column definition query expects 2 result column. Query contains %d columns.", sqlite3_column_count(stmt_col_query));
+    PIVOT_VTAB_CONNECT_ERROR
+  }
+  
+  // Validate pivot columns for uniqueness
+  rc = sqlite3_get_table(db, sql, &azData, &nRow, &nCol, &zMsg);
+
+  if( rc!=SQLITE_OK ){
+    *pzErr = sqlite3_mprintf("%s", zMsg);
+    PIVOT_VTAB_CONNECT_ERROR
+  }
+
+  // Row 0 of azData holds the column names. A NULL key only duplicates
+  // another NULL key, and a NULL name is the empty name it is declared as.
+  if( nRow > 1 ){
+    for( i=1; i<nRow; i++ ){
+      for( j=i+1; j<=nRow; j++ ){
+        if( azData[i*nCol] ? azData[j*nCol] && !strcmp(azData[i*nCol], azData[j*nCol]) : azData[j*nCol]==0 ){
+          *pzErr = sqlite3_mprintf("Pivot table column keys must be unique. Duplicate column key \"%s\".", azData[i*nCol]);
+          PIVOT_VTAB_CONNECT_ERROR
+        }
+        if( !sqlite3_stricmp(azData[i*nCol+1] ? azData[i*nCol+1] : "", azData[j*nCol+1] ? azData[j*nCol+1] : "") ){
+          *pzErr = sqlite3_mprintf("Pivot table column names must be unique. Duplicate column \"%s\".", azData[i*nCol+1]);
+          PIVOT_VTAB_CONNECT_ERROR
+        }
+      }
+    }
+  }
+  sqlite3_free_table(azData);
+  azData = 0;
+  sqlite3_free(sql);
+  sql = 0;
+
+  ///////////////////////////////////////////////////
+  // Inner pivot - semi-join the key query on the source query
+  ///////////////////////////////////////////////////
+
+  if( tab->bInner ){
+    sqlite3_str *inner_sql;
+    char *key_sql;
+
+    if( tab->zSourceSql==0 ){
+      *pzErr = sqlite3_mprintf("Pivot table option error - inner=1 requires a source query.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    if( tab->bAsOf ){
+      *pzErr = sqlite3_mprintf("Pivot table option error - inner=1 cannot be used with as_of.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+
+    // Keep only the rows of the key query with at least one non-null cell
+    // in the source query
+    inner_sql = sqlite3_str_new(db);
+    sqlite3_str_appendall(inner_sql, "WITH pivot_source(");
+    for( i=0; i<tab->nRow_key; i++ )
+      sqlite3_str_appendf(inner_sql, "pivot_row_key%d,", i+1);
+    sqlite3_str_appendf(inner_sql, "pivot_column_key,pivot_value) AS (%s),\n", tab->zSourceSql);
+    sqlite3_str_appendf(inner_sql, "pivot_columns(pivot_column_key,pivot_column_name) AS (SELECT * FROM \n%s)\n", argv[4]);
+    sqlite3_str_appendf(inner_sql, "SELECT * FROM (SELECT * FROM \n%s AS pivot_key\n WHERE EXISTS (SELECT 1 FROM pivot_source WHERE ", argv[3]);
+    for( i=0; i<tab->nRow_key; i++ )
+      sqlite3_str_appendf(inner_sql, "pivot_source.pivot_row_key%d = pivot_key.%s AND ", i+1, tab->key_sql_col_names[i]);
+    sqlite3_str_appendall(inner_sql, "pivot_source.pivot_value IS NOT NULL AND pivot_source.pivot_column_key IN (SELECT pivot_column_key FROM pivot_columns)))");
+    key_sql = sqlite3_str_finish(inner_sql);
+    if( key_sql==0 ){
+      *pzErr = sqlite3_mprintf("Pivot table inner query error - out of memory.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    sqlite3_free(tab->key_sql_full_table_scan);
+    tab->key_sql_full_table_scan = key_sql;
+
+    rc = sqlite3_prepare_v2(db, key_sql, -1, &stmt_key_query, 0);
+    if( rc==SQLITE_OK ){
+      tab->nKeyParam = sqlite3_bind_parameter_count(stmt_key_query);
+      if( tab->bTrackDeps ){
+        rc = pivotFindTables(db, key_sql, &tab->nDep, &tab->aDep, &tab->bTrackDeps);
+      }
+    }
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table inner query error - %s", sqlite3_errmsg(db));
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    sqlite3_finalize(stmt_key_query);
+    stmt_key_query = 0;
+  }
+
+  // A row key known to hold unique integers doubles as the rowid
+  if( tab->nRow_cols==1 ){
+    rc = pivotKeyIsRowid(db, tab->key_sql_full_table_scan, &tab->bKeyRowid);
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table key query error - %s", sqlite3_errmsg(db));
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+  }
+
+  ///////////////////////////////////////////////////
+  // Construct remainder of vtab definition
+  ///////////////////////////////////////////////////
+
+  tab->nCol_key = 0;
+  while( sqlite3_step(stmt_col_query)==SQLITE_ROW ){
+    pivot_column *aCol = sqlite3_realloc(tab->aCol, (tab->nCol_key+1)*sizeof(pivot_column));
+    if( aCol==0 ){
+      *pzErr = sqlite3_mprintf("Pivot table column definition error - out of memory.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    tab->aCol = aCol;
+    memset(&aCol[tab->nCol_key], 0, sizeof(pivot_column));
+    aCol[tab->nCol_key].zName = sqlite3_mprintf("%s", sqlite3_column_text(stmt_col_query, 1));
+    aCol[tab->nCol_key].pKey = sqlite3_value_dup(sqlite3_column_value(stmt_col_query, 0));
+    tab->nCol_key++;
+    tab->col_stmt = sqlite3_realloc(tab->col_stmt, tab->nCol_key*sizeof(sqlite3_stmt*));
+    
+    // prepare pivot col stmt
+    sqlite3_prepare_v2(db, pivot_query_sql, -1, &(tab->col_stmt[tab->nCol_key-1]), 0);
+    sqlite3_bind_value(tab->col_stmt[tab->nCol_key-1], tab->nRow_key+1, sqlite3_column_value(stmt_col_query, 0));
+    sqlite3_str_appendf(create_vtab_sql, ",\"%w\"", sqlite3_column_text(stmt_col_query, 1));
+  }
+
+  // Serialize the column keys as the source query compares them, to map
+  // source query rows to columns
+  if( tab->zSourceSql ){
+    tab->azColKey = sqlite3_malloc((tab->nCol_key+1)*sizeof(char*));
+    tab->anColKey = sqlite3_malloc((tab->nCol_key+1)*sizeof(int));
+    if( tab->azColKey==0 || tab->anColKey==0 ){
+      *pzErr = sqlite3_mprintf("Pivot table source query error - out of memory.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    memset(tab->azColKey, 0, (tab->nCol_key+1)*sizeof(char*));
+    for( i=0; i<tab->nCol_key; i++ ){
+      if( pivotKeyBuild(db, &tab->aKeyType[tab->nRow_key], 1, &tab->aCol[i].pKey, 0,
+                        &tab->azColKey[i], &tab->anColKey[i]) ){
+        *pzErr = sqlite3_mprintf("Pivot table source query error - out of memory.");
+        PIVOT_VTAB_CONNECT_ERROR
+      }
+      if( tab->azColKey[i]==0 ) tab->anColKey[i] = -1;
+    }
+    if( pivotColHashBuild(tab)!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table source query error - out of memory.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+  }
+  sqlite3_finalize(stmt_col_query);
+  sqlite3_free(pivot_query_sql);
+  stmt_col_query = 0;
+  pivot_query_sql = 0;
+
+  // Value indexes are built from the source scan
+  for( i=0; i<tab->nValueIndex; i++ ){
+    for( j=0; j<tab->nCol_key; j++ ){
+      if( sqlite3_stricmp(tab->aCol[j].zName, tab->azValueIndex[i])==0 ) break;
+    }
+    if( tab->zSourceSql==0 ){
+      *pzErr = sqlite3_mprintf("Pivot table option error - value_index requires a source query.");
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    if( j==tab->nCol_key ){
+      *pzErr = sqlite3_mprintf("Pivot table option error - value_index column \"%s\" is not a pivot column.", tab->azValueIndex[i]);
+      PIVOT_VTAB_CONNECT_ERROR
+    }
+    tab->aCol[j].bValueIndex = 1;
+  }
+  if( tab->nValueIndex>0 ) pivotValueRebindCheck(db, tab);
+
+  for( i=0; i<tab->nParam; i++ )
+    sqlite3_str_appendf(create_vtab_sql, ",\"%w\" HIDDEN", tab->azParam[i]);
+  sqlite3_str_appendall(create_vtab_sql, ")");
+  
+  sql = sqlite3_str_finish(create_vtab_sql);
+  // printf("%s\n", sql);
+  rc = sqlite3_declare_vtab(db, sql);
+  sqlite3_free(sql);
+
+  // Register with the per-connection state
+  if( rc==SQLITE_OK ){
+    tab->zName = sqlite3_mprintf("%s", argv[2]);
+    tab->zDb = sqlite3_mprintf("%s", argv[1]);
+    tab->pGlobal = (pivot_global*)pAux;
+    tab->pNext = tab->pGlobal->pVtab;
+    tab->pGlobal->pVtab = tab;
+  }
+  
+  return rc;
+}
+
+static int pivotDisconnect(sqlite3_vtab *pVtab);
+static void pivotReaderDetach(pivot_vtab *tab);
+
+/*
+** The xConnect and xCreate methods do the same thing, but they must be
+** different so that the virtual table is not an eponymous virtual table.
+*/
+static int pivotCreate(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  pivot_vtab *tab;
+  int rc = pivotConnect(db, pAux, argc, argv, ppVtab, pzErr);
+  if( rc!=SQLITE_OK ) return rc;
+
+  // Create the advised indexes if asked to. This is only done when the
+  // table is created, not every time it is connected.
+  tab = (pivot_vtab*)*ppVtab;
+  if( tab->bCreateIndex && pivotAdvise(tab)==SQLITE_OK && tab->zAdvice ){
+    char *zErr = 0;
+    rc = sqlite3_exec(db, tab->zAdvice, 0, 0, &zErr);
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("Pivot table create_index error - %s", zErr);
+      sqlite3_free(zErr);
+      pivotDisconnect(*ppVtab);
+      *ppVtab = 0;
+      return rc;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Implementation of pivot xRename method.
+*/
+static int pivotRename(
+  sqlite3_vtab *pVtab, // Virtual table handle
+  const char *zName    // New name of table
+){
+  pivot_vtab *tab = (pivot_vtab*)pVtab;
+  char *zNew = sqlite3_mprintf("%s", zName);
+  if( zNew==0 ) return SQLITE_NOMEM;
+  sqlite3_free(tab->zName);
+  tab->zName = zNew;
+  return SQLITE_OK;
+}
+
+/*
+** This method is the destructor for pivot_vtab objects.
+*/
+static int pivotDisconnect(sqlite3_vtab *pVtab){
+  pivot_vtab *tab = (pivot_vtab*)pVtab;
+
+  int i;
+
+  // Readers scan through the table, and must not outlive it
+  pivotReaderDetach(tab);
+
+  // The refresh worker reads the table definition
+  pivotRefreshFree(tab);
+
+  for( i=0; i<tab->nCol_key; i++ )
+    sqlite3_finalize(tab->col_stmt[i]);
+  sqlite3_free(tab->col_stmt);
+
+  for( i=0; i<tab->nCol_key; i++ ){
+    sqlite3_free(tab->aCol[i].zName);
+    sqlite3_value_free(tab->aCol[i].pKey);
+  }
+  sqlite3_free(tab->aCol);
+
+  for( i=0; i<tab->nRow_cols; i++ )
+    sqlite3_free(tab->key_sql_col_names[i]);
+  sqlite3_free(tab->key_sql_col_names);
+
+  sqlite3_free(tab->key_sql_full_table_scan);
+
+  for( i=0; i<tab->nParam; i++ )
+    sqlite3_free(tab->azParam[i]);
+  sqlite3_free(tab->azParam);
+  for( i=0; i<tab->nValueIndex; i++ )
+    sqlite3_free(tab->azValueIndex[i]);
+  sqlite3_free(tab->azValueIndex);
+
+  for( i=0; i<tab->nPlan; i++ ){
+    sqlite3_free(tab->aPlan[i].aSig);
+    sqlite3_free(tab->aPlan[i].zSql);
+    sqlite3_free(tab->aPlan[i].zValueSql);
+    sqlite3_free(tab->aPlan[i].aPoint);
+    sqlite3_finalize(tab->aPlan[i].stmt);
+  }
+  sqlite3_free(tab->aPlan);
+
+  pivotLruFree(tab, &tab->rowCache);
+  pivotLruFree(tab, &tab->missCache);
+
+  pivotDepFree(tab->nDep, tab->aDep);
+  sqlite3_finalize(tab->delta_stmt);
+  sqlite3_free(tab->zDeltaSql);
+  sqlite3_free(tab->zDeltaDb);
+  sqlite3_free(tab->zDeltaTab);
+  sqlite3_free(tab->aDelta);
+
+  pivotScanFlush(tab, &tab->source);
+  sqlite3_free(tab->source.aVec);
+  sqlite3_finalize(tab->source_stmt);
+  sqlite3_finalize(tab->column_stmt);
+  sqlite3_free(tab->zColumnSql);
+  sqlite3_finalize(tab->tile_stmt);
+  sqlite3_finalize(tab->value_stmt);
+  sqlite3_free(tab->zSourceSql);
+  for( i=0; i<tab->nCol_key && tab->azColKey; i++ )
+    sqlite3_free(tab->azColKey[i]);
+  sqlite3_free(tab->azColKey);
+  sqlite3_free(tab->anColKey);
+  sqlite3_free(tab->aColNext);
+  sqlite3_free(tab->aColHash);
+  sqlite3_free(tab->aKeyType);
+  sqlite3_free(tab->zAdvice);
+
+  // Unregister from the per-connection state
+  if( tab->pGlobal ){
+    pivot_vtab **pp;
+    for( pp=&tab->pGlobal->pVtab; *pp; pp=&(*pp)->pNext ){
+      if( *pp==tab ){
+        *pp = tab->pNext;
+        break;
+      }
+    }
+    if( tab->pGlobal->pVtab==0 ) pivotGlobalFinalize(tab->pGlobal);
+  }
+  sqlite3_free(tab->zName);
+  sqlite3_free(tab->zDb);
+
+  sqlite3_free(tab);
+  return SQLITE_OK;
+}
+
+/*
+** Constructor for a new pivot_cursor object.
+*/
+static int pivotOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCur){
+  pivot_vtab *tab = (pivot_vtab*)pVtab;
+  pivot_cursor *cur;
+  cur = sqlite3_malloc( sizeof(*cur) );
+  if( cur==0 ) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(*cur));
+  cur->iPlan = -1;
+  cur->rc = SQLITE_DONE;
+  cur->pivot_key = sqlite3_malloc(tab->nRow_cols*sizeof(sqlite3_value*));
+  if( cur->pivot_key==0 ){
+    sqlite3_free(cur);
+    return SQLITE_NOMEM;
+  }
+  memset(cur->pivot_key, 0, tab->nRow_cols*sizeof(sqlite3_value*));
+  if( tab->nParam>0 ){
+    cur->aParam = sqlite3_malloc(tab->nParam*sizeof(sqlite3_value*));
+    if( cur->aParam==0 ){
+      sqlite3_free(cur->pivot_key);
+      sqlite3_free(cur);
+      return SQLITE_NOMEM;
+    }
+    memset(cur->aParam, 0, tab->nParam*sizeof(sqlite3_value*));
+  }
+  if( tab->nTileRows>0 ){
+    cur->aTileDone = sqlite3_malloc((tab->nCol_key+7)/8+1);
+    cur->aTileUsed = sqlite3_malloc((tab->nCol_key+7)/8+1);
+    cur->aTileReads = sqlite3_malloc(tab->nCol_key*sizeof(int)+1);
+    if( cur->aTileDone==0 || cur->aTileUsed==0 || cur->aTileReads==0 ){
+      sqlite3_free(cur->aTileDone);
+      sqlite3_free(cur->aTileUsed);
+      sqlite3_free(cur->aTileReads);
+      sqlite3_free(cur->aParam);
+      sqlite3_free(cur->pivot_key);
+      sqlite3_free(cur);
+      return SQLITE_NOMEM;
+    }
+  }
+  *ppCur = &cur->base;
+  return SQLITE_OK;
+}
+
+/*
+** Free the current row key values of a cursor.
+*/
+static void pivotCursorClearKey(pivot_vtab *tab, pivot_cursor *cur){
+  int i;
+  for( i=0; i<tab->nRow_cols; i++ ){
+    sqlite3_value_free(cur->pivot_key[i]);
+    cur->pivot_key[i] = 0;
+  }
+}
+
+/*
+** Free the parameter values of a cursor.
+*/
+static void pivotCursorClearParams(pivot_vtab *tab, pivot_cursor *cur){
+  int i;
+  for( i=0; i<tab->nParam; i++ ){
+    sqlite3_value_free(cur->aParam[i]);
+    cur->aParam[i] = 0;
+  }
+}
+
+/*
+** Bind the parameter values of a cursor to a key query or pivot query
+** stmt. Parameters follow the row key values and the column key.
+** Unconstrained parameters are bound to NULL.
+*/
+static void pivotBindParams(pivot_vtab *tab, pivot_cursor *cur, sqlite3_stmt *stmt){
+  int i;
+  for( i=0; i<tab->nParam; i++ ){
+    if( cur->aParam[i] ){
+      sqlite3_bind_value(stmt, tab->nRow_cols+2+i, cur->aParam[i]);
+    }else{
+      sqlite3_bind_null(stmt, tab->nRow_cols+2+i);
+    }
+  }
+}
+
+/*
+** Release the key query stmt held by a cursor. Stmts prepared for a
+** memoized plan are reset and handed back to the plan for reuse by the
+** next pivotFilter() call, unless the plan already holds an idle stmt.
+*/
+static void pivotCursorReleaseStmt(pivot_vtab *tab, pivot_cursor *cur){
+  pivot_plan *plan;
+  sqlite3_free(cur->zMatch);
+  sqlite3_free(cur->aMatch);
+  cur->zMatch = 0;
+  cur->aMatch = 0;
+  cur->nMatch = 0;
+  if( cur->stmt==0 ) return;
+  plan = cur->iPlan>=0 ? &tab->aPlan[cur->iPlan] : 0;
+  if( plan && plan->stmt==0 ){
+    sqlite3_reset(cur->stmt);
+    sqlite3_clear_bindings(cur->stmt);
+    plan->stmt = cur->stmt;
+  }else{
+    sqlite3_finalize(cur->stmt);
+  }
+  cur->stmt = 0;
+  cur->iPlan = -1;
+}
+
+/*
+** Append value pVal to pStr as an SQL literal of its type.
+*/
+static void pivotAppendLiteral(sqlite3_str *pStr, sqlite3_value *pVal){
+  const unsigned char *a;
+  int n, i;
+  switch( sqlite3_value_type(pVal) ){
+    case SQLITE_INTEGER:
+      sqlite3_str_appendf(pStr, "%lld", sqlite3_value_int64(pVal));
+      break;
+    case SQLITE_FLOAT:
+      sqlite3_str_appendf(pStr, "%!.15g", sqlite3_value_double(pVal));
+      break;
+    case SQLITE_TEXT:
+      sqlite3_str_appendf(pStr, "%Q", sqlite3_value_text(pVal));
+      break;
+    case SQLITE_BLOB:
+      a = (const unsigned char*)sqlite3_value_blob(pVal);
+      n = sqlite3_value_bytes(pVal);
+      sqlite3_str_appendall(pStr, "X'");
+      for( i=0; i<n; i++ ) sqlite3_str_appendf(pStr, "%02X", a[i]);
+      sqlite3_str_appendchar(pStr, 1, '\'');
+      break;
+    default:
+      sqlite3_str_appendall(pStr, "NULL");
+      break;
+  }
+}
+
+/*
+** End the current scan of a cursor, whether it ran to EOF or was
+** abandoned, and record its duration. Scans slower than the slow_scan_ms
+** option are logged with sqlite3_log().
+*/
+static void pivotScanEnd(pivot_vtab *tab, pivot_cursor *cur){
+  sqlite3_int64 nTime;
+
+  if( cur->iScanStart ){
+    nTime = pivotTimeNs()-cur->iScanStart;
+    pivotHistAdd(tab->aHist[PIVOT_HIST_SCAN], nTime);
+    if( tab->nSlowScan>0 && nTime>=tab->nSlowScan ){
+      sqlite3_log(SQLITE_WARNING,
+        "pivot_vtab %s: slow scan of %.3f ms, %lld rows, %lld cells, args (%s): %s",
+        tab->zName, nTime/1e6, cur->nScanRow, cur->nScanCell,
+        cur->zScanArgs ? cur->zScanArgs : "",
+        cur->zScanSql ? cur->zScanSql : "(row cache)"
+      );
+    }
+  }
+  sqlite3_free(cur->zScanSql);
+  sqlite3_free(cur->zScanArgs);
+  cur->zScanSql = 0;
+  cur->zScanArgs = 0;
+  cur->iScanStart = 0;
+}
+
+/*
+** Record the progress of the current scan after the cursor has been
+** positioned on its next row, or past the last one.
+*/
+static void pivotScanProgress(pivot_vtab *tab, pivot_cursor *cur){
+  if( cur->iScanStart==0 ) return;
+  if( cur->rc!=SQLITE_ROW ){
+    pivotScanEnd(tab, cur);
+    return;
+  }
+  if( cur->nScanRow==0 ){
+    pivotHistAdd(tab->aHist[PIVOT_HIST_FIRST_ROW], pivotTimeNs()-cur->iScanStart);
+  }
+  cur->nScanRow++;
+}
+
+/*
+** Free the row keys of the current tile of a cursor.
+*/
+static void pivotTileClear(pivot_vtab *tab, pivot_cursor *cur){
+  pivotScanFlush(tab, &cur->tile);
+  sqlite3_free(cur->aTileHead);
+  sqlite3_free(cur->aTileNext);
+  cur->aTileHead = 0;
+  cur->aTileNext = 0;
+}
+
+/*
+** Destructor for a pivot_cursor.
+*/
+static int pivotClose(sqlite3_vtab_cursor *pCur){
+  pivot_vtab *tab = (pivot_vtab*)pCur->pVtab;
+  pivot_cursor *cur = (pivot_cursor*)pCur;
+
+  pivotScanEnd(tab, cur);
+  pivotCursorClearKey(tab, cur);
+  sqlite3_free(cur->pivot_key);
+  if( cur->aParam ){
+    pivotCursorClearParams(tab, cur);
+    sqlite3_free(cur->aParam);
+  }
+  pivotCursorReleaseStmt(tab, cur);
+  if( cur->pEntry ) pivotEntryRelease(tab, cur->pEntry);
+  pivotSnapshotRelease(tab, cur->pSnapshot);
+  pivotTileClear(tab, cur);
+  sqlite3_free(cur->aTileDone);
+  sqlite3_free(cur->aTileUsed);
+  sqlite3_free(cur->aTileReads);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+/*
+** Bind the row key values of the current match of a value index scan to
+** the last parameters of the key query of cur.
+*/
+static void pivotCursorBindMatch(pivot_vtab *tab, pivot_cursor *cur){
+  const char *z = &cur->zMatch[cur->aMatch[cur->iMatch]];
+  const char *zEnd = &cur->zMatch[cur->aMatch[cur->iMatch+1]];
+  int iParam = sqlite3_bind_parameter_count(cur->stmt)-tab->nRow_key+1;
+  sqlite3_int64 iVal;
+  double rVal;
+  int n;
+
+  while( z<zEnd ){
+    switch( *z++ ){
+      case SQLITE_INTEGER:
+        memcpy(&iVal, z, sizeof(iVal));
+        sqlite3_bind_int64(cur->stmt, iParam, iVal);
+        z += sizeof(iVal);
+        break;
+      case SQLITE_FLOAT:
+        memcpy(&rVal, z, sizeof(rVal));
+        sqlite3_bind_double(cur->stmt, iParam, rVal);
+        z += sizeof(rVal);
+        break;
+      case SQLITE_TEXT:
+      case SQLITE_BLOB:
+        memcpy(&n, z, sizeof(n));
+        if( z[-1]==SQLITE_TEXT ){
+          sqlite3_bind_text(cur->stmt, iParam, z+sizeof(n), n, SQLITE_STATIC);
+        }else{
+          sqlite3_bind_blob(cur->stmt, iParam, z+sizeof(n), n, SQLITE_STATIC);
+        }
+        z += sizeof(n)+n;
+        break;
+      default:
+        sqlite3_bind_null(cur->stmt, iParam);
+        break;
+    }
+    iParam++;
+  }
+}
+
+/*
+** Step the key query of a cursor and load the next row key. Once the key
+** query is exhausted its stmt is released so that it can be reused.
+*/
+static int pivotCursorStep(pivot_vtab *tab, pivot_cursor *cur){
+  int i;
+
+  pivotCursorClearKey(tab, cur);
+  cur->rc = sqlite3_step(cur->stmt);
+  while( cur->rc==SQLITE_DONE && cur->iMatch+1<cur->nMatch ){
+    // A value index scan moves on to the next matching row key
+    cur->iMatch++;
+    sqlite3_reset(cur->stmt);
+    pivotCursorBindMatch(tab, cur);
+    cur->rc = sqlite3_step(cur->stmt);
+  }
+  if( cur->rc==SQLITE_ROW ){
+    for( i=0; i<tab->nRow_cols; i++ ){
+      cur->pivot_key[i] = sqlite3_value_dup(sqlite3_column_value(cur->stmt, i));
+      if( cur->pivot_key[i]==0 ) return SQLITE_NOMEM;
+    }
+    return SQLITE_OK;
+  }
+  if( cur->rc!=SQLITE_DONE ){
+    sqlite3_free(tab->base.zErrMsg);
+    tab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(tab->db));
+    i = cur->rc;
+    cur->rc = SQLITE_DONE;
+    pivotCursorReleaseStmt(tab, cur);
+    return i;
+  }
+  pivotCursorReleaseStmt(tab, cur);
+  return SQLITE_OK;
+}
+
+/*
+** Return the type that key value pVal is listed as in the JSON arrays of
+** the tile query, SQLITE_INTEGER or SQLITE_TEXT, or 0 if it cannot be
+** listed. The value is converted to the affinity of the key column of type
+** pType, as the pivot query would convert it, so that the IN operator of
+** the tile query compares like with like: a json_each() value has no
+** affinity for SQLite to apply. Only integers and text are listed, as JSON
+** does not round-trip every real and cannot hold blobs.
+*/
+static int pivotJsonType(sqlite3_value *pVal, const pivot_keytype *pType){
+  sqlite3_value *pConv;
+  int eType = sqlite3_value_type(pVal);
+  if( eType==SQLITE_INTEGER ){
+    return pType->eAff==PIVOT_AFF_TEXT ? SQLITE_TEXT : SQLITE_INTEGER;
+  }
+  if( eType==SQLITE_TEXT && pType->eAff==PIVOT_AFF_NUMERIC ){
+    pConv = sqlite3_value_dup(pVal);
+    if( pConv==0 ) return 0;
+    eType = sqlite3_value_numeric_type(pConv);
+    sqlite3_value_free(pConv);
+    return eType==SQLITE_FLOAT ? 0 : eType;
+  }
+  return eType==SQLITE_TEXT ? SQLITE_TEXT : 0;
+}
+
+/*
+** Append a key value, compared with a key column of type pType, to a JSON
+** array being built in pJson, returning false if the value cannot be
+** listed (see pivotJsonType()).
+*/
+static int pivotJsonAppend(sqlite3_str *pJson, sqlite3_value *pVal, const pivot_keytype *pType){
+  const unsigned char *z;
+  int n;
+  int i;
+
+  switch( pivotJsonType(pVal, pType) ){
+    case SQLITE_INTEGER:
+      sqlite3_str_appendf(pJson, "%s%lld",
+        sqlite3_str_length(pJson)>1 ? "," : "", sqlite3_value_int64(pVal));
+      return 1;
+    case SQLITE_TEXT:
+      z = sqlite3_value_text(pVal);
+      n = sqlite3_value_bytes(pVal);
+      if( z==0 ) return 0;
+      if( sqlite3_str_length(pJson)>1 ) sqlite3_str_appendchar(pJson, 1, ',');
+      sqlite3_str_appendchar(pJson, 1, '"');
+      for( i=0; i<n; i++ ){
+        if( z[i]=='"' || z[i]=='\\' ){
+          sqlite3_str_appendchar(pJson, 1, '\\');
+          sqlite3_str_appendchar(pJson, 1, (char)z[i]);
+        }else if( z[i]<0x20 ){
+          sqlite3_str_appendf(pJson, "\\u%04x", z[i]);
+        }else{
+          sqlite3_str_appendchar(pJson, 1, (char)z[i]);
+        }
+      }
+      sqlite3_str_appendchar(pJson, 1, '"');
+      return 1;
+  }
+  return 0;
+}
+
+/*
+** Load the next tile of a tiled scan: up to cur->nTileRows rows of the
+** key query, into a row cache entry private to the cursor. Cells are
+** fetched by pivotTileFetch() when the scan first reads their column.
+** Rows are indexed by row key, except those with a row key value that
+** cannot be listed in the tile query, whose cells are evaluated one at a
+** time.
+*/
+static int pivotTileLoad(pivot_vtab *tab, pivot_cursor *cur){
+  int nVal = tab->nRow_cols+tab->nCol_key;
+  pivot_entry *e;
+  pivot_entry *pKeyEntry;
+  char *zKey;
+  int nKey;
+  unsigned int iHash;
+  int bTiled;
+  int rc = SQLITE_OK;
+  int i;
+
+  // Each tile the scan reads past the first is sized from the selectivity
+  // of the last one. It is twice the size, or four times if the tile
+  // queries returned less than a cell per two rows, but stops growing once
+  // they return PIVOT_VTAB_TILE_CELLS cells. The columns read by at least
+  // half the rows of the last tile are fetched together in the next one,
+  // others only once read.
+  if( cur->pEntry ){
+    int nRow = cur->pEntry->nRow;
+    sqlite3_int64 nNext = (sqlite3_int64)cur->nTileRows*(cur->nTileCells*2<nRow ? 4 : 2);
+    if( cur->nTileCells>0 && nNext>PIVOT_VTAB_TILE_CELLS*(sqlite3_int64)nRow/cur->nTileCells ){
+      nNext = PIVOT_VTAB_TILE_CELLS*(sqlite3_int64)nRow/cur->nTileCells;
+      if( nNext<cur->nTileRows ) nNext = cur->nTileRows;
+    }
+    if( cur->nTileRows<PIVOT_VTAB_MAX_TILE_ROWS ){
+      cur->nTileRows = nNext<PIVOT_VTAB_MAX_TILE_ROWS ? (int)nNext : PIVOT_VTAB_MAX_TILE_ROWS;
+    }
+    for( i=0; i<tab->nCol_key; i++ ){
+      if( cur->aTileReads[i]>0 && cur->aTileReads[i]*2>=nRow ){
+        cur->aTileUsed[i/8] |= (unsigned char)(1<<(i%8));
+      }else{
+        cur->aTileUsed[i/8] &= (unsigned char)~(1<<(i%8));
+      }
+    }
+    memset(cur->aTileReads, 0, tab->nCol_key*sizeof(int));
+    cur->nTileCells = 0;
+    pivotEntryRelease(tab, cur->pEntry);
+    cur->pEntry = 0;
+  }
+  pivotTileClear(tab, cur);
+  memset(cur->aTileDone, 0, (tab->nCol_key+7)/8+1);
+  cur->rc = SQLITE_DONE;
+
+  e = pivotEntryNew(0, 0, 0);
+  if( e==0 ) return SQLITE_NOMEM;
+  e->nRef = 1;
+  e->bOrphan = 1;
+  cur->pEntry = e;
+  cur->iEntryRow = 0;
+  e->aVal = sqlite3_malloc(cur->nTileRows*nVal*sizeof(sqlite3_value*));
+  e->aEval = sqlite3_malloc(cur->nTileRows*nVal);
+  cur->aTileHead = sqlite3_malloc(cur->nTileRows*sizeof(int));
+  cur->aTileNext = sqlite3_malloc(cur->nTileRows*sizeof(int));
+  if( e->aVal==0 || e->aEval==0 || cur->aTileHead==0 || cur->aTileNext==0 ){
+    return SQLITE_NOMEM;
+  }
+
+  while( e->nRow<cur->nTileRows && (rc = sqlite3_step(cur->stmt))==SQLITE_ROW ){
+    sqlite3_value **aRow = &e->aVal[e->nRow*nVal];
+    memset(aRow, 0, nVal*sizeof(sqlite3_value*));
+    memset(&e->aEval[e->nRow*nVal], 0, nVal);
+    e->nRow++;
+    for( i=0; i<tab->nRow_cols; i++ ){
+      aRow[i] = sqlite3_value_dup(sqlite3_column_value(cur->stmt, i));
+      e->aEval[(e->nRow-1)*nVal+i] = 1;
+      if( aRow[i]==0 ) return SQLITE_NOMEM;
+    }
+
+    // Index the row by its row key as the source query compares it, if
+    // it can be listed
+    cur->aTileNext[e->nRow-1] = -2;
+    bTiled = 1;
+    for( i=0; i<tab->nRow_key; i++ ){
+      if( pivotJsonType(aRow[i], &tab->aKeyType[i])==0 ) bTiled = 0;
+    }
+    if( !bTiled ) continue;
+    if( pivotKeyBuild(tab->db, tab->aKeyType, tab->nRow_key, aRow, 0, &zKey, &nKey) ){
+      return SQLITE_NOMEM;
+    }
+    iHash = pivotKeyHash(zKey, nKey);
+    pKeyEntry = pivotScanFind(&cur->tile, zKey, nKey, iHash);
+    if( pKeyEntry ){
+      sqlite3_free(zKey);
+      cur->aTileNext[e->nRow-1] = cur->aTileHead[pKeyEntry->iRow];
+    }else{
+      pKeyEntry = pivotEntryNew(zKey, nKey, iHash);
+      if( pKeyEntry==0 ) return SQLITE_NOMEM;
+      if( pivotScanInsert(&cur->tile, pKeyEntry) ){
+        pivotEntryFree(tab, pKeyEntry);
+        return SQLITE_NOMEM;
+      }
+      cur->aTileNext[e->nRow-1] = -1;
+    }
+    cur->aTileHead[pKeyEntry->iRow] = e->nRow-1;
+  }
+
+  if( rc!=SQLITE_ROW && rc!=SQLITE_DONE && rc!=SQLITE_OK ){
+    sqlite3_free(tab->base.zErrMsg);
+    tab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(tab->db));
+    pivotCursorReleaseStmt(tab, cur);
+    return rc;
+  }
+  // The stmt is kept while the key query may have more rows
+  if( rc!=SQLITE_ROW ) pivotCursorReleaseStmt(tab, cur);
+  cur->rc = e->nRow>0 ? SQLITE_ROW : SQLITE_DONE;
+  return SQLITE_OK;
+}
+
+/*
+** Fetch the cells of pivot column iCol for every row of the current tile
+** of cur with one run of the tile query, along with those of any other
+** column read earlier in the scan but not yet fetched for this tile. The
+** first cell of the source query for a row and column wins, as in a
+** source scan. Cells of columns with a column key that cannot be listed
+** are left to be evaluated one at a time.
+*/
+static int pivotTileFetch(pivot_vtab *tab, pivot_cursor *cur, int iCol){
+  sqlite3_stmt *stmt = tab->tile_stmt;
+  pivot_entry *e = cur->pEntry;
+  int nVal = tab->nRow_cols+tab->nCol_key;
+  unsigned char *aFetch;
+  sqlite3_str *pJson;
+  char *zKey;
+  int nKey;
+  int nFetch = 0;
+  int rc = SQLITE_OK;
+  int i, j, r;
+
+  aFetch = sqlite3_malloc((tab->nCol_key+7)/8+1);
+  if( aFetch==0 ) return SQLITE_NOMEM;
+  memset(aFetch, 0, (tab->nCol_key+7)/8+1);
+
+  // Column keys
+  pJson = sqlite3_str_new(tab->db);
+  sqlite3_str_appendchar(pJson, 1, '[');
+  for( j=0; j<tab->nCol_key; j++ ){
+    if( PIVOT_BIT(cur->aTileDone, j) ) continue;
+    if( j!=iCol && !PIVOT_BIT(cur->aTileUsed, j) ) continue;
+    cur->aTileDone[j/8] |= (unsigned char)(1<<(j%8));
+    if( pivotJsonAppend(pJson, tab->aCol[j].pKey, &tab->aKeyType[tab->nRow_key]) ){
+      aFetch[j/8] |= (unsigned char)(1<<(j%8));
+      nFetch++;
+    }
+  }
+  sqlite3_str_appendchar(pJson, 1, ']');
+  nKey = sqlite3_str_length(pJson);
+  zKey = sqlite3_str_finish(pJson);
+  if( zKey==0 ){
+    sqlite3_free(aFetch);
+    return SQLITE_NOMEM;
+  }
+  if( nFetch==0 || cur->tile.nEntry==0 ){
+    sqlite3_free(zKey);
+    sqlite3_free(aFetch);
+    return SQLITE_OK;
+  }
+  sqlite3_bind_text(stmt, tab->nRow_key+1, zKey, nKey, sqlite3_free);
+
+  // Row keys, one list per row key column
+  for( i=0; i<tab->nRow_key; i++ ){
+    pJson = sqlite3_str_new(tab->db);
+    sqlite3_str_appendchar(pJson, 1, '[');
+    for( r=0; r<e->nRow; r++ ){
+      if( cur->aTileNext[r]!=-2 ) pivotJsonAppend(pJson, e->aVal[r*nVal+i], &tab->aKeyType[i]);
+    }
+    sqlite3_str_appendchar(pJson, 1, ']');
+    nKey = sqlite3_str_length(pJson);
+    zKey = sqlite3_str_finish(pJson);
+    if( zKey==0 ){
+      sqlite3_reset(stmt);
+      sqlite3_free(aFetch);
+      return SQLITE_NOMEM;
+    }
+    sqlite3_bind_text(stmt, i+1, zKey, nKey, sqlite3_free);
+  }
+  if( tab->bAsOf && cur->aParam[0] ){
+    sqlite3_bind_value(stmt, tab->nRow_key+2, cur->aParam[0]);
+  }
+
+  tab->aStat[PIVOT_STAT_TILE_QUERIES]++;
+  while( (rc = sqlite3_step(stmt))==SQLITE_ROW ){
+    pivot_entry *pKeyEntry;
+    sqlite3_value *pColKey;
+    cur->nTileCells++;
+    if( pivotKeyBuild(tab->db, tab->aKeyType, tab->nRow_key, 0, stmt, &zKey, &nKey) ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    if( zKey==0 ) continue;
+    pKeyEntry = pivotScanFind(&cur->tile, zKey, nKey, pivotKeyHash(zKey, nKey));
+    sqlite3_free(zKey);
+    if( pKeyEntry==0 ) continue;
+
+    pColKey = sqlite3_column_value(stmt, tab->nRow_key);
+    if( pivotKeyBuild(tab->db, &tab->aKeyType[tab->nRow_key], 1, &pColKey, 0, &zKey, &nKey) ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    if( zKey==0 ) continue;
+    j = pivotColFind(tab, zKey, nKey, pivotKeyHash(zKey, nKey));
+    sqlite3_free(zKey);
+
+    for( ; j>=0 && rc==SQLITE_ROW; j=tab->aColNext[j] ){
+      if( !PIVOT_BIT(aFetch, j) ) continue;
+      for( r=cur->aTileHead[pKeyEntry->iRow]; r>=0; r=cur->aTileNext[r] ){
+        int iVal = r*nVal+tab->nRow_cols+j;
+        if( e->aEval[iVal] ) continue;
+        e->aVal[iVal] = sqlite3_value_dup(sqlite3_column_value(stmt, tab->nRow_key+1));
+        if( e->aVal[iVal]==0 ){
+          rc = SQLITE_NOMEM;
+          break;
+        }
+        e->aEval[iVal] = 1;
+      }
+    }
+    if( rc==SQLITE_NOMEM ) break;
+  }
+  if( rc!=SQLITE_DONE && rc!=SQLITE_NOMEM ){
+    sqlite3_free(tab->base.zErrMsg);
+    tab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(tab->db));
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  if( rc==SQLITE_DONE ){
+    // Cells of listed rows that the source query did not return are NULL
+    for( r=0; r<e->nRow; r++ ){
+      if( cur->aTileNext[r]==-2 ) continue;
+      for( j=0; j<tab->nCol_key; j++ ){
+        if( PIVOT_BIT(aFetch, j) ) e->aEval[r*nVal+tab->nRow_cols+j] = 1;
+      }
+    }
+  }
+  sqlite3_free(aFetch);
+  return rc==SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/*
+** Advance a pivot_cursor to its next row of output.
+*/
+static int pivotNext(sqlite3_vtab_cursor *pCur){
+  pivot_vtab *tab = (pivot_vtab*)pCur->pVtab;
+  pivot_cursor *cur = (pivot_cursor*)pCur;
+  int rc = SQLITE_OK;
+
+  tab->aStat[PIVOT_STAT_NEXT_CALLS]++;
+  cur->iRowid++;
+  if( cur->pEntry ){
+    cur->iEntryRow++;
+    cur->rc = cur->iEntryRow<cur->pEntry->nRow ? SQLITE_ROW : SQLITE_DONE;
+    if( cur->rc==SQLITE_DONE && cur->nTileRows>0 && cur->stmt ){
+      rc = pivotTileLoad(tab, cur);
+      if( rc!=SQLITE_OK ) cur->rc = SQLITE_DONE;
+    }
+  }else{
+    rc = pivotCursorStep(tab, cur);
+  }
+  pivotScanProgress(tab, cur);
+  return rc;
+}
+
+/*
+** Step the pivot query of column iCol for cursor cur, recording its
+** evaluation profile. The evaluation is only timed with the timing option.
+*/
+static int pivotColStep(pivot_vtab *tab, pivot_cursor *cur, int iCol){
+  pivot_column *pCol = &tab->aCol[iCol];
+  sqlite3_int64 iStart;
+  sqlite3_int64 nTime;
+  int rc;
+  if( tab->bTiming ){
+    iStart = pivotTimeNs();
+    rc = sqlite3_step(tab->col_stmt[iCol]);
+    nTime = pivotTimeNs()-iStart;
+    pCol->nTime += nTime;
+    pivotHistAdd(tab->aHist[PIVOT_HIST_CELL], nTime);
+  }else{
+    rc = sqlite3_step(tab->col_stmt[iCol]);
+  }
+  pCol->nEval++;
+  if( rc==SQLITE_ROW ) pCol->nHit++;
+  cur->nScanCell++;
+  return rc;
+}
+
+/*
+** Evaluate the pivot query for column iCol of the row with key values
+** aKey and the parameter values of cur. *ppVal is set to a copy of the
+** cell value, or to 0 if the pivot query returns no rows. The cell is
+** read from the source scan instead when it is current.
+*/
+static int pivotEvalCell(
+  pivot_vtab *tab,
+  pivot_cursor *cur,
+  sqlite3_value **aKey,
+  int iCol,
+  sqlite3_value **ppVal
+){
+  sqlite3_stmt *stmt = tab->col_stmt[iCol];
+  int rc;
+  int i;
+
+  *ppVal = 0;
+  if( cur->pSnapshot ){
+    pivot_entry *e = pivotSourceRow(tab, &cur->pSnapshot->scan, aKey);
+    if( e ) return pivotVectorValue(tab, &cur->pSnapshot->scan.aVec[iCol], e->iRow, ppVal);
+    return SQLITE_OK;
+  }
+  if( pivotSourceCurrent(tab, cur) ){
+    pivot_entry *e = pivotSourceRow(tab, &tab->source, aKey);
+    if( e ) return pivotVectorValue(tab, &tab->source.aVec[iCol], e->iRow, ppVal);
+    return SQLITE_OK;
+  }
+
+  for( i=0; i<tab->nRow_key; i++ )
+    sqlite3_bind_value(stmt, i+1, aKey[i]);
+  pivotBindParams(tab, cur, stmt);
+
+  rc = pivotColStep(tab, cur, iCol);
+  if( rc==SQLITE_ROW ){
+    *ppVal = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
+    rc = *ppVal ? SQLITE_OK : SQLITE_NOMEM;
+  }else if( rc==SQLITE_DONE ){
+    rc = SQLITE_OK;
+  }
+  sqlite3_reset(stmt);
+  return rc;
+}
+
+/*
+** pivot_cell is a cell of the row at which a cursor is pointing. It is
+** either a value pVal, or NULL if pVal is 0, or row iRow of the source
+** scan vector pVec. If stmt is set, pVal is a column of that stmt, which
+** must be reset by pivotCellDone() once the value has been used.
+*/
+typedef struct pivot_cell pivot_cell;
+struct pivot_cell {
+  sqlite3_value *pVal;           // The value, or 0
+  sqlite3_stmt *stmt;            // Stmt that pVal belongs to, or 0
+  pivot_vector *pVec;            // Source scan vector holding the cell, or 0
+  int iRow;                      // Row of pVec
+};
+
+/*
+** Load column i of the row at which cur is pointing into *pCell.
+*/
+static int pivotCellValue(
+  pivot_vtab *tab,
+  pivot_cursor *cur,
+  int i,
+  pivot_cell *pCell
+){
+  memset(pCell, 0, sizeof(*pCell));
+  if( i>=tab->nRow_cols+tab->nCol_key ){
+    // return a parameter value, or null
+    pCell->pVal = cur->aParam[i-tab->nRow_cols-tab->nCol_key];
+  }else if( cur->pEntry ){
+    // return a cached value, evaluating and caching the cell on first use
+    pivot_entry *e = cur->pEntry;
+    int iVal = cur->iEntryRow*(tab->nRow_cols+tab->nCol_key) + i;
+    if( cur->nTileRows>0 && i>=tab->nRow_cols ) cur->aTileReads[i-tab->nRow_cols]++;
+    if( !e->aEval[iVal] && cur->nTileRows>0 ){
+      // fetch the column for the whole tile on its first read
+      int iCol = i-tab->nRow_cols;
+      if( !PIVOT_BIT(cur->aTileDone, iCol) ){
+        int rc = pivotTileFetch(tab, cur, iCol);
+        if( rc!=SQLITE_OK ) return rc;
+      }
+    }
+    if( !e->aEval[iVal] ){
+      int rc = pivotEvalCell(tab, cur, &e->aVal[iVal-i], i-tab->nRow_cols, &e->aVal[iVal]);
+      if( rc!=SQLITE_OK ) return rc;
+      e->aEval[iVal] = 1;
+    }
+    pCell->pVal = e->aVal[iVal];
+  }else if( i<tab->nRow_cols ){
+    // return the row key
+    pCell->pVal = cur->pivot_key[i];
+  }else if( cur->pSnapshot ){
+    // return the cell of the snapshot pinned by the scan, or null
+    pivot_entry *e = pivotSourceRow(tab, &cur->pSnapshot->scan, cur->pivot_key);
+    if( e ){
+      pCell->pVec = &cur->pSnapshot->scan.aVec[i-tab->nRow_cols];
+      pCell->iRow = e->iRow;
+    }
+  }else if( pivotSourceCurrent(tab, cur) ){
+    // return the cell loaded by the source scan, or null
+    pivot_entry *e = pivotSourceRow(tab, &tab->source, cur->pivot_key);
+    if( e ){
+      pCell->pVec = &tab->source.aVec[i-tab->nRow_cols];
+      pCell->iRow = e->iRow;
+    }
+  }else if( cur->bColumnScan ){
+    // return the cell loaded by the column query, or null
+    int iCol = i-tab->nRow_cols;
+    pivot_entry *e;
+    if( tab->source.aLoaded==0 || !PIVOT_BIT(tab->source.aLoaded, iCol) ){
+      int rc = pivotColumnLoad(tab, iCol);
+      if( rc!=SQLITE_OK ) return rc;
+    }
+    e = pivotSourceRow(tab, &tab->source, cur->pivot_key);
+    if( e ){
+      pCell->pVec = &tab->source.aVec[iCol];
+      pCell->iRow = e->iRow;
+    }
+  }else{
+    // return column value, or null
+    int iCol = i-tab->nRow_cols;
+    sqlite3_stmt *stmt = tab->col_stmt[iCol];
+
+    for( i=0; i<tab->nRow_key; i++ )
+      sqlite3_bind_value(stmt, i+1, cur->pivot_key[i]);
+    pivotBindParams(tab, cur, stmt);
+
+    if( pivotColStep(tab, cur, iCol)==SQLITE_ROW ){
+      pCell->pVal = sqlite3_column_value(stmt, 0);
+    }
+    pCell->stmt = stmt;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Release a cell loaded by pivotCellValue().
+*/
+static void pivotCellDone(pivot_cell *pCell){
+  if( pCell->stmt ) sqlite3_reset(pCell->stmt);
+}
+
+/*
+** Return values of columns for the row at which the pivot_cursor
+** is currently pointing.
+*/
+static int pivotColumn(
+  sqlite3_vtab_cursor *pCur,  // The cursor
+  sqlite3_context *ctx,       // First argument to sqlite3_result_...()
+  int i                       // Which column to return
+){
+  pivot_vtab *tab = (pivot_vtab*)pCur->pVtab;
+  pivot_cursor *cur = (pivot_cursor*)pCur;
+  pivot_cell cell;
+  int rc;
+
+  tab->aStat[PIVOT_STAT_COLUMN_CALLS]++;
+  rc = pivotCellValue(tab, cur, i, &cell);
+  if( rc!=SQLITE_OK ) return rc;
+  if( cell.pVec ){
+    pivotVectorResult(cell.pVec, cell.iRow, ctx);
+  }else if( cell.pVal ){
+    sqlite3_result_value(ctx, cell.pVal);
+  }else{
+    sqlite3_result_null(ctx);
+  }
+  pivotCellDone(&cell);
+  return SQLITE_OK;
+}
+
+/*
+** Return the rowid for the current row. If the row key is known to hold
+** unique integers the rowid is the row key, otherwise it is the position
+** of the row in the scan.
+*/
+static int pivotRowid(sqlite3_vtab_cursor *pCur, sqlite_int64 *pRowid){
+  pivot_vtab *tab = (pivot_vtab*)pCur->pVtab;
+  pivot_cursor *cur = (pivot_cursor*)pCur;
+  sqlite3_value *pKey = 0;
+
+  if( tab->bKeyRowid ){
+    if( cur->pEntry ){
+      pKey = cur->pEntry->aVal[cur->iEntryRow*(tab->nRow_cols+tab->nCol_key)];
+    }else{
+      pKey = cur->pivot_key[0];
+    }
+  }
+  if( pKey && sqlite3_value_type(pKey)==SQLITE_INTEGER ){
+    *pRowid = sqlite3_value_int64(pKey);
+  }else{
+    *pRowid = cur->iRowid;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Return TRUE if the cursor has been moved off of the last
+** row of output.
+*/
+static int pivotEof(sqlite3_vtab_cursor *pCur){
+  pivot_cursor *cur = (pivot_cursor*)pCur;
+  return cur->rc!=SQLITE_ROW;
+}
+
+/*
+** Prepare and bind the key query of a cursor. The idle stmt of a memoized
+** plan is reused when there is one. The constraint values in argv are
+** numbered after the bound params of the unfiltered key query.
+*/
+static int pivotCursorPrepare(
+  pivot_vtab *tab,
+  pivot_cursor *cur,
+  int iPlan,
+  const char *zSql,
+  int argc, sqlite3_value **argv
+){
+  int rc;
+  int i;
+
+  if( iPlan>=0 ){
+    zSql = tab->aPlan[iPlan].zSql;
+    cur->stmt = tab->aPlan[iPlan].stmt;
+    tab->aPlan[iPlan].stmt = 0;
+  }
+  if( cur->stmt==0 ){
+    rc = sqlite3_prepare_v2(tab->db, zSql, -1, &(cur->stmt), 0);
+    if( rc!=SQLITE_OK ){
+      sqlite3_free(tab->base.zErrMsg);
+      tab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(tab->db));
+      return rc;
+    }
+  }
+  cur->iPlan = iPlan;
+  for( i=0; i<argc; i++ )
+    sqlite3_bind_value(cur->stmt, tab->nKeyParam+i+1, argv[i]);
+  pivotBindParams(tab, cur, cur->stmt);
+  if( tab->nSlowScan>0 ){
+    sqlite3_free(cur->zScanSql);
+    cur->zScanSql = sqlite3_expanded_sql(cur->stmt);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Load every row of the key query bound in cur->stmt into a row cache
+** entry. Only the row key values are loaded - cells are evaluated lazily
+** by pivotColumn().
+*/
+static int pivotEntryLoad(pivot_vtab *tab, pivot_cursor *cur, pivot_entry *e){
+  int nVal = tab->nRow_cols+tab->nCol_key;
+  int rc;
+  int i;
+
+  while( (rc = sqlite3_step(cur->stmt))==SQLITE_ROW ){
+    sqlite3_value **aVal = sqlite3_realloc(e->aVal, (e->nRow+1)*nVal*sizeof(sqlite3_value*));
+    unsigned char *aEval = sqlite3_realloc(e->aEval, (e->nRow+1)*nVal);
+    if( aVal ) e->aVal = aVal;
+    if( aEval ) e->aEval = aEval;
+    if( aVal==0 || aEval==0 ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    memset(&aVal[e->nRow*nVal], 0, nVal*sizeof(sqlite3_value*));
+    memset(&aEval[e->nRow*nVal], 0, nVal);
+    e->nRow++;
+    for( i=0; i<tab->nRow_cols; i++ ){
+      aVal[(e->nRow-1)*nVal+i] = sqlite3_value_dup(sqlite3_column_value(cur->stmt, i));
+      aEval[(e->nRow-1)*nVal+i] = 1;
+      if( aVal[(e->nRow-1)*nVal+i]==0 ) rc = SQLITE_NOMEM;
+    }
+    if( rc==SQLITE_NOMEM ) break;
+  }
+  if( rc!=SQLITE_DONE && rc!=SQLITE_NOMEM ){
+    sqlite3_free(tab->base.zErrMsg);
+    tab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(tab->db));
+  }
+  pivotCursorReleaseStmt(tab, cur);
+  return rc==SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/*
+** Serve a point lookup on the pivot table key from the row and miss
+** caches. A hit in either runs no SQL at all. On a row cache miss every
+** row of the key query is loaded into a new cache entry, and cells are
+** evaluated lazily by pivotColumn(). Lookups that find no rows are
+** remembered in the miss cache when it is enabled, so that they do not
+** evict hot rows from the row cache.
+*/
+static int pivotFilterPoint(
+  pivot_vtab *tab,
+  pivot_cursor *cur,
+  int iPlan,
+  int argc, sqlite3_value **argv
+){
+  pivot_plan *plan = &tab->aPlan[iPlan];
+  sqlite3_str *pKey;
+  pivot_entry *e;
+  char *zKey;
+  int nKey;
+  unsigned int iHash;
+  int rc = SQLITE_OK;
+  int i;
+
+  pivotCacheValidate(tab);
+
+  pKey = sqlite3_str_new(tab->db);
+  for( i=0; i<tab->nRow_cols; i++ )
+    pivotKeyAppend(pKey, argv[plan->aPoint[i]]);
+  for( i=0; i<tab->nParam; i++ ){
+    if( cur->aParam[i] ){
+      pivotKeyAppend(pKey, cur->aParam[i]);
+    }else{
+      sqlite3_str_appendchar(pKey, 1, 0);
+    }
+  }
+  nKey = sqlite3_str_length(pKey);
+  zKey = sqlite3_str_finish(pKey);
+  if( zKey==0 ) return SQLITE_NOMEM;
+  iHash = pivotKeyHash(zKey, nKey);
+
+  // Known absent key
+  if( pivotLruFind(&tab->missCache, zKey, nKey, iHash) ){
+    tab->aStat[PIVOT_STAT_MISS_CACHE_HITS]++;
+    sqlite3_free(zKey);
+    cur->rc = SQLITE_DONE;
+    return SQLITE_OK;
+  }
+
+  // Without a row cache the key query is streamed as usual, and only
+  // recorded in the miss cache if it returns no rows
+  if( tab->rowCache.nMax==0 ){
+    rc = pivotCursorPrepare(tab, cur, iPlan, 0, argc, argv);
+    if( rc==SQLITE_OK ) rc = pivotCursorStep(tab, cur);
+    if( rc==SQLITE_OK && cur->rc==SQLITE_DONE ){
+      e = pivotEntryNew(zKey, nKey, iHash);
+      if( e==0 ) return SQLITE_NOMEM;
+      rc = pivotLruInsert(tab, &tab->missCache, e, PIVOT_STAT_MISS_CACHE_EVICTIONS);
+      if( rc!=SQLITE_OK ) pivotEntryFree(tab, e);
+    }else{
+      sqlite3_free(zKey);
+    }
+    return rc;
+  }
+
+  e = pivotLruFind(&tab->rowCache, zKey, nKey, iHash);
+  if( e ){
+    tab->aStat[PIVOT_STAT_ROW_CACHE_HITS]++;
+    sqlite3_free(zKey);
+  }else{
+    tab->aStat[PIVOT_STAT_ROW_CACHE_MISSES]++;
+    e = pivotEntryNew(zKey, nKey, iHash);
+    if( e==0 ) return SQLITE_NOMEM;
+    rc = pivotCursorPrepare(tab, cur, iPlan, 0, argc, argv);
+    if( rc==SQLITE_OK ) rc = pivotEntryLoad(tab, cur, e);
+    if( rc==SQLITE_OK ){
+      if( e->nRow==0 && tab->missCache.nMax>0 ){
+        rc = pivotLruInsert(tab, &tab->missCache, e, PIVOT_STAT_MISS_CACHE_EVICTIONS);
+      }else{
+        rc = pivotLruInsert(tab, &tab->rowCache, e, PIVOT_STAT_ROW_CACHE_EVICTIONS);
+      }
+    }
+    if( rc!=SQLITE_OK ){
+      pivotEntryFree(tab, e);
+      return rc;
+    }
+  }
+
+  e->nRef++;
+  cur->pEntry = e;
+  cur->iEntryRow = 0;
+  cur->rc = e->nRow>0 ? SQLITE_ROW : SQLITE_DONE;
+  return SQLITE_OK;
+}
+
+/*
+** Start a scan of plan, which has value index constraints, by reading the
+** key query once for each row key of a source row with a matching cell.
+** The constraint values follow the argc row key constraint values in
+** argv. *pbUsed is set to false if the value index cannot answer the
+** constraints.
+*/
+static int pivotFilterValue(
+  pivot_vtab *tab,
+  pivot_cursor *cur,
+  pivot_plan *plan,
+  int argc, sqlite3_value **argv,
+  int *pbUsed
+){
+  pivot_scan *pScan = &tab->source;
+  pivot_vector *pVec = &pScan->aVec[plan->iValueCol];
+  int *aRow;
+  int lo = 0, hi = 0;
+  int nMatch = 0;
+  int rc;
+  int i;
+
+  *pbUsed = 0;
+  rc = pivotValueIndexBuild(tab, plan->iValueCol);
+  if( rc!=SQLITE_OK ) return rc;
+  if( pVec->aSorted ){
+    pivotValueIndexRange(pVec, &plan->aSig[(plan->nCons-plan->nValueCons)*2],
+                         plan->nValueCons, &argv[argc], &lo, &hi);
+    if( lo<0 ) return SQLITE_OK;
+  }
+  *pbUsed = 1;
+  tab->aStat[PIVOT_STAT_VALUE_INDEX_SCANS]++;
+  cur->rc = SQLITE_DONE;
+  if( lo==hi ) return SQLITE_OK;
+
+  // Read the matching rows in source query order
+  aRow = sqlite3_malloc((hi-lo)*sizeof(int));
+  if( aRow==0 ) return SQLITE_NOMEM;
+  memcpy(aRow, &pVec->aSorted[lo], (hi-lo)*sizeof(int));
+  qsort(aRow, hi-lo, sizeof(int), pivotIntCompare);
+  cur->aMatch = sqlite3_malloc((hi-lo+1)*sizeof(int));
+  if( cur->aMatch ){
+    sqlite3_str *pMatch = sqlite3_str_new(tab->db);
+    for( i=0; i<hi-lo; i++ ){
+      pivot_entry *e = pScan->aEntry[aRow[i]];
+      cur->aMatch[nMatch++] = sqlite3_str_length(pMatch);
+      sqlite3_str_append(pMatch, e->zKey, e->nKey);
+    }
+    cur->aMatch[nMatch] = sqlite3_str_length(pMatch);
+    cur->zMatch = sqlite3_str_finish(pMatch);
+  }
+  sqlite3_free(aRow);
+  if( cur->aMatch==0 || cur->zMatch==0 ){
+    pivotCursorReleaseStmt(tab, cur);
+    return SQLITE_NOMEM;
+  }
+  cur->nMatch = nMatch;
+  cur->iMatch = 0;
+
+  rc = pivotCursorPrepare(tab, cur, -1, plan->zValueSql, argc, argv);
+  if( rc!=SQLITE_OK ){
+    pivotCursorReleaseStmt(tab, cur);
+    return rc;
+  }
+  pivotCursorBindMatch(tab, cur);
+  return pivotCursorStep(tab, cur);
+}
+
+/*
+** Start the scan of plan idxNum, positioning cur on its first row.
+*/
+static int pivotFilterScan(
+  pivot_vtab *tab,
+  pivot_cursor *cur,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  pivot_plan *plan = 0;
+  unsigned int mParam;
+  int rc;
+  int i;
+
+  pivotCursorClearKey(tab, cur);
+  pivotCursorReleaseStmt(tab, cur);
+  if( cur->pEntry ){
+    pivotEntryRelease(tab, cur->pEntry);
+    cur->pEntry = 0;
+  }
+  pivotTileClear(tab, cur);
+  pivotSnapshotRelease(tab, cur->pSnapshot);
+  cur->pSnapshot = 0;
+  cur->nTileRows = 0;
+  cur->rc = SQLITE_DONE;
+
+  cur->iRowid = 1;
+  if( idxNum>=0 && idxNum<tab->nPlan ){
+    plan = &tab->aPlan[idxNum];
+    mParam = plan->mParam;
+  }else{
+    mParam = idxNum<0 ? (unsigned int)(-1-idxNum) : 0;
+  }
+
+  // Parameter values are passed first in argv, followed by the constraints
+  // on the row key columns
+  if( tab->nParam>0 ){
+    pivotCursorClearParams(tab, cur);
+    for( i=0; i<tab->nParam; i++ ){
+      if( (mParam & (1u<<i))==0 ) continue;
+      cur->aParam[i] = sqlite3_value_dup(argv[0]);
+      if( cur->aParam[i]==0 ) return SQLITE_NOMEM;
+      argv++;
+      argc--;
+    }
+  }
+
+  // Scans other than point lookups load every cell from the source query,
+  // or each column read from the column query
+  cur->bColumnScan = 0;
+  if( tab->zColumnSql && !tab->bReference && (plan==0 || plan->aPoint==0) ){
+    pivotCacheValidate(tab);
+    cur->bColumnScan = 1;
+  }
+  if( tab->pRefresh && !tab->bReference && !pivotWriteTxn(tab->db) ){
+    pivotSnapshotAcquire(tab, cur);
+  }
+  if( tab->zSourceSql && !tab->bReference && cur->pSnapshot==0 ){
+    pivotCacheValidate(tab);
+    cur->iSourceLoad = -1;
+    if( tab->bAsOf && tab->source.bValid && pivotAsOfSame(tab, cur) ){
+      cur->iSourceLoad = tab->source.iLoad;
+    }
+    if( !pivotSourceCurrent(tab, cur) && (plan==0 || plan->aPoint==0) ){
+      if( tab->nTileRows>0 && plan && plan->nCons>plan->nValueCons ){
+        // Range scans are read in tiles
+        cur->nTileRows = tab->nTileRows;
+        memset(cur->aTileUsed, 0, (tab->nCol_key+7)/8+1);
+        memset(cur->aTileReads, 0, tab->nCol_key*sizeof(int));
+        cur->nTileCells = 0;
+      }else{
+        rc = pivotSourceScan(tab, tab->bAsOf ? cur->aParam[0] : 0);
+        if( rc!=SQLITE_OK ) return rc;
+        cur->iSourceLoad = tab->source.iLoad;
+      }
+    }
+  }
+
+  if( plan ){
+    // Value index constraint values come last
+    argc -= plan->nValueCons;
+    if( plan->zValueSql && pivotSourceCurrent(tab, cur)
+     && tab->source.aVec[plan->iValueCol].aOther==0 ){
+      int bUsed;
+      rc = pivotFilterValue(tab, cur, plan, argc, argv, &bUsed);
+      if( rc!=SQLITE_OK || bUsed ) return rc;
+    }
+    if( plan->aPoint && (tab->rowCache.nMax>0 || tab->missCache.nMax>0)
+     && !pivotWriteTxn(tab->db) ){
+      return pivotFilterPoint(tab, cur, idxNum, argc, argv);
+    }
+  }
+
+  rc = pivotCursorPrepare(tab, cur, plan ? idxNum : -1, idxStr, argc, argv);
+  if( rc!=SQLITE_OK ) return rc;
+  if( cur->nTileRows>0 ) return pivotTileLoad(tab, cur);
+  return pivotCursorStep(tab, cur);
+}
+
+/*
+** This method is called to "rewind" the pivot_cursor object back
+** to the first row of output.  This method is always called at least
+** once prior to any call to pivotColumn() or pivotRowid() or 
+** pivotEof().
+*/
+static int pivotFilter(
+  sqlite3_vtab_cursor *pVtabCursor, 
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  pivot_vtab *tab = (pivot_vtab*)pVtabCursor->pVtab;
+  pivot_cursor *cur = (pivot_cursor*)pVtabCursor;
+  int rc;
+  int i;
+
+  tab->aStat[PIVOT_STAT_FILTER_CALLS]++;
+
+  // Time the scan from here to EOF, ending any scan this cursor abandoned
+  pivotScanEnd(tab, cur);
+  cur->nScanRow = 0;
+  cur->nScanCell = 0;
+  if( tab->nSlowScan>0 ){
+    sqlite3_str *pArgs = sqlite3_str_new(tab->db);
+    for( i=0; i<argc; i++ ){
+      if( i>0 ) sqlite3_str_appendall(pArgs, ", ");
+      pivotAppendLiteral(pArgs, argv[i]);
+    }
+    cur->zScanArgs = sqlite3_str_finish(pArgs);
+  }
+  if( tab->bTiming || tab->nSlowScan>0 ) cur->iScanStart = pivotTimeNs();
+
+  rc = pivotFilterScan(tab, cur, idxNum, idxStr, argc, argv);
+  if( rc!=SQLITE_OK ){
+    cur->iScanStart = 0;
+    pivotScanEnd(tab, cur);
+    return rc;
+  }
+  pivotScanProgress(tab, cur);
+  return SQLITE_OK;
+}
+
+/*
+** Map a constraint operator to its SQL text, or return 0 if the
+** constraint cannot be pushed down into the key query.
+*/
+static const char *pivotConstraintOp(int op){
+  switch( op ){
+    case SQLITE_INDEX_CONSTRAINT_EQ:        return "=";
+    case SQLITE_INDEX_CONSTRAINT_LT:        return "<";
+    case SQLITE_INDEX_CONSTRAINT_LE:        return "<=";
+    case SQLITE_INDEX_CONSTRAINT_GT:        return ">";
+    case SQLITE_INDEX_CONSTRAINT_GE:        return ">=";
+    case SQLITE_INDEX_CONSTRAINT_MATCH:     return "MATCH";
+    case SQLITE_INDEX_CONSTRAINT_LIKE:      return "LIKE";
+    case SQLITE_INDEX_CONSTRAINT_GLOB:      return "GLOB";
+    case SQLITE_INDEX_CONSTRAINT_REGEXP:    return "REGEXP";
+    case SQLITE_INDEX_CONSTRAINT_NE:        return "<>";
+    case SQLITE_INDEX_CONSTRAINT_ISNOT:
+    case SQLITE_INDEX_CONSTRAINT_ISNOTNULL: return "IS NOT";
+    case SQLITE_INDEX_CONSTRAINT_ISNULL:
+    case SQLITE_INDEX_CONSTRAINT_IS:        return "IS";
+    case SQLITE_INDEX_CONSTRAINT_FUNCTION:
+    default:                                return 0;
+  }
+}
+
+/*
+** Return true if a value index can answer constraint operator op.
+*/
+static int pivotValueIndexOp(int op){
+  return op==SQLITE_INDEX_CONSTRAINT_EQ || op==SQLITE_INDEX_CONSTRAINT_LT
+      || op==SQLITE_INDEX_CONSTRAINT_LE || op==SQLITE_INDEX_CONSTRAINT_GT
+      || op==SQLITE_INDEX_CONSTRAINT_GE;
+}
+
+/*
+** Build the filtered key query for a plan signature. Constraints on
+** parameter columns are not part of the WHERE clause - parameters are
+** bound to the key query by number instead - and neither are value index
+** constraints on pivot columns. If bRowKey is true, the query is also
+** filtered on each row key value, bound after the constraint values.
+*/
+static char *pivotPlanSql(pivot_vtab *tab, const int *aSig, int nCons, int nSig, int bRowKey){
+  sqlite3_str *key_sql_filtered;
+  int nKeyCons = 0;
+  int i;
+
+  key_sql_filtered = sqlite3_str_new(tab->db);
+  sqlite3_str_appendall(key_sql_filtered, tab->key_sql_full_table_scan);
+
+  for( i=0; i<nCons*2; i+=2 ){
+    if( aSig[i]>=tab->nRow_cols ) continue;
+    sqlite3_str_appendall(key_sql_filtered, nKeyCons==0 ? "\n WHERE " : " AND ");
+    nKeyCons++;
+    sqlite3_str_appendf(key_sql_filtered, "%s %s ?%d", tab->key_sql_col_names[aSig[i]], pivotConstraintOp(aSig[i+1]), tab->nKeyParam+nKeyCons);
+  }
+  for( i=0; bRowKey && i<tab->nRow_key; i++ ){
+    sqlite3_str_appendall(key_sql_filtered, nKeyCons+i==0 ? "\n WHERE " : " AND ");
+    sqlite3_str_appendf(key_sql_filtered, "%s IS ?%d", tab->key_sql_col_names[i], tab->nKeyParam+nKeyCons+i+1);
+  }
+  i = nCons*2;
+  for( ; i<nSig; i+=2 ){
+    sqlite3_str_appendall(key_sql_filtered, i==nCons*2 ? "\n ORDER BY " : ", ");
+    sqlite3_str_appendf(key_sql_filtered, "%s %s", tab->key_sql_col_names[aSig[i]], aSig[i+1] ? "DESC" : "");
+  }
+
+  return sqlite3_str_finish(key_sql_filtered);
+}
+
+/*
+** Return the index of the memoized plan matching a signature, adding a
+** new plan if there is none. Return -1 if the plan could not be added.
+*/
+static int pivotPlanFind(pivot_vtab *tab, const int *aSig, int nCons, int nSig){
+  pivot_plan *aPlan;
+  pivot_plan *plan;
+  int i;
+
+  for( i=0; i<tab->nPlan; i++ ){
+    plan = &tab->aPlan[i];
+    if( plan->nCons==nCons && plan->nSig==nSig 
+     && (nSig==0 || memcmp(plan->aSig, aSig, nSig*sizeof(int))==0) ){
+      return i;
+    }
+  }
+  if( tab->nPlan>=PIVOT_VTAB_MAX_PLANS ) return -1;
+
+  aPlan = sqlite3_realloc(tab->aPlan, (tab->nPlan+1)*sizeof(pivot_plan));
+  if( aPlan==0 ) return -1;
+  tab->aPlan = aPlan;
+  plan = &aPlan[tab->nPlan];
+  memset(plan, 0, sizeof(*plan));
+  plan->nCons = nCons;
+  plan->nSig = nSig;
+  plan->zSql = pivotPlanSql(tab, aSig, nCons, nSig, 0);
+  if( nSig>0 ){
+    plan->aSig = sqlite3_malloc(nSig*sizeof(int));
+    if( plan->aSig ) memcpy(plan->aSig, aSig, nSig*sizeof(int));
+  }
+  if( plan->zSql==0 || (nSig>0 && plan->aSig==0) ){
+    sqlite3_free(plan->zSql);
+    sqlite3_free(plan->aSig);
+    return -1;
+  }
+
+  // Constraints on parameter columns come first, and value index
+  // constraints on a pivot column last
+  plan->iValueCol = -1;
+  while( nCons>0 && aSig[nCons*2-2]>=tab->nRow_cols && aSig[nCons*2-2]<tab->nRow_cols+tab->nCol_key ){
+    plan->iValueCol = aSig[nCons*2-2]-tab->nRow_cols;
+    plan->nValueCons++;
+    nCons--;
+  }
+  for( i=0; i<nCons && aSig[i*2]>=tab->nRow_cols; i++ ){
+    plan->mParam |= 1u<<(aSig[i*2]-tab->nRow_cols-tab->nCol_key);
+  }
+  aSig += i*2;
+  nCons -= i;
+
+  // A plan with exactly one EQ constraint on each row key column is a
+  // point lookup, which can be served from the row cache
+  if( nCons==tab->nRow_cols ){
+    plan->aPoint = sqlite3_malloc(tab->nRow_cols*sizeof(int));
+    if( plan->aPoint ){
+      for( i=0; i<tab->nRow_cols; i++ ) plan->aPoint[i] = -1;
+      for( i=0; i<nCons; i++ ){
+        if( aSig[i*2+1]!=SQLITE_INDEX_CONSTRAINT_EQ || plan->aPoint[aSig[i*2]]>=0 ) break;
+        plan->aPoint[aSig[i*2]] = i;
+      }
+      if( i<nCons ){
+        sqlite3_free(plan->aPoint);
+        plan->aPoint = 0;
+      }
+    }
+  }
+
+  // Other plans with value index constraints read the key query once for
+  // each row key with a matching cell
+  if( plan->iValueCol>=0 && plan->aPoint==0 ){
+    plan->zValueSql = pivotPlanSql(tab, aSig, nCons, nCons, 1);
+    if( plan->zValueSql==0 ){
+      sqlite3_free(plan->zSql);
+      sqlite3_free(plan->aSig);
+      return -1;
+    }
+  }
+  return tab->nPlan++;
+}
+
+/*
+** SQLite will invoke this method one or more times while planning a query
+** that uses the pivot virtual table.  This routine needs to create
+** a query plan for each invocation and compute an estimated cost for that
+** plan.
+**
+** The key query for each distinct set of consumed constraints and ORDER BY
+** terms is built once and memoized in tab->aPlan. The plan is passed to
+** pivotFilter() as idxNum.
+**
+** An EQ constraint on a parameter column is always consumed, and its
+** value is passed ahead of the row key constraints in argv. If a plan
+** cannot be memoized, the mask of consumed parameters is passed as a
+** negative idxNum instead.
+*/
+static int pivotBestIndex(
+  sqlite3_vtab *pVtab,
+  sqlite3_index_info *pIdxInfo
+){
+  pivot_vtab *tab = (pivot_vtab*)pVtab;
+  int i, j;
+  int argvIndex = 1;
+  unsigned int mParam = 0;
+  int nCons;
+  int nSig = 0;
+  int *aSig;
+  int iPlan;
+  int iValueCol;
+  int bValueEq = 0;
+
+  tab->aStat[PIVOT_STAT_BEST_INDEX_CALLS]++;
+  aSig = sqlite3_malloc((pIdxInfo->nConstraint+pIdxInfo->nOrderBy)*2*sizeof(int)+1);
+  if( aSig==0 ) return SQLITE_NOMEM;
+
+  const struct sqlite3_index_constraint *pConstraint;
+  for(j=0; j<tab->nParam; j++){
+    int iColumn = tab->nRow_cols+tab->nCol_key+j;
+    int bUnusable = 0;
+    pConstraint = pIdxInfo->aConstraint;
+    for(i=0; i<pIdxInfo->nConstraint; i++, pConstraint++){
+      if( pConstraint->iColumn!=iColumn || pConstraint->op!=SQLITE_INDEX_CONSTRAINT_EQ ) continue;
+      if( pConstraint->usable ) break;
+      bUnusable = 1;
+    }
+    if( i<pIdxInfo->nConstraint ){
+      aSig[nSig++] = iColumn;
+      aSig[nSig++] = SQLITE_INDEX_CONSTRAINT_EQ;
+      mParam |= 1u<<j;
+      pIdxInfo->aConstraintUsage[i].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[i].omit = 1;
+    }else if( bUnusable ){
+      // The parameter value is not available to this plan
+      sqlite3_free(aSig);
+      return SQLITE_CONSTRAINT;
+    }
+  }
+
+  pConstraint = pIdxInfo->aConstraint;
+  for(i=0; i<pIdxInfo->nConstraint; i++, pConstraint++){
+    int iColumn = pConstraint->iColumn;
+    if( pConstraint->usable==0 ) continue;
+
+    // A key-derived rowid is constrained as the row key column
+    if( iColumn<0 && tab->bKeyRowid ) iColumn = 0;
+    if( iColumn<0 || !(iColumn < tab->nRow_cols) ) continue;
+    if( pivotConstraintOp(pConstraint->op)==0 ){
+      pIdxInfo->aConstraintUsage[i].omit = 0;
+      continue;
+    }
+    aSig[nSig++] = iColumn;
+    aSig[nSig++] = pConstraint->op;
+    pIdxInfo->aConstraintUsage[i].argvIndex = argvIndex++;
+    pIdxInfo->aConstraintUsage[i].omit = 1;
+  }
+
+  // Comparisons on one pivot column with a value index, preferring one
+  // compared for equality. SQLite still checks them on each row returned.
+  iValueCol = -1;
+  pConstraint = pIdxInfo->aConstraint;
+  for(i=0; i<pIdxInfo->nConstraint; i++, pConstraint++){
+    int iColumn = pConstraint->iColumn-tab->nRow_cols;
+    if( pConstraint->usable==0 || iColumn<0 || iColumn>=tab->nCol_key ) continue;
+    if( !tab->aCol[iColumn].bValueIndex || !tab->bValueRebind ) continue;
+    if( !pivotValueIndexOp(pConstraint->op) ) continue;
+    if( sqlite3_stricmp(sqlite3_vtab_collation(pIdxInfo, i), "BINARY") ) continue;
+    if( iValueCol<0 || (!bValueEq && pConstraint->op==SQLITE_INDEX_CONSTRAINT_EQ) ){
+      iValueCol = iColumn;
+      bValueEq = pConstraint->op==SQLITE_INDEX_CONSTRAINT_EQ;
+    }
+  }
+  pConstraint = pIdxInfo->aConstraint;
+  for(i=0; iValueCol>=0 && i<pIdxInfo->nConstraint; i++, pConstraint++){
+    if( pConstraint->usable==0 || pConstraint->iColumn!=tab->nRow_cols+iValueCol ) continue;
+    if( !pivotValueIndexOp(pConstraint->op) ) continue;
+    if( sqlite3_stricmp(sqlite3_vtab_collation(pIdxInfo, i), "BINARY") ) continue;
+    aSig[nSig++] = pConstraint->iColumn;
+    aSig[nSig++] = pConstraint->op;
+    pIdxInfo->aConstraintUsage[i].argvIndex = argvIndex++;
+  }
+  nCons = nSig/2;
+
+  // ORDER BY can only be consumed if every term is a row key column, or a
+  // key-derived rowid, and rows are not read through a value index
+  const struct sqlite3_index_orderby *pOrderBy;
+  pOrderBy = pIdxInfo->aOrderBy;
+  for(i=0; i<pIdxInfo->nOrderBy; i++, pOrderBy++){
+    if( pOrderBy->iColumn<0 && tab->bKeyRowid ) continue;
+    if( pOrderBy->iColumn<0 || !(pOrderBy->iColumn < tab->nRow_cols) ) break;
+  }
+  if( pIdxInfo->nOrderBy>0 && i==pIdxInfo->nOrderBy && iValueCol<0 ){
+    pOrderBy = pIdxInfo->aOrderBy;
+    for(i=0; i<pIdxInfo->nOrderBy; i++, pOrderBy++){
+      aSig[nSig++] = pOrderBy->iColumn<0 ? 0 : pOrderBy->iColumn;
+      aSig[nSig++] = pOrderBy->desc;
+    }
+    pIdxInfo->orderByConsumed = 1;
+  }
+
+  iPlan = pivotPlanFind(tab, aSig, nCons, nSig);
+  pIdxInfo->idxNum = iPlan;
+  if( iPlan<0 ){
+    pIdxInfo->idxNum = -1-(int)mParam;
+    pIdxInfo->idxStr = pivotPlanSql(tab, aSig, nCons, nSig, 0);
+    pIdxInfo->needToFreeIdxStr = 1;
+  }
+  sqlite3_free(aSig);
+  if( iPlan<0 && pIdxInfo->idxStr==0 ) return SQLITE_NOMEM;
+
+  pIdxInfo->estimatedCost = (double)2147483647/argvIndex;
+  pIdxInfo->estimatedRows = 10;
+  if( iValueCol>=0 ) pIdxInfo->estimatedCost /= bValueEq ? 100 : 4;
+  
+  return SQLITE_OK;
+}
+
+/*
+** This following structure defines all the methods for the 
+** pivot virtual table.
+*/
+static sqlite3_module pivotModule = {
+  0,                 // iVersion
+  pivotCreate,       // xCreate
+  pivotConnect,      // xConnect
+  pivotBestIndex,    // xBestIndex
+  pivotDisconnect,   // xDisconnect
+  pivotDisconnect,   // xDestroy
+  pivotOpen,         // xOpen
+  pivotClose,        // xClose
+  pivotFilter,       // xFilter
+  pivotNext,         // xNext
+  pivotEof,          // xEof
+  pivotColumn,       // xColumn
+  pivotRowid,        // xRowid
+  0,                 // xUpdate
+  0,                 // xBegin
+  0,                 // xSync
+  0,                 // xCommit
+  0,                 // xRollback
+  0,                 // xFindFunction
+  pivotRename,       // xRename
+};
+
+/*
+** pivot_vtab_stats is an eponymous virtual table that reports the
+** statistics of every pivot table on the connection:
+**
+**   SELECT * FROM pivot_vtab_stats;
+**
+**   -- vtab   stat                value
+**   -- -----  ------------------  -----
+**   -- pivot  row_cache_capacity  1000
+**   -- pivot  row_cache_hits      42
+**   -- ...
+*/
+typedef struct pivot_stats_vtab pivot_stats_vtab;
+struct pivot_stats_vtab {
+  sqlite3_vtab base;             // Base class. Must be first
+  pivot_global *pGlobal;         // Per-connection state
+};
+
+typedef struct pivot_stats_cursor pivot_stats_cursor;
+struct pivot_stats_cursor {
+  sqlite3_vtab_cursor base;      // Base class - must be first
+  pivot_vtab *pTab;              // Current pivot table
+  int iStat;                     // Current statistic
+  sqlite3_int64 iRowid;          // The rowid
+};
+
+static int pivotStatsConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  pivot_stats_vtab *tab;
+  int rc;
+
+  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(vtab TEXT, stat TEXT, value)");
+  if( rc!=SQLITE_OK ) return rc;
+  tab = sqlite3_malloc(sizeof(*tab));
+  if( tab==0 ) return SQLITE_NOMEM;
+  memset(tab, 0, sizeof(*tab));
+  tab->pGlobal = (pivot_global*)pAux;
+  *ppVtab = &tab->base;
+  return SQLITE_OK;
+}
+
+static int pivotStatsDisconnect(sqlite3_vtab *pVtab){
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static int pivotStatsOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCur){
+  pivot_stats_cursor *cur;
+  cur = sqlite3_malloc(sizeof(*cur));
+  if( cur==0 ) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(*cur));
+  *ppCur = &cur->base;
+  return SQLITE_OK;
+}
+
+static int pivotStatsClose(sqlite3_vtab_cursor *pCur){
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int pivotStatsNext(sqlite3_vtab_cursor *pCur){
+  pivot_stats_cursor *cur = (pivot_stats_cursor*)pCur;
+  cur->iRowid++;
+  cur->iStat++;
+  if( cur->iStat>=PIVOT_STAT_COUNT ){
+    cur->iStat = 0;
+    cur->pTab = cur->pTab->pNext;
+  }
+  return SQLITE_OK;
+}
+
+static int pivotStatsColumn(
+  sqlite3_vtab_cursor *pCur,
+  sqlite3_context *ctx,
+  int i
+){
+  pivot_stats_cursor *cur = (pivot_stats_cursor*)pCur;
+  pivot_vtab *tab = cur->pTab;
+  sqlite3_int64 nLookup;
+  sqlite3_int64 nBytes;
+  int rc;
+  int j;
+
+  switch( i ){
+    case 0:
+      sqlite3_result_text(ctx, tab->zName, -1, SQLITE_TRANSIENT);
+      break;
+    case 1:
+      sqlite3_result_text(ctx, azPivotStat[cur->iStat], -1, SQLITE_STATIC);
+      break;
+    default:
+      switch( cur->iStat ){
+        case PIVOT_STAT_ROW_CACHE_CAPACITY:
+          sqlite3_result_int64(ctx, tab->rowCache.nMax);
+          break;
+        case PIVOT_STAT_ROW_CACHE_SIZE:
+          sqlite3_result_int64(ctx, tab->rowCache.nEntry);
+          break;
+        case PIVOT_STAT_MISS_CACHE_CAPACITY:
+          sqlite3_result_int64(ctx, tab->missCache.nMax);
+          break;
+        case PIVOT_STAT_MISS_CACHE_SIZE:
+          sqlite3_result_int64(ctx, tab->missCache.nEntry);
+          break;
+        case PIVOT_STAT_DEPENDENCIES:
+          if( tab->bTrackDeps ){
+            sqlite3_str *pDeps = sqlite3_str_new(0);
+            for( j=0; j<tab->nDep; j++ ){
+              sqlite3_str_appendf(pDeps, "%s%s.%s", j ? ", " : "", tab->aDep[j].zDb, tab->aDep[j].zTab);
+            }
+            sqlite3_result_text(ctx, sqlite3_str_finish(pDeps), -1, sqlite3_free);
+          }else{
+            sqlite3_result_null(ctx);
+          }
+          break;
+        case PIVOT_STAT_SOURCE_BYTES:
+          nBytes = 0;
+          for( j=0; j<tab->source.nVec; j++ ){
+            nBytes += pivotVectorBytes(&tab->source.aVec[j], tab->source.nEntry);
+          }
+          sqlite3_result_int64(ctx, nBytes);
+          break;
+        case PIVOT_STAT_INDEX_ADVICE:
+          rc = pivotAdvise(tab);
+          if( rc!=SQLITE_OK ){
+            sqlite3_result_error_code(ctx, rc);
+          }else if( tab->zAdvice ){
+            sqlite3_result_text(ctx, tab->zAdvice, -1, SQLITE_TRANSIENT);
+          }else{
+            sqlite3_result_null(ctx);
+          }
+          break;
+        case PIVOT_STAT_DEPENDENCY_CHANGES:
+          sqlite3_result_int64(ctx, tab->iDepChange);
+          break;
+        case PIVOT_STAT_ROW_CACHE_HIT_RATE:
+          nLookup = tab->aStat[PIVOT_STAT_ROW_CACHE_HITS] + tab->aStat[PIVOT_STAT_ROW_CACHE_MISSES];
+          if( nLookup>0 ){
+            sqlite3_result_double(ctx, (double)tab->aStat[PIVOT_STAT_ROW_CACHE_HITS]/nLookup);
+          }else{
+            sqlite3_result_null(ctx);
+          }
+          break;
+        default:
+          sqlite3_result_int64(ctx, tab->aStat[cur->iStat]);
+          break;
+      }
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int pivotStatsRowid(sqlite3_vtab_cursor *pCur, sqlite_int64 *pRowid){
+  pivot_stats_cursor *cur = (pivot_stats_cursor*)pCur;
+  *pRowid = cur->iRowid;
+  return SQLITE_OK;
+}
+
+static int pivotStatsEof(sqlite3_vtab_cursor *pCur){
+  pivot_stats_cursor *cur = (pivot_stats_cursor*)pCur;
+  return cur->pTab==0;
+}
+
+static int pivotStatsFilter(
+  sqlite3_vtab_cursor *pVtabCursor,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  pivot_stats_vtab *tab = (pivot_stats_vtab*)pVtabCursor->pVtab;
+  pivot_stats_cursor *cur = (pivot_stats_cursor*)pVtabCursor;
+  cur->pTab = tab->pGlobal->pVtab;
+  cur->iStat = 0;
+  cur->iRowid = 1;
+  return SQLITE_OK;
+}
+
+static int pivotStatsBestIndex(
+  sqlite3_vtab *pVtab,
+  sqlite3_index_info *pIdxInfo
+){
+  pIdxInfo->estimatedCost = 1000;
+  pIdxInfo->estimatedRows = 100;
+  return SQLITE_OK;
+}
+
+static sqlite3_module pivotStatsModule = {
+  0,                     // iVersion
+  0,                     // xCreate
+  pivotStatsConnect,     // xConnect
+  pivotStatsBestIndex,   // xBestIndex
+  pivotStatsDisconnect,  // xDisconnect
+  0,                     // xDestroy
+  pivotStatsOpen,        // xOpen
+  pivotStatsClose,       // xClose
+  pivotStatsFilter,      // xFilter
+  pivotStatsNext,        // xNext
+  pivotStatsEof,         // xEof
+  pivotStatsColumn,      // xColumn
+  pivotStatsRowid,       // xRowid
+  0,                     // xUpdate
+  0,                     // xBegin
+  0,                     // xSync
+  0,                     // xCommit
+  0,                     // xRollback
+  0,                     // xFindFunction
+  0,                     // xRename
+};
+
+/*
+** pivot_vtab_column_stats is an eponymous virtual table that reports the
+** evaluation profile of every pivot column of the pivot tables on the
+** connection. It can be limited to one pivot table with a table-valued
+** function argument:
+**
+**   SELECT column_name, evaluations, time_ms, fullscan_steps
+**     FROM pivot_vtab_column_stats('pivot')
+**    ORDER BY time_ms DESC;
+**
+** vm_steps and fullscan_steps are the SQLITE_STMTSTATUS_VM_STEP and
+** SQLITE_STMTSTATUS_FULLSCAN_STEP counters of the column's pivot query.
+** A high fullscan_steps count usually means the pivot query is missing an
+** index.
+*/
+typedef struct pivot_column_stats_cursor pivot_column_stats_cursor;
+struct pivot_column_stats_cursor {
+  sqlite3_vtab_cursor base;      // Base class - must be first
+  pivot_global *pGlobal;         // Per-connection state
+  pivot_vtab *pTab;              // Current pivot table
+  int iCol;                      // Current pivot column
+  char *zTab;                    // Pivot table to report, or 0 for all
+  sqlite3_int64 iRowid;          // The rowid
+};
+
+static int pivotColumnStatsConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  pivot_stats_vtab *tab;
+  int rc;
+
+  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(vtab TEXT, column_name TEXT, column_key,"
+                                " evaluations INTEGER, hits INTEGER, time_ms REAL,"
+                                " vm_steps INTEGER, fullscan_steps INTEGER, pivot HIDDEN)");
+  if( rc!=SQLITE_OK ) return rc;
+  tab = sqlite3_malloc(sizeof(*tab));
+  if( tab==0 ) return SQLITE_NOMEM;
+  memset(tab, 0, sizeof(*tab));
+  tab->pGlobal = (pivot_global*)pAux;
+  *ppVtab = &tab->base;
+  return SQLITE_OK;
+}
+
+static int pivotColumnStatsOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCur){
+  pivot_column_stats_cursor *cur;
+  cur = sqlite3_malloc(sizeof(*cur));
+  if( cur==0 ) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(*cur));
+  cur->pGlobal = ((pivot_stats_vtab*)pVtab)->pGlobal;
+  *ppCur = &cur->base;
+  return SQLITE_OK;
+}
+
+static int pivotColumnStatsClose(sqlite3_vtab_cursor *pCur){
+  pivot_column_stats_cursor *cur = (pivot_column_stats_cursor*)pCur;
+  sqlite3_free(cur->zTab);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+/*
+** Move the cursor forward to the first column at or after its current
+** position that is to be reported.
+*/
+static void pivotColumnStatsSkip(pivot_column_stats_cursor *cur){
+  while( cur->pTab ){
+    if( cur->iCol<cur->pTab->nCol_key
+     && (cur->zTab==0 || sqlite3_stricmp(cur->zTab, cur->pTab->zName)==0) ){
+      break;
+    }
+    cur->pTab = cur->pTab->pNext;
+    cur->iCol = 0;
+  }
+}
+
+static int pivotColumnStatsNext(sqlite3_vtab_cursor *pCur){
+  pivot_column_stats_cursor *cur = (pivot_column_stats_cursor*)pCur;
+  cur->iRowid++;
+  cur->iCol++;
+  pivotColumnStatsSkip(cur);
+  return SQLITE_OK;
+}
+
+static int pivotColumnStatsColumn(
+  sqlite3_vtab_cursor *pCur,
+  sqlite3_context *ctx,
+  int i
+){
+  pivot_column_stats_cursor *cur = (pivot_column_stats_cursor*)pCur;
+  pivot_vtab *tab = cur->pTab;
+  pivot_column *pCol = &tab->aCol[cur->iCol];
+
+  switch( i ){
+    case 0:
+      sqlite3_result_text(ctx, tab->zName, -1, SQLITE_TRANSIENT);
+      break;
+    case 1:
+      sqlite3_result_text(ctx, pCol->zName, -1, SQLITE_TRANSIENT);
+      break;
+    case 2:
+      if( pCol->pKey ) sqlite3_result_value(ctx, pCol->pKey);
+      break;
+    case 3:
+      sqlite3_result_int64(ctx, pCol->nEval);
+      break;
+    case 4:
+      sqlite3_result_int64(ctx, pCol->nHit);
+      break;
+    case 5:
+      sqlite3_result_double(ctx, pCol->nTime/1000000.0);
+      break;
+    case 6:
+      sqlite3_result_int(ctx, sqlite3_stmt_status(tab->col_stmt[cur->iCol], SQLITE_STMTSTATUS_VM_STEP, 0));
+      break;
+    case 7:
+      sqlite3_result_int(ctx, sqlite3_stmt_status(tab->col_stmt[cur->iCol], SQLITE_STMTSTATUS_FULLSCAN_STEP, 0));
+      break;
+    default:
+      if( cur->zTab ) sqlite3_result_text(ctx, cur->zTab, -1, SQLITE_TRANSIENT);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int pivotColumnStatsRowid(sqlite3_vtab_cursor *pCur, sqlite_int64 *pRowid){
+  pivot_column_stats_cursor *cur = (pivot_column_stats_cursor*)pCur;
+  *pRowid = cur->iRowid;
+  return SQLITE_OK;
+}
+
+static int pivotColumnStatsEof(sqlite3_vtab_cursor *pCur){
+  pivot_column_stats_cursor *cur = (pivot_column_stats_cursor*)pCur;
+  return cur->pTab==0;
+}
+
+static int pivotColumnStatsFilter(
+  sqlite3_vtab_cursor *pVtabCursor,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  pivot_column_stats_cursor *cur = (pivot_column_stats_cursor*)pVtabCursor;
+  sqlite3_free(cur->zTab);
+  cur->zTab = 0;
+  if( idxNum==1 ){
+    cur->zTab = sqlite3_mprintf("%s", sqlite3_value_text(argv[0]));
+    if( cur->zTab==0 ) return SQLITE_NOMEM;
+  }
+  cur->pTab = cur->pGlobal->pVtab;
+  cur->iCol = 0;
+  cur->iRowid = 1;
+  pivotColumnStatsSkip(cur);
+  return SQLITE_OK;
+}
+
+/*
+** Use an equality constraint on the hidden pivot column iCol, the pivot
+** table name argument of pivot_vtab_column_stats and pivot_vtab_latency.
+*/
+static int pivotNamedBestIndex(sqlite3_index_info *pIdxInfo, int iCol){
+  int i;
+  for(i=0; i<pIdxInfo->nConstraint; i++){
+    if( pIdxInfo->aConstraint[i].iColumn==iCol
+     && pIdxInfo->aConstraint[i].op==SQLITE_INDEX_CONSTRAINT_EQ
+     && pIdxInfo->aConstraint[i].usable ){
+      pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+      pIdxInfo->aConstraintUsage[i].omit = 1;
+      pIdxInfo->idxNum = 1;
+      pIdxInfo->estimatedCost = 100;
+      pIdxInfo->estimatedRows = 100;
+      return SQLITE_OK;
+    }
+  }
+  pIdxInfo->estimatedCost = 10000;
+  pIdxInfo->estimatedRows = 10000;
+  return SQLITE_OK;
+}
+
+static int pivotColumnStatsBestIndex(
+  sqlite3_vtab *pVtab,
+  sqlite3_index_info *pIdxInfo
+){
+  return pivotNamedBestIndex(pIdxInfo, 8);
+}
+
+static sqlite3_module pivotColumnStatsModule = {
+  0,                          // iVersion
+  0,                          // xCreate
+  pivotColumnStatsConnect,    // xConnect
+  pivotColumnStatsBestIndex,  // xBestIndex
+  pivotStatsDisconnect,       // xDisconnect
+  0,                          // xDestroy
+  pivotColumnStatsOpen,       // xOpen
+  pivotColumnStatsClose,      // xClose
+  pivotColumnStatsFilter,     // xFilter
+  pivotColumnStatsNext,       // xNext
+  pivotColumnStatsEof,        // xEof
+  pivotColumnStatsColumn,     // xColumn
+  pivotColumnStatsRowid,      // xRowid
+  0,                          // xUpdate
+  0,                          // xBegin
+  0,                          // xSync
+  0,                          // xCommit
+  0,                          // xRollback
+  0,                          // xFindFunction
+  0,                          // xRename
 };
 
-#define PIVOT_VTAB_CONNECT_ERROR \
-  sqlite3_finalize(stmt_key_query); \
-  sqlite3_finalize(stmt_pivot_query); \
-  sqlite3_finalize(stmt_col_query); \
-  sqlite3_free(sql); \
-  sqlite3_free(pivot_query_sql); \
-  sqlite3_free(tab->key_sql_full_table_scan); \
-  sqlite3_free(zMsg); \
-  sqlite3_free_table(azData); \
-  sqlite3_free(sqlite3_str_finish(create_vtab_sql)); \
-  for( i=0; i<tab->nCol_key; i++ ) \
-    sqlite3_finalize(tab->col_stmt[i]); \
-  sqlite3_free(tab->col_stmt); \
-  for( i=0; i<tab->nRow_cols; i++ ) \
-    sqlite3_free(tab->key_sql_col_names[i]); \
-  sqlite3_free(tab->key_sql_col_names); \
-  sqlite3_free(tab); \
-  return SQLITE_ERROR;
-
 /*
-** The pivotConnect() method is invoked to create a new
-** template virtual table.
-**
-** Think of this routine as the constructor for pivot_vtab objects.
+** pivot_vtab_latency is an eponymous virtual table that reports the latency
+** histograms of the pivot tables on the connection, one row per non-empty
+** bucket. The metrics are:
 **
-** All this routine needs to do is:
+**   scan       Time from xFilter to the end of the scan
+**   first_row  Time from xFilter to the first row
+**   cell       Time of one pivot query evaluation
 **
-**    (1) Allocate the pivot_vtab object and initialize all fields.
+** Bucket boundaries are powers of two nanoseconds. The max_ns of the last
+** bucket is NULL. As with pivot_vtab_column_stats, a table-valued function
+** argument limits the report to one pivot table:
 **
-**    (2) Tell SQLite (via the sqlite3_declare_vtab() interface) what the
-**        result set of queries against the virtual table will look like.
+**   SELECT metric, min_ns, count FROM pivot_vtab_latency('pivot');
 */
-static int pivotConnect(
+typedef struct pivot_latency_cursor pivot_latency_cursor;
+struct pivot_latency_cursor {
+  sqlite3_vtab_cursor base;      // Base class - must be first
+  pivot_global *pGlobal;         // Per-connection state
+  pivot_vtab *pTab;              // Current pivot table
+  int iHist;                     // Current histogram
+  int iBucket;                   // Current bucket
+  char *zTab;                    // Pivot table to report, or 0 for all
+  sqlite3_int64 iRowid;          // The rowid
+};
+
+static int pivotLatencyConnect(
   sqlite3 *db,
   void *pAux,
   int argc, const char *const*argv,
   sqlite3_vtab **ppVtab,
   char **pzErr
 ){
-  pivot_vtab *tab;
-  char *sql = 0;
-  char *pivot_query_sql = 0;
-  sqlite3_stmt *stmt_key_query = 0;
-  sqlite3_stmt *stmt_pivot_query = 0;
-  sqlite3_stmt *stmt_col_query = 0;
+  pivot_stats_vtab *tab;
   int rc;
-  int i, j;
 
-  sqlite3_str *create_vtab_sql = 0;
-  
-  tab = (pivot_vtab*)sqlite3_malloc(sizeof(pivot_vtab));
+  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(vtab TEXT, metric TEXT, min_ns INTEGER,"
+                                " max_ns INTEGER, count INTEGER, pivot HIDDEN)");
+  if( rc!=SQLITE_OK ) return rc;
+  tab = sqlite3_malloc(sizeof(*tab));
   if( tab==0 ) return SQLITE_NOMEM;
   memset(tab, 0, sizeof(*tab));
-  tab->db = db;
-  *ppVtab = (sqlite3_vtab*)tab;
-
-  // vars for sqlite3_get_table
-  int nRow = 0;
-  int nCol = 0;
-  char **azData = 0;
-  char *zMsg = 0;
-
-  // CREATE TABLE string
-  create_vtab_sql = sqlite3_str_new(db);
-  sqlite3_str_appendall(create_vtab_sql, "CREATE TABLE x(");
+  tab->pGlobal = (pivot_global*)pAux;
+  *ppVtab = &tab->base;
+  return SQLITE_OK;
+}
 
-  ///////////////////////////////////////////////////
-  // Pivot table key query
-  ///////////////////////////////////////////////////
+static int pivotLatencyOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCur){
+  pivot_latency_cursor *cur;
+  cur = sqlite3_malloc(sizeof(*cur));
+  if( cur==0 ) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(*cur));
+  cur->pGlobal = ((pivot_stats_vtab*)pVtab)->pGlobal;
+  *ppCur = &cur->base;
+  return SQLITE_OK;
+}
 
-  tab->key_sql_full_table_scan =  sqlite3_mprintf("SELECT * FROM \n%s", argv[3]);
-  rc = sqlite3_prepare_v2(db, tab->key_sql_full_table_scan, -1, &stmt_key_query, 0);
+static int pivotLatencyClose(sqlite3_vtab_cursor *pCur){
+  pivot_latency_cursor *cur = (pivot_latency_cursor*)pCur;
+  sqlite3_free(cur->zTab);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
 
-  // Validate pivot table key query
-  if( rc!=SQLITE_OK ){
-    *pzErr = sqlite3_mprintf("Pivot table key query prepare error - %s", sqlite3_errmsg(db));
-    PIVOT_VTAB_CONNECT_ERROR
+/*
+** Move the cursor forward to the first non-empty bucket at or after its
+** current position that is to be reported.
+*/
+static void pivotLatencySkip(pivot_latency_cursor *cur){
+  while( cur->pTab ){
+    if( cur->zTab==0 || sqlite3_stricmp(cur->zTab, cur->pTab->zName)==0 ){
+      while( cur->iHist<PIVOT_HIST_COUNT ){
+        if( cur->iBucket>=PIVOT_VTAB_HIST_BUCKETS ){
+          cur->iHist++;
+          cur->iBucket = 0;
+        }else if( PIVOT_ATOMIC_LOAD(&cur->pTab->aHist[cur->iHist][cur->iBucket])==0 ){
+          cur->iBucket++;
+        }else{
+          return;
+        }
+      }
+    }
+    cur->pTab = cur->pTab->pNext;
+    cur->iHist = 0;
+    cur->iBucket = 0;
   }
+}
 
-  // get row key columnn count
-  tab->nRow_cols = sqlite3_column_count(stmt_key_query);
+static int pivotLatencyNext(sqlite3_vtab_cursor *pCur){
+  pivot_latency_cursor *cur = (pivot_latency_cursor*)pCur;
+  cur->iRowid++;
+  cur->iBucket++;
+  pivotLatencySkip(cur);
+  return SQLITE_OK;
+}
 
-  // get row key column names
-  tab->key_sql_col_names = sqlite3_malloc(tab->nRow_cols*sizeof(char*));
-  memset(tab->key_sql_col_names, 0, tab->nRow_cols*sizeof(char*));
+static int pivotLatencyColumn(
+  sqlite3_vtab_cursor *pCur,
+  sqlite3_context *ctx,
+  int i
+){
+  pivot_latency_cursor *cur = (pivot_latency_cursor*)pCur;
+  pivot_vtab *tab = cur->pTab;
 
-  for( i=0; i<tab->nRow_cols; i++ ){
-    tab->key_sql_col_names[i] = sqlite3_mprintf("\"%w\"", sqlite3_column_name(stmt_key_query, i));
-    if( i>0 )
-      sqlite3_str_appendall(create_vtab_sql, ",");
-    sqlite3_str_appendf(create_vtab_sql, "%s", tab->key_sql_col_names[i]);
+  switch( i ){
+    case 0:
+      sqlite3_result_text(ctx, tab->zName, -1, SQLITE_TRANSIENT);
+      break;
+    case 1:
+      sqlite3_result_text(ctx, azPivotHist[cur->iHist], -1, SQLITE_STATIC);
+      break;
+    case 2:
+      sqlite3_result_int64(ctx, cur->iBucket==0 ? 0 : (sqlite3_int64)1<<cur->iBucket);
+      break;
+    case 3:
+      if( cur->iBucket<PIVOT_VTAB_HIST_BUCKETS-1 ){
+        sqlite3_result_int64(ctx, ((sqlite3_int64)2<<cur->iBucket)-1);
+      }
+      break;
+    case 4:
+      sqlite3_result_int64(ctx, PIVOT_ATOMIC_LOAD(&tab->aHist[cur->iHist][cur->iBucket]));
+      break;
+    default:
+      if( cur->zTab ) sqlite3_result_text(ctx, cur->zTab, -1, SQLITE_TRANSIENT);
+      break;
   }
+  return SQLITE_OK;
+}
 
-  sqlite3_finalize(stmt_key_query);
-  stmt_key_query = 0;
-
-  ///////////////////////////////////////////////////
-  // Pivot query
-  ///////////////////////////////////////////////////
+static int pivotLatencyRowid(sqlite3_vtab_cursor *pCur, sqlite_int64 *pRowid){
+  pivot_latency_cursor *cur = (pivot_latency_cursor*)pCur;
+  *pRowid = cur->iRowid;
+  return SQLITE_OK;
+}
 
-  pivot_query_sql =  sqlite3_mprintf("SELECT * FROM \n%s", argv[5]);
-  rc = sqlite3_prepare_v2(db, pivot_query_sql, -1, &stmt_pivot_query, 0);
+static int pivotLatencyEof(sqlite3_vtab_cursor *pCur){
+  pivot_latency_cursor *cur = (pivot_latency_cursor*)pCur;
+  return cur->pTab==0;
+}
 
-  // Validate pivot query 
-  if( rc!=SQLITE_OK ){
-    *pzErr = sqlite3_mprintf("Pivot query prepare error - %s", sqlite3_errmsg(db));
-    PIVOT_VTAB_CONNECT_ERROR
+static int pivotLatencyFilter(
+  sqlite3_vtab_cursor *pVtabCursor,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  pivot_latency_cursor *cur = (pivot_latency_cursor*)pVtabCursor;
+  sqlite3_free(cur->zTab);
+  cur->zTab = 0;
+  if( idxNum==1 ){
+    cur->zTab = sqlite3_mprintf("%s", sqlite3_value_text(argv[0]));
+    if( cur->zTab==0 ) return SQLITE_NOMEM;
   }
+  cur->pTab = cur->pGlobal->pVtab;
+  cur->iHist = 0;
+  cur->iBucket = 0;
+  cur->iRowid = 1;
+  pivotLatencySkip(cur);
+  return SQLITE_OK;
+}
 
-  tab->nRow_key = sqlite3_bind_parameter_count(stmt_pivot_query)-1;
+static int pivotLatencyBestIndex(
+  sqlite3_vtab *pVtab,
+  sqlite3_index_info *pIdxInfo
+){
+  return pivotNamedBestIndex(pIdxInfo, 5);
+}
 
-  // Validate bound param count
-  if( tab->nRow_key > tab->nRow_cols ){
-    *pzErr = sqlite3_mprintf("Pivot table key query error - Unexpected number of bound parameters.");
-    PIVOT_VTAB_CONNECT_ERROR
-  }
+static sqlite3_module pivotLatencyModule = {
+  0,                          // iVersion
+  0,                          // xCreate
+  pivotLatencyConnect,        // xConnect
+  pivotLatencyBestIndex,      // xBestIndex
+  pivotStatsDisconnect,       // xDisconnect
+  0,                          // xDestroy
+  pivotLatencyOpen,           // xOpen
+  pivotLatencyClose,          // xClose
+  pivotLatencyFilter,         // xFilter
+  pivotLatencyNext,           // xNext
+  pivotLatencyEof,            // xEof
+  pivotLatencyColumn,         // xColumn
+  pivotLatencyRowid,          // xRowid
+  0,                          // xUpdate
+  0,                          // xBegin
+  0,                          // xSync
+  0,                          // xCommit
+  0,                          // xRollback
+  0,                          // xFindFunction
+  0,                          // xRename
+};
 
-  sqlite3_finalize(stmt_pivot_query);
-  stmt_pivot_query = 0;
+/*
+** Return the pivot table zName of schema zDb connected to g, or 0.
+*/
+static pivot_vtab *pivotVtabFind(pivot_global *g, const char *zDb, const char *zName){
+  pivot_vtab *tab;
+  for( tab=g->pVtab; tab; tab=tab->pNext ){
+    if( sqlite3_stricmp(tab->zName, zName)==0 && sqlite3_stricmp(tab->zDb, zDb)==0 ) break;
+  }
+  return tab;
+}
 
-  ///////////////////////////////////////////////////
-  // Pivot table column definition query
-  ///////////////////////////////////////////////////
+/*
+** Return the pivot table named by SQL function argument pName, or set an
+** error and return 0 if there is none. The name may be qualified with the
+** schema, as in 'aux.pivot'. Otherwise the schemas are searched in the
+** order SQLite resolves unqualified names in - temp, main, then the
+** attached databases - for a pivot table of that name.
+*/
+static pivot_vtab *pivotFuncVtab(sqlite3_context *ctx, sqlite3_value *pName){
+  pivot_global *g = (pivot_global*)sqlite3_user_data(ctx);
+  const char *zArg = (const char*)sqlite3_value_text(pName);
+  const char *zName = zArg;
+  const char *zDb = 0;
+  const char *zSchema;
+  pivot_vtab *tab = 0;
+  int i;
 
-  sql =  sqlite3_mprintf("SELECT * FROM \n%s", argv[4]);
-  rc = sqlite3_prepare_v2(db, sql, -1, &stmt_col_query, 0);
+  for( i=0; zName && (zSchema = sqlite3_db_name(g->db, i))!=0; i++ ){
+    int n = (int)strlen(zSchema);
+    if( sqlite3_strnicmp(zName, zSchema, n)==0 && zName[n]=='.' ){
+      zDb = zSchema;
+      zName += n+1;
+      break;
+    }
+  }
+  for( i=0; tab==0 && zName && (zSchema = sqlite3_db_name(g->db, i==0 ? 1 : i==1 ? 0 : i))!=0; i++ ){
+    if( zDb && sqlite3_stricmp(zDb, zSchema)!=0 ) continue;
+    tab = pivotVtabFind(g, zSchema, zName);
+    if( tab==0 ){
+      // Preparing a statement that reads the table connects it
+      sqlite3_stmt *stmt = 0;
+      char *zSql = sqlite3_mprintf("SELECT 1 FROM \"%w\".\"%w\" LIMIT 0", zSchema, zName);
+      if( zSql && sqlite3_prepare_v2(g->db, zSql, -1, &stmt, 0)==SQLITE_OK ){
+        tab = pivotVtabFind(g, zSchema, zName);
+      }
+      sqlite3_finalize(stmt);
+      sqlite3_free(zSql);
+    }
+  }
+  if( tab==0 ){
+    char *zErr = sqlite3_mprintf("no such pivot table: %s", zArg ? zArg : "NULL");
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_free(zErr);
+  }
+  return tab;
+}
 
-  // Validate pivot table column definition query
+/*
+** Implementation of the pivot_advise(NAME) SQL function. Returns a script
+** of the CREATE INDEX statements that would turn the full scans made by
+** the pivot query of pivot table NAME into b-tree searches, or NULL if
+** the pivot query makes no full scans.
+*/
+static void pivotAdviseFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  pivot_vtab *tab = pivotFuncVtab(ctx, argv[0]);
+  int rc;
+  if( tab==0 ) return;
+  rc = pivotAdvise(tab);
   if( rc!=SQLITE_OK ){
-    *pzErr = sqlite3_mprintf("Pivot table column definition query prepare error - %s", sqlite3_errmsg(db));
-    PIVOT_VTAB_CONNECT_ERROR
+    sqlite3_result_error_code(ctx, rc);
+    return;
   }
+  if( tab->zAdvice ) sqlite3_result_text(ctx, tab->zAdvice, -1, SQLITE_TRANSIENT);
+}
 
-  // Validate pivot table column definition query count == 2
-  if( sqlite3_column_count(stmt_col_query) != 2 ){
-    *pzErr = sqlite3_mprintf("Pivot table column definition query expects 2 result column. Query contains %d columns.", sqlite3_column_count(stmt_col_query));
-    PIVOT_VTAB_CONNECT_ERROR
+/*
+** Aggregates computed by pivot_count(), pivot_sum(), pivot_avg(),
+** pivot_min() and pivot_max(), named as the SQL aggregate functions they
+** are equivalent to.
+*/
+enum {
+  PIVOT_AGG_COUNT,
+  PIVOT_AGG_SUM,
+  PIVOT_AGG_AVG,
+  PIVOT_AGG_MIN,
+  PIVOT_AGG_MAX
+};
+static const char *const azPivotAgg[] = {
+  "count",
+  "sum",
+  "avg",
+  "min",
+  "max",
+};
+
+/*
+** Add b to *pA, returning non-zero instead on integer overflow.
+*/
+static int pivotAddInt64(sqlite3_int64 *pA, sqlite3_int64 b){
+  sqlite3_int64 a = *pA;
+  if( b>=0 ){
+    if( a>0 && (sqlite3_int64)0x7fffffffffffffffLL-a<b ) return 1;
+  }else{
+    if( a<0 && -(a+(sqlite3_int64)0x7fffffffffffffffLL)>b+1 ) return 1;
   }
-  
-  // Validate pivot columns for uniqueness
-  rc = sqlite3_get_table(db, sql, &azData, &nRow, &nCol, &zMsg);
+  *pA = a+b;
+  return 0;
+}
 
-  if( rc!=SQLITE_OK ){
-    *pzErr = sqlite3_mprintf("%s", zMsg);
-    PIVOT_VTAB_CONNECT_ERROR
+/*
+** Add r to the compensated (Kahan-Babuska-Neumaier) sum *pSum + *pErr.
+*/
+static void pivotSumStep(double *pSum, double *pErr, double r){
+  double s = *pSum;
+  double t = s+r;
+  if( (s<0 ? -s : s)>(r<0 ? -r : r) ){
+    *pErr += (s-t)+r;
+  }else{
+    *pErr += (r-t)+s;
   }
+  *pSum = t;
+}
 
-  if( nRow > 1 ){
-    for( i=1; i<nRow-1; i++ ){
-      for( j=i+1; j<nRow; j++ ){
-        if( !strcmp(azData[i*nCol], azData[j*nCol]) ){
-          *pzErr = sqlite3_mprintf("Pivot table column keys must be unique. Duplicate column key \"%s\".", azData[i*nCol]);
-          PIVOT_VTAB_CONNECT_ERROR
+/*
+** Compute aggregate eAgg over the non-NULL values of an INTEGER, FLOAT or
+** all-NULL vector in the rows set in bitmap aMember. The loops run over
+** the unboxed arrays a byte of the bitmaps at a time, skipping bytes
+** without values.
+*/
+static void pivotVectorAggregate(
+  sqlite3_context *ctx,
+  pivot_vector *pVec,
+  const unsigned char *aMember,
+  int nRow,
+  int eAgg
+){
+  sqlite3_int64 nCount = 0;
+  sqlite3_int64 iSum = 0;
+  sqlite3_int64 iBest = 0;
+  double rSum = 0.0;
+  double rErr = 0.0;
+  double rBest = 0.0;
+  int bApprox = pVec->eType==SQLITE_FLOAT;
+  int bOverflow = 0;
+  int iSlot = 0;
+  int b;
+
+  for( b=0; pVec->eType && b<(nRow+7)/8; b++ ){
+    unsigned int valid = pVec->aValid[b];
+    unsigned int m = valid & aMember[b];
+    int iBase = iSlot;
+    iSlot += pVec->aRank ? pivotPopcount(valid) : 8;
+    if( m==0 ) continue;
+    if( eAgg==PIVOT_AGG_COUNT ){
+      nCount += pivotPopcount(m);
+      continue;
+    }
+    for( ; m; m &= m-1 ){
+      unsigned int k = m & (~m+1);
+      int i = iBase + pivotPopcount((k-1) & (pVec->aRank ? valid : 0xff));
+      if( pVec->eType==SQLITE_INTEGER ){
+        sqlite3_int64 v = pVec->aInt[i];
+        if( eAgg==PIVOT_AGG_MIN || eAgg==PIVOT_AGG_MAX ){
+          if( nCount==0 || (eAgg==PIVOT_AGG_MIN ? v<iBest : v>iBest) ) iBest = v;
+        }else if( bApprox ){
+          pivotSumStep(&rSum, &rErr, (double)v);
+        }else if( pivotAddInt64(&iSum, v) ){
+          // Carry on with a compensated real sum, as sum() and avg() do
+          bApprox = bOverflow = 1;
+          rSum = (double)iSum;
+          pivotSumStep(&rSum, &rErr, (double)v);
         }
-        if( !sqlite3_stricmp(azData[i*nCol+1], azData[j*nCol+1]) ){
-          *pzErr = sqlite3_mprintf("Pivot table column names must be unique. Duplicate column \"%s\".", azData[i*nCol+1]);
-          PIVOT_VTAB_CONNECT_ERROR
+      }else{
+        double r = pVec->aReal[i];
+        if( eAgg==PIVOT_AGG_MIN || eAgg==PIVOT_AGG_MAX ){
+          if( nCount==0 || (eAgg==PIVOT_AGG_MIN ? r<rBest : r>rBest) ) rBest = r;
+        }else{
+          pivotSumStep(&rSum, &rErr, r);
         }
       }
+      nCount++;
     }
   }
-  sqlite3_free_table(azData);
-  sqlite3_free(sql);
-
-  ///////////////////////////////////////////////////
-  // Construct remainder of vtab definition
-  ///////////////////////////////////////////////////
 
-  tab->nCol_key = 0;
-  while( sqlite3_step(stmt_col_query)==SQLITE_ROW ){
-    tab->nCol_key++;
-    tab->col_stmt = sqlite3_realloc(tab->col_stmt, tab->nCol_key*sizeof(sqlite3_stmt*));
-    
-    // prepare pivot col stmt
-    sqlite3_prepare_v2(db, pivot_query_sql, -1, &(tab->col_stmt[tab->nCol_key-1]), 0);
-    sqlite3_bind_value(tab->col_stmt[tab->nCol_key-1], tab->nRow_key+1, sqlite3_column_value(stmt_col_query, 0));
-    sqlite3_str_appendf(create_vtab_sql, ",\"%w\"", sqlite3_column_text(stmt_col_query, 1));
+  if( eAgg==PIVOT_AGG_COUNT ){
+    sqlite3_result_int64(ctx, nCount);
+  }else if( nCount==0 ){
+    sqlite3_result_null(ctx);
+  }else if( eAgg==PIVOT_AGG_MIN || eAgg==PIVOT_AGG_MAX ){
+    if( pVec->eType==SQLITE_INTEGER ){
+      sqlite3_result_int64(ctx, iBest);
+    }else{
+      sqlite3_result_double(ctx, rBest);
+    }
+  }else if( eAgg==PIVOT_AGG_AVG ){
+    sqlite3_result_double(ctx, (bApprox ? rSum+rErr : (double)iSum)/nCount);
+  }else if( bOverflow ){
+    sqlite3_result_error(ctx, "integer overflow", -1);
+  }else if( bApprox ){
+    sqlite3_result_double(ctx, rSum+rErr);
+  }else{
+    sqlite3_result_int64(ctx, iSum);
   }
-  sqlite3_finalize(stmt_col_query);
-  sqlite3_free(pivot_query_sql);
-  sqlite3_str_appendall(create_vtab_sql, ")");
-  
-  sql = sqlite3_str_finish(create_vtab_sql);
-  // printf("%s\n", sql);
-  rc = sqlite3_declare_vtab(db, sql);
-  sqlite3_free(sql);
-  
-  return rc;
 }
 
 /*
-** The xConnect and xCreate methods do the same thing, but they must be
-** different so that the virtual table is not an eponymous virtual table.
+** Implementation of pivot_count(TABLE, COLUMN), pivot_sum(), pivot_avg(),
+** pivot_min() and pivot_max(). Each returns the same as the SQL aggregate
+** over every row of the pivot table, e.g. pivot_sum('pivot', 'a') is
+** SELECT sum(a) FROM pivot.
+**
+** A pivot column of a table with a source query whose cells are all
+** integers or all reals is aggregated directly over the source scan
+** vectors, without producing rows. Other columns, and those of as-of
+** tables, are aggregated by running the equivalent SELECT. Real sums are
+** compensated, as in SQLite 3.43 and later, but are added in source query
+** order, so they may differ from those of a SELECT in the last bits.
 */
-static int pivotCreate(
-  sqlite3 *db,
-  void *pAux,
-  int argc, const char *const*argv,
-  sqlite3_vtab **ppVtab,
-  char **pzErr
-){
-  return pivotConnect(db, pAux, argc, argv, ppVtab, pzErr);
+static void pivotAggregate(sqlite3_context *ctx, sqlite3_value **argv, int eAgg){
+  pivot_vtab *tab = pivotFuncVtab(ctx, argv[0]);
+  const char *zCol = (const char*)sqlite3_value_text(argv[1]);
+  sqlite3_stmt *stmt = 0;
+  char *zSql;
+  int rc = SQLITE_OK;
+  int i;
+
+  if( tab==0 ) return;
+  for( i=0; zCol && i<tab->nCol_key; i++ ){
+    if( sqlite3_stricmp(tab->aCol[i].zName, zCol)==0 ) break;
+  }
+  if( zCol && i<tab->nCol_key && tab->zSourceSql && !tab->bReference && !tab->bAsOf
+   && tab->pRefresh==0 ){
+    pivot_vector *pVec;
+    pivotCacheValidate(tab);
+    if( !tab->source.bValid ) rc = pivotSourceScan(tab, 0);
+    if( rc==SQLITE_OK && tab->source.bValid ) rc = pivotScanMembers(tab);
+    if( rc!=SQLITE_OK ){
+      sqlite3_result_error_code(ctx, rc);
+      return;
+    }
+    pVec = &tab->source.aVec[i];
+    if( tab->source.aMember && !tab->source.bMemberDup && pVec->aOther==0
+     && (pVec->eType==0 || pVec->eType==SQLITE_INTEGER || pVec->eType==SQLITE_FLOAT) ){
+      pivotVectorAggregate(ctx, pVec, tab->source.aMember, tab->source.nEntry, eAgg);
+      return;
+    }
+  }
+
+  // An unknown column would be taken for a string literal by the SELECT
+  zSql = sqlite3_mprintf("\"%w\"", zCol ? zCol : "");
+  if( zSql && (zCol==0 || i==tab->nCol_key) ){
+    for( i=0; i<tab->nRow_cols; i++ ){
+      if( sqlite3_stricmp(tab->key_sql_col_names[i], zSql)==0 ) break;
+    }
+    if( i==tab->nRow_cols ){
+      sqlite3_free(zSql);
+      zSql = sqlite3_mprintf("no such column: %s", zCol ? zCol : "NULL");
+      if( zSql ) sqlite3_result_error(ctx, zSql, -1);
+      else sqlite3_result_error_nomem(ctx);
+      sqlite3_free(zSql);
+      return;
+    }
+  }
+  sqlite3_free(zSql);
+  zSql = sqlite3_mprintf("SELECT %s(\"%w\") FROM \"%w\".\"%w\"", azPivotAgg[eAgg],
+                         zCol ? zCol : "", tab->zDb, tab->zName);
+  if( zSql==0 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  rc = sqlite3_prepare_v2(tab->db, zSql, -1, &stmt, 0);
+  sqlite3_free(zSql);
+  if( rc==SQLITE_OK && sqlite3_step(stmt)==SQLITE_ROW ){
+    sqlite3_result_value(ctx, sqlite3_column_value(stmt, 0));
+  }
+  rc = sqlite3_finalize(stmt);
+  if( rc!=SQLITE_OK ) sqlite3_result_error(ctx, sqlite3_errmsg(tab->db), -1);
+}
+
+static void pivotCountFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  pivotAggregate(ctx, argv, PIVOT_AGG_COUNT);
+}
+static void pivotSumFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  pivotAggregate(ctx, argv, PIVOT_AGG_SUM);
+}
+static void pivotAvgFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  pivotAggregate(ctx, argv, PIVOT_AGG_AVG);
+}
+static void pivotMinFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  pivotAggregate(ctx, argv, PIVOT_AGG_MIN);
+}
+static void pivotMaxFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  pivotAggregate(ctx, argv, PIVOT_AGG_MAX);
 }
 
 /*
-** Implementation of pivot xRename method.
+** Implementation of the pivot_vtab_global() SQL function, which returns the
+** per-connection state as a pointer value. pivot_vtab_reader_open() uses
+** it to find the pivot tables of a connection.
 */
-static int pivotRename(
-  sqlite3_vtab *pVtab, // Virtual table handle
-  const char *zName    // New name of table
+static void pivotGlobalFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
 ){
-  return SQLITE_OK;
+  sqlite3_result_pointer(ctx, sqlite3_user_data(ctx), "pivot_global", 0);
 }
 
 /*
-** This method is the destructor for pivot_vtab objects.
+** pivot_vtab_reader reads a pivot table through the pivot_vtab methods,
+** with the same plans, caches and source scans as SQL statements. See
+** pivot_vtab.h.
 */
-static int pivotDisconnect(sqlite3_vtab *pVtab){
-  pivot_vtab *tab = (pivot_vtab*)pVtab;
+struct pivot_vtab_reader {
+  pivot_vtab *tab;               // Pivot table read, or 0 once it is disconnected
+  pivot_vtab_reader *pNext;      // Next reader of the same pivot table
+  pivot_cursor *cur;             // Cursor of the current scan, or 0
+  int rc;                        // Error that ended the current scan, or SQLITE_OK
+  int nCol;                      // Number of columns
+  char **azName;                 // Unquoted name of each column
+  int nCons;                     // Number of constraints
+  struct sqlite3_index_constraint *aCons; // Constraints, all usable
+  sqlite3_value **aConsVal;      // Value of each constraint
+  int nText;                     // Number of values in azText
+  int nTextAlloc;                // Allocated size of azText
+  char **azText;                 // Text values fetched by the last batch
+  char *zErr;                    // Error message of the last failed call, or 0
+};
 
+int pivot_vtab_reader_open(
+  sqlite3 *db,
+  const char *zDb,
+  const char *zTab,
+  pivot_vtab_reader **ppReader
+){
+  pivot_global *g = 0;
+  pivot_vtab *tab = 0;
+  pivot_vtab_reader *p;
+  sqlite3_stmt *stmt = 0;
+  char *zSchema = 0;
+  char *zSql;
+  int nCol;
+  int rc = SQLITE_OK;
   int i;
-  for( i=0; i<tab->nCol_key; i++ )
-    sqlite3_finalize(tab->col_stmt[i]);
-  sqlite3_free(tab->col_stmt);
 
-  for( i=0; i<tab->nRow_cols; i++ )
-    sqlite3_free(tab->key_sql_col_names[i]);
-  sqlite3_free(tab->key_sql_col_names);
+  *ppReader = 0;
 
-  sqlite3_free(tab->key_sql_full_table_scan);
+  // Resolve an unqualified name as SQLite does - temp, then main, then
+  // the attached databases in order
+  for( i=0; zDb==0 && rc==SQLITE_OK && sqlite3_db_name(db, i); i++ ){
+    const char *zName = sqlite3_db_name(db, i==0 ? 1 : i==1 ? 0 : i);
+    zSql = sqlite3_mprintf("SELECT 1 FROM \"%w\".sqlite_schema WHERE type = 'table' AND name = ?1 COLLATE NOCASE", zName);
+    if( zSql==0 ) return SQLITE_NOMEM;
+    rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+    sqlite3_free(zSql);
+    if( rc==SQLITE_OK ){
+      sqlite3_bind_text(stmt, 1, zTab, -1, SQLITE_STATIC);
+      if( sqlite3_step(stmt)==SQLITE_ROW ){
+        zDb = zSchema = sqlite3_mprintf("%s", zName);
+        if( zSchema==0 ) rc = SQLITE_NOMEM;
+      }
+      rc = sqlite3_finalize(stmt);
+      stmt = 0;
+    }
+  }
+  if( rc!=SQLITE_OK || zDb==0 ){
+    sqlite3_free(zSchema);
+    return rc!=SQLITE_OK ? rc : SQLITE_ERROR;
+  }
 
-  sqlite3_free(tab);
+  // Preparing a statement that reads the table connects it
+  zSql = sqlite3_mprintf("SELECT pivot_vtab_global(), (SELECT 1 FROM \"%w\".\"%w\" LIMIT 0)", zDb, zTab);
+  if( zSql==0 ) rc = SQLITE_NOMEM;
+  if( rc==SQLITE_OK ) rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+  sqlite3_free(zSql);
+  if( rc==SQLITE_OK && sqlite3_step(stmt)==SQLITE_ROW ){
+    g = (pivot_global*)sqlite3_value_pointer(sqlite3_column_value(stmt, 0), "pivot_global");
+  }
+  if( rc==SQLITE_OK ) rc = sqlite3_finalize(stmt);
+
+  if( rc==SQLITE_OK && g ) tab = pivotVtabFind(g, zDb, zTab);
+  sqlite3_free(zSchema);
+  if( rc!=SQLITE_OK ) return rc;
+  if( tab==0 ) return SQLITE_ERROR;
+
+  p = sqlite3_malloc(sizeof(*p));
+  if( p==0 ) return SQLITE_NOMEM;
+  memset(p, 0, sizeof(*p));
+  p->tab = tab;
+  *ppReader = p;
+
+  // Row key column names are kept quoted for use in SQL
+  nCol = p->nCol = tab->nRow_cols+tab->nCol_key;
+  p->azName = sqlite3_malloc(nCol*sizeof(char*));
+  if( p->azName==0 ) rc = SQLITE_NOMEM;
+  for( i=0; rc==SQLITE_OK && i<nCol; i++ ){
+    if( i<tab->nRow_cols ){
+      const char *zIn = tab->key_sql_col_names[i]+1;
+      char *zOut = p->azName[i] = sqlite3_malloc((int)strlen(zIn));
+      if( zOut ){
+        for( ; zIn[1]; zIn++ ){
+          *zOut++ = *zIn;
+          if( zIn[0]=='"' ) zIn++;
+        }
+        *zOut = 0;
+      }
+    }else{
+      p->azName[i] = sqlite3_mprintf("%s", tab->aCol[i-tab->nRow_cols].zName);
+    }
+    if( p->azName[i]==0 ){
+      while( --i>=0 ) sqlite3_free(p->azName[i]);
+      sqlite3_free(p->azName);
+      p->azName = 0;
+      rc = SQLITE_NOMEM;
+    }
+  }
+  if( rc!=SQLITE_OK ){
+    sqlite3_free(p);
+    *ppReader = 0;
+    return rc;
+  }
+  p->pNext = tab->pReader;
+  tab->pReader = p;
   return SQLITE_OK;
 }
 
+int pivot_vtab_reader_column_count(pivot_vtab_reader *p){
+  return p->nCol;
+}
+
+const char *pivot_vtab_reader_column_name(pivot_vtab_reader *p, int iCol){
+  if( iCol<0 || iCol>=p->nCol ) return 0;
+  return p->azName[iCol];
+}
+
+const char *pivot_vtab_reader_errmsg(pivot_vtab_reader *p){
+  return p->zErr;
+}
+
 /*
-** Constructor for a new pivot_cursor object.
+** Set the error message of a reader whose pivot table has been dropped or
+** disconnected.
 */
-static int pivotOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCur){
-  pivot_cursor *cur;
-  cur = sqlite3_malloc( sizeof(*cur) );
-  if( cur==0 ) return SQLITE_NOMEM;
-  memset(cur, 0, sizeof(*cur));
-  *ppCur = &cur->base;
-  return SQLITE_OK;
+static int pivotReaderDetached(pivot_vtab_reader *p){
+  sqlite3_free(p->zErr);
+  p->zErr = sqlite3_mprintf("Pivot table reader error - the pivot table has been dropped or disconnected.");
+  return SQLITE_ABORT;
 }
 
 /*
-** Destructor for a pivot_cursor.
+** Set the error message of a reader to that of the pivot table, or to
+** the message for error code rc if the pivot table has none.
 */
-static int pivotClose(sqlite3_vtab_cursor *pCur){
-  pivot_vtab *tab = (pivot_vtab*)pCur->pVtab;
-  pivot_cursor *cur = (pivot_cursor*)pCur;
+static int pivotReaderError(pivot_vtab_reader *p, int rc){
+  sqlite3_free(p->zErr);
+  if( p->tab && p->tab->base.zErrMsg ){
+    p->zErr = p->tab->base.zErrMsg;
+    p->tab->base.zErrMsg = 0;
+  }else{
+    p->zErr = sqlite3_mprintf("%s", sqlite3_errstr(rc));
+  }
+  return rc;
+}
+
+int pivot_vtab_reader_constrain(pivot_vtab_reader *p, const char *zCol, int op, sqlite3_value *pVal){
+  pivot_vtab *tab = p->tab;
+  struct sqlite3_index_constraint *aCons;
+  sqlite3_value **aConsVal;
+  int iColumn = -1;
   int i;
 
-  if( cur->pivot_key ){
-    for( i=0; i<tab->nRow_cols; i++ )
-      sqlite3_value_free(cur->pivot_key[i]);
-    sqlite3_free(cur->pivot_key);
+  if( tab==0 ) return pivotReaderDetached(p);
+  sqlite3_free(p->zErr);
+  p->zErr = 0;
+  for( i=0; i<tab->nRow_cols && iColumn<0; i++ ){
+    if( sqlite3_stricmp(p->azName[i], zCol)==0 ) iColumn = i;
   }
-  if( cur->stmt )
-    sqlite3_finalize(cur->stmt);
-  sqlite3_free(cur);
+  for( i=0; i<tab->nParam && iColumn<0; i++ ){
+    if( sqlite3_stricmp(tab->azParam[i], zCol)==0 ){
+      if( op!=SQLITE_INDEX_CONSTRAINT_EQ ){
+        p->zErr = sqlite3_mprintf("Pivot table reader error - parameter %s only takes equality constraints.", zCol);
+        return SQLITE_MISUSE;
+      }
+      iColumn = tab->nRow_cols+tab->nCol_key+i;
+    }
+  }
+  if( iColumn<0 || pivotConstraintOp(op)==0 ){
+    p->zErr = sqlite3_mprintf("Pivot table reader error - cannot constrain %s.", zCol);
+    return SQLITE_MISUSE;
+  }
+
+  aCons = sqlite3_realloc(p->aCons, (p->nCons+1)*sizeof(*aCons));
+  if( aCons==0 ) return SQLITE_NOMEM;
+  p->aCons = aCons;
+  aConsVal = sqlite3_realloc(p->aConsVal, (p->nCons+1)*sizeof(sqlite3_value*));
+  if( aConsVal==0 ) return SQLITE_NOMEM;
+  p->aConsVal = aConsVal;
+  aConsVal[p->nCons] = sqlite3_value_dup(pVal);
+  if( aConsVal[p->nCons]==0 ) return SQLITE_NOMEM;
+  memset(&aCons[p->nCons], 0, sizeof(*aCons));
+  aCons[p->nCons].iColumn = iColumn;
+  aCons[p->nCons].op = (unsigned char)op;
+  aCons[p->nCons].usable = 1;
+  p->nCons++;
   return SQLITE_OK;
 }
 
 /*
-** Advance a pivot_cursor to its next row of output.
+** Plan and start a scan of the pivot table with the constraints of p, as
+** SQLite would for a SELECT on the table.
 */
-static int pivotNext(sqlite3_vtab_cursor *pCur){
-  pivot_vtab *tab = (pivot_vtab*)pCur->pVtab;
-  pivot_cursor *cur = (pivot_cursor*)pCur;
+static int pivotReaderStart(pivot_vtab_reader *p){
+  pivot_vtab *tab = p->tab;
+  sqlite3_index_info info;
+  struct sqlite3_index_constraint_usage *aUsage;
+  sqlite3_value **argv;
+  sqlite3_vtab_cursor *pCur = 0;
+  int nArg = 0;
+  int rc = SQLITE_OK;
   int i;
-  
-  if( cur->pivot_key ){
-    for( i=0; i<tab->nRow_cols; i++ ){
-      sqlite3_value_free(cur->pivot_key[i]);
-      cur->pivot_key[i] = 0;
+
+  memset(&info, 0, sizeof(info));
+  aUsage = sqlite3_malloc(p->nCons*sizeof(*aUsage)+1);
+  argv = sqlite3_malloc(p->nCons*sizeof(sqlite3_value*)+1);
+  if( aUsage==0 || argv==0 ){
+    rc = SQLITE_NOMEM;
+  }else{
+    memset(aUsage, 0, p->nCons*sizeof(*aUsage));
+    info.nConstraint = p->nCons;
+    info.aConstraint = p->aCons;
+    info.aConstraintUsage = aUsage;
+    info.colUsed = ~(sqlite3_uint64)0;
+    rc = pivotBestIndex(&tab->base, &info);
+  }
+  for( i=0; rc==SQLITE_OK && i<p->nCons; i++ ){
+    int k = aUsage[i].argvIndex;
+    if( k==0 ){
+      sqlite3_free(tab->base.zErrMsg);
+      tab->base.zErrMsg = sqlite3_mprintf("Pivot table reader error - constraint %d cannot be used.", i);
+      rc = SQLITE_ERROR;
+    }else{
+      argv[k-1] = p->aConsVal[i];
+      if( k>nArg ) nArg = k;
     }
   }
-  
-  cur->rc = sqlite3_step(cur->stmt);
-  if( cur->rc != SQLITE_DONE ){
-    for( i=0; i<tab->nRow_cols; i++ )
-      cur->pivot_key[i] = sqlite3_value_dup(sqlite3_column_value(cur->stmt, i));
+  if( rc==SQLITE_OK ) rc = pivotOpen(&tab->base, &pCur);
+  if( rc==SQLITE_OK ){
+    pCur->pVtab = &tab->base;
+    rc = pivotFilter(pCur, info.idxNum, info.idxStr, nArg, argv);
+    if( rc==SQLITE_OK ){
+      p->cur = (pivot_cursor*)pCur;
+    }else{
+      pivotClose(pCur);
+    }
   }
-  
-  cur->iRowid++;
-  return SQLITE_OK;
+  if( info.needToFreeIdxStr ) sqlite3_free(info.idxStr);
+  sqlite3_free(aUsage);
+  sqlite3_free(argv);
+  return rc;
 }
 
 /*
-** Return values of columns for the row at which the pivot_cursor
-** is currently pointing.
+** Keep a copy of the n bytes of text z until the next batch, and store
+** it as row iRow of buffer pBuf.
 */
-static int pivotColumn(
-  sqlite3_vtab_cursor *pCur,  // The cursor
-  sqlite3_context *ctx,       // First argument to sqlite3_result_...()
-  int i                       // Which column to return
+static int pivotReaderStoreText(
+  pivot_vtab_reader *p,
+  pivot_vtab_buffer *pBuf,
+  int iRow,
+  const char *z,
+  int n
 ){
-  pivot_vtab *tab = (pivot_vtab*)pCur->pVtab;
-  pivot_cursor *cur = (pivot_cursor*)pCur;
-
-  if( i<tab->nRow_cols ){
-    // return the row key
-    sqlite3_result_value(ctx, cur->pivot_key[i]);
-  }else{
-    // return column value, or null
-    sqlite3_stmt *stmt = tab->col_stmt[i-tab->nRow_cols];
-
-    for( i=0; i<tab->nRow_key; i++ )
-      sqlite3_bind_value(stmt, i+1, cur->pivot_key[i]);
-
-    if( sqlite3_step(stmt)==SQLITE_ROW ){
-      sqlite3_result_value(ctx, sqlite3_column_value(stmt, 0));
-    }else{
-      sqlite3_result_null(ctx);
-    }
-    sqlite3_reset(stmt);
+  char *zCopy;
+  if( p->nText==p->nTextAlloc ){
+    int nAlloc = p->nTextAlloc ? p->nTextAlloc*2 : 64;
+    char **azText = sqlite3_realloc(p->azText, nAlloc*sizeof(char*));
+    if( azText==0 ) return SQLITE_NOMEM;
+    p->azText = azText;
+    p->nTextAlloc = nAlloc;
   }
-  
+  zCopy = sqlite3_malloc(n+1);
+  if( zCopy==0 ) return SQLITE_NOMEM;
+  if( n>0 ) memcpy(zCopy, z, n);
+  zCopy[n] = 0;
+  p->azText[p->nText++] = zCopy;
+  pBuf->azText[iRow] = zCopy;
   return SQLITE_OK;
 }
 
 /*
-** Return the rowid for the current row.
+** Store value pVal, or NULL if pVal is 0, as row iRow of buffer pBuf.
 */
-static int pivotRowid(sqlite3_vtab_cursor *pCur, sqlite_int64 *pRowid){
-  pivot_cursor *cur = (pivot_cursor*)pCur;
-  *pRowid = cur->iRowid;
+static int pivotReaderStoreValue(
+  pivot_vtab_reader *p,
+  pivot_vtab_buffer *pBuf,
+  int iRow,
+  sqlite3_value *pVal
+){
+  if( pVal==0 || sqlite3_value_type(pVal)==SQLITE_NULL ){
+    if( pBuf->aNull ) pBuf->aNull[iRow/8] |= (unsigned char)(1<<(iRow%8));
+    pVal = 0;
+  }
+  switch( pBuf->eType ){
+    case SQLITE_INTEGER:
+      pBuf->aInt[iRow] = pVal ? sqlite3_value_int64(pVal) : 0;
+      break;
+    case SQLITE_FLOAT:
+      pBuf->aReal[iRow] = pVal ? sqlite3_value_double(pVal) : 0.0;
+      break;
+    case SQLITE_TEXT:
+      pBuf->azText[iRow] = 0;
+      if( pVal ){
+        const char *z = (const char*)sqlite3_value_text(pVal);
+        if( z==0 ) return SQLITE_NOMEM;
+        return pivotReaderStoreText(p, pBuf, iRow, z, sqlite3_value_bytes(pVal));
+      }
+      break;
+  }
   return SQLITE_OK;
 }
 
 /*
-** Return TRUE if the cursor has been moved off of the last
-** row of output.
+** Store a cell as row iRow of buffer pBuf. Source scan cells already of
+** the buffer type are copied unboxed; others are converted as
+** sqlite3_value_*() would.
 */
-static int pivotEof(sqlite3_vtab_cursor *pCur){
-  pivot_vtab *tab = (pivot_vtab*)pCur->pVtab;
-  pivot_cursor *cur = (pivot_cursor*)pCur; 
-  int i;
+static int pivotReaderStore(
+  pivot_vtab_reader *p,
+  pivot_vtab_buffer *pBuf,
+  int iRow,
+  pivot_cell *pCell
+){
+  pivot_vector *pVec = pCell->pVec;
+  sqlite3_value *pVal;
+  int rc;
 
-  if( cur->rc == SQLITE_DONE ){
-    if( cur->pivot_key ){
-      for( i=0; i<tab->nRow_cols; i++ )
-        sqlite3_value_free(cur->pivot_key[i]);
-      sqlite3_free(cur->pivot_key);
+  if( pVec==0 ) return pivotReaderStoreValue(p, pBuf, iRow, pCell->pVal);
+  if( !PIVOT_BIT(pVec->aValid, pCell->iRow) ){
+    return pivotReaderStoreValue(p, pBuf, iRow, 0);
+  }
+  if( pVec->aOther==0 || pVec->aOther[pCell->iRow]==0 ){
+    int iSlot = pivotVectorSlot(pVec, pCell->iRow);
+    if( pBuf->eType==SQLITE_INTEGER && pVec->eType==SQLITE_INTEGER ){
+      pBuf->aInt[iRow] = pVec->aInt[iSlot];
+      return SQLITE_OK;
+    }
+    if( pBuf->eType==SQLITE_FLOAT && pVec->eType==SQLITE_FLOAT ){
+      pBuf->aReal[iRow] = pVec->aReal[iSlot];
+      return SQLITE_OK;
+    }
+    if( pBuf->eType==SQLITE_TEXT && (pVec->eType==SQLITE_TEXT || pVec->eType==SQLITE_BLOB) ){
+      const char *z;
+      int n = pivotVectorText(pVec, iSlot, &z);
+      return pivotReaderStoreText(p, pBuf, iRow, z, n);
     }
-    sqlite3_finalize(cur->stmt);
-    cur->stmt = 0;
-    return 1;
   }
-  return 0;
+  rc = pivotVectorValue(p->tab, pVec, pCell->iRow, &pVal);
+  if( rc==SQLITE_OK ) rc = pivotReaderStoreValue(p, pBuf, iRow, pVal);
+  sqlite3_value_free(pVal);
+  return rc;
 }
 
 /*
-** This method is called to "rewind" the templatevtab_cursor object back
-** to the first row of output.  This method is always called at least
-** once prior to any call to templatevtabColumn() or templatevtabRowid() or 
-** templatevtabEof().
+** Free the text values fetched by the last batch.
 */
-static int pivotFilter(
-  sqlite3_vtab_cursor *pVtabCursor, 
-  int idxNum, const char *idxStr,
-  int argc, sqlite3_value **argv
-){
-  pivot_vtab *tab = (pivot_vtab*)pVtabCursor->pVtab;
-  pivot_cursor *cur = (pivot_cursor*)pVtabCursor;
+static void pivotReaderClearText(pivot_vtab_reader *p){
   int i;
-  
-  cur->pivot_key = sqlite3_malloc(tab->nRow_cols*sizeof(sqlite3_value*));
-  
-  // Row query
-  sqlite3_prepare_v2(tab->db, idxStr, -1, &(cur->stmt), 0);
-  for( i=0; i<argc; i++ )
-    sqlite3_bind_value(cur->stmt, i+1, argv[i]);
-
-  // printf("%s\n", sqlite3_expanded_sql(cur->stmt));
+  for( i=0; i<p->nText; i++ ) sqlite3_free(p->azText[i]);
+  p->nText = 0;
+}
 
-  cur->rc = sqlite3_step(cur->stmt);
-  if( cur->rc == SQLITE_DONE ){
-    cur->pivot_key = 0;
-  }else{
-    for( i=0; i<tab->nRow_cols; i++ )
-      cur->pivot_key[i] = sqlite3_value_dup(sqlite3_column_value(cur->stmt, i));
+/*
+** Check that aBuf holds nBuf buffers, one per column of the reader, each
+** of a known type and with the array of its type.
+*/
+static int pivotReaderCheckBuffers(pivot_vtab_reader *p, int nBuf, pivot_vtab_buffer *aBuf){
+  int i;
+  if( nBuf!=p->nCol ){
+    p->zErr = sqlite3_mprintf("Pivot table reader error - %d buffers for %d columns.", nBuf, p->nCol);
+    return SQLITE_MISUSE;
+  }
+  for( i=0; i<nBuf; i++ ){
+    int eType = aBuf[i].eType;
+    if( (eType==SQLITE_INTEGER && aBuf[i].aInt)
+     || (eType==SQLITE_FLOAT && aBuf[i].aReal)
+     || (eType==SQLITE_TEXT && aBuf[i].azText)
+     || eType==SQLITE_NULL
+    ){
+      continue;
+    }
+    p->zErr = sqlite3_mprintf("Pivot table reader error - bad buffer for column %s.", p->azName[i]);
+    return SQLITE_MISUSE;
   }
-  
-  cur->iRowid = 1;
   return SQLITE_OK;
 }
 
 /*
-** SQLite will invoke this method one or more times while planning a query
-** that uses the pivot virtual table.  This routine needs to create
-** a query plan for each invocation and compute an estimated cost for that
-** plan.
+** End the current scan of a reader, if any.
 */
-static int pivotBestIndex(
-  sqlite3_vtab *pVtab,
-  sqlite3_index_info *pIdxInfo
-){
-  pivot_vtab *tab = (pivot_vtab*)pVtab;
-  int i;
-  int argvIndex = 1;
-  int orderIdx = 0;
-  char *op;
+static void pivotReaderEnd(pivot_vtab_reader *p){
+  if( p->cur ){
+    pivotClose(&p->cur->base);
+    p->cur = 0;
+  }
+}
 
-  sqlite3_str *key_sql_filtered;
+int pivot_vtab_reader_fetch(
+  pivot_vtab_reader *p,
+  int nRow,
+  int nBuf,
+  pivot_vtab_buffer *aBuf,
+  int *pnRow
+){
+  pivot_vtab *tab = p->tab;
+  pivot_cell cell;
+  int rc = SQLITE_OK;
+  int iRow = 0;
+  int iCol;
 
-  key_sql_filtered = sqlite3_str_new(tab->db);
-  sqlite3_str_appendall(key_sql_filtered, tab->key_sql_full_table_scan);
+  *pnRow = 0;
+  pivotReaderClearText(p);
+  if( tab==0 ) return pivotReaderDetached(p);
 
-  const struct sqlite3_index_constraint *pConstraint;
-  pConstraint = pIdxInfo->aConstraint;
-  for(i=0; i<pIdxInfo->nConstraint; i++, pConstraint++){
-    if( pConstraint->usable==0 ) continue;
-    if( !(pConstraint->iColumn < tab->nRow_cols) ) continue;
-    switch( pConstraint->op ){
-      case SQLITE_INDEX_CONSTRAINT_EQ:
-        op = "=";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_LT:
-        op = "<";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_LE:
-        op = "<=";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_GT:
-        op = ">";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_GE:
-        op = ">=";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_MATCH:
-        op = "MATCH";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_LIKE:
-        op = "LIKE";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_GLOB:
-        op = "GLOB";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_REGEXP:
-        op = "REGEXP";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_NE:
-        op = "<>";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_ISNOT:
-      case SQLITE_INDEX_CONSTRAINT_ISNOTNULL:
-        op = "IS NOT";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_ISNULL:
-      case SQLITE_INDEX_CONSTRAINT_IS:
-        op = "IS";
-        break;
-      case SQLITE_INDEX_CONSTRAINT_FUNCTION:
-      default:
-        pIdxInfo->aConstraintUsage[i].omit = 0;
-        op = 0;
-        break;
-    }
+  // An error after some rows of the last batch is returned now
+  if( p->rc!=SQLITE_OK ) return p->rc;
+  sqlite3_free(p->zErr);
+  p->zErr = 0;
+  if( nRow<0 ){
+    p->zErr = sqlite3_mprintf("Pivot table reader error - negative row count.");
+    return SQLITE_MISUSE;
+  }
+  rc = pivotReaderCheckBuffers(p, nBuf, aBuf);
+  if( rc!=SQLITE_OK ) return rc;
+  if( p->cur==0 ){
+    rc = pivotReaderStart(p);
+    if( rc!=SQLITE_OK ) return pivotReaderError(p, rc);
+  }
 
-    if( op ){
-      if( argvIndex==1 ){
-        sqlite3_str_appendall(key_sql_filtered, "\n WHERE ");
-      } else{
-        sqlite3_str_appendall(key_sql_filtered, " AND ");
+  for( iCol=0; iCol<nBuf; iCol++ ){
+    if( aBuf[iCol].aNull ) memset(aBuf[iCol].aNull, 0, (nRow+7)/8);
+  }
+  for( iRow=0; iRow<nRow && p->cur->rc==SQLITE_ROW; iRow++ ){
+    for( iCol=0; iCol<nBuf && rc==SQLITE_OK; iCol++ ){
+      if( aBuf[iCol].eType==SQLITE_NULL ) continue;
+      rc = pivotCellValue(tab, p->cur, iCol, &cell);
+      if( rc==SQLITE_OK ){
+        rc = pivotReaderStore(p, &aBuf[iCol], iRow, &cell);
+        pivotCellDone(&cell);
       }
-      sqlite3_str_appendf(key_sql_filtered, "%s %s ?", tab->key_sql_col_names[pConstraint->iColumn], op);
-      pIdxInfo->aConstraintUsage[i].argvIndex = argvIndex++;
-      pIdxInfo->aConstraintUsage[i].omit = 1;
+    }
+    if( rc!=SQLITE_OK ) break;
+    rc = pivotNext(&p->cur->base);
+    if( rc!=SQLITE_OK ){
+      iRow++;
+      break;
     }
   }
 
-  const struct sqlite3_index_orderby *pOrderBy;
-  pOrderBy = pIdxInfo->aOrderBy;
-  for(i=0; i<pIdxInfo->nOrderBy; i++, pOrderBy++){
-    if( !(pOrderBy->iColumn < tab->nRow_cols) ) continue;
-    if( orderIdx==0 ){
-      sqlite3_str_appendall(key_sql_filtered, "\n ORDER BY ");
-    } else{
-      sqlite3_str_appendall(key_sql_filtered, ", ");
-    }
-    sqlite3_str_appendf(key_sql_filtered, "%s %s", tab->key_sql_col_names[pOrderBy->iColumn], pOrderBy->desc ? "DESC" : "");
-    pIdxInfo->orderByConsumed = 1;
-    orderIdx++;
+  // The scan ends at an error. Rows completed before it are returned
+  // first, and the error by the next fetch.
+  if( rc!=SQLITE_OK ){
+    rc = pivotReaderError(p, rc);
+    pivotReaderEnd(p);
+    if( iRow==0 ) return rc;
+    p->rc = rc;
   }
+  *pnRow = iRow;
+  return SQLITE_OK;
+}
 
-  pIdxInfo->idxNum = 0;
-  pIdxInfo->estimatedCost = (double)2147483647/argvIndex;
-  pIdxInfo->estimatedRows = 10;
-  pIdxInfo->idxStr = sqlite3_str_finish(key_sql_filtered);
-  pIdxInfo->needToFreeIdxStr = 1;
-  
+int pivot_vtab_reader_reset(pivot_vtab_reader *p){
+  int i;
+  pivotReaderEnd(p);
+  for( i=0; i<p->nCons; i++ ) sqlite3_value_free(p->aConsVal[i]);
+  p->nCons = 0;
+  p->rc = SQLITE_OK;
+  pivotReaderClearText(p);
   return SQLITE_OK;
 }
 
+void pivot_vtab_reader_close(pivot_vtab_reader *p){
+  int i;
+  if( p==0 ) return;
+  pivot_vtab_reader_reset(p);
+  if( p->tab ){
+    pivot_vtab_reader **pp;
+    for( pp=&p->tab->pReader; *pp!=p; pp=&(*pp)->pNext );
+    *pp = p->pNext;
+  }
+  for( i=0; i<p->nCol; i++ ) sqlite3_free(p->azName[i]);
+  sqlite3_free(p->azName);
+  sqlite3_free(p->aCons);
+  sqlite3_free(p->aConsVal);
+  sqlite3_free(p->azText);
+  sqlite3_free(p->zErr);
+  sqlite3_free(p);
+}
+
+void *pivot_vtab_hook_arg(sqlite3 *db){
+  pivot_global *g = 0;
+  sqlite3_stmt *stmt = 0;
+  if( sqlite3_prepare_v2(db, "SELECT pivot_vtab_global()", -1, &stmt, 0)==SQLITE_OK
+   && sqlite3_step(stmt)==SQLITE_ROW ){
+    g = (pivot_global*)sqlite3_value_pointer(sqlite3_column_value(stmt, 0), "pivot_global");
+  }
+  sqlite3_finalize(stmt);
+  return g;
+}
+
 /*
-** This following structure defines all the methods for the 
-** pivot virtual table.
+** Detach every reader of tab, which is being disconnected. Their scans
+** end, and later calls on them fail with SQLITE_ABORT.
 */
-static sqlite3_module pivotModule = {
-  0,                 // iVersion
-  pivotCreate,       // xCreate
-  pivotConnect,      // xConnect
-  pivotBestIndex,    // xBestIndex
-  pivotDisconnect,   // xDisconnect
-  pivotDisconnect,   // xDestroy
-  pivotOpen,         // xOpen
-  pivotClose,        // xClose
-  pivotFilter,       // xFilter
-  pivotNext,         // xNext
-  pivotEof,          // xEof
-  pivotColumn,       // xColumn
-  pivotRowid,        // xRowid
-  0,                 // xUpdate
-  0,                 // xBegin
-  0,                 // xSync
-  0,                 // xCommit
-  0,                 // xRollback
-  0,                 // xFindFunction
-  pivotRename,       // xRename
-};
+static void pivotReaderDetach(pivot_vtab *tab){
+  while( tab->pReader ){
+    pivot_vtab_reader *p = tab->pReader;
+    pivotReaderEnd(p);
+    tab->pReader = p->pNext;
+    p->pNext = 0;
+    p->tab = 0;
+  }
+}
+
+/*
+** Destructor for the per-connection state, called when the pivot_vtab
+** module is unregistered or the connection is closed.
+*/
+static void pivotGlobalFree(void *p){
+  pivot_global *g = (pivot_global*)p;
+  pivotGlobalFinalize(g);
+  sqlite3_free(g);
+}
 
 #ifdef _WIN32
 __declspec(dllexport)
@@ -751,8 +7127,43 @@ int sqlite3_pivotvtab_init(
   char **pzErrMsg, 
   const sqlite3_api_routines *pApi
 ){
+  pivot_global *pGlobal;
   int rc;
   SQLITE_EXTENSION_INIT2(pApi);
-  rc = sqlite3_create_module(db, "pivot_vtab", &pivotModule, 0);
+  pGlobal = sqlite3_malloc(sizeof(*pGlobal));
+  if( pGlobal==0 ) return SQLITE_NOMEM;
+  memset(pGlobal, 0, sizeof(*pGlobal));
+  pGlobal->db = db;
+  rc = sqlite3_create_module_v2(db, "pivot_vtab", &pivotModule, pGlobal, pivotGlobalFree);
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_module(db, "pivot_vtab_stats", &pivotStatsModule, pGlobal);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_module(db, "pivot_vtab_column_stats", &pivotColumnStatsModule, pGlobal);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_module(db, "pivot_vtab_latency", &pivotLatencyModule, pGlobal);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "pivot_advise", 1, SQLITE_UTF8, pGlobal, pivotAdviseFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "pivot_count", 2, SQLITE_UTF8, pGlobal, pivotCountFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "pivot_sum", 2, SQLITE_UTF8, pGlobal, pivotSumFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "pivot_avg", 2, SQLITE_UTF8, pGlobal, pivotAvgFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "pivot_min", 2, SQLITE_UTF8, pGlobal, pivotMinFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "pivot_max", 2, SQLITE_UTF8, pGlobal, pivotMaxFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "pivot_vtab_global", 0, SQLITE_UTF8, pGlobal, pivotGlobalFunc, 0, 0);
+  }
   return rc;
 }
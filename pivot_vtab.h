@@ -0,0 +1,142 @@
+/*
+** pivot_vtab.h - C API for reading pivot tables without SQL, and for
+** reporting changes to them
+**
+*************************************************************************
+**
+** MIT License - see pivot_vtab.c
+**
+*************************************************************************
+**
+** A pivot_vtab_reader reads the rows of a pivot table directly through
+** the pivot_vtab methods, using the same plans, caches and source scans
+** as a SELECT on the table. Rows are fetched in batches into columnar
+** arrays supplied by the caller, without a VDBE program, result copies or
+** sqlite3_column_*() calls per cell.
+**
+**   pivot_vtab_reader *pReader;
+**   pivot_vtab_buffer *aBuf;
+**   sqlite3_int64 aId[256];
+**   const char *azA[256];
+**   unsigned char aNull[2][32];
+**   int nRow, nCol, i;
+**
+**   pivot_vtab_reader_open(db, 0, "pivot", &pReader);
+**   pivot_vtab_reader_constrain(pReader, "r_id", SQLITE_INDEX_CONSTRAINT_GE, pMin);
+**   nCol = pivot_vtab_reader_column_count(pReader);
+**   aBuf = sqlite3_malloc(nCol*sizeof(pivot_vtab_buffer));
+**   for( i=0; i<nCol; i++ ) aBuf[i] = (pivot_vtab_buffer){SQLITE_NULL, 0, 0, 0, 0};
+**   aBuf[0] = (pivot_vtab_buffer){SQLITE_INTEGER, aId, 0, 0, aNull[0]};
+**   aBuf[1] = (pivot_vtab_buffer){SQLITE_TEXT, 0, 0, azA, aNull[1]};
+**   while( pivot_vtab_reader_fetch(pReader, 256, nCol, aBuf, &nRow)==SQLITE_OK && nRow>0 ){
+**     ...
+**   }
+**   pivot_vtab_reader_close(pReader);
+**   sqlite3_free(aBuf);
+**
+** The extension must have been loaded on db. A reader whose pivot table is
+** dropped or disconnected, or whose connection is closed, fails every
+** later call with SQLITE_ABORT, and must still be closed. The functions
+** are available to applications that link pivot_vtab.c (e.g. built with
+** -DSQLITE_CORE into the application).
+*/
+#ifndef PIVOT_VTAB_H
+#define PIVOT_VTAB_H
+
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pivot_vtab_reader pivot_vtab_reader;
+
+/*
+** The destination of one column of a batch of rows. Values are converted
+** to eType with the usual sqlite3_value_*() conversions. Text values
+** remain valid until the next fetch, reset or close of the reader.
+*/
+typedef struct pivot_vtab_buffer pivot_vtab_buffer;
+struct pivot_vtab_buffer {
+  int eType;               // SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, or
+                           // SQLITE_NULL to skip the column unevaluated
+  sqlite3_int64 *aInt;     // Values, if eType is SQLITE_INTEGER
+  double *aReal;           // Values, if eType is SQLITE_FLOAT
+  const char **azText;     // Values, if eType is SQLITE_TEXT
+  unsigned char *aNull;    // Null bitmap - bit i%8 of byte i/8 is set if row i
+                           // is NULL - or 0. NULL values are stored as 0.
+};
+
+/*
+** Open a reader on pivot table zTab of schema zDb of connection db. If
+** zDb is 0, the table is found as SQLite finds an unqualified name.
+*/
+int pivot_vtab_reader_open(sqlite3 *db, const char *zDb, const char *zTab, pivot_vtab_reader **ppReader);
+
+/*
+** Return the number of columns of each row - the row key columns followed
+** by the pivot columns - and the name of column iCol.
+*/
+int pivot_vtab_reader_column_count(pivot_vtab_reader *pReader);
+const char *pivot_vtab_reader_column_name(pivot_vtab_reader *pReader, int iCol);
+
+/*
+** Constrain the rows read to those where row key column or parameter zCol
+** compares to pVal with op, one of SQLITE_INDEX_CONSTRAINT_EQ, _LT, _LE,
+** _GT, _GE, _NE, _IS, _ISNOT, _LIKE, _GLOB. Parameters only take _EQ.
+** Constraints apply from the next scan.
+*/
+int pivot_vtab_reader_constrain(pivot_vtab_reader *pReader, const char *zCol, int op, sqlite3_value *pVal);
+
+/*
+** Fetch up to nRow rows into the nBuf buffers of aBuf, and set *pnRow to
+** the number fetched. There must be one buffer per column, or
+** SQLITE_MISUSE is returned. The first fetch after open or reset starts a
+** scan. *pnRow is 0 once the scan is exhausted. If the scan fails after
+** some rows of a batch, those rows are returned, and the error is returned
+** by every later fetch until the reader is reset.
+*/
+int pivot_vtab_reader_fetch(pivot_vtab_reader *pReader, int nRow, int nBuf, pivot_vtab_buffer *aBuf, int *pnRow);
+
+/*
+** End the current scan, clear any error that ended it, and remove every
+** constraint.
+*/
+int pivot_vtab_reader_reset(pivot_vtab_reader *pReader);
+
+/*
+** Return the error message of the last failed call, or 0.
+*/
+const char *pivot_vtab_reader_errmsg(pivot_vtab_reader *pReader);
+
+void pivot_vtab_reader_close(pivot_vtab_reader *pReader);
+
+/*
+** Change hooks. Pivot tables with the track_dependencies or delta_query
+** options only keep the cached rows that a change of this connection does
+** not affect if they are told of the changes by these hooks. SQLite has a
+** single update hook and rollback hook per connection, and does not
+** return the callback it replaces, so the extension leaves them to the
+** application. Install them with the argument returned by
+** pivot_vtab_hook_arg(), or call them from the application's own hooks:
+**
+**   void *pArg = pivot_vtab_hook_arg(db);
+**   sqlite3_update_hook(db, pivot_vtab_update_hook, pArg);
+**   sqlite3_rollback_hook(db, pivot_vtab_rollback_hook, pArg);
+**
+** Without them every change of this connection discards every cached
+** row, as without the options. pivot_vtab_hook_arg() returns 0 if the
+** extension is not loaded on db, and the hooks then do nothing. The
+** argument is valid until the connection is closed; remove the hooks
+** before the pivot_vtab module is dropped from a connection that stays
+** open.
+*/
+void *pivot_vtab_hook_arg(sqlite3 *db);
+void pivot_vtab_update_hook(void *pArg, int op, const char *zDb, const char *zTab, sqlite3_int64 iRowid);
+void pivot_vtab_rollback_hook(void *pArg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PIVOT_VTAB_H */
@@ -0,0 +1,38 @@
+-- user-051: memoized key query plans. Every constraint shape, repeated so
+-- that later scans reuse the plan, must return what the reference does.
+CREATE TABLE r(id INTEGER PRIMARY KEY, grp TEXT);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<50)
+INSERT INTO r SELECT i, CASE WHEN i%3 THEN 'odd' ELSE 'even' END FROM n;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b'),('c');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c WHERE (r.id+c.id)%4;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 7', 'SELECT * FROM ref WHERE r_id = 7');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = ''7''', 'SELECT * FROM ref WHERE r_id = ''7''');
+SELECT pivot_check('SELECT * FROM p WHERE r_id > 45', 'SELECT * FROM ref WHERE r_id > 45');
+SELECT pivot_check('SELECT * FROM p WHERE r_id >= 10 AND r_id < 14', 'SELECT * FROM ref WHERE r_id >= 10 AND r_id < 14');
+SELECT pivot_check('SELECT * FROM p WHERE r_id BETWEEN 20 AND 22 ORDER BY r_id DESC', 'SELECT * FROM ref WHERE r_id BETWEEN 20 AND 22 ORDER BY r_id DESC');
+SELECT pivot_check('SELECT * FROM p WHERE r_id IN (3, 1, 99)', 'SELECT * FROM ref WHERE r_id IN (3, 1, 99)');
+SELECT pivot_check('SELECT * FROM p ORDER BY r_id DESC LIMIT 4', 'SELECT * FROM ref ORDER BY r_id DESC LIMIT 4');
+SELECT pivot_check('SELECT * FROM p WHERE a IS NULL', 'SELECT * FROM ref WHERE a IS NULL');
+SELECT pivot_check('SELECT r.grp, p.* FROM r JOIN p ON p.r_id = r.id WHERE r.grp = ''even''', 'SELECT r.grp, ref.* FROM r JOIN ref ON ref.r_id = r.id WHERE r.grp = ''even''');
+
+-- The same shapes again, with other values
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 8', 'SELECT * FROM ref WHERE r_id = 8');
+SELECT pivot_check('SELECT * FROM p WHERE r_id > 48', 'SELECT * FROM ref WHERE r_id > 48');
+SELECT pivot_check('SELECT * FROM p WHERE r_id IN (50, 2)', 'SELECT * FROM ref WHERE r_id IN (50, 2)');
+
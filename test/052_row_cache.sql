@@ -0,0 +1,48 @@
+-- user-052: LRU row cache for point lookups. Cached rows must follow every
+-- change, whether committed, uncommitted or rolled back.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3 UNION SELECT 4;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  row_cache=2
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+-- Fill the cache past its capacity, and hit it
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 2', 'SELECT * FROM ref WHERE r_id = 2');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 3', 'SELECT * FROM ref WHERE r_id = 3');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 3', 'SELECT * FROM ref WHERE r_id = 3');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = ''2''', 'SELECT * FROM ref WHERE r_id = ''2''');
+SELECT 'no cache hit' WHERE (SELECT value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'row_cache_hits') = 0;
+SELECT 'no eviction' WHERE (SELECT value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'row_cache_evictions') = 0;
+
+-- Committed changes
+UPDATE x SET val = 'new' WHERE r_id = 3 AND c_id = 1;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 3', 'SELECT * FROM ref WHERE r_id = 3');
+DELETE FROM r WHERE id = 2;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 2', 'SELECT * FROM ref WHERE r_id = 2');
+
+-- Uncommitted and rolled back changes
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+BEGIN;
+UPDATE x SET val = 'txn' WHERE r_id = 1;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+SAVEPOINT sp;
+DELETE FROM x WHERE r_id = 1 AND c_id = 2;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+ROLLBACK TO sp;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+ROLLBACK;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
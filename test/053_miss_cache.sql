@@ -0,0 +1,38 @@
+-- user-053: miss cache for point lookups that find no rows. A remembered
+-- miss must be forgotten once the row appears.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  miss_cache=4
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 5', 'SELECT * FROM ref WHERE r_id = 5');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 5', 'SELECT * FROM ref WHERE r_id = 5');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = NULL', 'SELECT * FROM ref WHERE r_id = NULL');
+SELECT 'no miss cache hit' WHERE (SELECT value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'miss_cache_hits') = 0;
+
+INSERT INTO r VALUES (5);
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 5', 'SELECT * FROM ref WHERE r_id = 5');
+INSERT INTO x VALUES (5, 1, 'a5');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 5', 'SELECT * FROM ref WHERE r_id = 5');
+
+-- A miss inside a transaction is not remembered past its rollback
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 6', 'SELECT * FROM ref WHERE r_id = 6');
+BEGIN;
+INSERT INTO r VALUES (6);
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 6', 'SELECT * FROM ref WHERE r_id = 6');
+ROLLBACK;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 6', 'SELECT * FROM ref WHERE r_id = 6');
@@ -0,0 +1,42 @@
+-- user-054: track_dependencies. Changes to tables the queries read must
+-- reach the caches, and changes to other tables must not break them.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c;
+CREATE TABLE other(v);
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  row_cache=8, miss_cache=8, track_dependencies=1
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT 'dependencies: ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'dependencies' AND value <> 'main.r, main.x';
+
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+INSERT INTO other VALUES (1);
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+SELECT 'flushed on an unrelated change' WHERE (SELECT value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'row_cache_hits') = 0;
+
+UPDATE x SET val = 'new' WHERE r_id = 1;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+DELETE FROM r WHERE id = 1;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+INSERT INTO r VALUES (1);
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+
+BEGIN;
+UPDATE x SET val = 'txn' WHERE r_id = 2;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 2', 'SELECT * FROM ref WHERE r_id = 2');
+ROLLBACK;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 2', 'SELECT * FROM ref WHERE r_id = 2');
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
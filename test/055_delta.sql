@@ -0,0 +1,70 @@
+-- user-055: delta_query. Inserted source rows only discard the cached rows
+-- they belong to. Updates discard every cached row.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c WHERE r.id < 3;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  row_cache=8, miss_cache=8,
+  delta_query=(SELECT r_id FROM x WHERE rowid = ?1)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p WHERE r_id IN (1, 2, 3)', 'SELECT * FROM ref WHERE r_id IN (1, 2, 3)');
+UPDATE x SET val = 'new' WHERE r_id = 2 AND c_id = 1;
+SELECT pivot_check('SELECT * FROM p WHERE r_id IN (1, 2, 3)', 'SELECT * FROM ref WHERE r_id IN (1, 2, 3)');
+INSERT INTO x VALUES (3, 2, 'b3');
+SELECT pivot_check('SELECT * FROM p WHERE r_id IN (1, 2, 3)', 'SELECT * FROM ref WHERE r_id IN (1, 2, 3)');
+SELECT 'no delta rows' WHERE (SELECT value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'delta_rows') = 0;
+SELECT 'row 1 not kept' WHERE (SELECT value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'row_cache_hits') = 0;
+
+-- An update that moves a source row to another row key
+CREATE TABLE y(r_id INT, c_id INT, val);
+INSERT INTO y VALUES (1, 1, 10);
+CREATE VIRTUAL TABLE q USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM y WHERE r_id = ?1 AND c_id = ?2),
+  row_cache=100,
+  delta_query=(SELECT r_id FROM y WHERE rowid = ?1)
+);
+CREATE VIRTUAL TABLE qref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM y WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+SELECT pivot_check('SELECT * FROM q WHERE r_id = 1', 'SELECT * FROM qref WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM q WHERE r_id = 2', 'SELECT * FROM qref WHERE r_id = 2');
+UPDATE y SET r_id = 2 WHERE r_id = 1;
+SELECT pivot_check('SELECT * FROM q WHERE r_id = 1', 'SELECT * FROM qref WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM q WHERE r_id = 2', 'SELECT * FROM qref WHERE r_id = 2');
+SELECT 'stale row 1' WHERE (SELECT a FROM q WHERE r_id = 1) IS NOT NULL;
+
+-- Deletes discard every cached row
+DELETE FROM x WHERE r_id = 1;
+SELECT pivot_check('SELECT * FROM p WHERE r_id IN (1, 2, 3)', 'SELECT * FROM ref WHERE r_id IN (1, 2, 3)');
+
+BEGIN;
+INSERT INTO x VALUES (1, 1, 'txn');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+ROLLBACK;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+
+-- error: delta query error
+CREATE VIRTUAL TABLE bad USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  delta_query=(SELECT r_id FROM x, r WHERE x.rowid = ?1)
+);
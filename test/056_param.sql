@@ -0,0 +1,42 @@
+-- user-056: parameter columns bound into the key and pivot queries.
+CREATE TABLE r(tenant TEXT, id INT);
+INSERT INTO r VALUES ('acme', 1), ('acme', 2), ('globex', 1), ('globex', 3);
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(tenant TEXT, r_id INT, c_id INT, val TEXT);
+INSERT INTO x SELECT r.tenant, r.id, c.id, r.tenant || c.name || r.id FROM c, r;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r WHERE tenant = ?3),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 AND tenant = ?3),
+  param=tenant, row_cache=8, miss_cache=8
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r WHERE tenant = ?3),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 AND tenant = ?3),
+  param=tenant, reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p(''acme'')', 'SELECT * FROM ref(''acme'')');
+SELECT pivot_check('SELECT * FROM p WHERE tenant = ''globex''', 'SELECT * FROM ref WHERE tenant = ''globex''');
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+-- Cached rows are kept per parameter value
+SELECT pivot_check('SELECT * FROM p(''acme'') WHERE r_id = 1', 'SELECT * FROM ref(''acme'') WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM p(''globex'') WHERE r_id = 1', 'SELECT * FROM ref(''globex'') WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM p(''acme'') WHERE r_id = 1', 'SELECT * FROM ref(''acme'') WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM p(''acme'') WHERE r_id = 3', 'SELECT * FROM ref(''acme'') WHERE r_id = 3');
+SELECT pivot_check('SELECT * FROM p(''globex'') WHERE r_id = 3', 'SELECT * FROM ref(''globex'') WHERE r_id = 3');
+SELECT pivot_check(
+  'SELECT t.t, p.* FROM (SELECT ''acme'' t UNION ALL SELECT ''globex'') t, p WHERE p.tenant = t.t',
+  'SELECT t.t, ref.* FROM (SELECT ''acme'' t UNION ALL SELECT ''globex'') t, ref WHERE ref.tenant = t.t'
+);
+
+-- error: parameter
+CREATE VIRTUAL TABLE bad USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 AND tenant = ?4),
+  param=tenant
+);
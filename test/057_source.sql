@@ -0,0 +1,95 @@
+-- user-057: source scans, shared by pivot tables with the same source
+-- query. Keys are matched as the pivot query compares them: with the
+-- affinity and collation of the compared columns, NULL keys match nothing,
+-- and the first of duplicate cells wins.
+CREATE TABLE r(id TEXT);
+INSERT INTO r VALUES ('1'), ('2'), ('3 '), ('x'), (NULL), ('01');
+CREATE TABLE c(id TEXT, name TEXT);
+INSERT INTO c VALUES ('1', 'a'), ('2', 'b'), (NULL, 'n'), ('2.0', 'b2');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x VALUES
+  (1, 1, 'a1'), (2, 1, 'a2'), (1, 2, 'b1'), (2, 2, 'b2'),
+  (NULL, 1, 'null key'), ('x', 1, 'ax'), (1, 1, 'duplicate'),
+  (1, NULL, 'null column'), (3, 2, 3.5), (2, 2, x'ff');
+
+CREATE VIRTUAL TABLE s1 USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM x)
+);
+CREATE VIRTUAL TABLE s2 USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM x)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM s1', 'SELECT * FROM ref');
+SELECT pivot_check('SELECT * FROM s2', 'SELECT * FROM ref');
+SELECT 'source not shared' WHERE (SELECT value FROM pivot_vtab_stats WHERE vtab = 's2' AND stat = 'source_shared_scans') = 0;
+SELECT pivot_check('SELECT * FROM s1 WHERE r_id = ''1''', 'SELECT * FROM ref WHERE r_id = ''1''');
+SELECT pivot_check('SELECT * FROM s1 WHERE r_id > ''1''', 'SELECT * FROM ref WHERE r_id > ''1''');
+
+UPDATE x SET val = 'new' WHERE r_id = 2 AND c_id = 1;
+SELECT pivot_check('SELECT * FROM s1', 'SELECT * FROM ref');
+SELECT pivot_check('SELECT * FROM s2', 'SELECT * FROM ref');
+
+-- Collations of the compared columns
+CREATE TABLE rn(id);
+INSERT INTO rn VALUES ('a'), ('B'), ('b'), ('c  '), (1);
+CREATE TABLE xn(r_id TEXT COLLATE NOCASE, r2 TEXT COLLATE RTRIM, c_id, val);
+INSERT INTO xn VALUES ('A', 'c', 1, 'A1'), ('b ', 'c', 1, 'b1'), ('b', 'c ', 1, 'b2'), ('1', 'c', 1, 'one'), ('C  ', 'x', 1, 'C');
+
+CREATE VIRTUAL TABLE sn USING pivot_vtab(
+  (SELECT id r_id FROM rn),
+  (SELECT 1, 'one'),
+  (SELECT val FROM xn WHERE r_id = ?1 AND r2 = 'c' AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM xn WHERE r2 = 'c')
+);
+CREATE VIRTUAL TABLE refn USING pivot_vtab(
+  (SELECT id r_id FROM rn),
+  (SELECT 1, 'one'),
+  (SELECT val FROM xn WHERE r_id = ?1 AND r2 = 'c' AND c_id = ?2),
+  reference=1
+);
+SELECT pivot_check('SELECT * FROM sn', 'SELECT * FROM refn');
+
+CREATE VIRTUAL TABLE sr USING pivot_vtab(
+  (SELECT id r_id FROM rn),
+  (SELECT 1, 'one'),
+  (SELECT val FROM xn WHERE r2 = ?1 AND c_id = ?2),
+  source=(SELECT r2, c_id, val FROM xn)
+);
+CREATE VIRTUAL TABLE refr USING pivot_vtab(
+  (SELECT id r_id FROM rn),
+  (SELECT 1, 'one'),
+  (SELECT val FROM xn WHERE r2 = ?1 AND c_id = ?2),
+  reference=1
+);
+SELECT pivot_check('SELECT * FROM sr', 'SELECT * FROM refr');
+
+-- Composite keys of different affinities
+CREATE TABLE rc(k1, k2);
+INSERT INTO rc VALUES (1, '1'), ('1', 1), (2, 2.0), ('a', 'A'), (NULL, 1);
+CREATE TABLE xc(k1 INT, k2 TEXT, c_id REAL, val);
+INSERT INTO xc VALUES (1, 1, 1, 'int text'), ('2', '2.0', '1.0', 'two'), ('a', 'A', 1, 'text'), (1, '1', 1, 'duplicate');
+CREATE VIRTUAL TABLE sc USING pivot_vtab(
+  (SELECT k1, k2 FROM rc),
+  (SELECT 1, 'one' UNION ALL SELECT '1.0', 'one_text'),
+  (SELECT val FROM xc WHERE k1 = ?1 AND k2 = ?2 AND c_id = ?3),
+  source=(SELECT k1, k2, c_id, val FROM xc)
+);
+CREATE VIRTUAL TABLE refc USING pivot_vtab(
+  (SELECT k1, k2 FROM rc),
+  (SELECT 1, 'one' UNION ALL SELECT '1.0', 'one_text'),
+  (SELECT val FROM xc WHERE k1 = ?1 AND k2 = ?2 AND c_id = ?3),
+  reference=1
+);
+SELECT pivot_check('SELECT * FROM sc', 'SELECT * FROM refc');
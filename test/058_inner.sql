@@ -0,0 +1,35 @@
+-- user-058: inner=1 only returns rows with at least one non-null cell.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3 UNION SELECT 4;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x VALUES (1, 1, 'a1'), (2, 2, 'b2'), (3, 1, NULL), ('4', 2, 'b4'), (9, 1, 'a9');
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM x),
+  inner=1
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref WHERE coalesce(a, b) IS NOT NULL');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 3', 'SELECT * FROM ref WHERE r_id = 3 AND coalesce(a, b) IS NOT NULL');
+SELECT pivot_check('SELECT * FROM p WHERE r_id >= 2', 'SELECT * FROM ref WHERE r_id >= 2 AND coalesce(a, b) IS NOT NULL');
+UPDATE x SET val = 'a3' WHERE r_id = 3;
+DELETE FROM x WHERE r_id = 1;
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref WHERE coalesce(a, b) IS NOT NULL');
+
+-- error: inner=1 requires a source query
+CREATE VIRTUAL TABLE bad USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  inner=1
+);
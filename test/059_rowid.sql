@@ -0,0 +1,41 @@
+-- user-059: the rowid is the row key when the key query returns the
+-- INTEGER PRIMARY KEY of one table.
+CREATE TABLE r(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO r VALUES (3, 'c'), (10, 'j'), (-2, 'minus'), (7, 'g');
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT 'rowid is not the key: ' || rowid || ' ' || r_id FROM p WHERE rowid <> r_id;
+SELECT pivot_check('SELECT rowid, * FROM p', 'SELECT rowid, * FROM ref');
+SELECT pivot_check('SELECT rowid, * FROM p WHERE rowid = 7', 'SELECT rowid, * FROM ref WHERE rowid = 7');
+SELECT pivot_check('SELECT rowid, * FROM p WHERE rowid > 3 ORDER BY rowid DESC', 'SELECT rowid, * FROM ref WHERE rowid > 3 ORDER BY rowid DESC');
+SELECT pivot_check('SELECT rowid, * FROM p WHERE rowid IN (-2, 10, 11)', 'SELECT rowid, * FROM ref WHERE rowid IN (-2, 10, 11)');
+
+-- A key query with a join numbers the rows instead
+CREATE VIRTUAL TABLE q USING pivot_vtab(
+  (SELECT r.id r_id FROM r, c WHERE c.id = 1),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2)
+);
+CREATE VIRTUAL TABLE refq USING pivot_vtab(
+  (SELECT r.id r_id FROM r, c WHERE c.id = 1),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+SELECT pivot_check('SELECT rowid, * FROM q', 'SELECT rowid, * FROM refq');
+SELECT pivot_check('SELECT * FROM q WHERE rowid = 2', 'SELECT * FROM refq WHERE rowid = 2');
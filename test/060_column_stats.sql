@@ -0,0 +1,31 @@
+-- user-060: per-column evaluation statistics. Profiling must not change
+-- results, and must count what it evaluated.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c WHERE c.id = 1 OR r.id = 1;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  timing=1
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+SELECT pivot_check('SELECT b FROM p WHERE r_id = 1', 'SELECT b FROM ref WHERE r_id = 1');
+
+SELECT 'column ' || column_name || ': ' || evaluations || ' evaluations, ' || hits || ' hits'
+  FROM pivot_vtab_column_stats('p')
+ WHERE (column_name, evaluations, hits) NOT IN (VALUES ('a', 3, 3), ('b', 4, 2));
+SELECT 'no time for ' || column_name FROM pivot_vtab_column_stats('p') WHERE NOT time_ms > 0;
+SELECT 'no steps for ' || column_name FROM pivot_vtab_column_stats('p') WHERE NOT vm_steps > 0;
+-- Without timing=1 the evaluations are counted but not timed
+SELECT 'timed without timing=1' FROM pivot_vtab_column_stats('ref') WHERE time_ms > 0;
@@ -0,0 +1,32 @@
+-- user-061: index advice for pivot queries that scan their source. The
+-- advised indexes must not change results.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE "x y"(r_id INT, "c-id" INT, val);
+INSERT INTO "x y" SELECT r.id, c.id, c.name || r.id FROM r, c;
+PRAGMA automatic_index = 0;
+
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM "x y" WHERE r_id = ?1 AND "c-id" = ?2),
+  reference=1
+);
+SELECT 'advice: ' || pivot_advise('ref')
+ WHERE pivot_advise('ref') IS NOT 'CREATE INDEX IF NOT EXISTS "main"."x_y_pivot_r_id_c_id" ON "x y"("r_id", "c-id");' || char(10);
+SELECT 'stat: ' || value FROM pivot_vtab_stats WHERE vtab = 'ref' AND stat = 'index_advice' AND value IS NOT pivot_advise('ref');
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM "x y" WHERE r_id = ?1 AND "c-id" = ?2),
+  create_index=1
+);
+SELECT 'index not created' WHERE NOT EXISTS (SELECT 1 FROM sqlite_schema WHERE name = 'x_y_pivot_r_id_c_id');
+SELECT 'advice after the index: ' || pivot_advise('p') WHERE pivot_advise('p') IS NOT NULL;
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 2', 'SELECT * FROM ref WHERE r_id = 2');
+
+-- error: no such pivot table
+SELECT pivot_advise('nope');
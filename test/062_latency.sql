@@ -0,0 +1,45 @@
+-- user-062: latency histograms and slow scan logging. Neither may change
+-- results.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  timing=1, slow_scan_ms=1000
+);
+CREATE VIRTUAL TABLE q USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 2', 'SELECT * FROM ref WHERE r_id = 2');
+SELECT pivot_check('SELECT a FROM p LIMIT 1', 'SELECT a FROM ref LIMIT 1');
+SELECT pivot_check('SELECT * FROM q', 'SELECT * FROM ref');
+
+SELECT 'scans: ' || sum(count) FROM pivot_vtab_latency('p') WHERE metric = 'scan' HAVING sum(count) <> 3;
+SELECT 'first rows: ' || sum(count) FROM pivot_vtab_latency('p') WHERE metric = 'first_row' HAVING sum(count) <> 3;
+SELECT 'cells: ' || sum(count) FROM pivot_vtab_latency('p') WHERE metric = 'cell' HAVING sum(count) <> 9;
+SELECT 'bucket ' || min_ns || '-' || max_ns FROM pivot_vtab_latency WHERE min_ns > max_ns;
+-- Without timing=1 or slow_scan_ms nothing is timed
+SELECT 'timed: ' || metric FROM pivot_vtab_latency('q');
+
+-- error: invalid value for slow_scan_ms
+CREATE VIRTUAL TABLE bad USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  slow_scan_ms=-1
+);
@@ -0,0 +1,25 @@
+-- user-063: counts of the calls of the pivot table methods.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+
+-- One scan of 3 rows of 3 columns
+SELECT 'filter_calls ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'filter_calls' AND value <> 1;
+SELECT 'next_calls ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'next_calls' AND value <> 3;
+SELECT 'column_calls ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'column_calls' AND value <> 9;
+SELECT 'best_index_calls ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'best_index_calls' AND value < 1;
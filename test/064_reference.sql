@@ -0,0 +1,23 @@
+-- user-064: reference=1 disables every fast path, so a reference table
+-- evaluates one pivot query per cell even where the options ask otherwise.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c;
+
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM x), row_cache=10, miss_cache=10, reference=1
+);
+SELECT 'rows: ' || count(*) FROM ref HAVING count(*) <> 3;
+SELECT ref.r_id FROM ref JOIN x ON x.r_id = ref.r_id AND x.c_id = 1 WHERE ref.a IS NOT x.val;
+-- Point lookups twice, hits and misses, that would otherwise be cached
+SELECT 'a: ' || a FROM ref WHERE r_id = 1 AND a IS NOT 'a1';
+SELECT 'a: ' || a FROM ref WHERE r_id = 1 AND a IS NOT 'a1';
+SELECT 'rows: ' || count(*) FROM ref WHERE r_id = 4 HAVING count(*) <> 0;
+SELECT 'rows: ' || count(*) FROM ref WHERE r_id = 4 HAVING count(*) <> 0;
+SELECT 'no fast path expected: ' || stat || ' ' || value FROM pivot_vtab_stats
+ WHERE vtab = 'ref' AND stat IN ('source_scans', 'row_cache_hits', 'miss_cache_hits') AND value <> 0;
@@ -0,0 +1,35 @@
+-- user-067: source scans store their cells by column. Every storage type
+-- must come back with its own type and value.
+CREATE TABLE r AS WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<200) SELECT i id FROM n;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('i'),('f'),('t'),('b'),('mixed'),('nulls');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT id, 1, id*1000003 FROM r WHERE id%5;
+INSERT INTO x SELECT id, 2, id/7.0 FROM r WHERE id%3;
+INSERT INTO x SELECT id, 3, 'text' || id FROM r WHERE id%2;
+INSERT INTO x SELECT id, 4, CAST('b' || id AS BLOB) FROM r WHERE id%4;
+INSERT INTO x SELECT id, 5, CASE id%4 WHEN 0 THEN id WHEN 1 THEN 'm' || id WHEN 2 THEN id*0.5 ELSE x'00ff' END FROM r;
+INSERT INTO x SELECT id, 6, NULL FROM r;
+INSERT INTO x VALUES (1, 1, 9223372036854775807), (2, 1, -9223372036854775808), (3, 2, 1e308), (4, 3, '');
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  source=(SELECT r_id, c_id, val FROM x)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p ORDER BY r_id', 'SELECT * FROM ref ORDER BY r_id');
+SELECT pivot_check('SELECT r_id, mixed FROM p WHERE r_id > 150 ORDER BY r_id', 'SELECT r_id, mixed FROM ref WHERE r_id > 150 ORDER BY r_id');
+SELECT 'source scans: ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'source_scans' AND value < 1;
+
+-- After a change the scan is rebuilt
+UPDATE x SET val = 'now text' WHERE r_id = 10 AND c_id = 1;
+DELETE FROM x WHERE r_id = 11;
+SELECT pivot_check('SELECT * FROM p ORDER BY r_id', 'SELECT * FROM ref ORDER BY r_id');
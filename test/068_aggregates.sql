@@ -0,0 +1,79 @@
+-- user-068: aggregate functions over source scans must agree with the SQL
+-- aggregates over the reference engine.
+CREATE TABLE r AS WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<250) SELECT i id FROM n;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('i'),('f'),('t'),('mixed'),('nulls');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT id, 1, (id*37)%101 - 50 FROM r;
+INSERT INTO x SELECT id, 2, id/8.0 FROM r WHERE id%3;
+INSERT INTO x SELECT id, 3, 'text' || id FROM r;
+INSERT INTO x SELECT id, 4, CASE id%3 WHEN 0 THEN id WHEN 1 THEN 'm' || id ELSE id*0.5 END FROM r;
+INSERT INTO x SELECT id, 5, NULL FROM r;
+-- Cells of rows that are not in the row key query do not count
+INSERT INTO x VALUES (260, 1, 100000), (7, 1, 999);
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  source=(SELECT r_id, c_id, val FROM x)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  reference=1
+);
+
+SELECT pivot_check('SELECT pivot_count(''p'', ''i''), pivot_sum(''p'', ''i''), pivot_avg(''p'', ''i''), pivot_min(''p'', ''i''), pivot_max(''p'', ''i'')',
+                   'SELECT count(i), sum(i), avg(i), min(i), max(i) FROM ref');
+SELECT pivot_check('SELECT pivot_count(''p'', ''f''), pivot_min(''p'', ''f''), pivot_max(''p'', ''f'')',
+                   'SELECT count(f), min(f), max(f) FROM ref');
+SELECT 'sum f: ' || pivot_sum('p', 'f') WHERE abs(pivot_sum('p', 'f') - (SELECT sum(f) FROM ref)) > 1e-9;
+SELECT pivot_check('SELECT pivot_count(''p'', ''t''), pivot_min(''p'', ''t''), pivot_max(''p'', ''t'')',
+                   'SELECT count(t), min(t), max(t) FROM ref');
+SELECT pivot_check('SELECT pivot_count(''p'', ''mixed''), pivot_min(''p'', ''mixed''), pivot_max(''p'', ''mixed'')',
+                   'SELECT count(mixed), min(mixed), max(mixed) FROM ref');
+SELECT pivot_check('SELECT pivot_count(''p'', ''nulls''), pivot_sum(''p'', ''nulls''), pivot_avg(''p'', ''nulls''), pivot_min(''p'', ''nulls''), pivot_max(''p'', ''nulls'')',
+                   'SELECT count(nulls), sum(nulls), avg(nulls), min(nulls), max(nulls) FROM ref');
+
+-- After a change the aggregates follow
+DELETE FROM r WHERE id > 200;
+UPDATE x SET val = 5000 WHERE r_id = 3 AND c_id = 1;
+SELECT pivot_check('SELECT pivot_count(''p'', ''i''), pivot_sum(''p'', ''i''), pivot_max(''p'', ''i'')',
+                   'SELECT count(i), sum(i), max(i) FROM ref');
+
+-- Tables of other schemas: a qualified name reads that schema's table, and
+-- an unqualified one the first pivot table of temp, main and the attached
+-- databases. The SELECT of the other columns reads the same table.
+ATTACH ':memory:' AS aux;
+CREATE TABLE aux.ax(r_id INT, val INT);
+INSERT INTO aux.ax VALUES (1, 1), (2, 2), (3, 3), (4, 4), (5, 5);
+CREATE VIRTUAL TABLE aux.pa USING pivot_vtab(
+  (SELECT DISTINCT r_id FROM ax),
+  (SELECT 1 c_id, 'a' name),
+  (SELECT val FROM ax WHERE r_id = ?1 AND ?2 = 1)
+);
+CREATE TABLE pa(a);
+INSERT INTO pa VALUES (1000);
+SELECT pivot_check('SELECT pivot_sum(''pa'', ''a''), pivot_sum(''aux.pa'', ''a''), pivot_count(''pa'', ''r_id'')',
+                   'SELECT sum(a), sum(a), count(r_id) FROM aux.pa');
+CREATE VIRTUAL TABLE pb USING pivot_vtab(
+  (SELECT id r_id FROM r WHERE id <= 2),
+  (SELECT 1 c_id, 'a' name),
+  (SELECT ?1 * 10 WHERE ?2 = 1)
+);
+CREATE VIRTUAL TABLE aux.pb USING pivot_vtab(
+  (SELECT DISTINCT r_id FROM ax),
+  (SELECT 1 c_id, 'a' name),
+  (SELECT val FROM ax WHERE r_id = ?1 AND ?2 = 1)
+);
+SELECT pivot_check('SELECT pivot_sum(''pb'', ''a''), pivot_sum(''main.pb'', ''a''), pivot_sum(''aux.pb'', ''a'')',
+                   'SELECT (SELECT sum(a) FROM main.pb), (SELECT sum(a) FROM main.pb), (SELECT sum(a) FROM aux.pb)');
+
+-- error: no such column: nope
+SELECT pivot_sum('p', 'nope');
+-- error: no such pivot table
+SELECT pivot_sum('nope', 'i');
+-- error: no such pivot table: temp.pa
+SELECT pivot_sum('temp.pa', 'a');
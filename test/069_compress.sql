@@ -0,0 +1,47 @@
+-- user-069: compressed source scan vectors. Dictionary, run-length and
+-- plain vectors must all return the values they were built from.
+CREATE TABLE r AS WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<3000) SELECT i id FROM n;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('status'),('sparse_i'),('sparse_t'),('uniq'),('f'),('dense_i'),('mixed'),('nulls');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT id, 1, CASE id%3 WHEN 0 THEN 'OPEN' WHEN 1 THEN 'CLOSED' ELSE 'PENDING_REVIEW' END FROM r;
+INSERT INTO x SELECT id, 2, id*7 FROM r WHERE id%50=0;
+INSERT INTO x SELECT id, 3, 'note ' || (id%3) FROM r WHERE id%40=1;
+INSERT INTO x SELECT id, 4, 'unique value ' || id FROM r;
+INSERT INTO x SELECT id, 5, id/3.0 FROM r WHERE id%4=0;
+INSERT INTO x SELECT id, 6, id FROM r;
+INSERT INTO x SELECT id, 7, CASE id%2 WHEN 0 THEN id ELSE 'm' END FROM r;
+INSERT INTO x SELECT id, 3, 'dup' FROM r WHERE id%40=1;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  source=(SELECT r_id, c_id, val FROM x), compress=1
+);
+CREATE VIRTUAL TABLE u USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  source=(SELECT r_id, c_id, val FROM x)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p ORDER BY r_id', 'SELECT * FROM ref ORDER BY r_id');
+SELECT pivot_check('SELECT * FROM p WHERE r_id IN (1, 50, 64, 100, 2999, 3000) ORDER BY r_id',
+                   'SELECT * FROM ref WHERE r_id IN (1, 50, 64, 100, 2999, 3000) ORDER BY r_id');
+SELECT pivot_check('SELECT pivot_sum(''p'', ''sparse_i''), pivot_count(''p'', ''status''), pivot_max(''p'', ''dense_i'')',
+                   'SELECT sum(sparse_i), count(status), max(dense_i) FROM ref');
+SELECT pivot_check('SELECT count(*) FROM u', 'SELECT 3000');
+SELECT 'compressed ' || a.value || ' bytes, plain ' || b.value FROM pivot_vtab_stats a, pivot_vtab_stats b
+ WHERE a.vtab = 'p' AND a.stat = 'source_bytes' AND b.vtab = 'u' AND b.stat = 'source_bytes' AND a.value >= b.value;
+
+-- After a change the vectors are rebuilt
+UPDATE x SET val = 'REOPENED' WHERE r_id = 3 AND c_id = 1;
+DELETE FROM x WHERE r_id = 50;
+SELECT pivot_check('SELECT * FROM p ORDER BY r_id', 'SELECT * FROM ref ORDER BY r_id');
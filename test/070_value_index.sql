@@ -0,0 +1,102 @@
+-- user-070: value indexes answer predicates on pivot columns. They must
+-- return the rows the reference engine filters, in the same order.
+CREATE TABLE r(id INT);
+INSERT INTO r WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<2000) SELECT i FROM n;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('status'),('amount'),('ratio'),('mixed'),('tag');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT id, 1, CASE id%4 WHEN 0 THEN 'OPEN' WHEN 1 THEN 'CLOSED' WHEN 2 THEN 'PENDING' ELSE NULL END FROM r;
+INSERT INTO x SELECT id, 2, (id*37)%1000 FROM r WHERE id%5;
+INSERT INTO x SELECT id, 3, id/16.0 FROM r;
+INSERT INTO x SELECT id, 4, CASE id%2 WHEN 0 THEN id ELSE 'm' || id END FROM r;
+INSERT INTO x SELECT id, 5, CAST('t' || (id%3) AS BLOB) FROM r WHERE id%7=0;
+INSERT INTO x VALUES (3000, 1, 'OPEN');
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  source=(SELECT r_id, c_id, val FROM x),
+  value_index=status, value_index=amount, value_index=ratio, value_index=mixed, value_index=tag
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p WHERE status = ''OPEN''', 'SELECT * FROM ref WHERE status = ''OPEN''');
+SELECT pivot_check('SELECT r_id FROM p WHERE status = ''NOPE''', 'SELECT r_id FROM ref WHERE status = ''NOPE''');
+SELECT pivot_check('SELECT r_id FROM p WHERE status = NULL', 'SELECT r_id FROM ref WHERE status = NULL');
+SELECT pivot_check('SELECT r_id FROM p WHERE status = 5', 'SELECT r_id FROM ref WHERE status = 5');
+SELECT pivot_check('SELECT r_id FROM p WHERE status > ''CLOSED'' AND status < ''PENDING''', 'SELECT r_id FROM ref WHERE status > ''CLOSED'' AND status < ''PENDING''');
+SELECT pivot_check('SELECT r_id FROM p WHERE status = ''open'' COLLATE NOCASE', 'SELECT r_id FROM ref WHERE status = ''open'' COLLATE NOCASE');
+SELECT pivot_check('SELECT r_id FROM p WHERE amount BETWEEN 10 AND 30', 'SELECT r_id FROM ref WHERE amount BETWEEN 10 AND 30');
+SELECT pivot_check('SELECT r_id FROM p WHERE amount > 990.5', 'SELECT r_id FROM ref WHERE amount > 990.5');
+SELECT pivot_check('SELECT r_id FROM p WHERE amount <= 3', 'SELECT r_id FROM ref WHERE amount <= 3');
+SELECT pivot_check('SELECT r_id FROM p WHERE ratio = 2', 'SELECT r_id FROM ref WHERE ratio = 2');
+SELECT pivot_check('SELECT r_id FROM p WHERE ratio < 1', 'SELECT r_id FROM ref WHERE ratio < 1');
+SELECT pivot_check('SELECT r_id FROM p WHERE mixed = 10', 'SELECT r_id FROM ref WHERE mixed = 10');
+SELECT pivot_check('SELECT r_id FROM p WHERE mixed > ''m1990''', 'SELECT r_id FROM ref WHERE mixed > ''m1990''');
+SELECT pivot_check('SELECT r_id FROM p WHERE tag = CAST(''t1'' AS BLOB)', 'SELECT r_id FROM ref WHERE tag = CAST(''t1'' AS BLOB)');
+SELECT pivot_check('SELECT r_id FROM p WHERE status = ''OPEN'' AND r_id BETWEEN 10 AND 30 ORDER BY r_id DESC',
+                   'SELECT r_id FROM ref WHERE status = ''OPEN'' AND r_id BETWEEN 10 AND 30 ORDER BY r_id DESC');
+SELECT 'value index scans: ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'value_index_scans' AND value < 1;
+
+-- After a change the indexes are rebuilt
+UPDATE x SET val = 'OPEN' WHERE r_id = 1 AND c_id = 1;
+SELECT pivot_check('SELECT * FROM p WHERE status = ''OPEN''', 'SELECT * FROM ref WHERE status = ''OPEN''');
+
+-- Row keys that the source query folds (NOCASE, or another affinity than
+-- the key query's) are not bound back to the key query
+CREATE TABLE rn(name TEXT);
+INSERT INTO rn VALUES ('Abc'), ('def'), ('1'), ('01');
+CREATE TABLE xn(r_name TEXT COLLATE NOCASE, c_id INT, val);
+INSERT INTO xn VALUES ('ABC', 1, 'OPEN'), ('def', 1, 'CLOSED');
+CREATE TABLE xi(r_name INT, c_id INT, val);
+INSERT INTO xi VALUES (1, 1, 'OPEN'), ('def', 1, 'OPEN');
+CREATE VIRTUAL TABLE pn USING pivot_vtab(
+  (SELECT name r_name FROM rn),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM xn WHERE r_name = ?1 AND c_id = ?2),
+  source=(SELECT r_name, c_id, val FROM xn), value_index=status
+);
+CREATE VIRTUAL TABLE refn USING pivot_vtab(
+  (SELECT name r_name FROM rn),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM xn WHERE r_name = ?1 AND c_id = ?2),
+  reference=1
+);
+CREATE VIRTUAL TABLE pi USING pivot_vtab(
+  (SELECT name r_name FROM rn),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM xi WHERE r_name = ?1 AND c_id = ?2),
+  source=(SELECT r_name, c_id, val FROM xi), value_index=status
+);
+CREATE VIRTUAL TABLE refi USING pivot_vtab(
+  (SELECT name r_name FROM rn),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM xi WHERE r_name = ?1 AND c_id = ?2),
+  reference=1
+);
+SELECT pivot_check('SELECT * FROM pn WHERE status = ''OPEN''', 'SELECT * FROM refn WHERE status = ''OPEN''');
+SELECT pivot_check('SELECT * FROM pn WHERE status > ''A''', 'SELECT * FROM refn WHERE status > ''A''');
+SELECT pivot_check('SELECT * FROM pi WHERE status = ''OPEN''', 'SELECT * FROM refi WHERE status = ''OPEN''');
+SELECT 'Abc not found' WHERE NOT EXISTS (SELECT 1 FROM pn WHERE status = 'OPEN' AND r_name = 'Abc');
+SELECT '01 not found' WHERE NOT EXISTS (SELECT 1 FROM pi WHERE status = 'OPEN' AND r_name = '01');
+
+-- error: value_index requires a source query
+CREATE VIRTUAL TABLE e1 USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  value_index=status
+);
+-- error: "nope" is not a pivot column
+CREATE VIRTUAL TABLE e2 USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  source=(SELECT r_id, c_id, val FROM x), value_index=nope
+);
@@ -0,0 +1,45 @@
+-- user-071: column-at-a-time scans run one column query per pivot column
+-- instead of one pivot query per cell.
+CREATE TABLE r AS WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<500) SELECT i id FROM n;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b'),('c'),('d');
+CREATE TABLE x(r_id INT, c_id INT, val);
+CREATE INDEX x_c_r ON x(c_id, r_id);
+INSERT INTO x SELECT id, 1, id*2 FROM r;
+INSERT INTO x SELECT id, 2, 'v' || id FROM r WHERE id%3;
+INSERT INTO x SELECT id, 3, id/4.0 FROM r WHERE id%10=0;
+INSERT INTO x SELECT id, 2, 'dup' FROM r WHERE id%3=1;
+-- Text keys that compare equal to the integer row keys, and a row key
+-- that is not in the row key query
+INSERT INTO x SELECT CAST(id AS TEXT), 4, 't' || id FROM r WHERE id%7=0;
+INSERT INTO x VALUES (9999, 1, 5);
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  column_query=(SELECT r_id, val FROM x WHERE c_id = ?1)
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p ORDER BY r_id', 'SELECT * FROM ref ORDER BY r_id');
+SELECT pivot_check('SELECT sum(a), count(b), count(d) FROM p WHERE r_id < 100', 'SELECT sum(a), count(b), count(d) FROM ref WHERE r_id < 100');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 10', 'SELECT * FROM ref WHERE r_id = 10');
+SELECT 'column scans: ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'column_scans' AND value < 1;
+
+-- After a change the columns are scanned again
+UPDATE x SET val = 1000 WHERE r_id = 1 AND c_id = 1;
+SELECT pivot_check('SELECT a FROM p WHERE r_id <= 2', 'SELECT a FROM ref WHERE r_id <= 2');
+
+-- error: Pivot table column query error
+CREATE VIRTUAL TABLE e1 USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2 LIMIT 1),
+  column_query=(SELECT r_id, val FROM x)
+);
@@ -0,0 +1,58 @@
+-- user-072: tiled range scans read blocks of rows from the source query.
+-- Keys of every type, and composite keys, must find their cells.
+CREATE TABLE r(id, grp);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<1000) INSERT INTO r SELECT i, i%7 FROM n;
+INSERT INTO r VALUES ('k"1\x', 1), (2.5, 2), (x'01', 3);
+CREATE TABLE c(id, name TEXT);
+INSERT INTO c VALUES (1,'a'),(2,'b'),('t','c'),(1.5,'d');
+CREATE TABLE x(r_id, c_id, val, PRIMARY KEY(r_id, c_id));
+INSERT INTO x SELECT id, 1, id*2 FROM r WHERE typeof(id)='integer';
+INSERT INTO x SELECT id, 2, 'v' || id FROM r WHERE typeof(id)='integer' AND id%3;
+INSERT INTO x SELECT id, 't', id/4.0 FROM r WHERE typeof(id)='integer' AND id%10=0;
+INSERT INTO x SELECT id, 1.5, 'd' FROM r WHERE typeof(id)='integer' AND id%100=0;
+INSERT INTO x VALUES ('k"1\x', 1, 'q'), (2.5, 1, 'r'), (2.5, 't', 'r2'), (x'01', 2, 'b');
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id, grp FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM x), tile_rows=16
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id, grp FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p WHERE r_id BETWEEN 100 AND 400', 'SELECT * FROM ref WHERE r_id BETWEEN 100 AND 400');
+SELECT pivot_check('SELECT * FROM p WHERE r_id > 900', 'SELECT * FROM ref WHERE r_id > 900');
+SELECT pivot_check('SELECT * FROM p WHERE grp = 3', 'SELECT * FROM ref WHERE grp = 3');
+SELECT pivot_check('SELECT * FROM p WHERE r_id >= 2.5 AND r_id < 10 OR r_id > ''a'' ORDER BY 1',
+                   'SELECT * FROM ref WHERE r_id >= 2.5 AND r_id < 10 OR r_id > ''a'' ORDER BY 1');
+SELECT pivot_check('SELECT a FROM p WHERE r_id > 100 LIMIT 3', 'SELECT a FROM ref WHERE r_id > 100 LIMIT 3');
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+SELECT 'tile queries: ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'tile_queries' AND value < 1;
+
+-- Composite row keys
+CREATE TABLE y(a, b, c_id, val);
+INSERT INTO y SELECT id/10, id%10, 1, id FROM r WHERE typeof(id)='integer';
+INSERT INTO y SELECT id/10, id%10, 2, -id FROM r WHERE typeof(id)='integer' AND id%4;
+CREATE VIRTUAL TABLE m USING pivot_vtab(
+  (SELECT DISTINCT a, b FROM y),
+  (SELECT id c_id, 'p' || name FROM c WHERE id IN (1,2)),
+  (SELECT val FROM y WHERE a = ?1 AND b = ?2 AND c_id = ?3),
+  source=(SELECT a, b, c_id, val FROM y), tile_rows=3
+);
+CREATE VIRTUAL TABLE mref USING pivot_vtab(
+  (SELECT DISTINCT a, b FROM y),
+  (SELECT id c_id, 'p' || name FROM c WHERE id IN (1,2)),
+  (SELECT val FROM y WHERE a = ?1 AND b = ?2 AND c_id = ?3),
+  reference=1
+);
+SELECT pivot_check('SELECT * FROM m WHERE a BETWEEN 10 AND 50', 'SELECT * FROM mref WHERE a BETWEEN 10 AND 50');
+SELECT pivot_check('SELECT * FROM m WHERE a < 40 AND b > 5', 'SELECT * FROM mref WHERE a < 40 AND b > 5');
+
+-- After a change the tiles are read again
+UPDATE x SET val = 'new' WHERE r_id = 150 AND c_id = 1;
+SELECT pivot_check('SELECT * FROM p WHERE r_id BETWEEN 100 AND 400', 'SELECT * FROM ref WHERE r_id BETWEEN 100 AND 400');
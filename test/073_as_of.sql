@@ -0,0 +1,56 @@
+-- user-073: as_of pivots return the latest value at or before a time.
+-- The reference table binds the same time as a parameter column.
+CREATE TABLE syms(sym TEXT PRIMARY KEY);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<50) INSERT INTO syms SELECT 'S' || i FROM n;
+CREATE TABLE fields(field TEXT);
+INSERT INTO fields VALUES ('bid'), ('ask'), ('last');
+CREATE TABLE ticks(sym, field, ts, val);
+CREATE INDEX ticks_sym_field_ts ON ticks(sym, field, ts);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<5000)
+INSERT INTO ticks SELECT 'S' || (i*7%50+1), CASE i%3 WHEN 0 THEN 'bid' WHEN 1 THEN 'ask' ELSE 'last' END, i, i FROM n;
+-- Ticks out of time order
+INSERT INTO ticks VALUES ('S1', 'bid', 99.5, -1), ('S1', 'bid', 100.5, 1000000);
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT sym FROM syms),
+  (SELECT field, field FROM fields),
+  (SELECT val FROM ticks WHERE sym = ?1 AND field = ?2 AND ts <= ?3 ORDER BY ts DESC, val DESC LIMIT 1),
+  source=(SELECT sym, field, ts, val FROM ticks ORDER BY val), as_of=t, row_cache=10
+);
+CREATE VIRTUAL TABLE q USING pivot_vtab(
+  (SELECT sym FROM syms),
+  (SELECT field, field FROM fields),
+  (SELECT val FROM ticks WHERE sym = ?1 AND field = ?2 AND ts <= ?3 ORDER BY ts DESC, val DESC LIMIT 1),
+  source=(SELECT sym, field, ts, val FROM ticks ORDER BY val), as_of=t, tile_rows=8
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT sym FROM syms),
+  (SELECT field, field FROM fields),
+  (SELECT val FROM ticks WHERE sym = ?1 AND field = ?2 AND ts <= ?3 ORDER BY ts DESC, val DESC LIMIT 1),
+  param=t, reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p(2500)', 'SELECT * FROM ref(2500)');
+SELECT pivot_check('SELECT * FROM p(100)', 'SELECT * FROM ref(100)');
+SELECT pivot_check('SELECT * FROM p(1)', 'SELECT * FROM ref(1)');
+SELECT pivot_check('SELECT * FROM p(0)', 'SELECT * FROM ref(0)');
+SELECT pivot_check('SELECT * FROM p WHERE t = 4999', 'SELECT * FROM ref WHERE t = 4999');
+SELECT pivot_check('SELECT * FROM p(400) WHERE sym IN (''S1'', ''S2'')', 'SELECT * FROM ref(400) WHERE sym IN (''S1'', ''S2'')');
+SELECT pivot_check('SELECT * FROM p WHERE sym = ''S5'' AND t = 300', 'SELECT * FROM ref WHERE sym = ''S5'' AND t = 300');
+SELECT pivot_check('SELECT a.sym, a.bid, b.bid FROM p(2000) a JOIN p(4000) b USING (sym)',
+                   'SELECT a.sym, a.bid, b.bid FROM ref(2000) a JOIN ref(4000) b USING (sym)');
+SELECT pivot_check('SELECT * FROM q(4000) WHERE sym < ''S3''', 'SELECT * FROM ref(4000) WHERE sym < ''S3''');
+-- Without a time there are no cells
+SELECT pivot_check('SELECT count(bid) FROM p', 'SELECT 0');
+
+-- After a change the latest values follow
+INSERT INTO ticks VALUES ('S2', 'ask', 2400, 7);
+SELECT pivot_check('SELECT * FROM p(2500)', 'SELECT * FROM ref(2500)');
+
+-- error: as_of requires a source query
+CREATE VIRTUAL TABLE e1 USING pivot_vtab(
+  (SELECT sym FROM syms),
+  (SELECT field, field FROM fields),
+  (SELECT val FROM ticks WHERE sym = ?1 AND field = ?2 AND ts <= ?3 LIMIT 1),
+  as_of=t
+);
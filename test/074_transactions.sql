@@ -0,0 +1,64 @@
+-- user-074: caches stay coherent with writes made on the same connection,
+-- inside transactions and savepoints and after rollbacks.
+CREATE TABLE r AS SELECT 1 id UNION SELECT 2 UNION SELECT 3;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val TEXT);
+INSERT INTO x (r_id, c_id, val) SELECT r.id, c.id, c.name || r.id FROM c, r;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  row_cache=10, miss_cache=10
+);
+CREATE VIRTUAL TABLE s USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM x), track_dependencies=1
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 4', 'SELECT * FROM ref WHERE r_id = 4');
+SELECT pivot_check('SELECT * FROM s', 'SELECT * FROM ref');
+
+BEGIN;
+UPDATE x SET val = 'w' WHERE r_id = 1 AND c_id = 1;
+INSERT INTO r VALUES (4);
+INSERT INTO x VALUES (4, 2, 'b4');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 4', 'SELECT * FROM ref WHERE r_id = 4');
+SELECT pivot_check('SELECT * FROM s', 'SELECT * FROM ref');
+SAVEPOINT sp;
+UPDATE x SET val = 'sp' WHERE r_id = 1 AND c_id = 1;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM s', 'SELECT * FROM ref');
+ROLLBACK TO sp;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM s', 'SELECT * FROM ref');
+ROLLBACK;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 1', 'SELECT * FROM ref WHERE r_id = 1');
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 4', 'SELECT * FROM ref WHERE r_id = 4');
+SELECT pivot_check('SELECT * FROM s', 'SELECT * FROM ref');
+
+-- A committed transaction
+BEGIN;
+DELETE FROM x WHERE r_id = 2;
+UPDATE c SET name = 'z' WHERE id = 2;
+COMMIT;
+SELECT pivot_check('SELECT * FROM p WHERE r_id = 2', 'SELECT * FROM ref WHERE r_id = 2');
+SELECT pivot_check('SELECT * FROM s', 'SELECT * FROM ref');
+
+-- Writes to a table the queries do not read keep the source scan
+CREATE TABLE other(v);
+SELECT pivot_check('SELECT * FROM s', 'SELECT * FROM ref');
+INSERT INTO other SELECT value FROM pivot_vtab_stats WHERE vtab = 's' AND stat = 'source_scans';
+SELECT pivot_check('SELECT * FROM s', 'SELECT * FROM ref');
+SELECT 'source scans: ' || value FROM pivot_vtab_stats WHERE vtab = 's' AND stat = 'source_scans' AND value <> (SELECT v FROM other);
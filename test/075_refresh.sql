@@ -0,0 +1,59 @@
+-- user-075: background snapshot refreshes. Snapshots may be stale, so the
+-- results are compared before any change, and inside write transactions,
+-- which read the source query on the connection.
+PRAGMA journal_mode = wal;
+CREATE TABLE r AS WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<100) SELECT i id FROM n;
+CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);
+INSERT INTO c (name) VALUES ('a'),('b');
+CREATE TABLE x(r_id INT, c_id INT, val);
+INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c WHERE r.id%3 OR c.id = 1;
+
+CREATE VIRTUAL TABLE p USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM x), refresh_ms=60000, track_dependencies=1
+);
+CREATE VIRTUAL TABLE q USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM x), refresh_ms=60000
+);
+CREATE VIRTUAL TABLE ref USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  reference=1
+);
+
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+SELECT pivot_check('SELECT * FROM p WHERE r_id BETWEEN 10 AND 20', 'SELECT * FROM ref WHERE r_id BETWEEN 10 AND 20');
+SELECT pivot_check('SELECT * FROM q', 'SELECT * FROM ref');
+
+-- refresh_ms alone does not track dependencies
+SELECT 'q dependencies: ' || value FROM pivot_vtab_stats WHERE vtab = 'q' AND stat = 'dependencies' AND value IS NOT NULL;
+
+-- A write transaction reads its own changes
+BEGIN;
+UPDATE x SET val = 'w' WHERE r_id = 1;
+DELETE FROM x WHERE r_id = 2;
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+ROLLBACK;
+
+-- With track_dependencies, writes of this connection to tables the
+-- queries do not read leave the snapshot current
+CREATE TABLE other(v);
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+INSERT INTO other VALUES (1);
+SELECT pivot_check('SELECT * FROM p', 'SELECT * FROM ref');
+SELECT 'snapshot failures: ' || value FROM pivot_vtab_stats WHERE vtab = 'p' AND stat = 'snapshot_failures' AND value <> 0;
+
+CREATE TEMP TABLE t(r_id, c_id, val);
+-- error: refresh_ms error
+CREATE VIRTUAL TABLE e1 USING pivot_vtab(
+  (SELECT id r_id FROM r),
+  (SELECT id c_id, name FROM c),
+  (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),
+  source=(SELECT r_id, c_id, val FROM temp.t), refresh_ms=100
+);
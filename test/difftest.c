@@ -0,0 +1,458 @@
+/*
+** difftest.c - Randomized differential test of the pivot_vtab fast paths
+**
+** Build and run from the repository root:
+**
+**   gcc -I. test/difftest.c pivot_vtab.c -lsqlite3 -o difftest && ./difftest
+**
+** Each round generates a schema and data, creates the same pivot table
+** once per evaluation strategy (caches, dependency tracking, deltas,
+** source scans, compression, column queries, tiles, value indexes and
+** inner) and once with reference=1, then runs the same queries on each of
+** them and compares the results value by value, type included. Between
+** queries the data is changed, inside and outside write transactions and
+** savepoints, so that the caches and scans must follow the changes.
+** Rounds with an even seed install the change hooks of pivot_vtab.h, so
+** that dependency tracking and deltas see the changes, and rounds with an
+** odd seed do not, so that the pivot tables must do without them.
+**
+** The data mixes the cases the fast paths must get right: NULL keys and
+** values, duplicate cells (the first source row wins), keys compared with
+** the affinity of INT, TEXT, REAL, NUMERIC and untyped columns, composite
+** row keys, and NOCASE and RTRIM collations.
+**
+** Options:
+**
+**   -seed N     Seed of the first round (default 1). Round k uses seed
+**               N+k, so a failure is reproduced with -seed N+k -rounds 1.
+**   -rounds N   Number of rounds (default 20).
+**   -size N     Number of row keys per round (default 40). Raise it, and
+**               -rounds, for soak runs. Rounds without an index on x
+**               take time in the cube of N.
+**   -v          Print each round's seed and schema.
+**   -sql        Print the statements that create and change the data, to
+**               replay a failing round in the sqlite3 shell.
+**
+** Exits with status 0 if every result matches the reference.
+*/
+#include "pivot_vtab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int sqlite3_pivotvtab_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+
+static sqlite3_uint64 iRand;
+static int bVerbose = 0;
+static int bSql = 0;
+
+/*
+** Return a pseudo-random number in [0, n). The generator (xorshift64*)
+** is the same on every platform, so that a seed always replays the same
+** round.
+*/
+static int rnd(int n){
+  iRand ^= iRand>>12;
+  iRand ^= iRand<<25;
+  iRand ^= iRand>>27;
+  return (int)(((iRand*0x2545F4914F6CDD1DULL)>>33) % (sqlite3_uint64)n);
+}
+
+/*
+** Run zSql, which must succeed.
+*/
+static int exec(sqlite3 *db, const char *zSql){
+  char *zErr = 0;
+  if( bSql ) printf("%s;\n", zSql);
+  if( sqlite3_exec(db, zSql, 0, 0, &zErr)!=SQLITE_OK ){
+    printf("%s\n  error: %s\n", zSql, zErr);
+    sqlite3_free(zErr);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+** Return a random key literal. The pool mixes integers with their text
+** and real forms, text differing only in case or trailing spaces, a blob
+** and NULL, so that every affinity and collation rule is exercised.
+*/
+static const char *randKey(int nKey){
+  static const char *azPool[] = {
+    "1", "'1'", "1.0", "' 1'", "2", "'2'", "2.5", "'2.5'", "3", "'03'",
+    "'a'", "'A'", "'a '", "'b'", "'B '", "x'01'", "NULL", "-1", "'-1'", "4"
+  };
+  return azPool[rnd(nKey<(int)(sizeof(azPool)/sizeof(azPool[0])) ? nKey : (int)(sizeof(azPool)/sizeof(azPool[0])))];
+}
+
+/*
+** Return a random cell value of any type.
+*/
+static char *randValue(void){
+  switch( rnd(8) ){
+    case 0:  return sqlite3_mprintf("NULL");
+    case 1:  return sqlite3_mprintf("%d", rnd(5));
+    case 2:  return sqlite3_mprintf("%d", rnd(1000)-500);
+    case 3:  return sqlite3_mprintf("%d.25", rnd(100));
+    case 4:  return sqlite3_mprintf("'v%d'", rnd(4));
+    case 5:  return sqlite3_mprintf("'V%d'", rnd(4));
+    case 6:  return sqlite3_mprintf("x'%02x'", rnd(4));
+    default: return sqlite3_mprintf("'%d'", rnd(5));
+  }
+}
+
+/*
+** Compare the results of zA and zB row by row, value by value. Return 0
+** if they match, or print the first difference and return 1.
+*/
+static int compareQueries(sqlite3 *db, const char *zA, const char *zB){
+  sqlite3_stmt *pA = 0, *pB = 0;
+  int rcA, rcB, iRow = 0, i, nCol, rc = 1;
+  if( sqlite3_prepare_v2(db, zA, -1, &pA, 0) || sqlite3_prepare_v2(db, zB, -1, &pB, 0) ){
+    printf("%s\n  error: %s\n", pA ? zB : zA, sqlite3_errmsg(db));
+    goto done;
+  }
+  nCol = sqlite3_column_count(pA);
+  for(;;){
+    rcA = sqlite3_step(pA);
+    rcB = sqlite3_step(pB);
+    iRow++;
+    if( rcA!=rcB ){
+      printf("%s\n%s\n  row %d: %s vs %s\n", zA, zB, iRow,
+        rcA==SQLITE_ROW ? "row" : sqlite3_errstr(rcA), rcB==SQLITE_ROW ? "row" : sqlite3_errstr(rcB));
+      goto done;
+    }
+    if( rcA!=SQLITE_ROW ) break;
+    for( i=0; i<nCol; i++ ){
+      int eA = sqlite3_column_type(pA, i), eB = sqlite3_column_type(pB, i);
+      int bSame = eA==eB;
+      if( bSame && eA==SQLITE_INTEGER ) bSame = sqlite3_column_int64(pA, i)==sqlite3_column_int64(pB, i);
+      if( bSame && eA==SQLITE_FLOAT ) bSame = sqlite3_column_double(pA, i)==sqlite3_column_double(pB, i);
+      if( bSame && (eA==SQLITE_TEXT || eA==SQLITE_BLOB) ){
+        int n = sqlite3_column_bytes(pA, i);
+        bSame = n==sqlite3_column_bytes(pB, i) && memcmp(sqlite3_column_blob(pA, i), sqlite3_column_blob(pB, i), n)==0;
+      }
+      if( !bSame ){
+        static const char *azType[] = { "", "integer", "real", "text", "blob", "null" };
+        printf("%s\n%s\n  row %d column %s: %s %s vs %s %s\n", zA, zB, iRow, sqlite3_column_name(pA, i),
+          azType[eA], sqlite3_column_text(pA, i), azType[eB], sqlite3_column_text(pB, i));
+        goto done;
+      }
+    }
+  }
+  if( rcA!=SQLITE_DONE ){
+    printf("%s\n  error: %s\n", zA, sqlite3_errmsg(db));
+    goto done;
+  }
+  rc = 0;
+done:
+  sqlite3_finalize(pA);
+  sqlite3_finalize(pB);
+  return rc;
+}
+
+/*
+** The evaluation strategies compared with the reference. %S is replaced
+** by the source query, %D by the delta query and %C by the column query. A strategy with bInner is compared with a
+** reference that also has inner=1.
+*/
+static const struct {
+  const char *zName;
+  const char *zOpt;
+  int bInner;
+} aStrategy[] = {
+  { "cache",    "row_cache=8, miss_cache=8", 0 },
+  { "deps",     "row_cache=8, miss_cache=8, track_dependencies=1", 0 },
+  { "delta",    "row_cache=8, miss_cache=8, delta_query=%D", 0 },
+  { "source",   "source=%S", 0 },
+  { "compress", "source=%S, compress=1", 0 },
+  { "column",   "column_query=%C", 0 },
+  { "tile",     "source=%S, tile_rows=2", 0 },
+  { "vindex",   "source=%S, value_index=c0, value_index=c1", 0 },
+  { "inner",    "source=%S, inner=1", 1 },
+};
+#define N_STRATEGY (int)(sizeof(aStrategy)/sizeof(aStrategy[0]))
+
+/*
+** Schema of the current round.
+*/
+typedef struct Round Round;
+struct Round {
+  int nKey;                      // Number of row key columns (1 or 2)
+  int nCol;                      // Number of pivot columns
+  int nSize;                     // Number of row keys
+  char zKeyCols[32];             // "k1" or "k1, k2"
+};
+
+/*
+** Expand the options of strategy iStrat for round p.
+*/
+static char *strategyOptions(Round *p, int iStrat){
+  const char *z = aStrategy[iStrat].zOpt;
+  sqlite3_str *pStr = sqlite3_str_new(0);
+  for( ; *z; z++ ){
+    if( z[0]!='%' ){
+      sqlite3_str_appendchar(pStr, 1, z[0]);
+      continue;
+    }
+    z++;
+    if( *z=='S' ) sqlite3_str_appendf(pStr, "(SELECT %s, c_id, val FROM x)", p->zKeyCols);
+    if( *z=='D' ) sqlite3_str_appendf(pStr, "(SELECT %s FROM x WHERE rowid = ?1)", p->zKeyCols);
+    if( *z=='C' ) sqlite3_str_appendf(pStr, "(SELECT %s, val FROM x WHERE c_id = ?1)", p->zKeyCols);
+  }
+  return sqlite3_str_finish(pStr);
+}
+
+/*
+** Create the tables of a round, and the pivot tables of every strategy.
+*/
+static int setupRound(sqlite3 *db, Round *p){
+  static const char *azType[] = {
+    "INT", "TEXT", "REAL", "NUMERIC", "", "TEXT COLLATE NOCASE", "TEXT COLLATE RTRIM", "COLLATE NOCASE"
+  };
+  const char *azKeyType[2];
+  const char *azRowType[2];
+  const char *zColType = azType[rnd(5)];
+  char *zSql;
+  int i, rc = 0;
+
+  p->nKey = 1+rnd(2);
+  p->nCol = 2+rnd(5);
+  azKeyType[0] = azType[rnd(8)];
+  azKeyType[1] = azType[rnd(8)];
+  // The key query may return values of another affinity than the columns
+  // the pivot query compares them with
+  azRowType[0] = rnd(2) ? azKeyType[0] : azType[rnd(8)];
+  azRowType[1] = rnd(2) ? azKeyType[1] : azType[rnd(8)];
+  strcpy(p->zKeyCols, p->nKey==1 ? "k1" : "k1, k2");
+  if( bVerbose ){
+    printf("  keys %d (%s, %s of %s, %s), columns %d (%s)\n", p->nKey,
+      azKeyType[0], azKeyType[1], azRowType[0], azRowType[1], p->nCol, zColType
+    );
+  }
+
+  // The row keys come from r, with duplicates. The column keys are of mixed
+  // types, and may be NULL.
+  zSql = sqlite3_mprintf(
+    "CREATE TABLE r(k1 %s, k2 %s);"
+    "CREATE TABLE c(id %s, name TEXT);"
+    "CREATE TABLE x(k1 %s, k2 %s, c_id %s, val);",
+    azRowType[0], azRowType[1], zColType, azKeyType[0], azKeyType[1], zColType
+  );
+  rc |= exec(db, zSql);
+  sqlite3_free(zSql);
+  for( i=0; i<p->nCol; i++ ){
+    static const char *azColKey[] = { "1", "'2'", "3.0", "'d'", "'D '", "NULL", "x'0a'" };
+    zSql = sqlite3_mprintf("INSERT INTO c VALUES (%s, 'c%d')", azColKey[i], i);
+    rc |= exec(db, zSql);
+    sqlite3_free(zSql);
+  }
+  for( i=0; i<p->nSize; i++ ){
+    zSql = sqlite3_mprintf("INSERT INTO r VALUES (%s, %s)", randKey(p->nSize), randKey(4));
+    rc |= exec(db, zSql);
+    sqlite3_free(zSql);
+  }
+  for( i=0; i<p->nSize*p->nCol; i++ ){
+    char *zVal = randValue();
+    static const char *azColKey[] = { "1", "'1'", "2", "'2'", "3", "'3.0'", "'d'", "'D'", "'D '", "NULL", "x'0a'" };
+    zSql = sqlite3_mprintf("INSERT INTO x VALUES (%s, %s, %s, %s)", randKey(p->nSize), randKey(4), azColKey[rnd(11)], zVal);
+    rc |= exec(db, zSql);
+    sqlite3_free(zSql);
+    sqlite3_free(zVal);
+  }
+  // An index on the compared columns keeps duplicate cells in rowid order,
+  // as the source query reads them. One with more columns would order them
+  // by those, and the first row of the pivot query would be another one.
+  if( rnd(2) ){
+    rc |= exec(db, p->nKey==1 ? "CREATE INDEX x_k ON x(k1, c_id)" : "CREATE INDEX x_k ON x(k1, k2, c_id)");
+  }
+
+  for( i=0; i<=N_STRATEGY; i++ ){
+    const char *zPivot = p->nKey==1
+      ? "(SELECT val FROM x WHERE k1 = ?1 AND c_id = ?2)"
+      : "(SELECT val FROM x WHERE k1 = ?1 AND k2 = ?2 AND c_id = ?3)";
+    char *zOpt;
+    if( i==N_STRATEGY ){
+      // The reference tables: one plain, and one with inner=1, which needs
+      // the source query to find the rows with cells
+      zSql = sqlite3_mprintf(
+        "CREATE VIRTUAL TABLE ref USING pivot_vtab((SELECT %s FROM r), (SELECT id, name FROM c), %s, reference=1);"
+        "CREATE VIRTUAL TABLE ref_inner USING pivot_vtab((SELECT %s FROM r), (SELECT id, name FROM c), %s, reference=1, inner=1,"
+        " source=(SELECT %s, c_id, val FROM x));",
+        p->zKeyCols, zPivot, p->zKeyCols, zPivot, p->zKeyCols
+      );
+      rc |= exec(db, zSql);
+      sqlite3_free(zSql);
+      break;
+    }
+    zOpt = strategyOptions(p, i);
+    zSql = sqlite3_mprintf("CREATE VIRTUAL TABLE t_%s USING pivot_vtab((SELECT %s FROM r), (SELECT id, name FROM c), %s, %s)",
+      aStrategy[i].zName, p->zKeyCols, zPivot, zOpt
+    );
+    rc |= exec(db, zSql);
+    sqlite3_free(zSql);
+    sqlite3_free(zOpt);
+  }
+  return rc;
+}
+
+/*
+** Return a random query on pivot table %s, with every column in the
+** ORDER BY so that results compare row by row.
+*/
+static char *randQuery(Round *p){
+  // Keys 1 and 1.0 are equal, so their types are ordered on as well
+  char *zOrder = sqlite3_mprintf(p->nKey==1 ? "ORDER BY k1, typeof(k1)" : "ORDER BY k1, typeof(k1), k2, typeof(k2)");
+  char *zSql;
+  int i;
+  for( i=0; i<p->nCol; i++ ){
+    char *z = sqlite3_mprintf("%s, c%d", zOrder, i);
+    sqlite3_free(zOrder);
+    zOrder = z;
+  }
+  switch( rnd(10) ){
+    case 0: zSql = sqlite3_mprintf("SELECT * FROM %%s %s", zOrder); break;
+    case 1: zSql = sqlite3_mprintf("SELECT * FROM %%s WHERE k1 = %s %s", randKey(p->nSize), zOrder); break;
+    case 2: zSql = sqlite3_mprintf("SELECT * FROM %%s WHERE k1 IN (%s, %s) %s", randKey(p->nSize), randKey(p->nSize), zOrder); break;
+    case 3: zSql = sqlite3_mprintf("SELECT * FROM %%s WHERE k1 > %s %s", randKey(p->nSize), zOrder); break;
+    case 4: zSql = sqlite3_mprintf("SELECT * FROM %%s WHERE k1 >= %s %s LIMIT 3", randKey(p->nSize), zOrder); break;
+    case 5: zSql = sqlite3_mprintf("SELECT * FROM %%s WHERE c%d = %s %s", rnd(2), randKey(5), zOrder); break;
+    case 6: zSql = sqlite3_mprintf("SELECT * FROM %%s WHERE c%d > %d %s", rnd(2), rnd(5), zOrder); break;
+    case 7: zSql = sqlite3_mprintf("SELECT * FROM (SELECT t.* FROM r, %%s t WHERE t.k1 = r.k1) %s", zOrder); break;
+    case 8:
+      zSql = sqlite3_mprintf("SELECT pivot_count('%%s', 'c%d'), pivot_min('%%s', 'c%d'), pivot_max('%%s', 'c%d')", 0, 0, 1);
+      break;
+    default:
+      zSql = p->nKey==1
+        ? sqlite3_mprintf("SELECT * FROM %%s WHERE k1 = %s %s", randKey(p->nSize), zOrder)
+        : sqlite3_mprintf("SELECT * FROM %%s WHERE k1 = %s AND k2 = %s %s", randKey(p->nSize), randKey(4), zOrder);
+      break;
+  }
+  sqlite3_free(zOrder);
+  return zSql;
+}
+
+/*
+** Apply a random change to the data. Updates do not move a source row to
+** another row key, as the delta_query option requires.
+*/
+static int randChange(sqlite3 *db, Round *p){
+  char *zSql;
+  char *zVal = randValue();
+  int rc;
+  switch( rnd(5) ){
+    case 0:
+      zSql = sqlite3_mprintf("INSERT INTO x VALUES (%s, %s, %d, %s)", randKey(p->nSize), randKey(4), 1+rnd(3), zVal);
+      break;
+    case 1:
+      zSql = sqlite3_mprintf("UPDATE x SET val = %s WHERE rowid IN (SELECT rowid FROM x LIMIT 3 OFFSET %d %% (SELECT count(*) FROM x))", zVal, rnd(1000));
+      break;
+    case 2:
+      zSql = sqlite3_mprintf("DELETE FROM x WHERE rowid = (SELECT rowid FROM x LIMIT 1 OFFSET %d %% (SELECT count(*) FROM x))", rnd(1000));
+      break;
+    case 3:
+      zSql = sqlite3_mprintf("INSERT INTO r VALUES (%s, %s)", randKey(p->nSize), randKey(4));
+      break;
+    default:
+      zSql = sqlite3_mprintf("DELETE FROM r WHERE rowid = (SELECT rowid FROM r LIMIT 1 OFFSET %d %% (SELECT count(*) FROM r))", rnd(1000));
+      break;
+  }
+  rc = exec(db, zSql);
+  sqlite3_free(zSql);
+  sqlite3_free(zVal);
+  return rc;
+}
+
+/*
+** Run one query on every strategy's table and compare it with the
+** reference.
+*/
+static int checkQuery(sqlite3 *db, Round *p){
+  char *zQuery = randQuery(p);
+  int i, rc = 0;
+  for( i=0; i<N_STRATEGY && rc==0; i++ ){
+    char *zTab = sqlite3_mprintf("t_%s", aStrategy[i].zName);
+    const char *zRef = aStrategy[i].bInner ? "ref_inner" : "ref";
+    char *zA = sqlite3_mprintf(zQuery, zTab, zTab, zTab);
+    char *zB = sqlite3_mprintf(zQuery, zRef, zRef, zRef);
+    rc = compareQueries(db, zA, zB);
+    if( rc ) printf("  strategy %s\n", aStrategy[i].zName);
+    sqlite3_free(zA);
+    sqlite3_free(zB);
+    sqlite3_free(zTab);
+  }
+  sqlite3_free(zQuery);
+  return rc;
+}
+
+/*
+** Run one round with seed iSeed. Return non-zero on a mismatch.
+*/
+static int runRound(sqlite3_uint64 iSeed, int nSize){
+  sqlite3 *db;
+  Round r;
+  int i, rc;
+  iRand = iSeed*0x9E3779B97F4A7C15ULL + 1;
+  memset(&r, 0, sizeof(r));
+  r.nSize = nSize;
+  if( bVerbose ) printf("seed %llu\n", (unsigned long long)iSeed);
+  sqlite3_open(":memory:", &db);
+  if( iSeed%2==0 ){
+    void *pArg = pivot_vtab_hook_arg(db);
+    sqlite3_update_hook(db, pivot_vtab_update_hook, pArg);
+    sqlite3_rollback_hook(db, pivot_vtab_rollback_hook, pArg);
+  }
+  rc = setupRound(db, &r);
+  for( i=0; rc==0 && i<r.nSize; i++ ){
+    rc = checkQuery(db, &r);
+    if( rc==0 && rnd(3)==0 ) rc = randChange(db, &r);
+    if( rc==0 && rnd(8)==0 ){
+      // A write transaction, partly rolled back to a savepoint, and then
+      // committed or rolled back
+      rc = exec(db, "BEGIN");
+      if( rc==0 ) rc = randChange(db, &r);
+      if( rc==0 ) rc = checkQuery(db, &r);
+      if( rc==0 ) rc = exec(db, "SAVEPOINT sp");
+      if( rc==0 ) rc = randChange(db, &r);
+      if( rc==0 ) rc = checkQuery(db, &r);
+      if( rc==0 ) rc = exec(db, rnd(2) ? "ROLLBACK TO sp" : "RELEASE sp");
+      if( rc==0 ) rc = checkQuery(db, &r);
+      if( rc==0 ) rc = exec(db, rnd(2) ? "COMMIT" : "ROLLBACK");
+    }
+  }
+  if( rc ) printf("seed %llu failed\n", (unsigned long long)iSeed);
+  sqlite3_close(db);
+  return rc;
+}
+
+int main(int argc, char **argv){
+  sqlite3_uint64 iSeed = 1;
+  int nRound = 20;
+  int nSize = 40;
+  int nFail = 0;
+  int i;
+  for( i=1; i<argc; i++ ){
+    if( strcmp(argv[i], "-seed")==0 && i+1<argc ){
+      iSeed = strtoull(argv[++i], 0, 10);
+    }else if( strcmp(argv[i], "-rounds")==0 && i+1<argc ){
+      nRound = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "-size")==0 && i+1<argc ){
+      nSize = atoi(argv[++i]);
+    }else if( strcmp(argv[i], "-v")==0 ){
+      bVerbose = 1;
+    }else if( strcmp(argv[i], "-sql")==0 ){
+      bSql = 1;
+    }else{
+      fprintf(stderr, "Usage: %s ?-seed N? ?-rounds N? ?-size N? ?-v? ?-sql?\n", argv[0]);
+      return 2;
+    }
+  }
+  if( nSize<1 ) nSize = 1;
+  sqlite3_auto_extension((void(*)(void))sqlite3_pivotvtab_init);
+  for( i=0; i<nRound; i++ ){
+    if( runRound(iSeed+i, nSize) ) nFail++;
+    fflush(stdout);
+  }
+  printf("%d of %d rounds failed\n", nFail, nRound);
+  return nFail!=0;
+}
@@ -0,0 +1,234 @@
+/*
+** reader.c - Tests of the pivot_vtab.h reader API
+**
+** Build and run from the repository root:
+**
+**   gcc -I. test/reader.c pivot_vtab.c -lsqlite3 -o reader && ./reader
+**
+** Exits with status 0 if every check passes.
+*/
+#include "pivot_vtab.h"
+#include <stdio.h>
+#include <string.h>
+
+int sqlite3_pivotvtab_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+
+static int nFail = 0;
+
+#define CHECK(x) do{ if( !(x) ){ printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); nFail++; } }while(0)
+
+static void exec(sqlite3 *db, const char *zSql){
+  char *zErr = 0;
+  if( sqlite3_exec(db, zSql, 0, 0, &zErr)!=SQLITE_OK ){
+    printf("%s: %s\n", zSql, zErr);
+    sqlite3_free(zErr);
+    nFail++;
+  }
+}
+
+/*
+** Read every row of reader p in batches of nBatch into the first two
+** columns, skipping the others. Sum the row keys into *pnSum and return
+** the number of rows, or -1 on error.
+*/
+static int readAll(pivot_vtab_reader *p, int nBatch, sqlite3_int64 *pnSum){
+  pivot_vtab_buffer aBuf[8];
+  sqlite3_int64 aId[16];
+  const char *azA[16];
+  unsigned char aNull[2][2];
+  int nCol = pivot_vtab_reader_column_count(p);
+  int nTotal = 0;
+  int nRow;
+  int i;
+  for( i=0; i<nCol; i++ ) aBuf[i] = (pivot_vtab_buffer){SQLITE_NULL, 0, 0, 0, 0};
+  aBuf[0] = (pivot_vtab_buffer){SQLITE_INTEGER, aId, 0, 0, aNull[0]};
+  aBuf[1] = (pivot_vtab_buffer){SQLITE_TEXT, 0, 0, azA, aNull[1]};
+  *pnSum = 0;
+  for(;;){
+    if( pivot_vtab_reader_fetch(p, nBatch, nCol, aBuf, &nRow)!=SQLITE_OK ) return -1;
+    if( nRow==0 ) return nTotal;
+    for( i=0; i<nRow; i++ ) *pnSum += aId[i];
+    nTotal += nRow;
+  }
+}
+
+/*
+** An application's update hook, which counts the changes in *pArg and
+** passes them on to the pivot tables.
+*/
+static int nAppChange = 0;
+static void *pPivotHookArg = 0;
+static void appUpdateHook(void *pArg, int op, const char *zDb, const char *zTab, sqlite3_int64 iRowid){
+  (*(int*)pArg)++;
+  pivot_vtab_update_hook(pPivotHookArg, op, zDb, zTab, iRowid);
+}
+
+/*
+** Return the value of statistic zStat of pivot table zTab, or -1.
+*/
+static sqlite3_int64 stat(sqlite3 *db, const char *zTab, const char *zStat){
+  sqlite3_stmt *stmt = 0;
+  sqlite3_int64 v = -1;
+  sqlite3_prepare_v2(db, "SELECT value FROM pivot_vtab_stats WHERE vtab = ?1 AND stat = ?2", -1, &stmt, 0);
+  sqlite3_bind_text(stmt, 1, zTab, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, zStat, -1, SQLITE_STATIC);
+  if( sqlite3_step(stmt)==SQLITE_ROW ) v = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  return v;
+}
+
+/*
+** The extension leaves the update hook to the application, which may pass
+** the changes on to the pivot tables.
+*/
+static void testHooks(void){
+  sqlite3 *db;
+  pivot_vtab_reader *p = 0;
+  sqlite3_int64 nSum;
+  const char *zPivot =
+    "CREATE VIRTUAL TABLE t USING pivot_vtab("
+    " (SELECT id r_id FROM r),"
+    " (SELECT id c_id, name FROM c),"
+    " (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2),"
+    " row_cache=8, track_dependencies=1);";
+
+  sqlite3_open(":memory:", &db);
+  sqlite3_update_hook(db, appUpdateHook, &nAppChange);
+  exec(db,
+    "CREATE TABLE r(id INTEGER PRIMARY KEY);"
+    "INSERT INTO r VALUES (1),(2),(3);"
+    "CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);"
+    "INSERT INTO c VALUES (1,'a');"
+    "CREATE TABLE x(r_id INT, c_id INT, val INT);"
+    "INSERT INTO x SELECT id, 1, id FROM r;"
+    "CREATE TABLE other(v);"
+  );
+  exec(db, zPivot);
+  CHECK( pivot_vtab_reader_open(db, 0, "t", &p)==SQLITE_OK );
+
+  // Without the pivot hooks every change discards every cached row
+  nAppChange = 0;
+  exec(db, "SELECT * FROM t WHERE r_id = 1; INSERT INTO other VALUES (1); SELECT * FROM t WHERE r_id = 1;");
+  CHECK( nAppChange==1 );
+  CHECK( stat(db, "t", "row_cache_hits")==0 );
+  exec(db, "UPDATE x SET val = 10 WHERE r_id = 1");
+  CHECK( readAll(p, 16, &nSum)==3 && nSum==6 );
+  CHECK( nAppChange==2 );
+
+  // Passed on, changes to other tables keep the cached rows
+  pPivotHookArg = pivot_vtab_hook_arg(db);
+  CHECK( pPivotHookArg!=0 );
+  exec(db, "SELECT * FROM t WHERE r_id = 1; INSERT INTO other VALUES (2); SELECT * FROM t WHERE r_id = 1;");
+  CHECK( stat(db, "t", "row_cache_hits")==1 );
+  exec(db, "UPDATE x SET val = 20 WHERE r_id = 1");
+  CHECK( stat(db, "t", "dependency_changes")>=1 );
+  exec(db, "DROP TABLE t");
+  exec(db, zPivot);
+  CHECK( nAppChange==4 );
+
+  // The application's hook is still the one installed
+  CHECK( sqlite3_update_hook(db, 0, 0)==(void*)&nAppChange );
+  pivot_vtab_reader_close(p);
+  sqlite3_close(db);
+}
+
+int main(void){
+  sqlite3 *db;
+  pivot_vtab_reader *p = 0;
+  pivot_vtab_reader *p2 = 0;
+  pivot_vtab_buffer aBuf[8];
+  sqlite3_int64 aId[16];
+  sqlite3_int64 aCell[16];
+  const char *azA[16];
+  sqlite3_int64 nSum;
+  int nRow;
+  int rc;
+
+  sqlite3_auto_extension((void(*)(void))sqlite3_pivotvtab_init);
+  sqlite3_open(":memory:", &db);
+  exec(db,
+    "CREATE TABLE r(id INTEGER PRIMARY KEY);"
+    "INSERT INTO r VALUES (1),(2),(3),(4),(5);"
+    "CREATE TABLE c(id INTEGER PRIMARY KEY, name TEXT);"
+    "INSERT INTO c VALUES (1,'a'),(2,'b'),(3,'c'),(4,'d');"
+    "CREATE TABLE x(r_id INT, c_id INT, val TEXT);"
+    "INSERT INTO x SELECT r.id, c.id, c.name || r.id FROM r, c;"
+    "CREATE VIRTUAL TABLE p USING pivot_vtab((SELECT id r_id FROM r),"
+    " (SELECT id c_id, name FROM c),"
+    " (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2));"
+    "CREATE VIRTUAL TABLE temp.p USING pivot_vtab((SELECT id r_id FROM r WHERE id>3),"
+    " (SELECT id c_id, name FROM c),"
+    " (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2));"
+  );
+
+  // An unqualified name finds the temp table first, as SQL does
+  CHECK( pivot_vtab_reader_open(db, 0, "p", &p)==SQLITE_OK );
+  CHECK( pivot_vtab_reader_column_count(p)==5 );
+  CHECK( readAll(p, 3, &nSum)==2 && nSum==9 );
+  pivot_vtab_reader_close(p);
+  CHECK( pivot_vtab_reader_open(db, "main", "p", &p)==SQLITE_OK );
+  CHECK( readAll(p, 2, &nSum)==5 && nSum==15 );
+  CHECK( pivot_vtab_reader_open(db, "aux", "p", &p2)!=SQLITE_OK && p2==0 );
+
+  // The number of buffers must be the number of columns
+  CHECK( pivot_vtab_reader_reset(p)==SQLITE_OK );
+  aBuf[0] = (pivot_vtab_buffer){SQLITE_INTEGER, aId, 0, 0, 0};
+  aBuf[1] = (pivot_vtab_buffer){SQLITE_TEXT, 0, 0, azA, 0};
+  CHECK( pivot_vtab_reader_fetch(p, 16, 2, aBuf, &nRow)==SQLITE_MISUSE && nRow==0 );
+  CHECK( pivot_vtab_reader_errmsg(p)!=0 );
+  aBuf[2] = aBuf[3] = aBuf[4] = (pivot_vtab_buffer){SQLITE_TEXT, 0, 0, 0, 0};
+  CHECK( pivot_vtab_reader_fetch(p, 16, 5, aBuf, &nRow)==SQLITE_MISUSE );
+  aBuf[2] = aBuf[3] = aBuf[4] = (pivot_vtab_buffer){SQLITE_NULL, 0, 0, 0, 0};
+  CHECK( pivot_vtab_reader_fetch(p, 16, 5, aBuf, &nRow)==SQLITE_OK && nRow==5 );
+  CHECK( strcmp(azA[4], "a5")==0 );
+
+  // Dropping the table detaches the reader
+  exec(db, "DROP TABLE main.p");
+  CHECK( pivot_vtab_reader_fetch(p, 16, 5, aBuf, &nRow)==SQLITE_ABORT && nRow==0 );
+  CHECK( pivot_vtab_reader_errmsg(p)!=0 );
+  CHECK( pivot_vtab_reader_reset(p)==SQLITE_OK );
+  CHECK( pivot_vtab_reader_fetch(p, 16, 5, aBuf, &nRow)==SQLITE_ABORT );
+  pivot_vtab_reader_close(p);
+
+  // Rows fetched before an error are returned, then the error
+  exec(db,
+    "CREATE VIRTUAL TABLE e USING pivot_vtab("
+    " (SELECT id r_id FROM r WHERE CASE WHEN id = 4 THEN abs(-9223372036854775808) ELSE 1 END),"
+    " (SELECT id c_id, name FROM c),"
+    " (SELECT ?1 * ?2));"
+  );
+  CHECK( pivot_vtab_reader_open(db, 0, "e", &p)==SQLITE_OK );
+  aBuf[0] = (pivot_vtab_buffer){SQLITE_INTEGER, aId, 0, 0, 0};
+  aBuf[1] = (pivot_vtab_buffer){SQLITE_INTEGER, aCell, 0, 0, 0};
+  CHECK( pivot_vtab_reader_fetch(p, 16, 5, aBuf, &nRow)==SQLITE_OK && nRow==3 );
+  CHECK( aId[2]==3 && aCell[2]==3 );
+  CHECK( pivot_vtab_reader_fetch(p, 16, 5, aBuf, &nRow)==SQLITE_ERROR && nRow==0 );
+  CHECK( pivot_vtab_reader_fetch(p, 16, 5, aBuf, &nRow)==SQLITE_ERROR && nRow==0 );
+  CHECK( pivot_vtab_reader_reset(p)==SQLITE_OK );
+  CHECK( pivot_vtab_reader_fetch(p, 2, 5, aBuf, &nRow)==SQLITE_OK && nRow==2 );
+  CHECK( pivot_vtab_reader_fetch(p, 2, 5, aBuf, &nRow)==SQLITE_OK && nRow==1 );
+  CHECK( pivot_vtab_reader_fetch(p, 2, 5, aBuf, &nRow)==SQLITE_ERROR && nRow==0 );
+  pivot_vtab_reader_close(p);
+
+  // A scan that fails to start is started again by the next fetch
+  exec(db,
+    "CREATE VIRTUAL TABLE f USING pivot_vtab("
+    " (SELECT id r_id FROM r WHERE CASE WHEN id = 1 THEN abs(-9223372036854775808) ELSE 1 END),"
+    " (SELECT id c_id, name FROM c),"
+    " (SELECT val FROM x WHERE r_id = ?1 AND c_id = ?2));"
+  );
+  CHECK( pivot_vtab_reader_open(db, 0, "f", &p)==SQLITE_OK );
+  CHECK( readAll(p, 16, &nSum)==-1 );
+  exec(db, "DELETE FROM r WHERE id = 1");
+  CHECK( readAll(p, 16, &nSum)==4 && nSum==14 );
+
+  // Closing the connection detaches the reader too
+  rc = sqlite3_close_v2(db);
+  CHECK( rc==SQLITE_OK );
+  CHECK( pivot_vtab_reader_fetch(p, 16, 5, aBuf, &nRow)==SQLITE_ABORT );
+  pivot_vtab_reader_close(p);
+
+  testHooks();
+  printf("%s\n", nFail ? "FAILED" : "ok");
+  return nFail>0;
+}
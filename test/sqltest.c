@@ -0,0 +1,248 @@
+/*
+** sqltest.c - Runs the SQL test scripts of pivot_vtab
+**
+** Build and run from the repository root:
+**
+**   gcc -I. test/sqltest.c pivot_vtab.c -lsqlite3 -o sqltest && ./sqltest test/0*.sql
+**
+** Each script runs on a new database file, so that options that need one
+** (refresh_ms) can be tested, with the change hooks of pivot_vtab.h
+** installed. Every statement must succeed, except one
+** preceded by a line "-- error: TEXT", which must fail with an error
+** message containing TEXT. A statement that returns a row whose first
+** value is not NULL fails the script and the row is printed: checks are
+** written as queries that return NULL, or no row, when they pass. The
+** rows of PRAGMA statements are not checked.
+**
+** The scripts compare fast paths with the reference engine with
+**
+**   SELECT pivot_check('SELECT ... FROM t ...', 'SELECT ... FROM ref ...');
+**
+** which runs both queries and returns NULL if they return the same rows,
+** in the same order, with the same values and types, or else a
+** description of the first difference.
+**
+** Exits with status 0 if every script passes.
+*/
+#include "pivot_vtab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int sqlite3_pivotvtab_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+
+static const char *azType[] = { "", "integer", "real", "text", "blob", "null" };
+
+/*
+** SQL function pivot_check(A, B). Return NULL if queries A and B return
+** the same rows, or a description of the first difference.
+*/
+static void checkFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  sqlite3 *db = sqlite3_context_db_handle(ctx);
+  const char *zA = (const char*)sqlite3_value_text(argv[0]);
+  const char *zB = (const char*)sqlite3_value_text(argv[1]);
+  sqlite3_stmt *pA = 0, *pB = 0;
+  char *zDiff = 0;
+  int rcA, rcB, iRow = 0, i;
+  (void)argc;
+  if( zA==0 || zB==0 ) return;
+  if( sqlite3_prepare_v2(db, zA, -1, &pA, 0) || sqlite3_prepare_v2(db, zB, -1, &pB, 0) ){
+    zDiff = sqlite3_mprintf("%s: %s", pA ? zB : zA, sqlite3_errmsg(db));
+    goto done;
+  }
+  if( sqlite3_column_count(pA)!=sqlite3_column_count(pB) ){
+    zDiff = sqlite3_mprintf("%d columns vs %d", sqlite3_column_count(pA), sqlite3_column_count(pB));
+    goto done;
+  }
+  for(;;){
+    rcA = sqlite3_step(pA);
+    rcB = sqlite3_step(pB);
+    iRow++;
+    if( rcA!=SQLITE_ROW && rcA!=SQLITE_DONE ){
+      zDiff = sqlite3_mprintf("%s: %s", zA, sqlite3_errmsg(db));
+      goto done;
+    }
+    if( rcB!=SQLITE_ROW && rcB!=SQLITE_DONE ){
+      zDiff = sqlite3_mprintf("%s: %s", zB, sqlite3_errmsg(db));
+      goto done;
+    }
+    if( rcA!=rcB ){
+      zDiff = sqlite3_mprintf("row %d: %s vs %s", iRow, rcA==SQLITE_ROW ? "row" : "end", rcB==SQLITE_ROW ? "row" : "end");
+      goto done;
+    }
+    if( rcA==SQLITE_DONE ) break;
+    for( i=0; i<sqlite3_column_count(pA); i++ ){
+      int eA = sqlite3_column_type(pA, i), eB = sqlite3_column_type(pB, i);
+      int bSame = eA==eB;
+      if( bSame && eA==SQLITE_INTEGER ) bSame = sqlite3_column_int64(pA, i)==sqlite3_column_int64(pB, i);
+      if( bSame && eA==SQLITE_FLOAT ) bSame = sqlite3_column_double(pA, i)==sqlite3_column_double(pB, i);
+      if( bSame && (eA==SQLITE_TEXT || eA==SQLITE_BLOB) ){
+        int n = sqlite3_column_bytes(pA, i);
+        bSame = n==sqlite3_column_bytes(pB, i) && (n==0 || memcmp(sqlite3_column_blob(pA, i), sqlite3_column_blob(pB, i), n)==0);
+      }
+      if( !bSame ){
+        zDiff = sqlite3_mprintf("row %d column %s: %s %s vs %s %s", iRow, sqlite3_column_name(pA, i),
+          azType[eA], sqlite3_column_text(pA, i), azType[eB], sqlite3_column_text(pB, i));
+        goto done;
+      }
+    }
+  }
+done:
+  sqlite3_finalize(pA);
+  sqlite3_finalize(pB);
+  if( zDiff ) sqlite3_result_text(ctx, zDiff, -1, sqlite3_free);
+}
+
+/*
+** Return the line of zScript that offset iOff is on.
+*/
+static int lineOf(const char *zScript, int iOff){
+  int i, iLine = 1;
+  for( i=0; i<iOff; i++ ) if( zScript[i]=='\n' ) iLine++;
+  return iLine;
+}
+
+/*
+** If the text between the previous statement and a statement, zGap of
+** nGap bytes, holds a "-- error: TEXT" line, return TEXT in a buffer
+** obtained from sqlite3_malloc(). Otherwise return 0.
+*/
+static char *expectedError(const char *zGap, int nGap){
+  const char *zEnd = zGap+nGap;
+  const char *z;
+  for( z=zGap; z+9<=zEnd; z++ ){
+    if( memcmp(z, "-- error:", 9)==0 ){
+      const char *zText = z+9;
+      int n = 0;
+      while( zText<zEnd && *zText==' ' ) zText++;
+      while( zText+n<zEnd && zText[n]!='\n' && zText[n]!='\r' ) n++;
+      return sqlite3_mprintf("%.*s", n, zText);
+    }
+  }
+  return 0;
+}
+
+/*
+** Run script zFile on a new database. Return the number of failures.
+*/
+static int runScript(const char *zFile){
+  static const char *azSuffix[] = { "", "-wal", "-shm", "-journal" };
+  char zDb[] = "sqltest.db";
+  sqlite3 *db = 0;
+  void *pArg;
+  char *zScript = 0;
+  const char *zSql, *zTail;
+  long nScript;
+  int nFail = 0;
+  int i;
+  FILE *in = fopen(zFile, "rb");
+
+  if( in==0 ){
+    printf("%s: cannot open\n", zFile);
+    return 1;
+  }
+  fseek(in, 0, SEEK_END);
+  nScript = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  zScript = sqlite3_malloc64(nScript+1);
+  if( zScript==0 || fread(zScript, 1, nScript, in)!=(size_t)nScript ){
+    printf("%s: cannot read\n", zFile);
+    fclose(in);
+    sqlite3_free(zScript);
+    return 1;
+  }
+  zScript[nScript] = 0;
+  fclose(in);
+
+  for( i=0; i<4; i++ ){
+    char *z = sqlite3_mprintf("%s%s", zDb, azSuffix[i]);
+    unlink(z);
+    sqlite3_free(z);
+  }
+  sqlite3_open(zDb, &db);
+  pArg = pivot_vtab_hook_arg(db);
+  sqlite3_update_hook(db, pivot_vtab_update_hook, pArg);
+  sqlite3_rollback_hook(db, pivot_vtab_rollback_hook, pArg);
+  sqlite3_create_function(db, "pivot_check", 2, SQLITE_UTF8, 0, checkFunc, 0, 0);
+
+  for( zSql=zScript; *zSql; zSql=zTail ){
+    const char *zGap = zSql;
+    char *zStmt, *zError;
+    sqlite3_stmt *stmt = 0;
+    int rc, iLine;
+
+    // Skip the blank and comment lines before the statement, and find its
+    // end as the shell does
+    while( *zSql==' ' || *zSql=='\t' || *zSql=='\r' || *zSql=='\n' || (zSql[0]=='-' && zSql[1]=='-') ){
+      if( *zSql=='-' ){
+        while( *zSql && *zSql!='\n' ) zSql++;
+      }else{
+        zSql++;
+      }
+    }
+    if( *zSql==0 ) break;
+    for( zTail=zSql; *zTail; zTail++ ){
+      if( *zTail==';' ){
+        zStmt = sqlite3_mprintf("%.*s", (int)(zTail+1-zSql), zSql);
+        rc = sqlite3_complete(zStmt);
+        sqlite3_free(zStmt);
+        if( rc ){
+          zTail++;
+          break;
+        }
+      }
+    }
+    zStmt = sqlite3_mprintf("%.*s", (int)(zTail-zSql), zSql);
+    iLine = lineOf(zScript, (int)(zSql-zScript));
+    zError = expectedError(zGap, (int)(zSql-zGap));
+
+    rc = sqlite3_prepare_v2(db, zStmt, -1, &stmt, 0);
+    if( rc==SQLITE_OK && stmt ){
+      int bPragma = sqlite3_strnicmp(zSql, "PRAGMA", 6)==0;
+      while( (rc = sqlite3_step(stmt))==SQLITE_ROW ){
+        if( !bPragma && sqlite3_column_type(stmt, 0)!=SQLITE_NULL ){
+          printf("%s:%d: %s\n", zFile, iLine, sqlite3_column_text(stmt, 0));
+          nFail++;
+        }
+      }
+      if( rc==SQLITE_DONE ) rc = SQLITE_OK;
+    }
+    if( zError ){
+      if( rc==SQLITE_OK ){
+        printf("%s:%d: expected error: %s\n", zFile, iLine, zError);
+        nFail++;
+      }else if( strstr(sqlite3_errmsg(db), zError)==0 ){
+        printf("%s:%d: expected error: %s\n  got: %s\n", zFile, iLine, zError, sqlite3_errmsg(db));
+        nFail++;
+      }
+    }else if( rc!=SQLITE_OK ){
+      printf("%s:%d: %s\n", zFile, iLine, sqlite3_errmsg(db));
+      nFail++;
+    }
+    sqlite3_free(zError);
+    sqlite3_free(zStmt);
+    sqlite3_finalize(stmt);
+  }
+
+  sqlite3_close(db);
+  for( i=0; i<4; i++ ){
+    char *z = sqlite3_mprintf("%s%s", zDb, azSuffix[i]);
+    unlink(z);
+    sqlite3_free(z);
+  }
+  sqlite3_free(zScript);
+  return nFail;
+}
+
+int main(int argc, char **argv){
+  int nFail = 0;
+  int i;
+  sqlite3_auto_extension((void(*)(void))sqlite3_pivotvtab_init);
+  for( i=1; i<argc; i++ ){
+    int n = runScript(argv[i]);
+    printf("%s: %s\n", argv[i], n ? "FAILED" : "ok");
+    nFail += n;
+  }
+  return nFail!=0;
+}